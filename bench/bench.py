@@ -0,0 +1,258 @@
+#! /usr/bin/env python
+#
+# Throughput benchmarks for htpy.
+#
+# Each corpus is a list of connections, each connection a list of
+# (direction, data) segments fed to req_data() or res_data() in order.
+# Every corpus is run with no callbacks, with only a transaction complete
+# callback and with a callback on every hook, and the best of a few runs is
+# reported as MB/s and transactions/s. With htpy built with HTPY_ARENA=1
+# the allocations libhtp and htpy make per transaction are counted too.
+#
+#   python bench/bench.py [-c corpus] [-k callbacks] [-t seconds] [-p pcap]
+#
+# or "python setup.py bench", which builds htpy first.
+
+from __future__ import print_function
+
+import optparse
+import sys
+import time
+import zlib
+
+import htpy
+
+MSS = 1460
+
+# Connections in each corpus, and transactions in each connection.
+CONNECTIONS = 16
+TRANSACTIONS = 64
+
+
+def segments(direction, data, size=MSS):
+    return [(direction, data[i:i + size]) for i in range(0, len(data), size)]
+
+
+def gzip(data):
+    c = zlib.compressobj(6, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+    return c.compress(data) + c.flush()
+
+
+def chunked(data, size=4096):
+    out = []
+    for i in range(0, len(data), size):
+        chunk = data[i:i + size]
+        out.append(b'%x\r\n' % len(chunk) + chunk + b'\r\n')
+    out.append(b'0\r\n\r\n')
+    return b''.join(out)
+
+
+def pipelined_gets():
+    """Many small GETs sent back to back before the responses come."""
+    reqs = b''.join(b'GET /index/%d.html HTTP/1.1\r\n'
+                    b'Host: www.example.com\r\n'
+                    b'User-Agent: bench\r\n'
+                    b'Accept: */*\r\n\r\n' % i for i in range(TRANSACTIONS))
+    res = b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok' * TRANSACTIONS
+    conn = segments(htpy.HTPY_REQUEST, reqs) + segments(htpy.HTPY_RESPONSE, res)
+    return [conn] * CONNECTIONS, TRANSACTIONS * CONNECTIONS
+
+
+def chunked_gzip():
+    """Large gzip'd responses sent with chunked transfer encoding."""
+    body = b''.join(b'<tr><td>%d</td><td>row %d of the table</td></tr>\n' % (i, i)
+                    for i in range(8192))
+    res = (b'HTTP/1.1 200 OK\r\n'
+           b'Content-Type: text/html\r\n'
+           b'Content-Encoding: gzip\r\n'
+           b'Transfer-Encoding: chunked\r\n\r\n' + chunked(gzip(body)))
+    conn = []
+    for i in range(TRANSACTIONS // 8):
+        conn += segments(htpy.HTPY_REQUEST, b'GET /table HTTP/1.1\r\nHost: www.example.com\r\n\r\n')
+        conn += segments(htpy.HTPY_RESPONSE, res)
+    return [conn] * CONNECTIONS, TRANSACTIONS // 8 * CONNECTIONS
+
+
+def multipart():
+    """File uploads in multipart/form-data request bodies."""
+    boundary = b'----bench0123456789'
+    payload = bytes(bytearray(i & 0xff for i in range(32768)))
+    body = (b'--' + boundary + b'\r\n'
+            b'Content-Disposition: form-data; name="comment"\r\n\r\n'
+            b'an upload\r\n'
+            b'--' + boundary + b'\r\n'
+            b'Content-Disposition: form-data; name="file"; filename="data.bin"\r\n'
+            b'Content-Type: application/octet-stream\r\n\r\n' + payload + b'\r\n'
+            b'--' + boundary + b'--\r\n')
+    req = (b'POST /upload HTTP/1.1\r\n'
+           b'Host: www.example.com\r\n'
+           b'Content-Type: multipart/form-data; boundary=' + boundary + b'\r\n'
+           b'Content-Length: %d\r\n\r\n' % len(body) + body)
+    res = b'HTTP/1.1 204 No Content\r\n\r\n'
+    conn = []
+    for i in range(TRANSACTIONS // 4):
+        conn += segments(htpy.HTPY_REQUEST, req)
+        conn += segments(htpy.HTPY_RESPONSE, res)
+    return [conn] * CONNECTIONS, TRANSACTIONS // 4 * CONNECTIONS
+
+
+def header_heavy():
+    """Requests and responses with lots of headers and cookies."""
+    headers = b''.join(b'X-Header-%d: value-%d-%s\r\n' % (i, i, b'v' * 40) for i in range(48))
+    cookie = b'Cookie: ' + b'; '.join(b'c%d=%s' % (i, b'x' * 16) for i in range(32)) + b'\r\n'
+    req = b'GET /api/v1/items?id=1&sort=name HTTP/1.1\r\nHost: api.example.com\r\n' + cookie + headers + b'\r\n'
+    res = b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\n' + headers + b'\r\nok'
+    conn = []
+    for i in range(TRANSACTIONS):
+        conn += segments(htpy.HTPY_REQUEST, req)
+        conn += segments(htpy.HTPY_RESPONSE, res)
+    return [conn] * CONNECTIONS, TRANSACTIONS * CONNECTIONS
+
+
+CORPORA = [
+    ('pipelined_gets', pipelined_gets),
+    ('chunked_gzip', chunked_gzip),
+    ('multipart', multipart),
+    ('header_heavy', header_heavy),
+]
+
+
+def ok(*args):
+    return htpy.HTP_OK
+
+
+def register_none(cfg):
+    pass
+
+
+def register_one(cfg):
+    cfg.register_transaction_complete(ok)
+
+
+def register_all(cfg):
+    for name in dir(cfg):
+        if name.startswith('register_'):
+            getattr(cfg, name)(ok)
+
+
+CALLBACKS = [
+    ('none', register_none),
+    ('one', register_one),
+    ('all', register_all),
+]
+
+
+def make_config(register):
+    cfg = htpy.config()
+    register(cfg)
+    # Needed for the allocation counts.
+    if getattr(htpy, 'HTPY_ARENA', 0):
+        cfg.stats = 1
+    return cfg
+
+
+def run_corpus(cfg, conns):
+    nbytes = 0
+    for conn in conns:
+        cp = htpy.connp(cfg)
+        for (direction, data) in conn:
+            if direction == htpy.HTPY_REQUEST:
+                cp.req_data(data)
+            else:
+                cp.res_data(data)
+            nbytes += len(data)
+        del cp
+    return nbytes
+
+
+def bench(func, min_time, repeat):
+    """Run func until min_time has passed, repeat times. Best run wins."""
+    best = None
+    for i in range(repeat):
+        start = time.time()
+        runs = 0
+        nbytes = 0
+        while True:
+            nbytes += func()
+            runs += 1
+            elapsed = time.time() - start
+            if elapsed >= min_time:
+                break
+        rate = (nbytes / elapsed, runs / elapsed)
+        if best is None or rate[0] > best[0]:
+            best = rate
+    return best
+
+
+def allocations(cfg):
+    if not getattr(htpy, 'HTPY_ARENA', 0):
+        return None
+    st = cfg.get_stats()
+    if not st['transactions']:
+        return None
+    return float(st['allocations']) / st['transactions']
+
+
+def report(corpus, callbacks, mbps, txps, allocs):
+    print('%-16s %-6s %10.1f %12.0f %10s' % (corpus, callbacks, mbps, txps,
+          '-' if allocs is None else '%.1f' % allocs))
+    sys.stdout.flush()
+
+
+def run_pcap(path, register, min_time, repeat):
+    cfg = make_config(register)
+    cfg.stats = 1
+    state = {'runs': 0}
+
+    def once():
+        reader = htpy.pcap_reader(path, cfg)
+        reader.run()
+        state['runs'] += 1
+        return reader.bytes
+
+    best = bench(once, min_time, repeat)
+    txs = float(cfg.get_stats()['transactions']) / state['runs']
+    return cfg, best, txs
+
+
+def main(argv=None):
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('-c', '--corpus', action='append', default=[],
+                      help='corpus to run, may be given more than once (%s)' %
+                      ', '.join(name for (name, func) in CORPORA))
+    parser.add_option('-k', '--callbacks', action='append', default=[],
+                      help='callbacks to register, may be given more than once (%s)' %
+                      ', '.join(name for (name, func) in CALLBACKS))
+    parser.add_option('-t', '--time', type='float', default=1.0,
+                      help='minimum seconds for each run (default 1)')
+    parser.add_option('-r', '--repeat', type='int', default=3,
+                      help='runs of each benchmark, the best is reported (default 3)')
+    parser.add_option('-p', '--pcap', action='append', default=[],
+                      help='also run a pcap through htpy.pcap_reader')
+    (opts, args) = parser.parse_args(argv)
+
+    corpora = [c for c in CORPORA if not opts.corpus or c[0] in opts.corpus]
+    callbacks = [c for c in CALLBACKS if not opts.callbacks or c[0] in opts.callbacks]
+    if not corpora and not opts.pcap:
+        parser.error('no such corpus')
+    if not callbacks:
+        parser.error('no such callbacks')
+
+    print('%-16s %-6s %10s %12s %10s' % ('corpus', 'cbs', 'MB/s', 'tx/s', 'allocs/tx'))
+    for (name, make) in corpora:
+        (conns, txs) = make()
+        for (cbname, register) in callbacks:
+            cfg = make_config(register)
+            (bps, rps) = bench(lambda: run_corpus(cfg, conns), opts.time, opts.repeat)
+            report(name, cbname, bps / 1e6, rps * txs, allocations(cfg))
+
+    for path in opts.pcap:
+        for (cbname, register) in callbacks:
+            (cfg, (bps, rps), txs) = run_pcap(path, register, opts.time, opts.repeat)
+            report(path, cbname, bps / 1e6, rps * txs, allocations(cfg))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
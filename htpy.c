@@ -23,16 +23,230 @@
  * SUCH DAMAGE.
  */
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <structmember.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
 #include "../htp_config_auto_gen.h"
 #include "htp.h"
 #include "htp_private.h"
 
 #define HTPY_VERSION "0.26"
 
-static PyObject *htpy_error;
-static PyObject *htpy_stop;
+/* Data directions, as used by feed_many() and the pool. */
+#define HTPY_REQUEST 0
+#define HTPY_RESPONSE 1
+
+#if PY_MAJOR_VERSION >= 3 && PY_VERSION_HEX < 0x03090000
+#error "htpy needs python 2.7 or 3.9 and later"
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+/*
+ * Python 3. Integers are all longs, and str is unicode. Anything which
+ * comes off the wire (header names and values, URIs, methods, ...) is
+ * made into a str with htpy_str(), which decodes it as latin-1 so every
+ * byte becomes one character and nothing can fail to decode. Bodies are
+ * bytes. The remaining PyString calls are on names and paths which are
+ * UTF-8.
+ */
+#define PyInt_Check PyLong_Check
+#define PyInt_AsLong PyLong_AsLong
+#define PyInt_FromLong PyLong_FromLong
+#define PyInt_FromSize_t PyLong_FromSize_t
+#define PyInt_FromSsize_t PyLong_FromSsize_t
+#define PyString_Check PyUnicode_Check
+#define PyString_AsString PyUnicode_AsUTF8
+#define PyString_AS_STRING PyUnicode_AsUTF8
+#define PyString_FromString PyUnicode_FromString
+#define PyString_FromStringAndSize PyUnicode_FromStringAndSize
+#define PyString_FromFormat PyUnicode_FromFormat
+#define PyString_InternFromString PyUnicode_InternFromString
+/* Only for the interned names, which are all ASCII. */
+#define HTPY_STR_SIZE PyUnicode_GET_LENGTH
+#define HTPY_STR_DATA(o) ((const char *) PyUnicode_1BYTE_DATA(o))
+#else
+#define HTPY_STR_SIZE PyString_GET_SIZE
+#define HTPY_STR_DATA PyString_AS_STRING
+#endif
+
+/*
+ * Module state.
+ *
+ * Under python 3 every interpreter which imports htpy gets its own
+ * exceptions, types and interned strings, so htpy can be used from
+ * subinterpreters, including ones with their own GIL. Code which has no
+ * module at hand finds the state of the current interpreter with
+ * htpy_get_state(). Under python 2 there is only one, static, state.
+ */
+typedef struct {
+	PyObject *error;
+	PyObject *stop;
+	PyTypeObject *config_type;
+	PyTypeObject *connp_type;
+	PyTypeObject *pool_type;
+	PyTypeObject *connp_pool_type;
+	PyTypeObject *flow_table_type;
+	PyTypeObject *tx_type;
+	PyTypeObject *headers_type;
+	PyTypeObject *headers_iter_type;
+	PyTypeObject *filter_type;
+	PyTypeObject *file_type;
+	PyTypeObject *pcap_type;
+	PyTypeObject *exporter_type;
+	PyTypeObject *record_batch_type;
+	PyTypeObject *chunk_type;
+	/* See "Interned strings". */
+	struct htpy_interned *interned;
+} htpy_state;
+
+#if PY_MAJOR_VERSION >= 3
+/*
+ * Bumped whenever a module state goes away, which makes every thread
+ * look the state up again.
+ */
+static unsigned long htpy_state_generation;
+
+static htpy_state *htpy_get_state(void) {
+	static __thread int64_t cached_id = -1;
+	static __thread unsigned long cached_generation;
+	static __thread htpy_state *cached;
+	PyInterpreterState *interp = PyInterpreterState_Get();
+	unsigned long generation = __atomic_load_n(&htpy_state_generation, __ATOMIC_ACQUIRE);
+	PyObject *dict, *capsule;
+
+	if (cached && cached_id == PyInterpreterState_GetID(interp) && cached_generation == generation)
+		return cached;
+
+	dict = PyInterpreterState_GetDict(interp);
+	capsule = dict ? PyDict_GetItemString(dict, "htpy.state") : NULL;
+	if (!capsule)
+		Py_FatalError("htpy used without being imported in this interpreter");
+
+	cached = PyCapsule_GetPointer(capsule, "htpy.state");
+	cached_id = PyInterpreterState_GetID(interp);
+	cached_generation = generation;
+
+	return cached;
+}
+#else
+static htpy_state htpy_static_state;
+
+#define htpy_get_state() (&htpy_static_state)
+#endif
+
+/* Return a new str made from data seen on the wire, or None without data. */
+static PyObject *htpy_str(const void *data, Py_ssize_t len) {
+	if (!data)
+		Py_RETURN_NONE;
+
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_DecodeLatin1((const char *) data, len, NULL);
+#else
+	return PyString_FromStringAndSize((const char *) data, len);
+#endif
+}
+
+/*
+ * The reverse of htpy_str(), for names to look up. Points into the object
+ * instead of copying, so data is only valid as long as it is. Also takes
+ * bytes under python 3. A str with characters beyond latin-1 can not match
+ * anything, data is set to NULL for those.
+ */
+static int htpy_str_data(PyObject *obj, const char **data, Py_ssize_t *len) {
+#if PY_MAJOR_VERSION >= 3
+	if (PyUnicode_Check(obj)) {
+#if PY_VERSION_HEX < 0x030C0000
+		if (PyUnicode_READY(obj) == -1)
+			return -1;
+#endif
+		if (PyUnicode_KIND(obj) != PyUnicode_1BYTE_KIND) {
+			*data = NULL;
+			*len = 0;
+			return 0;
+		}
+		*data = (const char *) PyUnicode_1BYTE_DATA(obj);
+		*len = PyUnicode_GET_LENGTH(obj);
+		return 0;
+	}
+	if (PyBytes_Check(obj)) {
+		*data = PyBytes_AS_STRING(obj);
+		*len = PyBytes_GET_SIZE(obj);
+		return 0;
+	}
+	PyErr_SetString(PyExc_TypeError, "expected a str or bytes");
+	return -1;
+#else
+	return PyString_AsStringAndSize(obj, (char **) data, len);
+#endif
+}
+
+#if PY_MAJOR_VERSION >= 3
+/*
+ * Instances of heap types hold a reference to their type, which has to be
+ * dropped when they are freed.
+ */
+#define HTPY_FREE(self) \
+	do { \
+		PyTypeObject *_tp = Py_TYPE(self); \
+		_tp->tp_free((PyObject *) (self)); \
+		Py_DECREF(_tp); \
+	} while (0)
+#else
+#define HTPY_FREE(self) Py_TYPE(self)->tp_free((PyObject *) (self))
+#endif
+
+/*
+ * Taking the GIL back in callbacks.
+ *
+ * The GIL is let go while libhtp parses, and taken back by the callbacks
+ * libhtp calls. The PyGILState functions can not be used for that, they
+ * only know about the main interpreter. Instead the thread state saved by
+ * HTPY_BEGIN_ALLOW_THREADS is kept for the callbacks on this thread to
+ * restore with htpy_gil_ensure(). If there is none the thread is already
+ * holding the GIL, which is the case when libhtp is called from python
+ * without letting go of it, such as on close or reset. Pool worker threads
+ * set up a thread state of their own for the same purpose.
+ */
+static __thread PyThreadState *htpy_saved_tstate;
+
+#define HTPY_BEGIN_ALLOW_THREADS \
+	{ \
+		PyThreadState *_htpy_prev = htpy_saved_tstate; \
+		htpy_saved_tstate = PyEval_SaveThread();
+
+#define HTPY_END_ALLOW_THREADS \
+		PyEval_RestoreThread(htpy_saved_tstate); \
+		htpy_saved_tstate = _htpy_prev; \
+	}
+
+static PyThreadState *htpy_gil_ensure(void) {
+	PyThreadState *tstate = htpy_saved_tstate;
+
+	if (tstate) {
+		htpy_saved_tstate = NULL;
+		PyEval_RestoreThread(tstate);
+	}
+
+	return tstate;
+}
+
+static void htpy_gil_release(PyThreadState *tstate) {
+	if (tstate)
+		htpy_saved_tstate = PyEval_SaveThread();
+}
 
 /*
  * We set the python connection parser as user_data in the libhtp connection
@@ -41,21 +255,135 @@ static PyObject *htpy_stop;
  *
  * PyObject *obj = (PyObject *) htp_connp_get_user_data(tx->connp);
  *
- * We store the python objects for the callbacks in the connection parser
- * object. Once we have the connection parser using the above snippet
- * we can call the appropriate python function by using obj->foo_callback.
+ * Python callbacks can be registered with either a config object or a
+ * connection parser object. Those registered with a config are shared by
+ * every connection parser created from it, while those registered with a
+ * connection parser only apply to it and take precedence over the config.
+ * Either way the C handler is only registered with libhtp once per config,
+ * the first time a callback is registered for that hook, and it looks up
+ * the python callback to call through the connection parser.
  *
  * The only callback that is not able to get to the connection parser is
- * the request_file_data callback. Since we can't get to a connection
- * parser from there we are storing the python object as a global.
+ * the request_file_data callback. Since the file data callback is always
+ * run from inside req_data() we keep track of the connection parser being
+ * fed on the current thread and use that instead.
  */
-PyObject *request_file_data_callback;
+static __thread PyObject *htpy_current_connp;
+
+/* Bits in htpy_config.hooks for each libhtp hook we have registered. */
+enum {
+	HTPY_HOOK_request_start,
+	HTPY_HOOK_request_line,
+	HTPY_HOOK_request_uri_normalize,
+	HTPY_HOOK_request_headers,
+	HTPY_HOOK_request_header_data,
+	HTPY_HOOK_request_body_data,
+	HTPY_HOOK_request_file_data,
+	HTPY_HOOK_request_trailer,
+	HTPY_HOOK_request_trailer_data,
+	HTPY_HOOK_request_complete,
+	HTPY_HOOK_response_start,
+	HTPY_HOOK_response_line,
+	HTPY_HOOK_response_headers,
+	HTPY_HOOK_response_header_data,
+	HTPY_HOOK_response_body_data,
+	HTPY_HOOK_response_trailer,
+	HTPY_HOOK_response_trailer_data,
+	HTPY_HOOK_response_complete,
+	HTPY_HOOK_transaction_complete,
+	HTPY_HOOK_log,
+	HTPY_HOOK_multipart_parser
+};
+
+/* Hooks which can be queued as events, see htpy_events below. */
+#define HTPY_EVENTS_TX \
+	((1U << HTPY_HOOK_request_start) | (1U << HTPY_HOOK_request_line) | \
+	 (1U << HTPY_HOOK_request_uri_normalize) | (1U << HTPY_HOOK_request_headers) | \
+	 (1U << HTPY_HOOK_request_trailer) | (1U << HTPY_HOOK_request_complete) | \
+	 (1U << HTPY_HOOK_response_start) | (1U << HTPY_HOOK_response_line) | \
+	 (1U << HTPY_HOOK_response_headers) | (1U << HTPY_HOOK_response_trailer) | \
+	 (1U << HTPY_HOOK_response_complete) | (1U << HTPY_HOOK_transaction_complete))
+#define HTPY_EVENTS_DATA \
+	((1U << HTPY_HOOK_request_header_data) | (1U << HTPY_HOOK_request_body_data) | \
+	 (1U << HTPY_HOOK_request_trailer_data) | (1U << HTPY_HOOK_response_header_data) | \
+	 (1U << HTPY_HOOK_response_body_data) | (1U << HTPY_HOOK_response_trailer_data))
+#define HTPY_EVENTS_ALL (HTPY_EVENTS_TX | HTPY_EVENTS_DATA)
+
+#define HTPY_EVENT_LIMIT 4096
+#define HTPY_EVENT_DATA_LIMIT (1024 * 1024)
+
+/* Bodies which can be captured, see htpy_captures below. */
+#define HTPY_CAPTURE_REQUEST 1
+#define HTPY_CAPTURE_RESPONSE 2
+
+/* Digests which can be computed over bodies, see htpy_digests below. */
+#define HTPY_DIGEST_MD5 1
+#define HTPY_DIGEST_SHA1 2
+#define HTPY_DIGEST_SHA256 4
 
 typedef struct {
 	PyObject_HEAD
 	htp_cfg_t *cfg;
+	/* Hand body data to callbacks as a memoryview instead of a copy. */
+	int zero_copy;
+	/* Pass a transaction object to regular and transaction callbacks. */
+	int pass_tx;
+	/* Give each connection parser its own allocation arena. */
+	int arena;
+	/* Digests to compute over request and response bodies. */
+	int body_digests;
+	/* Least severe log level passed to the log callback. */
+	int log_callback_level;
+	/* Hold log messages back and pass them to the log callback as a list. */
+	int log_batch;
+	/* Keep stats for connection parsers, and the totals of finished ones. */
+	int stats;
+	struct htpy_stats *stats_total;
+	/* Directory extracted files go in, owned by us as libhtp does not copy it. */
+	char *tmpdir;
+	/* Largest extracted file to keep on disk, 0 for no limit. */
+	long extract_request_file_size_limit;
+	/* Bodies to capture, and where to and how much of them. */
+	int capture_bodies;
+	long capture_limit;
+	char *capture_dir;
+	/* Which hooks have been registered with libhtp. */
+	unsigned int hooks;
+	/* Hooks queued as events instead of calling callbacks, and the limits. */
+	unsigned int events;
+	size_t event_limit;
+	size_t event_data_limit;
+	/* Data kept in each direction for checkpoints, 0 for no checkpoints. */
+	size_t checkpoint_limit;
+	/* Rules a transaction has to match before any callbacks are called. */
+	PyObject *filter;
+	/* Where completed transactions are exported to, see "Columnar export". */
+	PyObject *exporter;
+	/* Callbacks shared by every connection parser using this config. */
+	PyObject *request_start_callback;
+	PyObject *request_line_callback;
+	PyObject *request_uri_normalize_callback;
+	PyObject *request_headers_callback;
+	PyObject *request_header_data_callback;
+	PyObject *request_body_data_callback;
+	PyObject *request_file_data_callback;
+	PyObject *request_trailer_callback;
+	PyObject *request_trailer_data_callback;
+	PyObject *request_complete_callback;
+	PyObject *response_start_callback;
+	PyObject *response_line_callback;
+	PyObject *response_headers_callback;
+	PyObject *response_header_data_callback;
+	PyObject *response_body_data_callback;
+	PyObject *response_trailer_callback;
+	PyObject *response_trailer_data_callback;
+	PyObject *response_complete_callback;
+	PyObject *transaction_complete_callback;
+	PyObject *log_callback;
 } htpy_config;
 
+static PyTypeObject htpy_config_type;
+
 static PyObject *htpy_config_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
 	htpy_config *self;
 
@@ -64,31 +392,113 @@ static PyObject *htpy_config_new(PyTypeObject *type, PyObject *args, PyObject *k
 	return (PyObject *) self;
 }
 
+static int htpy_timing_request_start(htp_tx_t *tx);
+static int htpy_timing_request_complete(htp_tx_t *tx);
+static int htpy_timing_response_start(htp_tx_t *tx);
+static int htpy_timing_response_complete(htp_tx_t *tx);
+static int htpy_digest_request_body_data(htp_tx_data_t *txd);
+static int htpy_digest_response_body_data(htp_tx_data_t *txd);
+static int htpy_digest_request_complete(htp_tx_t *tx);
+static int htpy_digest_response_complete(htp_tx_t *tx);
+static int htpy_extract_file_data(htp_file_data_t *file_data);
+static int htpy_capture_request_body_data(htp_tx_data_t *txd);
+static int htpy_capture_response_body_data(htp_tx_data_t *txd);
+static int htpy_capture_request_complete(htp_tx_t *tx);
+static int htpy_capture_response_complete(htp_tx_t *tx);
+static int htpy_checkpoint_request_start(htp_tx_t *tx);
+static int htpy_checkpoint_response_complete(htp_tx_t *tx);
+int htpy_transaction_complete_callback(htp_tx_t *tx);
+
 static int htpy_config_init(htpy_config *self, PyObject *args, PyObject *kwds) {
 	self->cfg = htp_config_create();
 	if (!self->cfg)
 		return -1;
 
 	htp_config_set_tx_auto_destroy(self->cfg, 1);
+	self->log_callback_level = HTP_LOG_DEBUG2;
+	self->event_limit = HTPY_EVENT_LIMIT;
+	self->event_data_limit = HTPY_EVENT_DATA_LIMIT;
+
+	/* libhtp has no default and would crash extracting files without one. */
+	htp_config_set_tmpdir(self->cfg, "/tmp");
+
+	/*
+	 * These are registered before any python callbacks so the times are
+	 * already recorded when the python callback for the same hook runs.
+	 */
+	htp_config_register_request_start(self->cfg, htpy_timing_request_start);
+	htp_config_register_request_complete(self->cfg, htpy_timing_request_complete);
+	htp_config_register_response_start(self->cfg, htpy_timing_response_start);
+	htp_config_register_response_complete(self->cfg, htpy_timing_response_complete);
+
+	/*
+	 * Body digests and captures are done the same way. These do nothing
+	 * unless the body_digests or capture_bodies attributes are set.
+	 */
+	htp_config_register_request_body_data(self->cfg, htpy_digest_request_body_data);
+	htp_config_register_response_body_data(self->cfg, htpy_digest_response_body_data);
+	htp_config_register_request_complete(self->cfg, htpy_digest_request_complete);
+	htp_config_register_response_complete(self->cfg, htpy_digest_response_complete);
+	htp_config_register_request_body_data(self->cfg, htpy_capture_request_body_data);
+	htp_config_register_response_body_data(self->cfg, htpy_capture_response_body_data);
+	htp_config_register_request_complete(self->cfg, htpy_capture_request_complete);
+	htp_config_register_response_complete(self->cfg, htpy_capture_response_complete);
+
+	/* Keep track of transaction boundaries, if checkpoint_limit is set. */
+	htp_config_register_request_start(self->cfg, htpy_checkpoint_request_start);
+	htp_config_register_response_complete(self->cfg, htpy_checkpoint_response_complete);
+
+	/* Keeps extracted files within extract_request_file_size_limit. */
+	htp_config_register_request_file_data(self->cfg, htpy_extract_file_data);
+
+	/*
+	 * The transaction complete handler is always needed, right after it
+	 * returns libhtp destroys the transaction and any transaction object
+	 * for it has to be detached first.
+	 */
+	htp_config_register_transaction_complete(self->cfg, htpy_transaction_complete_callback);
+	self->hooks |= 1U << HTPY_HOOK_transaction_complete;
 
 	return 0;
 }
 
 static void htpy_config_dealloc(htpy_config *self) {
-	htp_config_destroy(self->cfg);
-	self->ob_type->tp_free((PyObject *) self);
+	free(self->stats_total);
+	Py_XDECREF(self->filter);
+	Py_XDECREF(self->exporter);
+	free(self->capture_dir);
+	free(self->tmpdir);
+	Py_XDECREF(self->request_start_callback);
+	Py_XDECREF(self->request_line_callback);
+	Py_XDECREF(self->request_uri_normalize_callback);
+	Py_XDECREF(self->request_headers_callback);
+	Py_XDECREF(self->request_header_data_callback);
+	Py_XDECREF(self->request_body_data_callback);
+	Py_XDECREF(self->request_file_data_callback);
+	Py_XDECREF(self->request_trailer_callback);
+	Py_XDECREF(self->request_trailer_data_callback);
+	Py_XDECREF(self->request_complete_callback);
+	Py_XDECREF(self->response_start_callback);
+	Py_XDECREF(self->response_line_callback);
+	Py_XDECREF(self->response_headers_callback);
+	Py_XDECREF(self->response_header_data_callback);
+	Py_XDECREF(self->response_body_data_callback);
+	Py_XDECREF(self->response_trailer_callback);
+	Py_XDECREF(self->response_trailer_data_callback);
+	Py_XDECREF(self->response_complete_callback);
+	Py_XDECREF(self->transaction_complete_callback);
+	Py_XDECREF(self->log_callback);
+	if (self->cfg)
+		htp_config_destroy(self->cfg);
+	HTPY_FREE(self);
 }
 
-static PyMethodDef htpy_config_methods[] = {
-	{ NULL }
-};
-
 #define CONFIG_GET(ATTR) \
 static PyObject *htpy_config_get_##ATTR(htpy_config *self, void *closure) { \
 	PyObject *ret; \
 	ret = Py_BuildValue("i", self->cfg->ATTR); \
 	if (!ret) { \
-		PyErr_SetString(htpy_error, "Unable to get this attribute."); \
+		PyErr_SetString(htpy_get_state()->error, "Unable to get this attribute."); \
 		return NULL; \
 	} \
 	return(ret); \
@@ -108,7 +518,7 @@ static PyObject *htpy_config_get_response_decompression(htpy_config *self, void
        PyObject *ret;
        ret = Py_BuildValue("i", self->cfg->response_decompression_enabled);
        if (!ret) {
-               PyErr_SetString(htpy_error, "Unable to get this attribute.");
+               PyErr_SetString(htpy_get_state()->error, "Unable to get this attribute.");
                return NULL;
        }
        return(ret);
@@ -118,11 +528,11 @@ static PyObject *htpy_config_get_response_decompression(htpy_config *self, void
 static int htpy_config_set_##ATTR(htpy_config *self, PyObject *value, void *closure) { \
 	int v; \
 	if (!value) { \
-		PyErr_SetString(htpy_error, "Value may not be None."); \
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None."); \
 		return -1; \
 	} \
 	if (!PyInt_Check(value)) { \
-		PyErr_SetString(htpy_error, "Attribute must be of type int."); \
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int."); \
 		return -1; \
 	} \
 	v = (int) PyInt_AsLong(value); \
@@ -144,12 +554,12 @@ CONFIG_SET(response_decompression)
 static int htpy_config_set_log_level(htpy_config *self, PyObject *value, void *closure) {
 	int v;
 	if (!value) {
-		PyErr_SetString(htpy_error, "Value may not be None.");
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
 		return -1;
 	}
 
 	if (!PyInt_Check(value)) {
-		PyErr_SetString(htpy_error, "Attribute must be of type int.");
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
 		return -1;
 	}
 
@@ -159,1012 +569,10473 @@ static int htpy_config_set_log_level(htpy_config *self, PyObject *value, void *c
 	return 0;
 }
 
-static PyGetSetDef htpy_config_getseters[] = {
-    {"log_level",
-     (getter) htpy_config_get_log_level,
-     (setter) htpy_config_set_log_level,
-     "Logs with a level less than this will be ignored.", NULL},
-    {"tx_auto_destroy",
-     (getter) htpy_config_get_tx_auto_destroy,
-     (setter) htpy_config_set_tx_auto_destroy,
-     "Automatically destroy transactions", NULL},
-    {"response_decompression",
-     (getter) htpy_config_get_response_decompression,
-     (setter) htpy_config_set_response_decompression,
-     "Enable response decompression", NULL},
-    {NULL}
-};
-
-static PyMemberDef htpy_config_members[] = {
-	{ NULL }
-};
-
-static PyTypeObject htpy_config_type = {
-	PyObject_HEAD_INIT(NULL)
-	0,                                /* ob_size */
-	"htpy.config",                    /* tp_name */
-	sizeof(htpy_config),              /* tp_basicsize */
-	0,                                /* tp_itemsize */
-	(destructor) htpy_config_dealloc, /* tp_dealloc */
-	0,                                /* tp_print */
-	0,                                /* tp_getattr */
-	0,                                /* tp_setattr */
-	0,                                /* tp_compare */
-	0,                                /* tp_repr */
-	0,                                /* tp_as_number */
-	0,                                /* tp_as_sequence */
-	0,                                /* tp_as_mapping */
-	0,                                /* tp_hash */
-	0,                                /* tp_call */
-	0,                                /* tp_str */
-	0,                                /* tp_getattro */
-	0,                                /* tp_setattro */
-	0,                                /* tp_as_buffer */
-	Py_TPFLAGS_DEFAULT,               /* tp_flags */
-	"config object",                  /* tp_doc */
-	0,                                /* tp_traverse */
-	0,                                /* tp_clear */
-	0,                                /* tp_richcompare */
-	0,                                /* tp_weaklistoffset */
-	0,                                /* tp_iter */
-	0,                                /* tp_iternext */
-	htpy_config_methods,              /* tp_methods */
-	htpy_config_members,              /* tp_members */
-	htpy_config_getseters,            /* tp_getset */
-	0,                                /* tp_base */
-	0,                                /* tp_dict */
-	0,                                /* tp_descr_get */
-	0,                                /* tp_descr_set */
-	0,                                /* tp_dictoffset */
-	(initproc) htpy_config_init,      /* tp_init */
-	0,                                /* tp_alloc */
-	htpy_config_new,                  /* tp_new */
-};
-
-typedef struct {
-	PyObject_HEAD
-	htp_connp_t *connp;
-	PyObject *cfg;
-	PyObject *obj_store;
-	/* Callbacks */
-	PyObject *request_start_callback;
-	PyObject *request_line_callback;
-	PyObject *request_uri_normalize_callback;
-	PyObject *request_headers_callback;
-	PyObject *request_header_data_callback;
-	PyObject *request_body_data_callback;
-	PyObject *request_trailer_callback;
-	PyObject *request_trailer_data_callback;
-	PyObject *request_complete_callback;
-	PyObject *response_start_callback;
-	PyObject *response_line_callback;
-	PyObject *response_headers_callback;
-	PyObject *response_header_data_callback;
-	PyObject *response_body_data_callback;
-	PyObject *response_trailer_callback;
-	PyObject *response_trailer_data_callback;
-	PyObject *response_complete_callback;
-	PyObject *transaction_complete_callback;
-	PyObject *log_callback;
-} htpy_connp;
-
-static PyObject *htpy_connp_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
-	htpy_connp *self;
-
-	self = (htpy_connp *) type->tp_alloc(type, 0);
+CONFIG_GET(response_decompression_layer_limit)
+CONFIG_GET(parse_request_cookies)
+CONFIG_GET(parse_request_auth)
+CONFIG_GET(generate_request_uri_normalized)
+CONFIG_GET(server_personality)
+CONFIG_SET(response_decompression_layer_limit)
+CONFIG_SET(parse_request_cookies)
+CONFIG_SET(parse_request_auth)
+
+/* There is no setter for this one in libhtp either. */
+static int htpy_config_set_generate_request_uri_normalized(htpy_config *self, PyObject *value, void *closure) {
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
 
-	return (PyObject *) self;
-}
+	if (!PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
 
-static void htpy_connp_dealloc(htpy_connp *self) {
-	/*
-	 * Decrement reference counters and free the underlying
-	 * libhtp backed storage.
-	 */
-	Py_XDECREF(self->obj_store);
-	Py_XDECREF(self->cfg);
-	Py_XDECREF(self->request_start_callback);
-	Py_XDECREF(self->request_line_callback);
-	Py_XDECREF(self->request_uri_normalize_callback);
-	Py_XDECREF(self->request_headers_callback);
-	Py_XDECREF(self->request_header_data_callback);
-	Py_XDECREF(self->request_body_data_callback);
-	Py_XDECREF(self->request_trailer_callback);
-	Py_XDECREF(self->request_trailer_data_callback);
-	Py_XDECREF(self->request_complete_callback);
-	Py_XDECREF(self->response_start_callback);
-	Py_XDECREF(self->response_line_callback);
-	Py_XDECREF(self->response_headers_callback);
-	Py_XDECREF(self->response_header_data_callback);
-	Py_XDECREF(self->response_body_data_callback);
-	Py_XDECREF(self->response_trailer_callback);
-	Py_XDECREF(self->response_trailer_data_callback);
-	Py_XDECREF(self->response_complete_callback);
-	Py_XDECREF(self->transaction_complete_callback);
-	Py_XDECREF(self->log_callback);
-	htp_connp_destroy_all(self->connp);
-	self->ob_type->tp_free((PyObject *) self);
+	self->cfg->generate_request_uri_normalized = PyInt_AsLong(value) ? 1 : 0;
+	return 0;
 }
 
-static int htpy_connp_init(htpy_connp *self, PyObject *args, PyObject *kwds) {
-	PyObject *cfg_obj = NULL;
-
-	if (!PyArg_ParseTuple(args, "|O:htpy_connp_init", &cfg_obj))
+/*
+ * Setting the personality resets the URI normalization settings to the
+ * ones of that server, so it should be done before changing any of them.
+ */
+static int htpy_config_set_server_personality(htpy_config *self, PyObject *value, void *closure) {
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
 		return -1;
+	}
 
-	/*
-	 * If we are not given a config object as an argument create an
-	 * htp_cfg_t and use that.
-	 */
-	if (!cfg_obj)
-		cfg_obj = PyObject_CallObject((PyObject *) &htpy_config_type, NULL);
-	else
-		Py_XINCREF(cfg_obj);
-
-	if (!cfg_obj) {
-		PyErr_SetString(htpy_error, "Unable to create config object.");
+	if (!PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
 		return -1;
 	}
 
-	self->cfg = cfg_obj;
-	self->connp = htp_connp_create(((htpy_config *) cfg_obj)->cfg);
-
-	if (!self->connp) {
-		PyErr_SetString(htpy_error, "Unable to create connection parser.");
+	if (htp_config_set_server_personality(self->cfg, (int) PyInt_AsLong(value)) != HTP_OK) {
+		PyErr_SetString(htpy_get_state()->error, "Invalid server personality.");
 		return -1;
 	}
 
-	htp_connp_set_user_data(self->connp, (void *) self);
-
 	return 0;
 }
 
-/*
- * Callback handlers.
- *
- * Libhtp will call one of these callbacks. This callback will then get the
+/* Limits which are a size_t in the libhtp config. */
+#define CONFIG_SIZE(ATTR) \
+static PyObject *htpy_config_get_##ATTR(htpy_config *self, void *closure) { \
+	return PyLong_FromSize_t(self->cfg->ATTR); \
+} \
+static int htpy_config_set_##ATTR(htpy_config *self, PyObject *value, void *closure) { \
+	long v; \
+	if (!value) { \
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None."); \
+		return -1; \
+	} \
+	if (!PyInt_Check(value) && !PyLong_Check(value)) { \
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int."); \
+		return -1; \
+	} \
+	v = PyInt_AsLong(value); \
+	if (v == -1 && PyErr_Occurred()) \
+		return -1; \
+	if (v < 0) { \
+		PyErr_SetString(htpy_get_state()->error, "Limit may not be negative."); \
+		return -1; \
+	} \
+	htp_config_set_##ATTR(self->cfg, (size_t) v); \
+	return 0; \
+}
+
+CONFIG_SIZE(lzma_memlimit)
+CONFIG_SIZE(compression_bomb_limit)
+
+/*
+ * libhtp buffers a request or response line or header until it is
+ * complete, and gives up on the stream once one grows past the hard
+ * field limit. This is what bounds the memory one connection can use
+ * for those buffers. The soft limit is not used by libhtp.
+ */
+static PyObject *htpy_config_get_field_limit(htpy_config *self, void *closure) {
+	return PyLong_FromSize_t(self->cfg->field_limit_hard);
+}
+
+static int htpy_config_set_field_limit(htpy_config *self, PyObject *value, void *closure) {
+	long v;
+
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+
+	if (!PyInt_Check(value) && !PyLong_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	v = PyInt_AsLong(value);
+	if (v == -1 && PyErr_Occurred())
+		return -1;
+	if (v <= 0) {
+		PyErr_SetString(htpy_get_state()->error, "Field limit must be positive.");
+		return -1;
+	}
+
+	htp_config_set_field_limits(self->cfg, (size_t) v < self->cfg->field_limit_soft ? (size_t) v : self->cfg->field_limit_soft, (size_t) v);
+	return 0;
+}
+
+/*
+ * URI normalization settings. libhtp keeps these per decoder context but
+ * most of them are only used when decoding the path, so that is the one
+ * which is read. Setting one applies it to all contexts.
+ */
+#define CONFIG_DECODER(ATTR) \
+static PyObject *htpy_config_get_##ATTR(htpy_config *self, void *closure) { \
+	return Py_BuildValue("i", self->cfg->decoder_cfgs[HTP_DECODER_URL_PATH].ATTR); \
+} \
+static int htpy_config_set_##ATTR(htpy_config *self, PyObject *value, void *closure) { \
+	if (!value) { \
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None."); \
+		return -1; \
+	} \
+	if (!PyInt_Check(value)) { \
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int."); \
+		return -1; \
+	} \
+	htp_config_set_##ATTR(self->cfg, HTP_DECODER_DEFAULTS, (int) PyInt_AsLong(value)); \
+	return 0; \
+}
+
+CONFIG_DECODER(backslash_convert_slashes)
+CONFIG_DECODER(convert_lowercase)
+CONFIG_DECODER(path_separators_compress)
+CONFIG_DECODER(path_separators_decode)
+CONFIG_DECODER(plusspace_decode)
+CONFIG_DECODER(u_encoding_decode)
+CONFIG_DECODER(utf8_convert_bestfit)
+CONFIG_DECODER(nul_raw_terminates)
+CONFIG_DECODER(nul_encoded_terminates)
+
+static PyObject *htpy_config_get_url_encoding_invalid_handling(htpy_config *self, void *closure) {
+	return Py_BuildValue("i", self->cfg->decoder_cfgs[HTP_DECODER_URL_PATH].url_encoding_invalid_handling);
+}
+
+static int htpy_config_set_url_encoding_invalid_handling(htpy_config *self, PyObject *value, void *closure) {
+	long v;
+
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+
+	if (!PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	v = PyInt_AsLong(value);
+	if (v != HTP_URL_DECODE_PRESERVE_PERCENT && v != HTP_URL_DECODE_REMOVE_PERCENT && v != HTP_URL_DECODE_PROCESS_INVALID) {
+		PyErr_SetString(htpy_get_state()->error, "Invalid URL encoding handling.");
+		return -1;
+	}
+
+	htp_config_set_url_encoding_invalid_handling(self->cfg, HTP_DECODER_DEFAULTS, (int) v);
+	return 0;
+}
+
+/* Flags which belong to htpy rather than to the libhtp config. */
+#define CONFIG_FLAG(ATTR) \
+static PyObject *htpy_config_get_##ATTR(htpy_config *self, void *closure) { \
+	PyObject *ret; \
+	ret = Py_BuildValue("i", self->ATTR); \
+	if (!ret) { \
+		PyErr_SetString(htpy_get_state()->error, "Unable to get this attribute."); \
+		return NULL; \
+	} \
+	return(ret); \
+} \
+static int htpy_config_set_##ATTR(htpy_config *self, PyObject *value, void *closure) { \
+	if (!value) { \
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None."); \
+		return -1; \
+	} \
+	if (!PyInt_Check(value)) { \
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int."); \
+		return -1; \
+	} \
+	self->ATTR = PyInt_AsLong(value) ? 1 : 0; \
+	return 0; \
+}
+
+CONFIG_FLAG(zero_copy)
+CONFIG_FLAG(pass_tx)
+CONFIG_FLAG(log_batch)
+CONFIG_FLAG(stats)
+
+static PyObject *htpy_config_get_log_callback_level(htpy_config *self, void *closure) {
+	return Py_BuildValue("i", self->log_callback_level);
+}
+
+/*
+ * Unlike log_level this does not stop libhtp from keeping the message, so
+ * it is still there for get_last_error(). It only saves the call.
+ */
+static int htpy_config_set_log_callback_level(htpy_config *self, PyObject *value, void *closure) {
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+
+	if (!PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	self->log_callback_level = (int) PyInt_AsLong(value);
+	return 0;
+}
+
+static PyObject *htpy_config_get_tmpdir(htpy_config *self, void *closure) {
+	return PyString_FromString(self->cfg->tmpdir);
+}
+
+static int htpy_config_set_tmpdir(htpy_config *self, PyObject *value, void *closure) {
+	char *dir;
+
+	if (!value || !PyString_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type str.");
+		return -1;
+	}
+
+	dir = strdup(PyString_AS_STRING(value));
+	if (!dir) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	htp_config_set_tmpdir(self->cfg, dir);
+	free(self->tmpdir);
+	self->tmpdir = dir;
+	return 0;
+}
+
+static void htpy_config_hook_multipart(htpy_config *cfg);
+
+static PyObject *htpy_config_get_extract_request_files(htpy_config *self, void *closure) {
+	return Py_BuildValue("i", self->cfg->extract_request_files);
+}
+
+/* Files are only found by the multipart parser, so turning this on needs it. */
+static int htpy_config_set_extract_request_files(htpy_config *self, PyObject *value, void *closure) {
+	if (!value || !PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	self->cfg->extract_request_files = PyInt_AsLong(value) ? 1 : 0;
+	if (self->cfg->extract_request_files)
+		htpy_config_hook_multipart(self);
+	return 0;
+}
+
+static PyObject *htpy_config_get_extract_request_files_limit(htpy_config *self, void *closure) {
+	return Py_BuildValue("i", self->cfg->extract_request_files_limit);
+}
+
+static int htpy_config_set_extract_request_files_limit(htpy_config *self, PyObject *value, void *closure) {
+	if (!value || !PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	self->cfg->extract_request_files_limit = (int) PyInt_AsLong(value);
+	return 0;
+}
+
+static PyObject *htpy_config_get_extract_request_file_size_limit(htpy_config *self, void *closure) {
+	return PyInt_FromLong(self->extract_request_file_size_limit);
+}
+
+static int htpy_config_set_extract_request_file_size_limit(htpy_config *self, PyObject *value, void *closure) {
+	long v;
+
+	if (!value || (!PyInt_Check(value) && !PyLong_Check(value))) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	v = PyInt_AsLong(value);
+	if (v == -1 && PyErr_Occurred())
+		return -1;
+	if (v < 0) {
+		PyErr_SetString(htpy_get_state()->error, "File size limit may not be negative.");
+		return -1;
+	}
+
+	self->extract_request_file_size_limit = v;
+	return 0;
+}
+
+static PyObject *htpy_config_get_capture_bodies(htpy_config *self, void *closure) {
+	return Py_BuildValue("i", self->capture_bodies);
+}
+
+static int htpy_config_set_capture_bodies(htpy_config *self, PyObject *value, void *closure) {
+	long v;
+
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+
+	if (!PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	v = PyInt_AsLong(value);
+	if (v & ~(HTPY_CAPTURE_REQUEST | HTPY_CAPTURE_RESPONSE)) {
+		PyErr_SetString(htpy_get_state()->error, "Invalid capture direction.");
+		return -1;
+	}
+
+	self->capture_bodies = (int) v;
+	return 0;
+}
+
+static PyObject *htpy_config_get_capture_limit(htpy_config *self, void *closure) {
+	return PyInt_FromLong(self->capture_limit);
+}
+
+static int htpy_config_set_capture_limit(htpy_config *self, PyObject *value, void *closure) {
+	long v;
+
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+
+	if (!PyInt_Check(value) && !PyLong_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	v = PyInt_AsLong(value);
+	if (v == -1 && PyErr_Occurred())
+		return -1;
+	if (v < 0) {
+		PyErr_SetString(htpy_get_state()->error, "Capture limit may not be negative.");
+		return -1;
+	}
+
+	self->capture_limit = v;
+	return 0;
+}
+
+static PyObject *htpy_config_get_capture_dir(htpy_config *self, void *closure) {
+	if (!self->capture_dir)
+		Py_RETURN_NONE;
+	return PyString_FromString(self->capture_dir);
+}
+
+/*
+ * Like the filter, this is used without the GIL and must not be changed
+ * while parsers using this config are being fed from other threads.
+ */
+static int htpy_config_set_capture_dir(htpy_config *self, PyObject *value, void *closure) {
+	char *dir = NULL;
+
+	if (value && value != Py_None) {
+		if (!PyString_Check(value)) {
+			PyErr_SetString(htpy_get_state()->error, "Attribute must be of type str.");
+			return -1;
+		}
+		dir = strdup(PyString_AS_STRING(value));
+		if (!dir) {
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+
+	free(self->capture_dir);
+	self->capture_dir = dir;
+	return 0;
+}
+
+static PyObject *htpy_config_get_body_digests(htpy_config *self, void *closure) {
+	return Py_BuildValue("i", self->body_digests);
+}
+
+static int htpy_config_set_body_digests(htpy_config *self, PyObject *value, void *closure) {
+	long v;
+
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+
+	if (!PyInt_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	v = PyInt_AsLong(value);
+	if (v & ~(HTPY_DIGEST_MD5 | HTPY_DIGEST_SHA1 | HTPY_DIGEST_SHA256)) {
+		PyErr_SetString(htpy_get_state()->error, "Invalid digest.");
+		return -1;
+	}
+
+	self->body_digests = (int) v;
+	return 0;
+}
+
+#ifdef HTPY_ARENA
+CONFIG_FLAG(arena)
+#else
+static PyObject *htpy_config_get_arena(htpy_config *self, void *closure) {
+	return Py_BuildValue("i", 0);
+}
+
+static int htpy_config_set_arena(htpy_config *self, PyObject *value, void *closure) {
+	if (value && PyObject_IsTrue(value)) {
+		PyErr_SetString(htpy_get_state()->error, "htpy was built without arena support.");
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static PyTypeObject htpy_filter_type;
+static int htpy_filter_freeze(PyObject *obj);
+
+static PyObject *htpy_config_get_filter(htpy_config *self, void *closure) {
+	if (!self->filter)
+		Py_RETURN_NONE;
+	Py_INCREF(self->filter);
+	return self->filter;
+}
+
+/*
+ * Attaching a filter compiles it and stops it from changing, as it is
+ * used without the GIL. It must not be replaced while parsers using this
+ * config are being fed from other threads.
+ */
+static int htpy_config_set_filter(htpy_config *self, PyObject *value, void *closure) {
+	if (value == Py_None)
+		value = NULL;
+
+	if (value && !PyObject_TypeCheck(value, htpy_get_state()->filter_type)) {
+		PyErr_SetString(htpy_get_state()->error, "Filter must be a htpy.filter object.");
+		return -1;
+	}
+
+	if (value && htpy_filter_freeze(value) == -1)
+		return -1;
+
+	Py_XINCREF(value);
+	Py_XDECREF(self->filter);
+	self->filter = value;
+
+	return 0;
+}
+
+static PyTypeObject htpy_exporter_type;
+
+static PyObject *htpy_config_get_exporter(htpy_config *self, void *closure) {
+	if (!self->exporter)
+		Py_RETURN_NONE;
+	Py_INCREF(self->exporter);
+	return self->exporter;
+}
+
+/* The same as filters, it must not be replaced while parsers are busy. */
+static int htpy_config_set_exporter(htpy_config *self, PyObject *value, void *closure) {
+	if (value == Py_None)
+		value = NULL;
+
+	if (value && !PyObject_TypeCheck(value, htpy_get_state()->exporter_type)) {
+		PyErr_SetString(htpy_get_state()->error, "Exporter must be a htpy.exporter object.");
+		return -1;
+	}
+
+	Py_XINCREF(value);
+	Py_XDECREF(self->exporter);
+	self->exporter = value;
+
+	return 0;
+}
+
+static void htpy_config_hook_events(htpy_config *self);
+
+static PyObject *htpy_config_get_events(htpy_config *self, void *closure) {
+	return PyLong_FromUnsignedLong(self->events);
+}
+
+static int htpy_config_set_events(htpy_config *self, PyObject *value, void *closure) {
+	long v;
+
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+
+	if (!PyInt_Check(value) && !PyLong_Check(value)) {
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int.");
+		return -1;
+	}
+
+	v = PyInt_AsLong(value);
+	if (v == -1 && PyErr_Occurred())
+		return -1;
+	if (v & ~(long) HTPY_EVENTS_ALL) {
+		PyErr_SetString(htpy_get_state()->error, "Invalid event.");
+		return -1;
+	}
+
+	self->events = (unsigned int) v;
+	htpy_config_hook_events(self);
+	return 0;
+}
+
+#define CONFIG_EVENT_LIMIT(ATTR, MSG) \
+static PyObject *htpy_config_get_##ATTR(htpy_config *self, void *closure) { \
+	return PyLong_FromSize_t(self->ATTR); \
+} \
+static int htpy_config_set_##ATTR(htpy_config *self, PyObject *value, void *closure) { \
+	long v; \
+	if (!value) { \
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None."); \
+		return -1; \
+	} \
+	if (!PyInt_Check(value) && !PyLong_Check(value)) { \
+		PyErr_SetString(htpy_get_state()->error, "Attribute must be of type int."); \
+		return -1; \
+	} \
+	v = PyInt_AsLong(value); \
+	if (v == -1 && PyErr_Occurred()) \
+		return -1; \
+	if (v < 0) { \
+		PyErr_SetString(htpy_get_state()->error, MSG " may not be negative."); \
+		return -1; \
+	} \
+	self->ATTR = (size_t) v; \
+	return 0; \
+}
+
+CONFIG_EVENT_LIMIT(event_limit, "Event limit")
+CONFIG_EVENT_LIMIT(event_data_limit, "Event data limit")
+CONFIG_EVENT_LIMIT(checkpoint_limit, "Checkpoint limit")
+
+static PyGetSetDef htpy_config_getseters[] = {
+    {"log_level",
+     (getter) htpy_config_get_log_level,
+     (setter) htpy_config_set_log_level,
+     "Logs with a level less than this will be ignored.", NULL},
+    {"log_callback_level",
+     (getter) htpy_config_get_log_callback_level,
+     (setter) htpy_config_set_log_callback_level,
+     "Logs with a level less than this are kept but not passed to the log callback.", NULL},
+    {"log_batch",
+     (getter) htpy_config_get_log_batch,
+     (setter) htpy_config_set_log_batch,
+     "Pass log messages to the log callback in one list per transaction", NULL},
+    {"stats",
+     (getter) htpy_config_get_stats,
+     (setter) htpy_config_set_stats,
+     "Count and time what connection parsers made with this config do", NULL},
+    {"tx_auto_destroy",
+     (getter) htpy_config_get_tx_auto_destroy,
+     (setter) htpy_config_set_tx_auto_destroy,
+     "Automatically destroy transactions", NULL},
+    {"response_decompression",
+     (getter) htpy_config_get_response_decompression,
+     (setter) htpy_config_set_response_decompression,
+     "Enable response decompression", NULL},
+    {"response_decompression_layer_limit",
+     (getter) htpy_config_get_response_decompression_layer_limit,
+     (setter) htpy_config_set_response_decompression_layer_limit,
+     "Maximum number of compression layers to decompress, 0 for no limit", NULL},
+    {"compression_bomb_limit",
+     (getter) htpy_config_get_compression_bomb_limit,
+     (setter) htpy_config_set_compression_bomb_limit,
+     "Decompressed size after which a response body is checked for being a compression bomb", NULL},
+    {"lzma_memlimit",
+     (getter) htpy_config_get_lzma_memlimit,
+     (setter) htpy_config_set_lzma_memlimit,
+     "Maximum memory the LZMA decompressor may use", NULL},
+    {"field_limit",
+     (getter) htpy_config_get_field_limit,
+     (setter) htpy_config_set_field_limit,
+     "Maximum length of a request or response line or header", NULL},
+    {"server_personality",
+     (getter) htpy_config_get_server_personality,
+     (setter) htpy_config_set_server_personality,
+     "Server whose parsing and normalization to mimic", NULL},
+    {"parse_request_cookies",
+     (getter) htpy_config_get_parse_request_cookies,
+     (setter) htpy_config_set_parse_request_cookies,
+     "Parse the Cookie request header", NULL},
+    {"parse_request_auth",
+     (getter) htpy_config_get_parse_request_auth,
+     (setter) htpy_config_set_parse_request_auth,
+     "Parse the Authorization request header", NULL},
+    {"generate_request_uri_normalized",
+     (getter) htpy_config_get_generate_request_uri_normalized,
+     (setter) htpy_config_set_generate_request_uri_normalized,
+     "Build a normalized request URI", NULL},
+    {"backslash_convert_slashes",
+     (getter) htpy_config_get_backslash_convert_slashes,
+     (setter) htpy_config_set_backslash_convert_slashes,
+     "Convert backslashes in the path to forward slashes", NULL},
+    {"convert_lowercase",
+     (getter) htpy_config_get_convert_lowercase,
+     (setter) htpy_config_set_convert_lowercase,
+     "Convert the path to lowercase", NULL},
+    {"path_separators_compress",
+     (getter) htpy_config_get_path_separators_compress,
+     (setter) htpy_config_set_path_separators_compress,
+     "Compress consecutive path separators", NULL},
+    {"path_separators_decode",
+     (getter) htpy_config_get_path_separators_decode,
+     (setter) htpy_config_set_path_separators_decode,
+     "Decode encoded path separators", NULL},
+    {"plusspace_decode",
+     (getter) htpy_config_get_plusspace_decode,
+     (setter) htpy_config_set_plusspace_decode,
+     "Decode + to a space", NULL},
+    {"u_encoding_decode",
+     (getter) htpy_config_get_u_encoding_decode,
+     (setter) htpy_config_set_u_encoding_decode,
+     "Decode %u encoding", NULL},
+    {"utf8_convert_bestfit",
+     (getter) htpy_config_get_utf8_convert_bestfit,
+     (setter) htpy_config_set_utf8_convert_bestfit,
+     "Convert UTF-8 in the path to single bytes using best-fit mapping", NULL},
+    {"nul_raw_terminates",
+     (getter) htpy_config_get_nul_raw_terminates,
+     (setter) htpy_config_set_nul_raw_terminates,
+     "Terminate the path at a raw NUL byte", NULL},
+    {"nul_encoded_terminates",
+     (getter) htpy_config_get_nul_encoded_terminates,
+     (setter) htpy_config_set_nul_encoded_terminates,
+     "Terminate the path at an encoded NUL byte", NULL},
+    {"url_encoding_invalid_handling",
+     (getter) htpy_config_get_url_encoding_invalid_handling,
+     (setter) htpy_config_set_url_encoding_invalid_handling,
+     "How to handle invalid URL encoding", NULL},
+    {"zero_copy",
+     (getter) htpy_config_get_zero_copy,
+     (setter) htpy_config_set_zero_copy,
+     "Pass data to callbacks as an htpy.chunk", NULL},
+    {"pass_tx",
+     (getter) htpy_config_get_pass_tx,
+     (setter) htpy_config_set_pass_tx,
+     "Pass a transaction object to callbacks", NULL},
+    {"arena",
+     (getter) htpy_config_get_arena,
+     (setter) htpy_config_set_arena,
+     "Allocate libhtp memory from a per-parser arena", NULL},
+    {"body_digests",
+     (getter) htpy_config_get_body_digests,
+     (setter) htpy_config_set_body_digests,
+     "Digests to compute over request and response bodies", NULL},
+    {"tmpdir",
+     (getter) htpy_config_get_tmpdir,
+     (setter) htpy_config_set_tmpdir,
+     "Directory extracted request files are written to", NULL},
+    {"extract_request_files",
+     (getter) htpy_config_get_extract_request_files,
+     (setter) htpy_config_set_extract_request_files,
+     "Extract files from multipart requests", NULL},
+    {"extract_request_files_limit",
+     (getter) htpy_config_get_extract_request_files_limit,
+     (setter) htpy_config_set_extract_request_files_limit,
+     "Maximum number of files to extract from a request, -1 for the libhtp default", NULL},
+    {"extract_request_file_size_limit",
+     (getter) htpy_config_get_extract_request_file_size_limit,
+     (setter) htpy_config_set_extract_request_file_size_limit,
+     "Maximum number of bytes of an extracted file to keep, 0 for no limit", NULL},
+    {"capture_bodies",
+     (getter) htpy_config_get_capture_bodies,
+     (setter) htpy_config_set_capture_bodies,
+     "Which bodies to capture", NULL},
+    {"capture_limit",
+     (getter) htpy_config_get_capture_limit,
+     (setter) htpy_config_set_capture_limit,
+     "Maximum number of bytes of a body to capture, 0 for no limit", NULL},
+    {"capture_dir",
+     (getter) htpy_config_get_capture_dir,
+     (setter) htpy_config_set_capture_dir,
+     "Directory to capture bodies to files in, None for memory", NULL},
+    {"filter",
+     (getter) htpy_config_get_filter,
+     (setter) htpy_config_set_filter,
+     "Rules a transaction must match before callbacks are called", NULL},
+    {"exporter",
+     (getter) htpy_config_get_exporter,
+     (setter) htpy_config_set_exporter,
+     "Exporter completed transactions are added to", NULL},
+    {"events",
+     (getter) htpy_config_get_events,
+     (setter) htpy_config_set_events,
+     "Hooks to queue as events for drain_events() instead of calling callbacks", NULL},
+    {"event_limit",
+     (getter) htpy_config_get_event_limit,
+     (setter) htpy_config_set_event_limit,
+     "Maximum number of events a connection parser queues", NULL},
+    {"event_data_limit",
+     (getter) htpy_config_get_event_data_limit,
+     (setter) htpy_config_set_event_data_limit,
+     "Maximum number of bytes of data a connection parser queues with events", NULL},
+    {"checkpoint_limit",
+     (getter) htpy_config_get_checkpoint_limit,
+     (setter) htpy_config_set_checkpoint_limit,
+     "Maximum number of bytes kept in each direction for checkpoints, 0 for no checkpoints", NULL},
+    {NULL}
+};
+
+
+/*
+ * libhtp does not keep any timestamps in a transaction, only the time of
+ * the last chunk of data seen in each direction. htpy records those times
+ * as each transaction passes through its start and complete hooks.
+ */
+typedef struct {
+	htp_time_t request_start;
+	htp_time_t request_complete;
+	htp_time_t response_start;
+	htp_time_t response_complete;
+	/* Request stream offset the request started at plus one, for checkpoints. */
+	unsigned long long request_offset;
+} htpy_tx_times;
+
+/*
+ * How far the filter of the config has got with a transaction, kept with
+ * the times. The stages are the points at which more
+ * of a transaction becomes known to the filter.
+ */
+enum {
+	HTPY_STAGE_NONE,
+	HTPY_STAGE_REQUEST_LINE,
+	HTPY_STAGE_REQUEST_HEADERS,
+	HTPY_STAGE_RESPONSE_LINE,
+	HTPY_STAGE_RESPONSE_HEADERS
+};
+
+typedef struct {
+	/* Last stage checked. */
+	int stage;
+	/* Rule which matched plus one, zero if none has yet. */
+	int rule;
+} htpy_tx_filter;
+
+/*
+ * Everything htpy keeps about a transaction is in a record set as the
+ * user data of the libhtp transaction. It is made the first time it is
+ * needed and freed by htpy_tx_detach() right before libhtp destroys the
+ * transaction, so any number of transactions can be in flight.
+ */
+typedef struct {
+	/* The python object of the transaction, if there is one. Owned. */
+	PyObject *obj;
+	htpy_tx_times times;
+	htpy_tx_filter filter;
+	/* The finished body digests, made when the first body finishes. */
+	struct htpy_tx_digests *digests;
+	/* The finished body captures, made when the first capture finishes. */
+	struct htpy_tx_captures *captures;
+} htpy_tx_record;
+
+/* Find the record of a transaction, making it if asked to. */
+static htpy_tx_record *htpy_tx_record_get(htp_tx_t *tx, int create) {
+	htpy_tx_record *r = (htpy_tx_record *) htp_tx_get_user_data(tx);
+
+	if (!r && create) {
+		r = calloc(1, sizeof(htpy_tx_record));
+		if (r)
+			htp_tx_set_user_data(tx, r);
+	}
+
+	return r;
+}
+
+static void htpy_tx_captures_free(struct htpy_tx_captures *t);
+
+static void htpy_tx_record_free(htpy_tx_record *r) {
+	free(r->digests);
+	if (r->captures) {
+		htpy_tx_captures_free(r->captures);
+		free(r->captures);
+	}
+	free(r);
+}
+
+#ifdef HTPY_ARENA
+typedef struct htpy_arena htpy_arena;
+#endif
+
+typedef struct {
+	PyObject_HEAD
+	htp_connp_t *connp;
+	PyObject *cfg;
+	PyObject *obj_store;
+#ifdef HTPY_ARENA
+	htpy_arena *arena;
+#endif
+	/* Only allocated once the config asks for body digests. */
+	struct htpy_digests *digests;
+	/* Only allocated once the config asks for bodies to be captured. */
+	struct htpy_captures *captures;
+	/* Only allocated once the config asks for stats. */
+	struct htpy_stats *stats;
+	/* Only allocated once the config asks for events. */
+	struct htpy_events *events;
+	/* Only allocated once the config asks for checkpoints. */
+	struct htpy_checkpoint *checkpoint;
+	/*
+	 * Held while libhtp is parsing data for this connection parser. The
+	 * GIL is released during parsing so this is what keeps two threads
+	 * from feeding the same parser at once.
+	 */
+	pthread_mutex_t lock;
+	/* Argument tuples reused between calls, see htpy_call(). */
+	PyObject *args;
+	PyObject *data_args;
+	PyObject *log_args;
+	PyObject *file_args;
+	/* The file being passed to request file data callbacks. */
+	PyObject *file;
+	/* Set for a direction which is skipping data up to the next transaction after a gap. */
+	int gap[2];
+	/* Whether the data skipped so far in a direction ended a line. */
+	int gap_line[2];
+	/* Index in the libhtp list of log messages of the first not passed on. */
+	size_t log_next;
+	/* Log messages passed to the log callback, left out, and batches. */
+	unsigned long log_delivered;
+	unsigned long log_suppressed;
+	unsigned long log_batches;
+	/* Callbacks */
+	PyObject *request_start_callback;
+	PyObject *request_line_callback;
+	PyObject *request_uri_normalize_callback;
+	PyObject *request_headers_callback;
+	PyObject *request_header_data_callback;
+	PyObject *request_body_data_callback;
+	PyObject *request_file_data_callback;
+	PyObject *request_trailer_callback;
+	PyObject *request_trailer_data_callback;
+	PyObject *request_complete_callback;
+	PyObject *response_start_callback;
+	PyObject *response_line_callback;
+	PyObject *response_headers_callback;
+	PyObject *response_header_data_callback;
+	PyObject *response_body_data_callback;
+	PyObject *response_trailer_callback;
+	PyObject *response_trailer_data_callback;
+	PyObject *response_complete_callback;
+	PyObject *transaction_complete_callback;
+	PyObject *log_callback;
+} htpy_connp;
+
+/*
+ * The python callback to use for a hook, preferring the one registered
+ * with the connection parser over the one registered with its config.
+ */
+#define HTPY_CALLBACK(OBJ, CB) \
+	(((htpy_connp *) (OBJ))->CB##_callback ? ((htpy_connp *) (OBJ))->CB##_callback : ((htpy_config *) ((htpy_connp *) (OBJ))->cfg)->CB##_callback)
+
+/*
+ * Getters reading libhtp's state of a connection parser take its lock, as
+ * another thread may be feeding it with the GIL released. Callbacks of the
+ * parser run on the thread feeding it, which already holds the lock.
+ * Returns 1 if the lock was taken, 0 if this thread already holds it or
+ * there is no parser, and -1 with an exception set if the parser is busy.
+ */
+static int htpy_connp_enter(PyObject *self) {
+	if (!self || htpy_current_connp == self)
+		return 0;
+
+	if (pthread_mutex_trylock(&((htpy_connp *) self)->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return -1;
+	}
+
+	return 1;
+}
+
+static void htpy_connp_leave(PyObject *self, int locked) {
+	if (locked)
+		pthread_mutex_unlock(&((htpy_connp *) self)->lock);
+}
+
+/* Define a connection parser method which calls NAME_unlocked() under the lock. */
+#define CONNP_LOCKED(NAME) \
+static PyObject *htpy_connp_##NAME(PyObject *self, PyObject *args) { \
+	PyObject *ret; \
+	int locked = htpy_connp_enter(self); \
+	if (locked == -1) \
+		return NULL; \
+	ret = htpy_connp_##NAME##_unlocked(self, args); \
+	htpy_connp_leave(self, locked); \
+	return ret; \
+}
+
+/*
+ * Stats.
+ *
+ * With the stats attribute of a config set, each connection parser made
+ * with it counts the data it is fed, transactions, errors and stops, and
+ * times libhtp and each of the callbacks. Times go into histograms with a
+ * bucket for each power of two nanoseconds. Callback time is everything
+ * from taking the GIL to giving it back, and is not counted as libhtp
+ * time. The stats are only touched by whoever holds the parser lock, and
+ * are folded into the totals of the config with the GIL held when the
+ * parser is reset or destroyed.
+ */
+#define HTPY_HOOKS (HTPY_HOOK_log + 1)
+#define HTPY_HISTOGRAM 32
+
+static const char *htpy_hook_names[HTPY_HOOKS] = {
+	"request_start",
+	"request_line",
+	"request_uri_normalize",
+	"request_headers",
+	"request_header_data",
+	"request_body_data",
+	"request_file_data",
+	"request_trailer",
+	"request_trailer_data",
+	"request_complete",
+	"response_start",
+	"response_line",
+	"response_headers",
+	"response_header_data",
+	"response_body_data",
+	"response_trailer",
+	"response_trailer_data",
+	"response_complete",
+	"transaction_complete",
+	"log"
+};
+
+typedef struct {
+	unsigned long long calls;
+	unsigned long long ns;
+	unsigned long long histogram[HTPY_HISTOGRAM];
+} htpy_timing;
+
+typedef struct htpy_stats {
+	unsigned long long bytes[2];
+	unsigned long long transactions;
+	unsigned long long errors;
+	unsigned long long stops;
+	/* Only counted when built with HTPY_ARENA, which wraps malloc(). */
+	unsigned long long allocations;
+	htpy_timing parse;
+	htpy_timing hooks[HTPY_HOOKS];
+	/* Callback time during the current call into libhtp. */
+	unsigned long long callback_ns;
+} htpy_stats;
+
+/* CLOCK_MONOTONIC is read from the TSC through the vDSO on Linux. */
+static inline unsigned long long htpy_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void htpy_timing_add(htpy_timing *t, unsigned long long ns) {
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	t->calls++;
+	t->ns += ns;
+	t->histogram[bucket < HTPY_HISTOGRAM ? bucket : HTPY_HISTOGRAM - 1]++;
+}
+
+static void htpy_timing_fold(htpy_timing *to, const htpy_timing *from) {
+	int i;
+
+	to->calls += from->calls;
+	to->ns += from->ns;
+	for (i = 0; i < HTPY_HISTOGRAM; i++)
+		to->histogram[i] += from->histogram[i];
+}
+
+static void htpy_stats_fold(htpy_stats *to, const htpy_stats *from) {
+	int i;
+
+	to->bytes[0] += from->bytes[0];
+	to->bytes[1] += from->bytes[1];
+	to->transactions += from->transactions;
+	to->errors += from->errors;
+	to->stops += from->stops;
+	to->allocations += from->allocations;
+	htpy_timing_fold(&to->parse, &from->parse);
+	for (i = 0; i < HTPY_HOOKS; i++)
+		htpy_timing_fold(&to->hooks[i], &from->hooks[i]);
+}
+
+/* Start timing a callback, returns 0 if the parser keeps no stats. */
+static inline unsigned long long htpy_hook_begin(PyObject *obj) {
+	return ((htpy_connp *) obj)->stats ? htpy_clock() : 0;
+}
+
+static inline void htpy_hook_end(PyObject *obj, int hook, unsigned long long start) {
+	htpy_stats *st = ((htpy_connp *) obj)->stats;
+	unsigned long long ns;
+
+	if (!st || !start)
+		return;
+
+	ns = htpy_clock() - start;
+	htpy_timing_add(&st->hooks[hook], ns);
+	st->callback_ns += ns;
+}
+
+/*
+ * Checkpoints.
+ *
+ * libhtp keeps its state in function pointers, half parsed buffers,
+ * decompressors and transactions full of pointers, none of which can be
+ * written out and read back in. What can be done is keep the data which
+ * the state came from. With the checkpoint_limit attribute of a config set
+ * a connection parser keeps, for each direction, every byte it has parsed
+ * since the start of the oldest transaction which is not complete. The
+ * request side is trimmed when a transaction completes and the response
+ * side when a response does, so on a keep-alive connection between
+ * transactions nothing is kept at all. serialize() writes out what is kept
+ * and restore() feeds it to a new parser, which ends up in the same state
+ * as the original one. Once a direction holds more than the limit its data
+ * is dropped, and the parser can not be checkpointed again until that
+ * direction reaches a transaction boundary.
+ */
+#define HTPY_CHECKPOINT_MAGIC "HTCP"
+#define HTPY_CHECKPOINT_VERSION 1
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	/* Stream offset of the first byte kept and of the next byte to parse. */
+	unsigned long long start;
+	unsigned long long end;
+	/* Set once bytes after start have been dropped. */
+	int lost;
+	/* The last timestamp given with data, used when the data is replayed. */
+	htp_time_t ts;
+} htpy_checkpoint_stream;
+
+typedef struct htpy_checkpoint {
+	htpy_checkpoint_stream stream[2];
+	/* Direction libhtp is parsing, -1 outside of htpy_parse(). */
+	int parsing;
+} htpy_checkpoint;
+
+static void htpy_checkpoint_clear(htpy_checkpoint *ck) {
+	int i;
+
+	if (!ck)
+		return;
+	for (i = 0; i < 2; i++) {
+		ck->stream[i].len = 0;
+		ck->stream[i].start = 0;
+		ck->stream[i].end = 0;
+		ck->stream[i].lost = 0;
+		memset(&ck->stream[i].ts, 0, sizeof(htp_time_t));
+	}
+	ck->parsing = -1;
+}
+
+static void htpy_checkpoint_free(htpy_checkpoint *ck) {
+	if (!ck)
+		return;
+	free(ck->stream[0].data);
+	free(ck->stream[1].data);
+	free(ck);
+}
+
+/* The stream offset libhtp has got to in a direction. */
+static unsigned long long htpy_checkpoint_offset(htpy_checkpoint *ck, htp_connp_t *connp, int direction) {
+	unsigned long long offset = ck->stream[direction].end;
+
+	if (ck->parsing == direction)
+		offset += direction == HTPY_REQUEST ? connp->in_current_read_offset : connp->out_current_read_offset;
+
+	return offset;
+}
+
+/* Forget everything in a direction before offset, a transaction boundary. */
+static void htpy_checkpoint_trim(htpy_checkpoint *ck, int direction, unsigned long long offset) {
+	htpy_checkpoint_stream *s = &ck->stream[direction];
+	size_t n;
+
+	if (offset <= s->start)
+		return;
+
+	/* Only a boundary past what was dropped makes the stream whole again. */
+	if (s->lost) {
+		if (offset >= s->end) {
+			s->lost = 0;
+			s->len = 0;
+			s->start = offset;
+		}
+		return;
+	}
+
+	n = (size_t) (offset - s->start);
+	if (n >= s->len) {
+		s->len = 0;
+	} else {
+		memmove(s->data, s->data + n, s->len - n);
+		s->len -= n;
+	}
+	s->start = offset;
+}
+
+/*
+ * Keep what libhtp consumed of data just parsed, from wherever the stream
+ * was trimmed to while it was being parsed.
+ */
+static void htpy_checkpoint_fed(htpy_connp *cp, int direction, const htp_time_t *ts, const unsigned char *data, size_t len, int status) {
+	htpy_checkpoint *ck = cp->checkpoint;
+	htpy_checkpoint_stream *s = &ck->stream[direction];
+	size_t limit = ((htpy_config *) cp->cfg)->checkpoint_limit;
+	size_t skip = 0, size;
+	void *p;
+
+	ck->parsing = -1;
+	if (status == HTP_STREAM_DATA_OTHER)
+		len = direction == HTPY_REQUEST ? htp_connp_req_data_consumed(cp->connp) : htp_connp_res_data_consumed(cp->connp);
+	if (ts)
+		s->ts = *ts;
+
+	if (s->start > s->end)
+		skip = (size_t) (s->start - s->end);
+	s->end += len;
+	if (s->lost || skip >= len)
+		return;
+	len -= skip;
+
+	if (s->len > limit || len > limit - s->len) {
+		s->lost = 1;
+		s->len = 0;
+		return;
+	}
+
+	if (len > s->size - s->len) {
+		for (size = s->size ? s->size : 4096; size - s->len < len; size *= 2)
+			;
+		p = realloc(s->data, size);
+		if (!p) {
+			s->lost = 1;
+			s->len = 0;
+			return;
+		}
+		s->data = p;
+		s->size = size;
+	}
+	memcpy(s->data + s->len, data + skip, len);
+	s->len += len;
+}
+
+/*
+ * Gaps.
+ *
+ * libhtp only takes contiguous data, so when a capture loses some of a
+ * connection htpy works around it. A gap inside a body of known length,
+ * or one which lasts until the connection closes, is skipped by moving
+ * libhtp's counters along as if the body data had been parsed, and the
+ * body data callbacks never see it. A compressed body is passed on as it
+ * is from there, as the decompressor can not make sense of it. A gap
+ * anywhere else loses the transaction: it is completed as far as it got,
+ * and data in that direction is thrown away until something which looks
+ * like the start of a request or response line comes along. Either way
+ * the transaction is marked with HTPY_TX_GAP in its flags.
+ */
+#define HTPY_TX_GAP 0x4000000000000000ULL
+
+static const char *htpy_gap_methods[] = {
+	"GET", "POST", "HEAD", "PUT", "DELETE", "OPTIONS", "CONNECT", "TRACE",
+	"PATCH", "PROPFIND", "PROPPATCH", "MKCOL", "COPY", "MOVE", "LOCK",
+	"UNLOCK", NULL
+};
+
+/* Whether a request or response line looks like it starts at data. */
+static int htpy_gap_boundary(int direction, const unsigned char *data, size_t len) {
+	const char **m;
+	size_t n;
+
+	if (direction == HTPY_RESPONSE)
+		return len > 5 && !memcmp(data, "HTTP/", 5) && data[5] >= '0' && data[5] <= '9';
+
+	for (m = htpy_gap_methods; *m; m++) {
+		n = strlen(*m);
+		if (len > n && data[n] == ' ' && !memcmp(data, *m, n))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Find where parsing can start again in data skipped after a gap, which is
+ * the start of a line that looks like a request or response line. Returns
+ * -1 if there is none.
+ */
+static Py_ssize_t htpy_gap_scan(htpy_connp *cp, int direction, const unsigned char *data, size_t len) {
+	const unsigned char *p = data, *end = data + len;
+
+	if (cp->gap_line[direction] && htpy_gap_boundary(direction, p, len))
+		return 0;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		if (htpy_gap_boundary(direction, p, end - p))
+			return p - data;
+	}
+
+	cp->gap_line[direction] = len && data[len - 1] == '\n';
+	return -1;
+}
+
+/* Turn what a libhtp state or hook returned into a stream status. */
+static int htpy_gap_status(htp_connp_t *connp, int direction, htp_status_t rc) {
+	int status;
+
+	if (rc == HTP_OK || rc == HTP_DATA)
+		return HTP_STREAM_DATA;
+	if (rc == HTP_DATA_OTHER)
+		status = HTP_STREAM_DATA_OTHER;
+	else if (rc == HTP_STOP)
+		status = HTP_STREAM_STOP;
+	else
+		status = HTP_STREAM_ERROR;
+
+	if (direction == HTPY_REQUEST)
+		connp->in_status = status;
+	else
+		connp->out_status = status;
+	return status;
+}
+
+/*
+ * Run the state machine of a direction over no data, to get it to where it
+ * would have been had the last of a body been parsed.
+ */
+static int htpy_gap_run(htp_connp_t *connp, int direction) {
+	htp_status_t rc;
+
+	if (direction == HTPY_REQUEST) {
+		connp->in_current_data = NULL;
+		connp->in_current_len = 0;
+		connp->in_current_read_offset = 0;
+		connp->in_current_consume_offset = 0;
+		connp->in_current_receiver_offset = 0;
+		while ((rc = connp->in_state(connp)) == HTP_OK)
+			;
+	} else {
+		connp->out_current_data = NULL;
+		connp->out_current_len = 0;
+		connp->out_current_read_offset = 0;
+		connp->out_current_consume_offset = 0;
+		connp->out_current_receiver_offset = 0;
+		while ((rc = connp->out_state(connp)) == HTP_OK)
+			;
+	}
+
+	return htpy_gap_status(connp, direction, rc);
+}
+
+/* Skip len bytes of the body being parsed, if the body is long enough. */
+static int htpy_gap_skip(htp_connp_t *connp, int direction, size_t len) {
+	htp_tx_t *tx;
+
+	if (direction == HTPY_REQUEST) {
+		tx = connp->in_tx;
+		if (!tx)
+			return 0;
+		if (connp->in_state == htp_connp_REQ_BODY_IDENTITY && (int64_t) len <= connp->in_body_data_left) {
+			connp->in_body_data_left -= len;
+			if (!connp->in_body_data_left)
+				connp->in_state = htp_connp_REQ_FINALIZE;
+		} else if (connp->in_state == htp_connp_REQ_BODY_CHUNKED_DATA && (int64_t) len <= connp->in_chunked_length) {
+			connp->in_chunked_length -= len;
+			if (!connp->in_chunked_length)
+				connp->in_state = htp_connp_REQ_BODY_CHUNKED_DATA_END;
+		} else {
+			return 0;
+		}
+		connp->in_stream_offset += len;
+		tx->request_message_len += len;
+	} else {
+		tx = connp->out_tx;
+		if (!tx)
+			return 0;
+		if (connp->out_state == htp_connp_RES_BODY_IDENTITY_CL_KNOWN && (int64_t) len <= connp->out_body_data_left) {
+			connp->out_body_data_left -= len;
+			if (!connp->out_body_data_left)
+				connp->out_state = htp_connp_RES_FINALIZE;
+		} else if (connp->out_state == htp_connp_RES_BODY_CHUNKED_DATA && (int64_t) len <= connp->out_chunked_length) {
+			connp->out_chunked_length -= len;
+			if (!connp->out_chunked_length)
+				connp->out_state = htp_connp_RES_BODY_CHUNKED_DATA_END;
+		} else if (connp->out_state != htp_connp_RES_BODY_IDENTITY_STREAM_CLOSE) {
+			return 0;
+		}
+		connp->out_stream_offset += len;
+		tx->response_message_len += len;
+		if (tx->response_content_encoding_processing != HTP_COMPRESSION_NONE) {
+			htp_connp_destroy_decompressors(connp);
+			tx->response_content_encoding_processing = HTP_COMPRESSION_NONE;
+		}
+	}
+
+	tx->flags |= HTPY_TX_GAP;
+	return 1;
+}
+
+/*
+ * Give up on the transaction a direction is in the middle of, along with
+ * any partial line libhtp is holding on to.
+ */
+static int htpy_gap_abort(htp_connp_t *connp, int direction) {
+	htp_tx_t *tx;
+	htp_status_t rc;
+
+	if (direction == HTPY_REQUEST) {
+		free(connp->in_buf);
+		connp->in_buf = NULL;
+		connp->in_buf_size = 0;
+		bstr_free(connp->in_header);
+		connp->in_header = NULL;
+		tx = connp->in_tx;
+		if (!tx)
+			return HTP_STREAM_DATA;
+		tx->flags |= HTPY_TX_GAP;
+		rc = htp_tx_state_request_complete(tx);
+	} else {
+		free(connp->out_buf);
+		connp->out_buf = NULL;
+		connp->out_buf_size = 0;
+		bstr_free(connp->out_header);
+		connp->out_header = NULL;
+		tx = connp->out_tx;
+		if (!tx)
+			return HTP_STREAM_DATA;
+		tx->flags |= HTPY_TX_GAP;
+		rc = htp_tx_state_response_complete(tx);
+		htp_connp_destroy_decompressors(connp);
+	}
+
+	return htpy_gap_status(connp, direction, rc);
+}
+
+/*
+ * Tell a connection parser len bytes in a direction were lost. Must be
+ * called with the parser locked.
+ */
+static int htpy_gap(htpy_connp *cp, int direction, size_t len) {
+	htp_connp_t *connp = cp->connp;
+	int status = direction == HTPY_REQUEST ? connp->in_status : connp->out_status;
+
+	if (status == HTP_STREAM_ERROR || status == HTP_STREAM_STOP || status == HTP_STREAM_TUNNEL)
+		return status;
+	if (!len)
+		return HTP_STREAM_DATA;
+
+	/* What a checkpoint would replay is missing the gap. */
+	if (cp->checkpoint) {
+		cp->checkpoint->stream[direction].lost = 1;
+		cp->checkpoint->stream[direction].len = 0;
+	}
+
+	/* Whatever was lost may have ended a line. */
+	if (cp->gap[direction]) {
+		cp->gap_line[direction] = 1;
+		return HTP_STREAM_DATA;
+	}
+
+	if (htpy_gap_skip(connp, direction, len)) {
+		if ((direction == HTPY_REQUEST ? connp->in_state == htp_connp_REQ_FINALIZE : connp->out_state == htp_connp_RES_FINALIZE))
+			return htpy_gap_run(connp, direction);
+		return HTP_STREAM_DATA;
+	}
+
+	cp->gap[direction] = 1;
+	cp->gap_line[direction] = 1;
+	return htpy_gap_abort(connp, direction);
+}
+
+/*
+ * Hand data to libhtp, which is where everything htpy_connp_feed(),
+ * feed_many(), worker pools and the pcap reader parse goes through.
+ * Must be called with the parser locked.
+ */
+static int htpy_parse(htpy_connp *cp, int direction, const htp_time_t *ts, const unsigned char *data, size_t len) {
+	htpy_stats *st = cp->stats;
+	unsigned long long start;
+	int x;
+
+	/* After a gap nothing is parsed until a transaction starts. */
+	if (cp->gap[direction]) {
+		Py_ssize_t skip = htpy_gap_scan(cp, direction, data, len);
+		if (skip == -1)
+			return HTP_STREAM_DATA;
+		cp->gap[direction] = 0;
+		data += skip;
+		len -= skip;
+	}
+
+	if (!st && ((htpy_config *) cp->cfg)->stats)
+		st = cp->stats = calloc(1, sizeof(htpy_stats));
+
+	if (!cp->checkpoint && ((htpy_config *) cp->cfg)->checkpoint_limit) {
+		cp->checkpoint = calloc(1, sizeof(htpy_checkpoint));
+		if (!cp->checkpoint)
+			return HTP_STREAM_ERROR;
+		cp->checkpoint->parsing = -1;
+	}
+	if (cp->checkpoint)
+		cp->checkpoint->parsing = direction;
+
+	if (!st) {
+		if (direction == HTPY_REQUEST)
+			x = htp_connp_req_data(cp->connp, ts, data, len);
+		else
+			x = htp_connp_res_data(cp->connp, ts, data, len);
+		if (cp->checkpoint)
+			htpy_checkpoint_fed(cp, direction, ts, data, len, x);
+		return x;
+	}
+
+	st->callback_ns = 0;
+	start = htpy_clock();
+	if (direction == HTPY_REQUEST)
+		x = htp_connp_req_data(cp->connp, ts, data, len);
+	else
+		x = htp_connp_res_data(cp->connp, ts, data, len);
+	htpy_timing_add(&st->parse, htpy_clock() - start - st->callback_ns);
+	if (cp->checkpoint)
+		htpy_checkpoint_fed(cp, direction, ts, data, len, x);
+
+	st->bytes[direction] += len;
+	if (x == HTP_STREAM_ERROR)
+		st->errors++;
+	else if (x == HTP_STREAM_STOP)
+		st->stops++;
+
+	return x;
+}
+
+static PyObject *htpy_timing_dict(const htpy_timing *t) {
+	PyObject *hist, *ret;
+	int i, last;
+
+	/* Leave off the empty buckets at the end. */
+	for (last = HTPY_HISTOGRAM; last > 0 && !t->histogram[last - 1]; last--)
+		;
+
+	hist = PyList_New(last);
+	if (!hist)
+		return NULL;
+	for (i = 0; i < last; i++) {
+		PyObject *n = PyLong_FromUnsignedLongLong(t->histogram[i]);
+		if (!n) {
+			Py_DECREF(hist);
+			return NULL;
+		}
+		PyList_SET_ITEM(hist, i, n);
+	}
+
+	ret = Py_BuildValue("{sKsdsN}", "calls", t->calls, "time", (double) t->ns / 1e9, "histogram", hist);
+	return ret;
+}
+
+static PyObject *htpy_stats_dict(const htpy_stats *st) {
+	static const htpy_stats empty;
+	PyObject *hooks, *t, *ret;
+	int i;
+
+	if (!st)
+		st = &empty;
+
+	hooks = PyDict_New();
+	if (!hooks)
+		return NULL;
+	for (i = 0; i < HTPY_HOOKS; i++) {
+		if (!st->hooks[i].calls)
+			continue;
+		t = htpy_timing_dict(&st->hooks[i]);
+		if (!t || PyDict_SetItemString(hooks, htpy_hook_names[i], t) == -1) {
+			Py_XDECREF(t);
+			Py_DECREF(hooks);
+			return NULL;
+		}
+		Py_DECREF(t);
+	}
+
+	t = htpy_timing_dict(&st->parse);
+	if (!t) {
+		Py_DECREF(hooks);
+		return NULL;
+	}
+
+	ret = Py_BuildValue("{sKsKsKsKsKsKsNsN}",
+	                    "request_bytes", st->bytes[HTPY_REQUEST],
+	                    "response_bytes", st->bytes[HTPY_RESPONSE],
+	                    "transactions", st->transactions,
+	                    "errors", st->errors,
+	                    "stops", st->stops,
+	                    "allocations", st->allocations,
+	                    "parse", t,
+	                    "hooks", hooks);
+	return ret;
+}
+
+/* Add the stats of a parser to the totals of its config and start again. */
+static void htpy_stats_retire(htpy_connp *cp) {
+	htpy_config *cfg = (htpy_config *) cp->cfg;
+
+	if (!cp->stats)
+		return;
+
+	if (!cfg->stats_total)
+		cfg->stats_total = calloc(1, sizeof(htpy_stats));
+	if (cfg->stats_total)
+		htpy_stats_fold(cfg->stats_total, cp->stats);
+	memset(cp->stats, 0, sizeof(htpy_stats));
+}
+
+/*
+ * Event queues.
+ *
+ * For the hooks in the events attribute of a config the handlers do not
+ * call into python at all. They append a record of the hook and the
+ * transaction to the queue of the connection parser, along with a copy of
+ * the data for the body data hooks, and drain_events() hands the lot to
+ * python in one go. The queue is only touched by whoever holds the parser
+ * lock. Records which do not fit within the limits of the config are
+ * dropped and counted.
+ */
+#define HTPY_EVENT_WANTED(OBJ, CB) \
+	(((htpy_config *) ((htpy_connp *) (OBJ))->cfg)->events & (1U << HTPY_HOOK_##CB))
+
+typedef struct {
+	unsigned int type;
+	size_t index;
+	/* Where the data of the record is in the data of the queue. */
+	size_t offset;
+	size_t len;
+} htpy_event;
+
+typedef struct htpy_events {
+	htpy_event *records;
+	size_t n;
+	size_t size;
+	unsigned char *data;
+	size_t len;
+	size_t data_size;
+	unsigned long dropped;
+} htpy_events;
+
+static void htpy_events_clear(htpy_events *ev) {
+	if (!ev)
+		return;
+	ev->n = 0;
+	ev->len = 0;
+	ev->dropped = 0;
+}
+
+static void htpy_events_free(htpy_events *ev) {
+	if (!ev)
+		return;
+	free(ev->records);
+	free(ev->data);
+	free(ev);
+}
+
+/* Queue a record for a hook, the return value is for libhtp. */
+static int htpy_event_push(PyObject *obj, int hook, htp_tx_t *tx, const unsigned char *data, size_t len) {
+	htpy_connp *cp = (htpy_connp *) obj;
+	htpy_config *cfg = (htpy_config *) cp->cfg;
+	htpy_events *ev = cp->events;
+	htpy_event *e;
+	unsigned long long start = htpy_hook_begin(obj);
+	size_t size;
+	void *p;
+
+	if (!ev) {
+		ev = cp->events = calloc(1, sizeof(htpy_events));
+		if (!ev)
+			return HTP_ERROR;
+	}
+
+	if (ev->n >= cfg->event_limit || len > cfg->event_data_limit - ev->len) {
+		ev->dropped++;
+		htpy_hook_end(obj, hook, start);
+		return HTP_OK;
+	}
+
+	if (ev->n == ev->size) {
+		size = ev->size ? ev->size * 2 : 64;
+		p = realloc(ev->records, size * sizeof(htpy_event));
+		if (!p)
+			return HTP_ERROR;
+		ev->records = p;
+		ev->size = size;
+	}
+
+	if (len > ev->data_size - ev->len) {
+		for (size = ev->data_size ? ev->data_size : 4096; size - ev->len < len; size *= 2)
+			;
+		p = realloc(ev->data, size);
+		if (!p)
+			return HTP_ERROR;
+		ev->data = p;
+		ev->data_size = size;
+	}
+
+	e = &ev->records[ev->n++];
+	e->type = 1U << hook;
+	e->index = tx->index;
+	e->offset = ev->len;
+	e->len = len;
+	if (len) {
+		memcpy(ev->data + ev->len, data, len);
+		ev->len += len;
+	}
+
+	htpy_hook_end(obj, hook, start);
+	return HTP_OK;
+}
+
+#ifdef HTPY_ARENA
+/*
+ * Allocation arenas.
+ *
+ * When htpy is built with HTPY_ARENA, malloc(), calloc(), realloc(), free()
+ * and strdup() are wrapped at link time for htpy and the libhtp it is
+ * linked with (see setup.py). While a connection parser with an arena is
+ * parsing, small allocations are carved out of 64k chunks owned by that
+ * parser instead of coming from malloc. Nearly everything libhtp allocates
+ * while parsing belongs to a transaction, so once a transaction is
+ * destroyed its chunks become empty and are reused as a whole, rather than
+ * leaving thousands of small holes in the heap.
+ *
+ * Every block, from an arena or not, has a small header saying where it
+ * came from, so free() does not have to know. A chunk counts the blocks
+ * still live in it and is recycled (or given back, past a few spares) when
+ * that reaches zero. Chunks still in use when their parser is destroyed
+ * are orphaned and freed when their last block is.
+ */
+#define HTPY_ARENA_CHUNK (64 * 1024)
+#define HTPY_ARENA_MAX 2048
+#define HTPY_ARENA_SPARE 4
+
+typedef struct htpy_arena_chunk {
+	struct htpy_arena_chunk *prev;
+	struct htpy_arena_chunk *next;
+	struct htpy_arena *arena;
+	size_t used;
+	size_t live;
+	int spare;
+} htpy_arena_chunk;
+
+#define HTPY_ARENA_HDR ((sizeof(htpy_arena_chunk) + 15) & ~(size_t) 15)
+
+struct htpy_arena {
+	/* Every chunk owned by the arena, in use or spare. */
+	htpy_arena_chunk *chunks;
+	htpy_arena_chunk *current;
+	size_t nspare;
+};
+
+/* Kept at 16 bytes so blocks stay 16 byte aligned. */
+typedef struct {
+	/* NULL for blocks from the system allocator. */
+	htpy_arena_chunk *chunk;
+	size_t size;
+} htpy_block;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static htpy_arena *htpy_arena_new(void) {
+	htpy_arena *a = __real_malloc(sizeof(htpy_arena));
+
+	if (a)
+		memset(a, 0, sizeof(*a));
+
+	return a;
+}
+
+static void htpy_arena_unlink(htpy_arena *a, htpy_arena_chunk *c) {
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		a->chunks = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+}
+
+/* Free empty chunks and orphan the rest. */
+static void htpy_arena_destroy(htpy_arena *a) {
+	htpy_arena_chunk *c, *next;
+
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		if (c->live)
+			c->arena = NULL;
+		else
+			__real_free(c);
+	}
+	__real_free(a);
+}
+
+static void *htpy_arena_alloc(htpy_arena *a, size_t size) {
+	size_t need = sizeof(htpy_block) + ((size + 15) & ~(size_t) 15);
+	htpy_arena_chunk *c = a->current;
+	htpy_block *b;
+
+	if (c && c->live == 0)
+		c->used = HTPY_ARENA_HDR;
+
+	if (!c || c->used + need > HTPY_ARENA_CHUNK) {
+		for (c = a->chunks; c && !c->spare; c = c->next);
+		if (c) {
+			c->spare = 0;
+			a->nspare--;
+		} else {
+			c = __real_malloc(HTPY_ARENA_CHUNK);
+			if (!c)
+				return NULL;
+			c->arena = a;
+			c->live = 0;
+			c->spare = 0;
+			c->prev = NULL;
+			c->next = a->chunks;
+			if (a->chunks)
+				a->chunks->prev = c;
+			a->chunks = c;
+		}
+		c->used = HTPY_ARENA_HDR;
+		a->current = c;
+	}
+
+	b = (htpy_block *) ((unsigned char *) c + c->used);
+	c->used += need;
+	c->live++;
+	b->chunk = c;
+	b->size = size;
+
+	return b + 1;
+}
+
+void *__wrap_malloc(size_t size) {
+	htpy_connp *cp = (htpy_connp *) htpy_current_connp;
+	htpy_block *b;
+
+	if (cp && cp->stats)
+		cp->stats->allocations++;
+
+	if (cp && cp->arena && size <= HTPY_ARENA_MAX)
+		return htpy_arena_alloc(cp->arena, size);
+
+	b = __real_malloc(sizeof(htpy_block) + size);
+	if (!b)
+		return NULL;
+	b->chunk = NULL;
+	b->size = size;
+
+	return b + 1;
+}
+
+void __wrap_free(void *ptr) {
+	htpy_block *b;
+	htpy_arena_chunk *c;
+	htpy_arena *a;
+
+	if (!ptr)
+		return;
+
+	b = (htpy_block *) ptr - 1;
+	c = b->chunk;
+	if (!c) {
+		__real_free(b);
+		return;
+	}
+
+	if (--c->live)
+		return;
+
+	a = c->arena;
+	if (!a) {
+		__real_free(c);
+		return;
+	}
+
+	/* The current chunk is simply rewound by the next allocation. */
+	if (c == a->current)
+		return;
+
+	if (a->nspare < HTPY_ARENA_SPARE) {
+		c->spare = 1;
+		a->nspare++;
+	} else {
+		htpy_arena_unlink(a, c);
+		__real_free(c);
+	}
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	void *ptr;
+
+	if (size && nmemb > (size_t) -1 / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ptr = __wrap_malloc(nmemb * size);
+	if (ptr)
+		memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	htpy_block *b, *nb;
+	void *ret;
+
+	if (!ptr)
+		return __wrap_malloc(size);
+
+	b = (htpy_block *) ptr - 1;
+	if (!b->chunk) {
+		if (htpy_current_connp && ((htpy_connp *) htpy_current_connp)->stats)
+			((htpy_connp *) htpy_current_connp)->stats->allocations++;
+		nb = __real_realloc(b, sizeof(htpy_block) + size);
+		if (!nb)
+			return NULL;
+		nb->size = size;
+		return nb + 1;
+	}
+
+	if (size <= b->size)
+		return ptr;
+
+	ret = __wrap_malloc(size);
+	if (!ret)
+		return NULL;
+	memcpy(ret, ptr, b->size);
+	__wrap_free(ptr);
+
+	return ret;
+}
+
+char *__wrap_strdup(const char *s) {
+	size_t len = strlen(s) + 1;
+	char *ret = __wrap_malloc(len);
+
+	if (ret)
+		memcpy(ret, s, len);
+
+	return ret;
+}
+#endif
+
+static void htpy_tx_detach_all(htp_connp_t *connp);
+
+static PyObject *htpy_connp_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	htpy_connp *self;
+
+	self = (htpy_connp *) type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	if (pthread_mutex_init(&self->lock, NULL) != 0) {
+		HTPY_FREE(self);
+		PyErr_SetString(htpy_get_state()->error, "Unable to create parser lock.");
+		return NULL;
+	}
+
+	return (PyObject *) self;
+}
+
+/*
+ * Body digests.
+ *
+ * When the config has body_digests set, the selected digests are computed
+ * over the request and response bodies as they pass through the body data
+ * hooks, without going through python. The bodies are what a body data
+ * callback would see, so after dechunking and (if enabled) decompression.
+ * Only one request and one response body are ever in progress on a
+ * connection, the finished digests are kept in the record of their
+ * transaction until it is destroyed.
+ */
+#define HTPY_DIGESTS 3
+#define HTPY_DIGEST_SIZE 32
+
+static const char *htpy_digest_names[HTPY_DIGESTS] = { "md5", "sha1", "sha256" };
+
+static const EVP_MD *htpy_digest_md(int i) {
+	switch (i) {
+		case 0:
+			return EVP_md5();
+		case 1:
+			return EVP_sha1();
+		default:
+			return EVP_sha256();
+	}
+}
+
+typedef struct {
+	/* Transaction index plus one, zero when no body is in progress. */
+	size_t index;
+	int digests;
+	uint64_t bytes;
+	EVP_MD_CTX *ctx[HTPY_DIGESTS];
+} htpy_body_hash;
+
+typedef struct htpy_tx_digests {
+	int digests[2];
+	uint64_t bytes[2];
+	unsigned char md[2][HTPY_DIGESTS][HTPY_DIGEST_SIZE];
+	unsigned int len[2][HTPY_DIGESTS];
+} htpy_tx_digests;
+
+typedef struct htpy_digests {
+	htpy_body_hash body[2];
+} htpy_digests;
+
+static void htpy_digests_free(htpy_digests *d) {
+	int i, j;
+
+	if (!d)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < HTPY_DIGESTS; j++) {
+			if (d->body[i].ctx[j])
+				EVP_MD_CTX_free(d->body[i].ctx[j]);
+		}
+	}
+	free(d);
+}
+
+/* Forget everything but keep the digest contexts for reuse. */
+static void htpy_digests_clear(htpy_digests *d) {
+	if (!d)
+		return;
+
+	d->body[0].index = 0;
+	d->body[1].index = 0;
+}
+
+/* Find the finished digests of a transaction, creating the record if asked to. */
+static htpy_tx_digests *htpy_tx_digests_get(htp_tx_t *tx, int create) {
+	htpy_tx_record *r = htpy_tx_record_get(tx, create);
+
+	if (!r)
+		return NULL;
+
+	if (!r->digests && create)
+		r->digests = calloc(1, sizeof(htpy_tx_digests));
+
+	return r->digests;
+}
+
+static int htpy_digest_body_data(htp_tx_data_t *txd, int direction) {
+	htpy_connp *obj = (htpy_connp *) htp_connp_get_user_data(txd->tx->connp);
+	htpy_body_hash *body;
+	int digests, i;
+
+	if (!obj || !txd->data || !txd->len)
+		return HTP_OK;
+
+	digests = ((htpy_config *) obj->cfg)->body_digests;
+	if (!digests)
+		return HTP_OK;
+
+	if (!obj->digests) {
+		obj->digests = calloc(1, sizeof(htpy_digests));
+		if (!obj->digests)
+			return HTP_ERROR;
+	}
+
+	body = &obj->digests->body[direction];
+	if (body->index != txd->tx->index + 1) {
+		for (i = 0; i < HTPY_DIGESTS; i++) {
+			if (!(digests & (1 << i)))
+				continue;
+			if (!body->ctx[i] && !(body->ctx[i] = EVP_MD_CTX_new()))
+				return HTP_ERROR;
+			if (!EVP_DigestInit_ex(body->ctx[i], htpy_digest_md(i), NULL))
+				return HTP_ERROR;
+		}
+		body->index = txd->tx->index + 1;
+		body->digests = digests;
+		body->bytes = 0;
+	}
+
+	for (i = 0; i < HTPY_DIGESTS; i++) {
+		if ((body->digests & (1 << i)) && !EVP_DigestUpdate(body->ctx[i], txd->data, txd->len))
+			return HTP_ERROR;
+	}
+	body->bytes += txd->len;
+
+	return HTP_OK;
+}
+
+static int htpy_digest_complete(htp_tx_t *tx, int direction) {
+	htpy_connp *obj = (htpy_connp *) htp_connp_get_user_data(tx->connp);
+	htpy_body_hash *body;
+	htpy_tx_digests *t;
+	int i;
+
+	if (!obj || !obj->digests)
+		return HTP_OK;
+
+	body = &obj->digests->body[direction];
+	if (body->index != tx->index + 1)
+		return HTP_OK;
+	body->index = 0;
+
+	t = htpy_tx_digests_get(tx, 1);
+	if (!t)
+		return HTP_ERROR;
+	t->digests[direction] = body->digests;
+	t->bytes[direction] = body->bytes;
+	for (i = 0; i < HTPY_DIGESTS; i++) {
+		if ((body->digests & (1 << i)) && !EVP_DigestFinal_ex(body->ctx[i], t->md[direction][i], &t->len[direction][i]))
+			return HTP_ERROR;
+	}
+
+	return HTP_OK;
+}
+
+static int htpy_digest_request_body_data(htp_tx_data_t *txd) {
+	return htpy_digest_body_data(txd, HTPY_REQUEST);
+}
+
+static int htpy_digest_response_body_data(htp_tx_data_t *txd) {
+	return htpy_digest_body_data(txd, HTPY_RESPONSE);
+}
+
+static int htpy_digest_request_complete(htp_tx_t *tx) {
+	return htpy_digest_complete(tx, HTPY_REQUEST);
+}
+
+static int htpy_digest_response_complete(htp_tx_t *tx) {
+	return htpy_digest_complete(tx, HTPY_RESPONSE);
+}
+
+/*
+ * The digests of a transaction as a dictionary of hex digests and byte
+ * counts, or None if neither body has finished.
+ */
+static PyObject *htpy_tx_digests_dict(htp_tx_t *tx) {
+	static const char *directions[2] = { "request", "response" };
+	static const char hex[] = "0123456789abcdef";
+	char key[32], buf[HTPY_DIGEST_SIZE * 2];
+	htpy_tx_digests *t;
+	PyObject *dict, *val;
+	unsigned int k;
+	int d, i;
+
+	t = htpy_tx_digests_get(tx, 0);
+	if (!t)
+		Py_RETURN_NONE;
+
+	dict = PyDict_New();
+	if (!dict)
+		return NULL;
+
+	for (d = 0; d < 2; d++) {
+		if (!t->digests[d])
+			continue;
+
+		snprintf(key, sizeof(key), "%s_bytes", directions[d]);
+		val = PyLong_FromUnsignedLongLong(t->bytes[d]);
+		if (!val || PyDict_SetItemString(dict, key, val) == -1)
+			goto fail;
+		Py_DECREF(val);
+
+		for (i = 0; i < HTPY_DIGESTS; i++) {
+			if (!(t->digests[d] & (1 << i)))
+				continue;
+			for (k = 0; k < t->len[d][i]; k++) {
+				buf[k * 2] = hex[t->md[d][i][k] >> 4];
+				buf[k * 2 + 1] = hex[t->md[d][i][k] & 0xf];
+			}
+			snprintf(key, sizeof(key), "%s_%s", directions[d], htpy_digest_names[i]);
+			val = PyString_FromStringAndSize(buf, t->len[d][i] * 2);
+			if (!val || PyDict_SetItemString(dict, key, val) == -1)
+				goto fail;
+			Py_DECREF(val);
+		}
+	}
+
+	return dict;
+
+fail:
+	Py_XDECREF(val);
+	Py_DECREF(dict);
+	return NULL;
+}
+
+/*
+ * Body captures.
+ *
+ * When the config has capture_bodies set, the selected bodies are copied
+ * out of the body data hooks into a buffer which doubles as it grows, or
+ * when capture_dir is set written straight to a new file there. Each body
+ * stops at capture_limit bytes, if that is not zero, and is marked as
+ * truncated. Like the digests only one body in each direction is in
+ * progress at a time, and finished bodies are kept in the record of their
+ * transaction until it is destroyed.
+ */
+typedef struct {
+	/* Transaction index plus one, zero when not in use. */
+	size_t index;
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	int fd;
+	char *path;
+	int truncated;
+} htpy_body_capture;
+
+typedef struct htpy_tx_captures {
+	htpy_body_capture body[2];
+} htpy_tx_captures;
+
+typedef struct htpy_captures {
+	htpy_body_capture body[2];
+} htpy_captures;
+
+static void htpy_body_capture_free(htpy_body_capture *b) {
+	free(b->data);
+	/* Still open means the body never finished, nobody will want it. */
+	if (b->fd != -1) {
+		close(b->fd);
+		unlink(b->path);
+	}
+	free(b->path);
+	memset(b, 0, sizeof(htpy_body_capture));
+	b->fd = -1;
+}
+
+static void htpy_tx_captures_free(htpy_tx_captures *t) {
+	htpy_body_capture_free(&t->body[0]);
+	htpy_body_capture_free(&t->body[1]);
+}
+
+static void htpy_captures_clear(htpy_captures *c) {
+	if (!c)
+		return;
+
+	htpy_body_capture_free(&c->body[0]);
+	htpy_body_capture_free(&c->body[1]);
+}
+
+static void htpy_captures_free(htpy_captures *c) {
+	htpy_captures_clear(c);
+	free(c);
+}
+
+/* Find the finished captures of a transaction, creating them if asked to. */
+static htpy_tx_captures *htpy_tx_captures_get(htp_tx_t *tx, int create) {
+	htpy_tx_record *r = htpy_tx_record_get(tx, create);
+
+	if (!r)
+		return NULL;
+
+	if (!r->captures && create) {
+		r->captures = calloc(1, sizeof(htpy_tx_captures));
+		if (r->captures)
+			r->captures->body[0].fd = r->captures->body[1].fd = -1;
+	}
+
+	return r->captures;
+}
+
+static int htpy_capture_start(htpy_body_capture *b, htpy_config *cfg, size_t index) {
+	size_t len;
+
+	htpy_body_capture_free(b);
+	b->index = index;
+
+	if (!cfg->capture_dir)
+		return 0;
+
+	len = strlen(cfg->capture_dir) + sizeof("/htpy-XXXXXX");
+	b->path = malloc(len);
+	if (!b->path)
+		return -1;
+	snprintf(b->path, len, "%s/htpy-XXXXXX", cfg->capture_dir);
+	b->fd = mkstemp(b->path);
+	if (b->fd == -1) {
+		free(b->path);
+		b->path = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int htpy_capture_write(htpy_body_capture *b, const unsigned char *data, size_t len) {
+	unsigned char *p;
+	size_t size;
+	ssize_t n;
+
+	if (b->path) {
+		while (len) {
+			n = write(b->fd, data, len);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			data += n;
+			len -= n;
+			b->len += n;
+		}
+		return 0;
+	}
+
+	if (b->len + len > b->size) {
+		for (size = b->size ? b->size : 4096; size < b->len + len; size *= 2)
+			;
+		p = realloc(b->data, size);
+		if (!p)
+			return -1;
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+
+	return 0;
+}
+
+static int htpy_capture_body_data(htp_tx_data_t *txd, int direction) {
+	htpy_connp *obj = (htpy_connp *) htp_connp_get_user_data(txd->tx->connp);
+	htpy_config *cfg;
+	htpy_body_capture *b;
+	size_t len;
+
+	if (!obj || !txd->data || !txd->len)
+		return HTP_OK;
+
+	cfg = (htpy_config *) obj->cfg;
+	if (!(cfg->capture_bodies & (1 << direction)))
+		return HTP_OK;
+
+	if (!obj->captures) {
+		obj->captures = calloc(1, sizeof(htpy_captures));
+		if (!obj->captures)
+			return HTP_ERROR;
+		obj->captures->body[0].fd = obj->captures->body[1].fd = -1;
+	}
+
+	b = &obj->captures->body[direction];
+	if (b->index != txd->tx->index + 1 && htpy_capture_start(b, cfg, txd->tx->index + 1) == -1) {
+		/* Nowhere to put it, keep parsing and call the body truncated. */
+		b->truncated = 1;
+		return HTP_OK;
+	}
+
+	if (b->truncated)
+		return HTP_OK;
+
+	len = txd->len;
+	if (cfg->capture_limit && b->len + len > (size_t) cfg->capture_limit) {
+		len = cfg->capture_limit - b->len;
+		b->truncated = 1;
+	}
+
+	if (len && htpy_capture_write(b, txd->data, len) == -1)
+		b->truncated = 1;
+
+	return HTP_OK;
+}
+
+static int htpy_capture_complete(htp_tx_t *tx, int direction) {
+	htpy_connp *obj = (htpy_connp *) htp_connp_get_user_data(tx->connp);
+	htpy_body_capture *b;
+	htpy_tx_captures *t;
+
+	if (!obj || !obj->captures)
+		return HTP_OK;
+
+	b = &obj->captures->body[direction];
+	if (b->index != tx->index + 1)
+		return HTP_OK;
+
+	t = htpy_tx_captures_get(tx, 1);
+	if (!t)
+		return HTP_ERROR;
+
+	/* The file is finished, it now belongs to whoever asks for it. */
+	if (b->fd != -1) {
+		close(b->fd);
+		b->fd = -1;
+	}
+
+	htpy_body_capture_free(&t->body[direction]);
+	t->body[direction] = *b;
+	memset(b, 0, sizeof(htpy_body_capture));
+	b->fd = -1;
+
+	return HTP_OK;
+}
+
+static int htpy_capture_request_body_data(htp_tx_data_t *txd) {
+	return htpy_capture_body_data(txd, HTPY_REQUEST);
+}
+
+static int htpy_capture_response_body_data(htp_tx_data_t *txd) {
+	return htpy_capture_body_data(txd, HTPY_RESPONSE);
+}
+
+static int htpy_capture_request_complete(htp_tx_t *tx) {
+	return htpy_capture_complete(tx, HTPY_REQUEST);
+}
+
+static int htpy_capture_response_complete(htp_tx_t *tx) {
+	return htpy_capture_complete(tx, HTPY_RESPONSE);
+}
+
+/*
+ * A captured body as a string, or the name of the file it is in, along
+ * with whether it was truncated. None if the body was not captured.
+ */
+static PyObject *htpy_tx_capture_tuple(htp_tx_t *tx, int direction) {
+	htpy_tx_captures *t = htpy_tx_captures_get(tx, 0);
+	htpy_body_capture *b;
+
+	if (!t || !t->body[direction].index)
+		Py_RETURN_NONE;
+
+	b = &t->body[direction];
+	if (b->path)
+		return Py_BuildValue("(sO)", b->path, b->truncated ? Py_True : Py_False);
+
+	return Py_BuildValue("(NO)", PyBytes_FromStringAndSize(b->data ? (char *) b->data : "", (Py_ssize_t) b->len), b->truncated ? Py_True : Py_False);
+}
+
+static void htpy_connp_dealloc(htpy_connp *self) {
+	/*
+	 * Decrement reference counters and free the underlying
+	 * libhtp backed storage.
+	 */
+	Py_XDECREF(self->obj_store);
+	if (self->cfg)
+		htpy_stats_retire(self);
+	free(self->stats);
+	Py_XDECREF(self->cfg);
+	Py_XDECREF(self->args);
+	Py_XDECREF(self->data_args);
+	Py_XDECREF(self->log_args);
+	Py_XDECREF(self->file_args);
+	Py_XDECREF(self->file);
+	Py_XDECREF(self->request_start_callback);
+	Py_XDECREF(self->request_line_callback);
+	Py_XDECREF(self->request_uri_normalize_callback);
+	Py_XDECREF(self->request_headers_callback);
+	Py_XDECREF(self->request_header_data_callback);
+	Py_XDECREF(self->request_body_data_callback);
+	Py_XDECREF(self->request_file_data_callback);
+	Py_XDECREF(self->request_trailer_callback);
+	Py_XDECREF(self->request_trailer_data_callback);
+	Py_XDECREF(self->request_complete_callback);
+	Py_XDECREF(self->response_start_callback);
+	Py_XDECREF(self->response_line_callback);
+	Py_XDECREF(self->response_headers_callback);
+	Py_XDECREF(self->response_header_data_callback);
+	Py_XDECREF(self->response_body_data_callback);
+	Py_XDECREF(self->response_trailer_callback);
+	Py_XDECREF(self->response_trailer_data_callback);
+	Py_XDECREF(self->response_complete_callback);
+	Py_XDECREF(self->transaction_complete_callback);
+	Py_XDECREF(self->log_callback);
+	if (self->connp) {
+		htpy_tx_detach_all(self->connp);
+		htp_connp_destroy_all(self->connp);
+	}
+	htpy_digests_free(self->digests);
+	htpy_captures_free(self->captures);
+	htpy_events_free(self->events);
+	htpy_checkpoint_free(self->checkpoint);
+#ifdef HTPY_ARENA
+	if (self->arena)
+		htpy_arena_destroy(self->arena);
+#endif
+	pthread_mutex_destroy(&self->lock);
+	HTPY_FREE(self);
+}
+
+static int htpy_connp_init(htpy_connp *self, PyObject *args, PyObject *kwds) {
+	PyObject *cfg_obj = NULL;
+
+	if (!PyArg_ParseTuple(args, "|O:htpy_connp_init", &cfg_obj))
+		return -1;
+
+	/*
+	 * If we are not given a config object as an argument create an
+	 * htp_cfg_t and use that.
+	 */
+	if (!cfg_obj)
+		cfg_obj = PyObject_CallObject((PyObject *) htpy_get_state()->config_type, NULL);
+	else
+		Py_XINCREF(cfg_obj);
+
+	if (!cfg_obj) {
+		PyErr_SetString(htpy_get_state()->error, "Unable to create config object.");
+		return -1;
+	}
+
+	if (!PyObject_TypeCheck(cfg_obj, htpy_get_state()->config_type)) {
+		Py_DECREF(cfg_obj);
+		PyErr_SetString(PyExc_TypeError, "parameter must be a config object");
+		return -1;
+	}
+
+	/* Being initialized again, the old parser may still use the old config. */
+	if (self->connp) {
+		htpy_tx_detach_all(self->connp);
+		htp_connp_destroy_all(self->connp);
+	}
+	if (self->cfg)
+		htpy_stats_retire(self);
+	free(self->stats);
+	self->stats = NULL;
+	htpy_events_clear(self->events);
+	htpy_checkpoint_clear(self->checkpoint);
+	memset(self->gap, 0, sizeof(self->gap));
+	memset(self->gap_line, 0, sizeof(self->gap_line));
+	Py_XDECREF(self->cfg);
+	self->cfg = cfg_obj;
+	self->connp = htp_connp_create(((htpy_config *) cfg_obj)->cfg);
+
+	if (!self->connp) {
+		PyErr_SetString(htpy_get_state()->error, "Unable to create connection parser.");
+		return -1;
+	}
+
+	htp_connp_set_user_data(self->connp, (void *) self);
+
+#ifdef HTPY_ARENA
+	if (((htpy_config *) cfg_obj)->arena && !self->arena) {
+		self->arena = htpy_arena_new();
+		if (!self->arena) {
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * Put a libhtp connection parser back into the state htp_connp_create()
+ * leaves it in, without giving back the parser, the connection or the
+ * transaction and message lists. This frees what htp_connp_destroy_all()
+ * would, apart from those, so it has to be kept in step with libhtp.
+ */
+static void htpy_connp_reset_htp(htp_connp_t *connp) {
+	htp_conn_t *conn = connp->conn;
+	htp_list_t *transactions = conn->transactions;
+	htp_list_t *messages = conn->messages;
+	htp_cfg_t *cfg = connp->cfg;
+	const void *user_data = connp->user_data;
+	size_t i, n;
+
+	for (i = 0, n = htp_list_size(transactions); i < n; i++) {
+		htp_tx_t *tx = htp_list_get(transactions, i);
+		if (tx)
+			htp_tx_destroy_incomplete(tx);
+	}
+	htp_list_clear(transactions);
+
+	for (i = 0, n = htp_list_size(messages); i < n; i++) {
+		htp_log_t *l = htp_list_get(messages, i);
+		free((void *) l->msg);
+		free(l);
+	}
+	htp_list_clear(messages);
+
+	free(conn->client_addr);
+	free(conn->server_addr);
+	memset(conn, 0, sizeof(*conn));
+	conn->transactions = transactions;
+	conn->messages = messages;
+
+	free(connp->in_buf);
+	free(connp->out_buf);
+	htp_connp_destroy_decompressors(connp);
+	if (connp->put_file) {
+		bstr_free(connp->put_file->filename);
+		free(connp->put_file);
+	}
+	bstr_free(connp->in_header);
+	bstr_free(connp->out_header);
+
+	memset(connp, 0, sizeof(*connp));
+	connp->cfg = cfg;
+	connp->conn = conn;
+	connp->user_data = user_data;
+	connp->in_state = htp_connp_REQ_IDLE;
+	connp->in_status = HTP_STREAM_NEW;
+	connp->out_state = htp_connp_RES_IDLE;
+	connp->out_status = HTP_STREAM_NEW;
+}
+
+/*
+ * Reset a connection parser object so it can be used for a new connection.
+ * Callbacks registered with it are kept, the object set with set_obj() is
+ * dropped. Returns -1 with an exception set if the parser is busy.
+ */
+static int htpy_connp_reset_obj(htpy_connp *self) {
+	if (pthread_mutex_trylock(&self->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return -1;
+	}
+
+	htpy_tx_detach_all(self->connp);
+	htpy_connp_reset_htp(self->connp);
+	htpy_digests_clear(self->digests);
+	htpy_captures_clear(self->captures);
+	htpy_stats_retire(self);
+	htpy_events_clear(self->events);
+	htpy_checkpoint_clear(self->checkpoint);
+	memset(self->gap, 0, sizeof(self->gap));
+	memset(self->gap_line, 0, sizeof(self->gap_line));
+	self->log_next = 0;
+	self->log_delivered = 0;
+	self->log_suppressed = 0;
+	self->log_batches = 0;
+	pthread_mutex_unlock(&self->lock);
+
+	Py_CLEAR(self->obj_store);
+	Py_CLEAR(self->file);
+
+	return 0;
+}
+
+/*
+ * What a layer of response decompression costs, which is mostly the zlib
+ * state and its 32k window.
+ */
+#define HTPY_DECOMPRESSOR_MEMORY (48 * 1024)
+
+static size_t htpy_headers_memory(htp_table_t *headers) {
+	size_t i, n, total = 0;
+	htp_header_t *h;
+
+	for (i = 0, n = htp_table_size(headers); i < n; i++) {
+		h = htp_table_get_index(headers, i, NULL);
+		total += sizeof(htp_header_t) + bstr_size(h->name) + bstr_size(h->value);
+	}
+
+	return total;
+}
+
+/*
+ * Estimate how much memory a connection parser holds on to: the data
+ * libhtp buffers while waiting for the end of a line, the transactions
+ * which are still around with their headers, the log messages it keeps,
+ * response decompressors and bodies captured to memory. Allocator overhead
+ * and smaller allocations are not counted.
+ */
+static size_t htpy_connp_memory(htpy_connp *self) {
+	htp_connp_t *connp = self->connp;
+	htp_list_t *list;
+	htp_decompressor_t *d;
+	htp_tx_t *tx;
+	htpy_tx_record *r;
+	htp_log_t *log;
+	size_t i, n, total;
+
+	total = sizeof(htpy_connp) + sizeof(htp_connp_t) + sizeof(htp_conn_t);
+	total += connp->in_buf_size + connp->out_buf_size;
+	if (connp->in_header)
+		total += bstr_size(connp->in_header);
+	if (connp->out_header)
+		total += bstr_size(connp->out_header);
+
+	for (d = connp->out_decompressor; d; d = d->next)
+		total += HTPY_DECOMPRESSOR_MEMORY;
+
+	list = connp->conn->transactions;
+	for (i = 0, n = htp_list_size(list); i < n; i++) {
+		tx = htp_list_get(list, i);
+		if (!tx)
+			continue;
+		total += sizeof(htp_tx_t);
+		if (tx->request_line)
+			total += bstr_size(tx->request_line);
+		if (tx->response_line)
+			total += bstr_size(tx->response_line);
+		total += htpy_headers_memory(tx->request_headers);
+		total += htpy_headers_memory(tx->response_headers);
+		r = htpy_tx_record_get(tx, 0);
+		if (!r)
+			continue;
+		total += sizeof(htpy_tx_record);
+		if (r->digests)
+			total += sizeof(htpy_tx_digests);
+		if (r->captures) {
+			total += sizeof(htpy_tx_captures);
+			total += r->captures->body[0].size + r->captures->body[1].size;
+		}
+	}
+
+	list = connp->conn->messages;
+	for (i = 0, n = htp_list_size(list); i < n; i++) {
+		log = htp_list_get(list, i);
+		total += sizeof(htp_log_t) + strlen(log->msg) + 1;
+	}
+
+	if (self->digests)
+		total += sizeof(htpy_digests);
+	if (self->captures) {
+		total += sizeof(htpy_captures);
+		total += self->captures->body[0].size + self->captures->body[1].size;
+	}
+	if (self->events)
+		total += sizeof(htpy_events) + self->events->size * sizeof(htpy_event) + self->events->data_size;
+	if (self->checkpoint)
+		total += sizeof(htpy_checkpoint) + self->checkpoint->stream[0].size + self->checkpoint->stream[1].size;
+
+	return total;
+}
+
+/* Find the timing record for a transaction, creating it if asked to. */
+static htpy_tx_times *htpy_tx_times_get(htp_tx_t *tx, int create) {
+	htpy_tx_record *r = htpy_tx_record_get(tx, create);
+
+	return r ? &r->times : NULL;
+}
+
+/* Find the filter record for a transaction, creating it if asked to. */
+static htpy_tx_filter *htpy_tx_filter_get(htp_tx_t *tx, int create) {
+	htpy_tx_record *r = htpy_tx_record_get(tx, create);
+
+	return r ? &r->filter : NULL;
+}
+
+static int htpy_timing_request_start(htp_tx_t *tx) {
+	htpy_tx_times *t = htpy_tx_times_get(tx, 1);
+	if (t)
+		t->request_start = tx->connp->in_timestamp;
+	return HTP_OK;
+}
+
+static int htpy_timing_request_complete(htp_tx_t *tx) {
+	htpy_tx_times *t = htpy_tx_times_get(tx, 1);
+	if (t)
+		t->request_complete = tx->connp->in_timestamp;
+	return HTP_OK;
+}
+
+static int htpy_timing_response_start(htp_tx_t *tx) {
+	htpy_tx_times *t = htpy_tx_times_get(tx, 1);
+	if (t)
+		t->response_start = tx->connp->out_timestamp;
+	return HTP_OK;
+}
+
+static int htpy_timing_response_complete(htp_tx_t *tx) {
+	htpy_tx_times *t = htpy_tx_times_get(tx, 1);
+	if (t)
+		t->response_complete = tx->connp->out_timestamp;
+	return HTP_OK;
+}
+
+/*
+ * Where the request of each transaction starts is remembered, so the
+ * request side can be trimmed to the oldest transaction still going once
+ * the one before it completes.
+ */
+static int htpy_checkpoint_request_start(htp_tx_t *tx) {
+	htpy_connp *obj = (htpy_connp *) htp_connp_get_user_data(tx->connp);
+	htpy_tx_times *t;
+
+	if (!obj || !obj->checkpoint)
+		return HTP_OK;
+	t = htpy_tx_times_get(tx, 1);
+	if (t)
+		t->request_offset = htpy_checkpoint_offset(obj->checkpoint, tx->connp, HTPY_REQUEST) + 1;
+	return HTP_OK;
+}
+
+/* Responses are parsed one at a time, so one ending is a boundary. */
+static int htpy_checkpoint_response_complete(htp_tx_t *tx) {
+	htpy_connp *obj = (htpy_connp *) htp_connp_get_user_data(tx->connp);
+
+	if (obj && obj->checkpoint)
+		htpy_checkpoint_trim(obj->checkpoint, HTPY_RESPONSE, htpy_checkpoint_offset(obj->checkpoint, tx->connp, HTPY_RESPONSE));
+	return HTP_OK;
+}
+
+/*
+ * Requests may be pipelined ahead of the responses, so once a transaction
+ * completes the request side is kept from where the next one started. If
+ * the next one has started but its offset is not known, the request side
+ * is as good as lost.
+ */
+static void htpy_checkpoint_tx_complete(htpy_connp *obj, htp_tx_t *tx) {
+	htpy_checkpoint *ck = obj->checkpoint;
+	htp_tx_t *next = htp_list_get(tx->conn->transactions, tx->index + 1);
+	htpy_tx_times *t = next ? htpy_tx_times_get(next, 0) : NULL;
+
+	if (t && t->request_offset) {
+		htpy_checkpoint_trim(ck, HTPY_REQUEST, t->request_offset - 1);
+	} else if (next) {
+		ck->stream[HTPY_REQUEST].lost = 1;
+		ck->stream[HTPY_REQUEST].len = 0;
+	} else {
+		htpy_checkpoint_trim(ck, HTPY_REQUEST, htpy_checkpoint_offset(ck, tx->connp, HTPY_REQUEST));
+	}
+}
+
+/*
+ * Interned strings.
+ *
+ * The keys of URI dictionaries, the request methods libhtp knows about and
+ * the most common header names are interned once when the module is
+ * loaded, and the same objects are handed out every time instead of
+ * building a new string for each transaction. They belong to the module
+ * state, as strings can not be shared between interpreters.
+ */
+enum {
+	HTPY_URI_SCHEME,
+	HTPY_URI_USERNAME,
+	HTPY_URI_PASSWORD,
+	HTPY_URI_HOSTNAME,
+	HTPY_URI_PORT,
+	HTPY_URI_PORT_NUMBER,
+	HTPY_URI_PATH,
+	HTPY_URI_QUERY,
+	HTPY_URI_FRAGMENT,
+	HTPY_URI_KEYS
+};
+
+static const char *htpy_uri_key_names[HTPY_URI_KEYS] = {
+	"scheme", "username", "password", "hostname", "port", "port_number",
+	"path", "query", "fragment"
+};
+
+
+/* Indexed by htp_method_t, as set by htp_convert_method_to_number(). */
+static const char *htpy_method_names[] = {
+	NULL, "HEAD", "GET", "PUT", "POST", "DELETE", "CONNECT", "OPTIONS",
+	"TRACE", "PATCH", "PROPFIND", "PROPPATCH", "MKCOL", "COPY", "MOVE",
+	"LOCK", "UNLOCK", "VERSION-CONTROL", "CHECKOUT", "UNCHECKOUT",
+	"CHECKIN", "UPDATE", "LABEL", "REPORT", "MKWORKSPACE", "MKACTIVITY",
+	"BASELINE-CONTROL", "MERGE"
+};
+
+#define HTPY_METHODS (sizeof(htpy_method_names) / sizeof(htpy_method_names[0]))
+
+
+static const char *htpy_header_names[] = {
+	"A-IM", "Accept", "Accept-Charset", "Accept-Datetime",
+	"Accept-Encoding", "Accept-Language", "Accept-Patch", "Accept-Ranges",
+	"Access-Control-Allow-Credentials", "Access-Control-Allow-Headers",
+	"Access-Control-Allow-Methods", "Access-Control-Allow-Origin",
+	"Access-Control-Expose-Headers", "Access-Control-Max-Age",
+	"Access-Control-Request-Headers", "Access-Control-Request-Method",
+	"Age", "Allow", "Alt-Svc", "Authorization", "Cache-Control",
+	"Connection", "Content-Disposition", "Content-Encoding",
+	"Content-Language", "Content-Length", "Content-Location", "Content-MD5",
+	"Content-Range", "Content-Security-Policy", "Content-Type", "Cookie",
+	"DNT", "Date", "ETag", "Expect", "Expires", "Forwarded", "From",
+	"Front-End-Https", "Host", "If-Match", "If-Modified-Since",
+	"If-None-Match", "If-Range", "If-Unmodified-Since", "Keep-Alive",
+	"Last-Modified", "Link", "Location", "Max-Forwards", "Origin", "P3P",
+	"Pragma", "Proxy-Authenticate", "Proxy-Authorization",
+	"Proxy-Connection", "Public-Key-Pins", "Range", "Referer", "Refresh",
+	"Retry-After", "Save-Data", "Server", "Set-Cookie", "Status",
+	"Strict-Transport-Security", "TE", "Timing-Allow-Origin", "Trailer",
+	"Transfer-Encoding", "Upgrade", "Upgrade-Insecure-Requests",
+	"User-Agent", "Vary", "Via", "WWW-Authenticate", "Warning",
+	"X-ATT-DeviceId", "X-Content-Duration", "X-Content-Security-Policy",
+	"X-Content-Type-Options", "X-Correlation-ID", "X-Csrf-Token",
+	"X-Forwarded-For", "X-Forwarded-Host", "X-Forwarded-Proto",
+	"X-Frame-Options", "X-Http-Method-Override", "X-Powered-By",
+	"X-Real-IP", "X-Request-ID", "X-Requested-With", "X-UA-Compatible",
+	"X-UIDH", "X-Wap-Profile", "X-WebKit-CSP", "X-XSS-Protection",
+	"X-Cache", "X-AspNet-Version", "X-Served-By", "X-Varnish",
+	NULL
+};
+
+/*
+ * Open addressed hash table of the interned header names. Header names
+ * are matched exactly, a name with different case gets a new string so
+ * the name is always reported the way it was seen.
+ */
+#define HTPY_HEADER_SLOTS 256
+
+struct htpy_interned {
+	PyObject *uri_keys[HTPY_URI_KEYS];
+	PyObject *methods[HTPY_METHODS];
+	PyObject *header_slots[HTPY_HEADER_SLOTS];
+};
+
+static size_t htpy_name_hash(const unsigned char *data, size_t len) {
+	size_t h = 2166136261u;
+
+	while (len--) {
+		h ^= *data++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static void htpy_intern_free(htpy_state *state) {
+	struct htpy_interned *in = state->interned;
+	size_t i;
+
+	if (!in)
+		return;
+
+	for (i = 0; i < HTPY_URI_KEYS; i++)
+		Py_XDECREF(in->uri_keys[i]);
+	for (i = 0; i < HTPY_METHODS; i++)
+		Py_XDECREF(in->methods[i]);
+	for (i = 0; i < HTPY_HEADER_SLOTS; i++)
+		Py_XDECREF(in->header_slots[i]);
+	PyMem_Free(in);
+	state->interned = NULL;
+}
+#endif
+
+static int htpy_intern_init(htpy_state *state) {
+	struct htpy_interned *in;
+	size_t i, slot;
+
+	in = state->interned = PyMem_Malloc(sizeof(struct htpy_interned));
+	if (!in) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	memset(in, 0, sizeof(*in));
+
+	for (i = 0; i < HTPY_URI_KEYS; i++) {
+		in->uri_keys[i] = PyString_InternFromString(htpy_uri_key_names[i]);
+		if (!in->uri_keys[i])
+			return -1;
+	}
+
+	for (i = 1; i < HTPY_METHODS; i++) {
+		in->methods[i] = PyString_InternFromString(htpy_method_names[i]);
+		if (!in->methods[i])
+			return -1;
+	}
+
+	for (i = 0; htpy_header_names[i]; i++) {
+		slot = htpy_name_hash((const unsigned char *) htpy_header_names[i], strlen(htpy_header_names[i]));
+		while (in->header_slots[slot & (HTPY_HEADER_SLOTS - 1)])
+			slot++;
+		in->header_slots[slot & (HTPY_HEADER_SLOTS - 1)] = PyString_InternFromString(htpy_header_names[i]);
+		if (!in->header_slots[slot & (HTPY_HEADER_SLOTS - 1)])
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Return a new reference to a string for a header name. */
+static PyObject *htpy_header_name(bstr *name) {
+	const unsigned char *data = bstr_ptr(name);
+	size_t len = bstr_len(name);
+	size_t slot = htpy_name_hash(data, len);
+	PyObject **slots = htpy_get_state()->interned->header_slots;
+	PyObject *str;
+
+	while ((str = slots[slot & (HTPY_HEADER_SLOTS - 1)])) {
+		if ((size_t) HTPY_STR_SIZE(str) == len && !memcmp(HTPY_STR_DATA(str), data, len)) {
+			Py_INCREF(str);
+			return str;
+		}
+		slot++;
+	}
+
+	return htpy_str(data, len);
+}
+
+/* Return a new reference to a string for the request method. */
+static PyObject *htpy_method_name(htp_tx_t *tx) {
+	PyObject *str;
+
+	if (tx->request_method_number > HTP_M_UNKNOWN && (size_t) tx->request_method_number < HTPY_METHODS) {
+		str = htpy_get_state()->interned->methods[tx->request_method_number];
+		Py_INCREF(str);
+		return str;
+	}
+
+	return htpy_str(bstr_ptr(tx->request_method), bstr_len(tx->request_method));
+}
+
+/* Add one part of a parsed URI to a dictionary, keyed by an interned name. */
+#define URI_ITEM(KEY, VALUE) \
+	do { \
+		val = VALUE; \
+		if (!val || PyDict_SetItem(ret, keys[KEY], val) == -1) \
+			fail = 1; \
+		Py_XDECREF(val); \
+	} while (0)
+
+/* Return a dictionary of the parts of a parsed URI. */
+static PyObject *htpy_uri_to_dict(htp_uri_t *uri) {
+	PyObject **keys = htpy_get_state()->interned->uri_keys;
+	int fail = 0;
+	PyObject *val;
+	PyObject *ret = PyDict_New();
+
+	if (!ret) {
+		PyErr_SetString(htpy_get_state()->error, "Unable to create new dictionary.");
+		return NULL;
+	}
+
+	if (uri->scheme)
+		URI_ITEM(HTPY_URI_SCHEME, htpy_str(bstr_ptr(uri->scheme), bstr_len(uri->scheme)));
+	if (uri->username)
+		URI_ITEM(HTPY_URI_USERNAME, htpy_str(bstr_ptr(uri->username), bstr_len(uri->username)));
+	if (uri->password)
+		URI_ITEM(HTPY_URI_PASSWORD, htpy_str(bstr_ptr(uri->password), bstr_len(uri->password)));
+	if (uri->hostname)
+		URI_ITEM(HTPY_URI_HOSTNAME, htpy_str(bstr_ptr(uri->hostname), bstr_len(uri->hostname)));
+	if (uri->port)
+		URI_ITEM(HTPY_URI_PORT, htpy_str(bstr_ptr(uri->port), bstr_len(uri->port)));
+	if (uri->port_number)
+		URI_ITEM(HTPY_URI_PORT_NUMBER, Py_BuildValue("i", uri->port_number));
+	if (uri->path)
+		URI_ITEM(HTPY_URI_PATH, htpy_str(bstr_ptr(uri->path), bstr_len(uri->path)));
+	if (uri->query)
+		URI_ITEM(HTPY_URI_QUERY, htpy_str(bstr_ptr(uri->query), bstr_len(uri->query)));
+	if (uri->fragment)
+		URI_ITEM(HTPY_URI_FRAGMENT, htpy_str(bstr_ptr(uri->fragment), bstr_len(uri->fragment)));
+
+	// Exception should be set by Py_BuildValue or PyDict_SetItem failing.
+	if (fail) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+/* Return the index of a URI dictionary key, or -1 with KeyError set. */
+static int htpy_uri_key_index(const char *name) {
+	int i;
+
+	for (i = 0; i < HTPY_URI_KEYS; i++)
+		if (!strcmp(name, htpy_uri_key_names[i]))
+			return i;
+
+	PyErr_SetString(PyExc_KeyError, name);
+	return -1;
+}
+
+/*
+ * Return a new reference to one part of a parsed URI, by the index of its
+ * dictionary key, or None if it is not set.
+ */
+static PyObject *htpy_uri_component(htp_uri_t *uri, int key) {
+	bstr *val = NULL;
+
+	switch (key) {
+		case HTPY_URI_SCHEME: val = uri->scheme; break;
+		case HTPY_URI_USERNAME: val = uri->username; break;
+		case HTPY_URI_PASSWORD: val = uri->password; break;
+		case HTPY_URI_HOSTNAME: val = uri->hostname; break;
+		case HTPY_URI_PORT: val = uri->port; break;
+		case HTPY_URI_PATH: val = uri->path; break;
+		case HTPY_URI_QUERY: val = uri->query; break;
+		case HTPY_URI_FRAGMENT: val = uri->fragment; break;
+		case HTPY_URI_PORT_NUMBER:
+			if (!uri->port_number)
+				Py_RETURN_NONE;
+			return PyInt_FromLong(uri->port_number);
+	}
+
+	if (!val)
+		Py_RETURN_NONE;
+
+	return htpy_str(bstr_ptr(val), bstr_len(val));
+}
+
+/* Return a dictionary of all the headers in a header table. */
+static PyObject *htpy_headers_to_dict(htp_table_t *headers) {
+	size_t i, n;
+	htp_header_t *hdr = NULL;
+	PyObject *key, *val;
+	PyObject *ret = PyDict_New();
+
+	if (!ret) {
+		PyErr_SetString(htpy_get_state()->error, "Unable to create return dictionary.");
+		return NULL;
+	}
+
+	for (i = 0, n = htp_table_size(headers); i < n; i++) {
+		hdr = htp_table_get_index(headers, i, NULL);
+		key = htpy_header_name(hdr->name);
+		val = htpy_str(bstr_ptr(hdr->value), bstr_len(hdr->value));
+		if (!key || !val) {
+			Py_DECREF(ret);
+			Py_XDECREF(key);
+			Py_XDECREF(val);
+			return NULL;
+		}
+		if (PyDict_SetItem(ret, key, val) == -1) {
+			Py_DECREF(ret);
+			Py_DECREF(key);
+			Py_DECREF(val);
+			return NULL;
+		}
+		Py_DECREF(key);
+		Py_DECREF(val);
+	}
+
+	return ret;
+}
+
+/*
+ * Transaction objects wrap a libhtp transaction. There is at most one
+ * python object for each transaction, owned by the record of the
+ * transaction, so the same object is passed to every callback for it and
+ * returned by every getter of the parser. Fields are only converted to
+ * python objects when they are first asked for, and are kept once the
+ * transaction has got far enough that they can no longer change. Header
+ * dictionaries are rebuilt if the number of headers changes (which can
+ * happen when trailers are parsed).
+ *
+ * libhtp destroys transactions without telling anyone, so htpy detaches
+ * the python object from the transaction right before libhtp destroys it.
+ * After that only the fields which have been cached are still available.
+ */
+typedef struct {
+	PyObject_HEAD
+	htp_tx_t *tx;
+	/* Borrowed, the parser outlives the transaction until detached. */
+	PyObject *connp;
+	PyObject *method;
+	PyObject *uri;
+	PyObject *protocol;
+	PyObject *parsed_uri;
+	PyObject *status_message;
+	PyObject *request_headers;
+	size_t request_headers_size;
+	PyObject *response_headers;
+	size_t response_headers_size;
+} htpy_tx;
+
+static PyTypeObject htpy_tx_type;
+
+/* Return a new reference to the python object for a transaction. */
+static PyObject *htpy_tx_get(PyObject *connp, htp_tx_t *tx) {
+	htpy_tx_record *r = htpy_tx_record_get(tx, 1);
+	htpy_tx *obj;
+
+	if (!r)
+		return PyErr_NoMemory();
+
+	if (r->obj) {
+		Py_INCREF(r->obj);
+		return r->obj;
+	}
+
+	obj = PyObject_New(htpy_tx, htpy_get_state()->tx_type);
+	if (!obj)
+		return NULL;
+
+	obj->tx = tx;
+	obj->connp = connp;
+	obj->method = NULL;
+	obj->uri = NULL;
+	obj->protocol = NULL;
+	obj->parsed_uri = NULL;
+	obj->status_message = NULL;
+	obj->request_headers = NULL;
+	obj->request_headers_size = 0;
+	obj->response_headers = NULL;
+	obj->response_headers_size = 0;
+	r->obj = (PyObject *) obj;
+
+	Py_INCREF(obj);
+	return (PyObject *) obj;
+}
+
+/* Cut a python object off from its transaction and drop the record's reference. */
+static void htpy_tx_release(htpy_tx *obj) {
+	obj->tx = NULL;
+	obj->connp = NULL;
+	Py_DECREF(obj);
+}
+
+/*
+ * Detach the python object from a transaction which is about to be
+ * destroyed, and free the record. The GIL is only needed if there is a
+ * python object.
+ */
+static void htpy_tx_detach(htp_tx_t *tx) {
+	htpy_tx_record *r = htpy_tx_record_get(tx, 0);
+	PyThreadState *gstate;
+
+	if (!r)
+		return;
+
+	if (r->obj) {
+		gstate = htpy_gil_ensure();
+		htpy_tx_release((htpy_tx *) r->obj);
+		htpy_gil_release(gstate);
+	}
+	htp_tx_set_user_data(tx, NULL);
+	htpy_tx_record_free(r);
+}
+
+/*
+ * Detach every transaction of a connection parser before destroying it.
+ * Called with the GIL held.
+ */
+static void htpy_tx_detach_all(htp_connp_t *connp) {
+	htpy_tx_record *r;
+	size_t i, n;
+	htp_tx_t *tx;
+
+	if (!connp || !connp->conn)
+		return;
+
+	for (i = 0, n = htp_list_size(connp->conn->transactions); i < n; i++) {
+		tx = htp_list_get(connp->conn->transactions, i);
+		if (!tx || !(r = htpy_tx_record_get(tx, 0)))
+			continue;
+		if (r->obj)
+			htpy_tx_release((htpy_tx *) r->obj);
+		htp_tx_set_user_data(tx, NULL);
+		htpy_tx_record_free(r);
+	}
+}
+
+static void htpy_tx_dealloc(htpy_tx *self) {
+	Py_XDECREF(self->method);
+	Py_XDECREF(self->uri);
+	Py_XDECREF(self->protocol);
+	Py_XDECREF(self->parsed_uri);
+	Py_XDECREF(self->status_message);
+	Py_XDECREF(self->request_headers);
+	Py_XDECREF(self->response_headers);
+	HTPY_FREE(self);
+}
+
+#define TX_CHECK(SELF) \
+	if (!(SELF)->tx) { \
+		PyErr_SetString(htpy_get_state()->error, "Transaction is no longer available."); \
+		return NULL; \
+	}
+
+/* Define a transaction getter which calls NAME_unlocked() under the lock of the parser. */
+#define TX_LOCKED(NAME) \
+static PyObject *htpy_tx_##NAME(htpy_tx *self, void *closure) { \
+	PyObject *ret; \
+	int locked = htpy_connp_enter(self->connp); \
+	if (locked == -1) \
+		return NULL; \
+	ret = htpy_tx_##NAME##_unlocked(self, closure); \
+	htpy_connp_leave(self->connp, locked); \
+	return ret; \
+}
+
+/* Strings are cached once libhtp has set them, they do not change after. */
+#define TX_GET_BSTR(ATTR, FIELD) \
+static PyObject *htpy_tx_get_##ATTR##_unlocked(htpy_tx *self, void *closure) { \
+	if (!self->ATTR) { \
+		TX_CHECK(self); \
+		if (!self->tx->FIELD) \
+			Py_RETURN_NONE; \
+		self->ATTR = htpy_str(bstr_ptr(self->tx->FIELD), bstr_len(self->tx->FIELD)); \
+		if (!self->ATTR) \
+			return NULL; \
+	} \
+	Py_INCREF(self->ATTR); \
+	return self->ATTR; \
+} \
+TX_LOCKED(get_##ATTR)
+
+TX_GET_BSTR(uri, request_uri)
+TX_GET_BSTR(protocol, request_protocol)
+TX_GET_BSTR(status_message, response_message)
+
+static PyObject *htpy_tx_get_method_unlocked(htpy_tx *self, void *closure) {
+	if (!self->method) {
+		TX_CHECK(self);
+		if (!self->tx->request_method)
+			Py_RETURN_NONE;
+		self->method = htpy_method_name(self->tx);
+		if (!self->method)
+			return NULL;
+	}
+	Py_INCREF(self->method);
+	return self->method;
+}
+
+TX_LOCKED(get_method)
+
+#define TX_CHECK_CACHED(SELF, ATTR) \
+	if (!(SELF)->ATTR) { \
+		PyErr_SetString(htpy_get_state()->error, "Transaction is no longer available."); \
+		return NULL; \
+	}
+
+/* Headers are cached until the number of headers changes. */
+#define TX_GET_HEADERS(TYPE) \
+static PyObject *htpy_tx_get_##TYPE##_headers_unlocked(htpy_tx *self, void *closure) { \
+	size_t n; \
+	if (self->tx) { \
+		if (!self->tx->TYPE##_headers) \
+			Py_RETURN_NONE; \
+		n = htp_table_size(self->tx->TYPE##_headers); \
+		if (!self->TYPE##_headers || self->TYPE##_headers_size != n) { \
+			Py_XDECREF(self->TYPE##_headers); \
+			self->TYPE##_headers = htpy_headers_to_dict(self->tx->TYPE##_headers); \
+			if (!self->TYPE##_headers) \
+				return NULL; \
+			self->TYPE##_headers_size = n; \
+		} \
+	} \
+	TX_CHECK_CACHED(self, TYPE##_headers); \
+	Py_INCREF(self->TYPE##_headers); \
+	return self->TYPE##_headers; \
+} \
+TX_LOCKED(get_##TYPE##_headers)
+
+TX_GET_HEADERS(request)
+TX_GET_HEADERS(response)
+
+static PyObject *htpy_tx_get_parsed_uri_unlocked(htpy_tx *self, void *closure) {
+	if (!self->parsed_uri) {
+		TX_CHECK(self);
+		if (!self->tx->parsed_uri)
+			Py_RETURN_NONE;
+		self->parsed_uri = htpy_uri_to_dict(self->tx->parsed_uri);
+		if (!self->parsed_uri)
+			return NULL;
+	}
+	Py_INCREF(self->parsed_uri);
+	return self->parsed_uri;
+}
+
+TX_LOCKED(get_parsed_uri)
+
+/*
+ * Return one part of the parsed URI without building the dictionary, or
+ * from the dictionary if it has already been built.
+ */
+static PyObject *htpy_tx_get_uri_component_unlocked(PyObject *self, PyObject *args) {
+	htpy_tx *tx = (htpy_tx *) self;
+	PyObject *ret;
+	char *name;
+	int key;
+
+	if (!PyArg_ParseTuple(args, "s:get_uri_component", &name))
+		return NULL;
+
+	key = htpy_uri_key_index(name);
+	if (key == -1)
+		return NULL;
+
+	if (tx->parsed_uri) {
+		ret = PyDict_GetItem(tx->parsed_uri, htpy_get_state()->interned->uri_keys[key]);
+		if (!ret)
+			ret = Py_None;
+		Py_INCREF(ret);
+		return ret;
+	}
+
+	TX_CHECK(tx);
+	if (!tx->tx->parsed_uri)
+		Py_RETURN_NONE;
+
+	return htpy_uri_component(tx->tx->parsed_uri, key);
+}
+
+static PyObject *htpy_tx_get_uri_component(PyObject *self, PyObject *args) {
+	PyObject *connp = ((htpy_tx *) self)->connp;
+	PyObject *ret;
+	int locked = htpy_connp_enter(connp);
+
+	if (locked == -1)
+		return NULL;
+	ret = htpy_tx_get_uri_component_unlocked(self, args);
+	htpy_connp_leave(connp, locked);
+	return ret;
+}
+
+#define TX_GET_INT(ATTR, FIELD) \
+static PyObject *htpy_tx_get_##ATTR##_unlocked(htpy_tx *self, void *closure) { \
+	TX_CHECK(self); \
+	return PyInt_FromLong((long) self->tx->FIELD); \
+} \
+TX_LOCKED(get_##ATTR)
+
+TX_GET_INT(index, index)
+TX_GET_INT(status, response_status_number)
+TX_GET_INT(request_message_length, request_message_len)
+TX_GET_INT(request_entity_length, request_entity_len)
+TX_GET_INT(response_message_length, response_message_len)
+TX_GET_INT(response_entity_length, response_entity_len)
+
+static PyObject *htpy_tx_get_flags_unlocked(htpy_tx *self, void *closure) {
+	TX_CHECK(self);
+	return PyLong_FromUnsignedLongLong((unsigned long long) self->tx->flags);
+}
+
+TX_LOCKED(get_flags)
+
+static PyObject *htpy_tx_get_body_digests_unlocked(htpy_tx *self, void *closure) {
+	TX_CHECK(self);
+	return htpy_tx_digests_dict(self->tx);
+}
+
+TX_LOCKED(get_body_digests)
+
+#define TX_GET_BODY(TYPE, DIRECTION) \
+static PyObject *htpy_tx_get_##TYPE##_body_unlocked(htpy_tx *self, void *closure) { \
+	TX_CHECK(self); \
+	return htpy_tx_capture_tuple(self->tx, DIRECTION); \
+} \
+TX_LOCKED(get_##TYPE##_body)
+
+TX_GET_BODY(request, HTPY_REQUEST)
+TX_GET_BODY(response, HTPY_RESPONSE)
+
+/* The filter rule which let this transaction through, if any. */
+static PyObject *htpy_tx_get_filter_rule_unlocked(htpy_tx *self, void *closure) {
+	htpy_tx_filter *f;
+
+	TX_CHECK(self);
+	f = htpy_tx_filter_get(self->tx, 0);
+	if (!f || !f->rule)
+		Py_RETURN_NONE;
+	return PyInt_FromLong(f->rule - 1);
+}
+
+TX_LOCKED(get_filter_rule)
+
+static PyObject *htpy_tx_get_valid(htpy_tx *self, void *closure) {
+	return PyBool_FromLong(self->tx != NULL);
+}
+
+/*
+ * Header views are read only mappings over the header table of a
+ * transaction. Nothing is copied out of the table: lookups are done with
+ * htp_table_get_mem() directly against the python string, which like
+ * libhtp is case insensitive, and only the returned values become python
+ * objects. The view keeps the transaction object alive, and raises
+ * htpy.error once libhtp has destroyed the transaction.
+ *
+ * Libhtp folds repeated headers into a single entry, joining the values
+ * with ", ", so there is normally one entry for each name. is_repeated()
+ * tells if that happened and get_all() returns every entry with the name.
+ */
+typedef struct {
+	PyObject_HEAD
+	htpy_tx *tx;
+	int direction;
+} htpy_headers;
+
+static PyTypeObject htpy_headers_type;
+static PyTypeObject htpy_headers_iter_type;
+
+static PyObject *htpy_headers_new(htpy_tx *tx, int direction) {
+	htpy_headers *obj = PyObject_New(htpy_headers, htpy_get_state()->headers_type);
+
+	if (!obj)
+		return NULL;
+
+	Py_INCREF(tx);
+	obj->tx = tx;
+	obj->direction = direction;
+
+	return (PyObject *) obj;
+}
+
+static void htpy_headers_dealloc(htpy_headers *self) {
+	Py_DECREF(self->tx);
+	HTPY_FREE(self);
+}
+
+/*
+ * Get the header table of the view. Returns -1 with an exception set if
+ * the transaction is gone. The table may be NULL, which every htp_table_*
+ * function treats as an empty table.
+ */
+static int htpy_headers_table(htpy_headers *self, htp_table_t **table) {
+	if (!self->tx->tx) {
+		PyErr_SetString(htpy_get_state()->error, "Transaction is no longer available.");
+		return -1;
+	}
+
+	if (self->direction == HTPY_REQUEST)
+		*table = self->tx->tx->request_headers;
+	else
+		*table = self->tx->tx->response_headers;
+
+	return 0;
+}
+
+/* Find a header by name. Returns NULL, with an exception set on error. */
+static htp_header_t *htpy_headers_find(htpy_headers *self, PyObject *key, int *err) {
+	htp_table_t *table;
+	const char *name;
+	Py_ssize_t len;
+
+	*err = 1;
+	if (htpy_headers_table(self, &table) == -1)
+		return NULL;
+	if (htpy_str_data(key, &name, &len) == -1)
+		return NULL;
+	*err = 0;
+
+	if (!name)
+		return NULL;
+	return htp_table_get_mem(table, name, len);
+}
+
+static Py_ssize_t htpy_headers_length(htpy_headers *self) {
+	htp_table_t *table;
+
+	if (htpy_headers_table(self, &table) == -1)
+		return -1;
+
+	return htp_table_size(table);
+}
+
+static PyObject *htpy_headers_subscript(htpy_headers *self, PyObject *key) {
+	htp_header_t *hdr;
+	int err;
+
+	hdr = htpy_headers_find(self, key, &err);
+	if (!hdr) {
+		if (!err)
+			PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	return htpy_str(bstr_ptr(hdr->value), bstr_len(hdr->value));
+}
+
+static int htpy_headers_contains(htpy_headers *self, PyObject *key) {
+	htp_header_t *hdr;
+	int err;
+
+	hdr = htpy_headers_find(self, key, &err);
+	if (err)
+		return -1;
+
+	return hdr != NULL;
+}
+
+static PyObject *htpy_headers_get(htpy_headers *self, PyObject *args) {
+	htp_header_t *hdr;
+	PyObject *key;
+	PyObject *def = Py_None;
+	int err;
+
+	if (!PyArg_ParseTuple(args, "O|O:get", &key, &def))
+		return NULL;
+
+	hdr = htpy_headers_find(self, key, &err);
+	if (!hdr) {
+		if (err)
+			return NULL;
+		Py_INCREF(def);
+		return def;
+	}
+
+	return htpy_str(bstr_ptr(hdr->value), bstr_len(hdr->value));
+}
+
+static PyObject *htpy_headers_get_all(htpy_headers *self, PyObject *args) {
+	htp_table_t *table;
+	htp_header_t *hdr;
+	PyObject *ret, *val, *key;
+	const char *name;
+	Py_ssize_t len;
+	size_t i, n;
+
+	if (!PyArg_ParseTuple(args, "O:get_all", &key))
+		return NULL;
+	if (htpy_str_data(key, &name, &len) == -1)
+		return NULL;
+
+	if (htpy_headers_table(self, &table) == -1)
+		return NULL;
+
+	ret = PyList_New(0);
+	if (!ret || !name)
+		return ret;
+
+	for (i = 0, n = htp_table_size(table); i < n; i++) {
+		hdr = htp_table_get_index(table, i, NULL);
+		if (bstr_cmp_mem_nocase(hdr->name, name, len) != 0)
+			continue;
+		val = htpy_str(bstr_ptr(hdr->value), bstr_len(hdr->value));
+		if (!val || PyList_Append(ret, val) == -1) {
+			Py_XDECREF(val);
+			Py_DECREF(ret);
+			return NULL;
+		}
+		Py_DECREF(val);
+	}
+
+	return ret;
+}
+
+static PyObject *htpy_headers_is_repeated(htpy_headers *self, PyObject *args) {
+	htp_header_t *hdr;
+	PyObject *key;
+	int err;
+
+	if (!PyArg_ParseTuple(args, "O:is_repeated", &key))
+		return NULL;
+
+	hdr = htpy_headers_find(self, key, &err);
+	if (err)
+		return NULL;
+
+	return PyBool_FromLong(hdr && (hdr->flags & HTP_FIELD_REPEATED));
+}
+
+/*
+ * Build a list out of the table. WHAT is 0 for names, 1 for values and 2
+ * for (name, value) tuples.
+ */
+static PyObject *htpy_headers_list(htpy_headers *self, int what) {
+	htp_table_t *table;
+	htp_header_t *hdr;
+	PyObject *ret, *item;
+	size_t i, n;
+
+	if (htpy_headers_table(self, &table) == -1)
+		return NULL;
+
+	n = htp_table_size(table);
+	ret = PyList_New(n);
+	if (!ret)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		hdr = htp_table_get_index(table, i, NULL);
+		if (what == 0)
+			item = htpy_header_name(hdr->name);
+		else if (what == 1)
+			item = htpy_str(bstr_ptr(hdr->value), bstr_len(hdr->value));
+		else
+			item = Py_BuildValue("(NN)", htpy_header_name(hdr->name), htpy_str(bstr_ptr(hdr->value), bstr_len(hdr->value)));
+		if (!item) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+		PyList_SET_ITEM(ret, i, item);
+	}
+
+	return ret;
+}
+
+static PyObject *htpy_headers_keys(PyObject *self, PyObject *args) {
+	return htpy_headers_list((htpy_headers *) self, 0);
+}
+
+static PyObject *htpy_headers_values(PyObject *self, PyObject *args) {
+	return htpy_headers_list((htpy_headers *) self, 1);
+}
+
+static PyObject *htpy_headers_items(PyObject *self, PyObject *args) {
+	return htpy_headers_list((htpy_headers *) self, 2);
+}
+
+static PyObject *htpy_headers_repr(htpy_headers *self) {
+	PyObject *items, *repr, *ret;
+
+	if (!self->tx->tx)
+		return PyString_FromString("<htpy.headers (destroyed)>");
+
+	items = htpy_headers_list(self, 2);
+	if (!items)
+		return NULL;
+	repr = PyObject_Repr(items);
+	Py_DECREF(items);
+	if (!repr)
+		return NULL;
+	ret = PyString_FromFormat("<htpy.headers %s>", PyString_AsString(repr));
+
+	Py_DECREF(repr);
+	return ret;
+}
+
+/* Iterating over a view gives the header names, in the order they came. */
+typedef struct {
+	PyObject_HEAD
+	htpy_headers *view;
+	size_t index;
+} htpy_headers_iter;
+
+static PyObject *htpy_headers_iter_new(htpy_headers *self) {
+	htpy_headers_iter *it;
+	htp_table_t *table;
+
+	if (htpy_headers_table(self, &table) == -1)
+		return NULL;
+
+	it = PyObject_New(htpy_headers_iter, htpy_get_state()->headers_iter_type);
+	if (!it)
+		return NULL;
+
+	Py_INCREF(self);
+	it->view = self;
+	it->index = 0;
+
+	return (PyObject *) it;
+}
+
+static void htpy_headers_iter_dealloc(htpy_headers_iter *self) {
+	Py_DECREF(self->view);
+	HTPY_FREE(self);
+}
+
+static PyObject *htpy_headers_iter_next(htpy_headers_iter *self) {
+	htp_table_t *table;
+	bstr *name = NULL;
+
+	if (htpy_headers_table(self->view, &table) == -1)
+		return NULL;
+
+	if (self->index >= htp_table_size(table))
+		return NULL;
+
+	htp_table_get_index(table, self->index++, &name);
+	return htpy_header_name(name);
+}
+
+static PyMappingMethods htpy_headers_as_mapping = {
+	(lenfunc) htpy_headers_length,          /* mp_length */
+	(binaryfunc) htpy_headers_subscript,    /* mp_subscript */
+	0,                                      /* mp_ass_subscript */
+};
+
+static PySequenceMethods htpy_headers_as_sequence = {
+	0,                                      /* sq_length */
+	0,                                      /* sq_concat */
+	0,                                      /* sq_repeat */
+	0,                                      /* sq_item */
+	0,                                      /* sq_slice */
+	0,                                      /* sq_ass_item */
+	0,                                      /* sq_ass_slice */
+	(objobjproc) htpy_headers_contains,     /* sq_contains */
+};
+
+static PyMethodDef htpy_headers_methods[] = {
+	{ "get", (PyCFunction) htpy_headers_get, METH_VARARGS,
+	  "Return the value of a header, or default if it is not there." },
+	{ "get_all", (PyCFunction) htpy_headers_get_all, METH_VARARGS,
+	  "Return a list of the values of every header with the given name." },
+	{ "is_repeated", (PyCFunction) htpy_headers_is_repeated, METH_VARARGS,
+	  "Return True if libhtp folded repeated headers into this one." },
+	{ "keys", htpy_headers_keys, METH_NOARGS,
+	  "Return a list of the header names." },
+	{ "values", htpy_headers_values, METH_NOARGS,
+	  "Return a list of the header values." },
+	{ "items", htpy_headers_items, METH_NOARGS,
+	  "Return a list of (name, value) tuples." },
+	{ NULL }
+};
+
+static PyTypeObject htpy_headers_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.headers",                  /* tp_name */
+	sizeof(htpy_headers),            /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_headers_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	(reprfunc) htpy_headers_repr,    /* tp_repr */
+	0,                               /* tp_as_number */
+	&htpy_headers_as_sequence,       /* tp_as_sequence */
+	&htpy_headers_as_mapping,        /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"header view object",            /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	(getiterfunc) htpy_headers_iter_new, /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_headers_methods,            /* tp_methods */
+};
+
+static PyTypeObject htpy_headers_iter_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.headers_iterator",         /* tp_name */
+	sizeof(htpy_headers_iter),       /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_headers_iter_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	0,                               /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"header view iterator",          /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	PyObject_SelfIter,               /* tp_iter */
+	(iternextfunc) htpy_headers_iter_next, /* tp_iternext */
+};
+
+#define TX_GET_HEADERS_VIEW(TYPE, DIRECTION) \
+static PyObject *htpy_tx_get_##TYPE##_headers_view(htpy_tx *self, void *closure) { \
+	TX_CHECK(self); \
+	return htpy_headers_new(self, DIRECTION); \
+}
+
+TX_GET_HEADERS_VIEW(request, HTPY_REQUEST)
+TX_GET_HEADERS_VIEW(response, HTPY_RESPONSE)
+
+static PyGetSetDef htpy_tx_getseters[] = {
+    {"index", (getter) htpy_tx_get_index, NULL,
+     "Index of the transaction on the connection", NULL},
+    {"method", (getter) htpy_tx_get_method, NULL,
+     "Request method", NULL},
+    {"uri", (getter) htpy_tx_get_uri, NULL,
+     "Request URI as it was given", NULL},
+    {"protocol", (getter) htpy_tx_get_protocol, NULL,
+     "Request protocol", NULL},
+    {"parsed_uri", (getter) htpy_tx_get_parsed_uri, NULL,
+     "Dictionary of the parsed URI", NULL},
+    {"request_headers", (getter) htpy_tx_get_request_headers, NULL,
+     "Dictionary of the request headers", NULL},
+    {"response_headers", (getter) htpy_tx_get_response_headers, NULL,
+     "Dictionary of the response headers", NULL},
+    {"request_headers_view", (getter) htpy_tx_get_request_headers_view, NULL,
+     "Read only view of the request headers", NULL},
+    {"response_headers_view", (getter) htpy_tx_get_response_headers_view, NULL,
+     "Read only view of the response headers", NULL},
+    {"status", (getter) htpy_tx_get_status, NULL,
+     "Response status number", NULL},
+    {"status_message", (getter) htpy_tx_get_status_message, NULL,
+     "Response status message", NULL},
+    {"request_message_length", (getter) htpy_tx_get_request_message_length, NULL,
+     "Request message length before decompressed and dechunked", NULL},
+    {"request_entity_length", (getter) htpy_tx_get_request_entity_length, NULL,
+     "Request message length after decompressed and dechunked", NULL},
+    {"response_message_length", (getter) htpy_tx_get_response_message_length, NULL,
+     "Response message length before decompressed and dechunked", NULL},
+    {"response_entity_length", (getter) htpy_tx_get_response_entity_length, NULL,
+     "Response message length after decompressed and dechunked", NULL},
+    {"flags", (getter) htpy_tx_get_flags, NULL,
+     "Parsing flags of libhtp, and HTPY_TX_GAP", NULL},
+    {"body_digests", (getter) htpy_tx_get_body_digests, NULL,
+     "Digests and sizes of the request and response bodies", NULL},
+    {"request_body", (getter) htpy_tx_get_request_body, NULL,
+     "Captured request body and whether it was truncated", NULL},
+    {"response_body", (getter) htpy_tx_get_response_body, NULL,
+     "Captured response body and whether it was truncated", NULL},
+    {"filter_rule", (getter) htpy_tx_get_filter_rule, NULL,
+     "Filter rule which matched the transaction", NULL},
+    {"valid", (getter) htpy_tx_get_valid, NULL,
+     "False once libhtp has destroyed the transaction", NULL},
+    {NULL}
+};
+
+static PyMethodDef htpy_tx_methods[] = {
+	{ "get_uri_component", htpy_tx_get_uri_component, METH_VARARGS,
+	  "Return one part of the parsed URI, or None." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_tx_members[] = {
+	{ "connp", T_OBJECT, offsetof(htpy_tx, connp), READONLY, "Connection parser"},
+	{ NULL }
+};
+
+static PyTypeObject htpy_tx_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.tx",                       /* tp_name */
+	sizeof(htpy_tx),                 /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_tx_dealloc,    /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	0,                               /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"transaction object",            /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_tx_methods,                 /* tp_methods */
+	htpy_tx_members,                 /* tp_members */
+	htpy_tx_getseters,               /* tp_getset */
+};
+
+/*
+ * Filters.
+ *
+ * A filter is a set of rules which is attached to a config. While a config
+ * has a filter the callbacks for a transaction, python or C, are only
+ * called once one of the rules has matched it, and everything else is
+ * parsed without ever touching the interpreter.
+ *
+ * Rules are checked as soon as what they look at is known: the method,
+ * URI and path when the request line is done, the host and the request
+ * headers when the request headers are, the status on the response line
+ * and the response headers after those. A transaction which has not
+ * matched by the time a hook runs gets no callback for that hook; once it
+ * matches it gets all of the rest. Nothing can have matched yet when a
+ * request starts, so request start callbacks are never called.
+ *
+ * String rules are exact, prefix, suffix or substring matches. All the
+ * patterns for one field (and for each header name) are compiled into a
+ * single Aho-Corasick automaton over case folded bytes when the filter is
+ * attached, so a value is scanned once however many rules there are.
+ * Case sensitive patterns are confirmed with a memcmp on a hit.
+ */
+#define HTPY_FILTER_EXACT 0
+#define HTPY_FILTER_PREFIX 1
+#define HTPY_FILTER_SUFFIX 2
+#define HTPY_FILTER_SUBSTRING 3
+#define HTPY_FILTER_NOCASE 4
+
+#define HTPY_FILTER_MATCH(FLAGS) ((FLAGS) & 3)
+
+enum {
+	HTPY_FILTER_METHOD,
+	HTPY_FILTER_URI,
+	HTPY_FILTER_PATH,
+	HTPY_FILTER_HOST,
+	HTPY_FILTER_FIELDS
+};
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	int flags;
+	int rule;
+	/* Next pattern ending in the same state, plus one. */
+	uint32_t next;
+} htpy_pattern;
+
+typedef struct {
+	unsigned char c;
+	uint32_t next;
+} htpy_ac_edge;
+
+typedef struct {
+	htpy_ac_edge *edges;
+	uint32_t nedges;
+	uint32_t fail;
+	/* First pattern ending in this state, plus one. */
+	uint32_t out;
+	/* Nearest state on the fail chain with patterns of its own. */
+	uint32_t link;
+} htpy_ac_state;
+
+typedef struct {
+	htpy_pattern *patterns;
+	size_t npatterns;
+	htpy_ac_state *states;
+	size_t nstates;
+	/* Patterns are all anchored at the start and no longer than this. */
+	int anchored;
+	size_t maxlen;
+	/* Transitions out of the root state, which is where most bytes go. */
+	uint32_t root[256];
+} htpy_patterns;
+
+typedef struct {
+	char *name;
+	size_t len;
+	/* Rule matching on the header being present, plus one. */
+	int present;
+	htpy_patterns values;
+} htpy_filter_header;
+
+typedef struct {
+	int low;
+	int high;
+	int rule;
+} htpy_filter_status;
+
+typedef struct {
+	PyObject_HEAD
+	htpy_patterns fields[HTPY_FILTER_FIELDS];
+	htpy_filter_header *request_headers;
+	size_t nrequest_headers;
+	htpy_filter_header *response_headers;
+	size_t nresponse_headers;
+	htpy_filter_status *status;
+	size_t nstatus;
+	int rules;
+	/* Set once the filter is attached to a config, it can not change. */
+	int frozen;
+} htpy_filter;
+
+static unsigned char htpy_fold(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static int htpy_patterns_add(htpy_patterns *set, const char *data, Py_ssize_t len, int flags, int rule) {
+	htpy_pattern *p;
+
+	if (!len) {
+		PyErr_SetString(htpy_get_state()->error, "Pattern may not be empty.");
+		return -1;
+	}
+
+	p = set->patterns;
+	if (!PyMem_Resize(p, htpy_pattern, set->npatterns + 1)) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	set->patterns = p;
+
+	p = &set->patterns[set->npatterns];
+	p->data = PyMem_Malloc(len);
+	if (!p->data) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	memcpy(p->data, data, len);
+	p->len = len;
+	p->flags = flags;
+	p->rule = rule;
+	p->next = 0;
+	set->npatterns++;
+
+	return 0;
+}
+
+static void htpy_patterns_free(htpy_patterns *set) {
+	size_t i;
+
+	for (i = 0; i < set->npatterns; i++)
+		PyMem_Free(set->patterns[i].data);
+	PyMem_Free(set->patterns);
+	for (i = 0; i < set->nstates; i++)
+		PyMem_Free(set->states[i].edges);
+	PyMem_Free(set->states);
+	memset(set, 0, sizeof(htpy_patterns));
+}
+
+/* The state reached from S on C, zero if there is no such edge. */
+static uint32_t htpy_ac_goto(const htpy_patterns *set, uint32_t s, unsigned char c) {
+	const htpy_ac_state *state = &set->states[s];
+	uint32_t i;
+
+	if (!s)
+		return set->root[c];
+
+	for (i = 0; i < state->nedges; i++) {
+		if (state->edges[i].c == c)
+			return state->edges[i].next;
+	}
+
+	return 0;
+}
+
+static int htpy_ac_add_edge(htpy_patterns *set, uint32_t s, unsigned char c, uint32_t next) {
+	htpy_ac_state *state = &set->states[s];
+	htpy_ac_edge *edges = state->edges;
+
+	if (!s) {
+		set->root[c] = next;
+		return 0;
+	}
+
+	if (!PyMem_Resize(edges, htpy_ac_edge, state->nedges + 1))
+		return -1;
+	edges[state->nedges].c = c;
+	edges[state->nedges].next = next;
+	state->edges = edges;
+	state->nedges++;
+
+	return 0;
+}
+
+/* Build the automaton for the patterns added so far. */
+static int htpy_patterns_compile(htpy_patterns *set) {
+	htpy_ac_state *states;
+	uint32_t *queue;
+	size_t i, j, max, head, tail;
+	uint32_t s, t, f;
+	unsigned char c;
+
+	if (!set->npatterns)
+		return 0;
+
+	/* A trie never has more states than the patterns have bytes. */
+	for (i = 0, max = 1; i < set->npatterns; i++)
+		max += set->patterns[i].len;
+
+	set->states = PyMem_New(htpy_ac_state, max);
+	if (!set->states)
+		goto nomem;
+	memset(set->states, 0, sizeof(htpy_ac_state) * max);
+	memset(set->root, 0, sizeof(set->root));
+	set->nstates = 1;
+	set->anchored = 1;
+	set->maxlen = 0;
+
+	for (i = 0; i < set->npatterns; i++) {
+		htpy_pattern *p = &set->patterns[i];
+
+		for (j = 0, s = 0; j < p->len; j++) {
+			c = htpy_fold(p->data[j]);
+			t = htpy_ac_goto(set, s, c);
+			if (!t) {
+				t = set->nstates++;
+				if (htpy_ac_add_edge(set, s, c, t) == -1)
+					goto nomem;
+			}
+			s = t;
+		}
+		p->next = set->states[s].out;
+		set->states[s].out = i + 1;
+
+		if (HTPY_FILTER_MATCH(p->flags) != HTPY_FILTER_EXACT && HTPY_FILTER_MATCH(p->flags) != HTPY_FILTER_PREFIX)
+			set->anchored = 0;
+		if (p->len > set->maxlen)
+			set->maxlen = p->len;
+	}
+
+	states = set->states;
+	if (!PyMem_Resize(states, htpy_ac_state, set->nstates))
+		goto nomem;
+	set->states = states;
+
+	queue = PyMem_New(uint32_t, set->nstates);
+	if (!queue)
+		goto nomem;
+
+	head = tail = 0;
+	for (i = 0; i < 256; i++) {
+		if (set->root[i])
+			queue[tail++] = set->root[i];
+	}
+
+	while (head < tail) {
+		s = queue[head++];
+		for (i = 0; i < set->states[s].nedges; i++) {
+			c = set->states[s].edges[i].c;
+			t = set->states[s].edges[i].next;
+			queue[tail++] = t;
+
+			f = set->states[s].fail;
+			while (f && !htpy_ac_goto(set, f, c))
+				f = set->states[f].fail;
+			f = htpy_ac_goto(set, f, c);
+			set->states[t].fail = f;
+			set->states[t].link = set->states[f].out ? f : set->states[f].link;
+		}
+	}
+
+	PyMem_Free(queue);
+	return 0;
+
+nomem:
+	PyErr_NoMemory();
+	return -1;
+}
+
+static int htpy_pattern_check(const htpy_pattern *p, const unsigned char *data, size_t len, size_t end) {
+	size_t start = end - p->len;
+
+	switch (HTPY_FILTER_MATCH(p->flags)) {
+		case HTPY_FILTER_EXACT:
+			if (start || end != len)
+				return 0;
+			break;
+		case HTPY_FILTER_PREFIX:
+			if (start)
+				return 0;
+			break;
+		case HTPY_FILTER_SUFFIX:
+			if (end != len)
+				return 0;
+			break;
+	}
+
+	if (!(p->flags & HTPY_FILTER_NOCASE) && memcmp(data + start, p->data, p->len))
+		return 0;
+
+	return 1;
+}
+
+/* Return the rule of a pattern found in DATA plus one, or zero. */
+static int htpy_patterns_match(const htpy_patterns *set, const unsigned char *data, size_t len) {
+	const htpy_pattern *p;
+	uint32_t s = 0, t = 0, o, n;
+	size_t i;
+
+	if (!set->nstates || !data)
+		return 0;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = htpy_fold(data[i]);
+
+		if (set->anchored && i >= set->maxlen)
+			break;
+
+		while (s && !(t = htpy_ac_goto(set, s, c)))
+			s = set->states[s].fail;
+		s = s ? t : set->root[c];
+
+		for (o = set->states[s].out ? s : set->states[s].link; o; o = set->states[o].link) {
+			for (n = set->states[o].out; n; n = p->next) {
+				p = &set->patterns[n - 1];
+				if (htpy_pattern_check(p, data, len, i + 1))
+					return p->rule + 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int htpy_bstr_match(const htpy_patterns *set, bstr *b) {
+	if (!b)
+		return 0;
+	return htpy_patterns_match(set, bstr_ptr(b), bstr_len(b));
+}
+
+static int htpy_filter_headers_match(htpy_filter_header *headers, size_t n, htp_table_t *table) {
+	htp_header_t *h;
+	size_t i;
+	int rule;
+
+	if (!table)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		h = htp_table_get_mem(table, headers[i].name, headers[i].len);
+		if (!h)
+			continue;
+		if (headers[i].present)
+			return headers[i].present;
+		if ((rule = htpy_bstr_match(&headers[i].values, h->value)))
+			return rule;
+	}
+
+	return 0;
+}
+
+static int htpy_filter_status_match(htpy_filter *filter, int status) {
+	size_t i;
+
+	for (i = 0; i < filter->nstatus; i++) {
+		if (status >= filter->status[i].low && status <= filter->status[i].high)
+			return filter->status[i].rule + 1;
+	}
+
+	return 0;
+}
+
+/* Check the rules for everything up to STAGE which has not been checked. */
+static int htpy_filter_stage(htpy_filter *filter, htp_tx_t *tx, int stage) {
+	int rule = 0;
+
+	switch (stage) {
+		case HTPY_STAGE_REQUEST_LINE:
+			if ((rule = htpy_bstr_match(&filter->fields[HTPY_FILTER_METHOD], tx->request_method)))
+				break;
+			if ((rule = htpy_bstr_match(&filter->fields[HTPY_FILTER_URI], tx->request_uri)))
+				break;
+			if (tx->parsed_uri)
+				rule = htpy_bstr_match(&filter->fields[HTPY_FILTER_PATH], tx->parsed_uri->path);
+			break;
+		case HTPY_STAGE_REQUEST_HEADERS:
+			if ((rule = htpy_bstr_match(&filter->fields[HTPY_FILTER_HOST], tx->request_hostname)))
+				break;
+			rule = htpy_filter_headers_match(filter->request_headers, filter->nrequest_headers, tx->request_headers);
+			break;
+		case HTPY_STAGE_RESPONSE_LINE:
+			rule = htpy_filter_status_match(filter, tx->response_status_number);
+			break;
+		case HTPY_STAGE_RESPONSE_HEADERS:
+			/* The status is checked again in case it was a 100 before. */
+			if ((rule = htpy_filter_status_match(filter, tx->response_status_number)))
+				break;
+			rule = htpy_filter_headers_match(filter->response_headers, filter->nresponse_headers, tx->response_headers);
+			break;
+	}
+
+	return rule;
+}
+
+/*
+ * Should the callbacks for a hook at STAGE be called for a transaction?
+ * Always, unless the config has a filter which has not matched yet. This
+ * runs without the GIL, the filter can not change once it is attached.
+ */
+static int htpy_filter_tx(PyObject *obj, htp_tx_t *tx, int stage) {
+	htpy_filter *filter = (htpy_filter *) ((htpy_config *) ((htpy_connp *) obj)->cfg)->filter;
+	htpy_tx_filter *f;
+	int s;
+
+	if (!filter)
+		return 1;
+
+	f = htpy_tx_filter_get(tx, 1);
+	if (!f)
+		return 0;
+
+	for (s = f->stage + 1; s <= stage && !f->rule; s++)
+		f->rule = htpy_filter_stage(filter, tx, s);
+	if (stage > f->stage)
+		f->stage = stage;
+
+	return f->rule != 0;
+}
+
+static PyObject *htpy_filter_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	return type->tp_alloc(type, 0);
+}
+
+static void htpy_filter_headers_free(htpy_filter_header *headers, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		PyMem_Free(headers[i].name);
+		htpy_patterns_free(&headers[i].values);
+	}
+	PyMem_Free(headers);
+}
+
+static void htpy_filter_dealloc(htpy_filter *self) {
+	int i;
+
+	for (i = 0; i < HTPY_FILTER_FIELDS; i++)
+		htpy_patterns_free(&self->fields[i]);
+	htpy_filter_headers_free(self->request_headers, self->nrequest_headers);
+	htpy_filter_headers_free(self->response_headers, self->nresponse_headers);
+	PyMem_Free(self->status);
+	HTPY_FREE(self);
+}
+
+#define FILTER_CHECK_FROZEN(SELF) \
+	if ((SELF)->frozen) { \
+		PyErr_SetString(htpy_get_state()->error, "Filter is attached to a config and can not be changed."); \
+		return NULL; \
+	}
+
+static int htpy_filter_flags(int flags) {
+	if (flags & ~(HTPY_FILTER_NOCASE | 3)) {
+		PyErr_SetString(htpy_get_state()->error, "Invalid match flags.");
+		return -1;
+	}
+	return 0;
+}
+
+/* Matches on one of the fields with no name. */
+#define FILTER_MATCH(FIELD, NAME, FIXED) \
+static PyObject *htpy_filter_match_##NAME(htpy_filter *self, PyObject *args) { \
+	const char *pattern; \
+	Py_ssize_t len; \
+	int flags = HTPY_FILTER_EXACT; \
+	if (!PyArg_ParseTuple(args, "s#|i:match_" #NAME, &pattern, &len, &flags)) \
+		return NULL; \
+	FILTER_CHECK_FROZEN(self); \
+	if (htpy_filter_flags(flags) == -1) \
+		return NULL; \
+	if (htpy_patterns_add(&self->fields[FIELD], pattern, len, flags | (FIXED), self->rules) == -1) \
+		return NULL; \
+	return PyInt_FromLong(self->rules++); \
+}
+
+FILTER_MATCH(HTPY_FILTER_METHOD, method, 0)
+FILTER_MATCH(HTPY_FILTER_URI, uri, 0)
+FILTER_MATCH(HTPY_FILTER_PATH, path, 0)
+/* Host names are not case sensitive. */
+FILTER_MATCH(HTPY_FILTER_HOST, host, HTPY_FILTER_NOCASE)
+
+static htpy_filter_header *htpy_filter_header_get(htpy_filter_header **headers, size_t *n, const char *name, Py_ssize_t len) {
+	htpy_filter_header *h;
+	size_t i;
+
+	for (i = 0; i < *n; i++) {
+		h = &(*headers)[i];
+		if (h->len == (size_t) len && !strncasecmp(h->name, name, len))
+			return h;
+	}
+
+	h = *headers;
+	if (!PyMem_Resize(h, htpy_filter_header, *n + 1)) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	*headers = h;
+
+	h = &(*headers)[*n];
+	memset(h, 0, sizeof(htpy_filter_header));
+	h->name = PyMem_Malloc(len + 1);
+	if (!h->name) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	memcpy(h->name, name, len);
+	h->name[len] = '\0';
+	h->len = len;
+	(*n)++;
+
+	return h;
+}
+
+/* Matches on a header, or only on it being there when there is no pattern. */
+#define FILTER_MATCH_HEADER(TYPE) \
+static PyObject *htpy_filter_match_##TYPE##_header(htpy_filter *self, PyObject *args) { \
+	const char *name, *pattern = NULL; \
+	Py_ssize_t name_len, len = 0; \
+	int flags = HTPY_FILTER_EXACT; \
+	htpy_filter_header *h; \
+	if (!PyArg_ParseTuple(args, "s#|z#i:match_" #TYPE "_header", &name, &name_len, &pattern, &len, &flags)) \
+		return NULL; \
+	FILTER_CHECK_FROZEN(self); \
+	if (htpy_filter_flags(flags) == -1) \
+		return NULL; \
+	if (!name_len) { \
+		PyErr_SetString(htpy_get_state()->error, "Header name may not be empty."); \
+		return NULL; \
+	} \
+	h = htpy_filter_header_get(&self->TYPE##_headers, &self->n##TYPE##_headers, name, name_len); \
+	if (!h) \
+		return NULL; \
+	if (!pattern) { \
+		if (!h->present) \
+			h->present = self->rules + 1; \
+	} \
+	else if (htpy_patterns_add(&h->values, pattern, len, flags, self->rules) == -1) \
+		return NULL; \
+	return PyInt_FromLong(self->rules++); \
+}
+
+FILTER_MATCH_HEADER(request)
+FILTER_MATCH_HEADER(response)
+
+static PyObject *htpy_filter_match_status(htpy_filter *self, PyObject *args) {
+	htpy_filter_status *status;
+	int low, high = -1;
+
+	if (!PyArg_ParseTuple(args, "i|i:match_status", &low, &high))
+		return NULL;
+
+	FILTER_CHECK_FROZEN(self);
+
+	if (high == -1)
+		high = low;
+	if (high < low) {
+		PyErr_SetString(htpy_get_state()->error, "Status range is empty.");
+		return NULL;
+	}
+
+	status = self->status;
+	if (!PyMem_Resize(status, htpy_filter_status, self->nstatus + 1))
+		return PyErr_NoMemory();
+	self->status = status;
+
+	status = &self->status[self->nstatus++];
+	status->low = low;
+	status->high = high;
+	status->rule = self->rules;
+
+	return PyInt_FromLong(self->rules++);
+}
+
+/* Compile every automaton and freeze the filter, done once on attach. */
+static int htpy_filter_freeze(PyObject *obj) {
+	htpy_filter *self = (htpy_filter *) obj;
+	size_t i;
+
+	if (self->frozen)
+		return 0;
+
+	for (i = 0; i < HTPY_FILTER_FIELDS; i++) {
+		if (htpy_patterns_compile(&self->fields[i]) == -1)
+			return -1;
+	}
+	for (i = 0; i < self->nrequest_headers; i++) {
+		if (htpy_patterns_compile(&self->request_headers[i].values) == -1)
+			return -1;
+	}
+	for (i = 0; i < self->nresponse_headers; i++) {
+		if (htpy_patterns_compile(&self->response_headers[i].values) == -1)
+			return -1;
+	}
+
+	self->frozen = 1;
+	return 0;
+}
+
+static Py_ssize_t htpy_filter_len(htpy_filter *self) {
+	return self->rules;
+}
+
+static PySequenceMethods htpy_filter_as_sequence = {
+	(lenfunc) htpy_filter_len,       /* sq_length */
+};
+
+static PyMethodDef htpy_filter_methods[] = {
+	{ "match_method", (PyCFunction) htpy_filter_match_method, METH_VARARGS,
+	  "Match on the request method." },
+	{ "match_uri", (PyCFunction) htpy_filter_match_uri, METH_VARARGS,
+	  "Match on the request URI as it was given." },
+	{ "match_path", (PyCFunction) htpy_filter_match_path, METH_VARARGS,
+	  "Match on the normalized path of the request URI." },
+	{ "match_host", (PyCFunction) htpy_filter_match_host, METH_VARARGS,
+	  "Match on the host name of the request." },
+	{ "match_request_header", (PyCFunction) htpy_filter_match_request_header, METH_VARARGS,
+	  "Match on a request header, or on it being present." },
+	{ "match_response_header", (PyCFunction) htpy_filter_match_response_header, METH_VARARGS,
+	  "Match on a response header, or on it being present." },
+	{ "match_status", (PyCFunction) htpy_filter_match_status, METH_VARARGS,
+	  "Match on a response status or range of them." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_filter_members[] = {
+	{ "frozen", T_INT, offsetof(htpy_filter, frozen), READONLY, "True once attached to a config" },
+	{ NULL }
+};
+
+static PyTypeObject htpy_filter_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.filter",                   /* tp_name */
+	sizeof(htpy_filter),             /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_filter_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	&htpy_filter_as_sequence,        /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"filter object",                 /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_filter_methods,             /* tp_methods */
+	htpy_filter_members,             /* tp_members */
+	0,                               /* tp_getset */
+	0,                               /* tp_base */
+	0,                               /* tp_dict */
+	0,                               /* tp_descr_get */
+	0,                               /* tp_descr_set */
+	0,                               /* tp_dictoffset */
+	0,                               /* tp_init */
+	0,                               /* tp_alloc */
+	htpy_filter_new,                 /* tp_new */
+};
+
+/*
+ * Columnar export.
+ *
+ * An exporter attached to a config turns each completed transaction into
+ * a row of a batch of columns, straight from the transaction complete
+ * handler and without the GIL. Once a batch has batch_size rows it is put
+ * aside until get_batches() hands it to python as a record batch. Record
+ * batches implement the Arrow PyCapsule interface, so pyarrow and other
+ * Arrow libraries take their buffers without a copy, and can give their
+ * fixed width columns as the records of a NumPy structured array.
+ *
+ * Strings are converted from latin-1 to UTF-8, the same way htpy turns them
+ * into str under python 3. Times are microseconds since the epoch. Strings
+ * and times which are not known are null.
+ *
+ * The exporter has its own lock as parsers on different threads may share
+ * a config. Batches are reference counted: the record batch object holds
+ * one reference and every Arrow array exported from it another, as those
+ * may be released by any thread at any time.
+ */
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+	const char *format;
+	const char *name;
+	const char *metadata;
+	int64_t flags;
+	int64_t n_children;
+	struct ArrowSchema **children;
+	struct ArrowSchema *dictionary;
+	void (*release)(struct ArrowSchema *);
+	void *private_data;
+};
+
+struct ArrowArray {
+	int64_t length;
+	int64_t null_count;
+	int64_t offset;
+	int64_t n_buffers;
+	int64_t n_children;
+	const void **buffers;
+	struct ArrowArray **children;
+	struct ArrowArray *dictionary;
+	void (*release)(struct ArrowArray *);
+	void *private_data;
+};
+#endif
+
+enum {
+	HTPY_COLUMN_INT64,
+	HTPY_COLUMN_INT32,
+	HTPY_COLUMN_TIMESTAMP,
+	HTPY_COLUMN_UTF8
+};
+
+static const char *htpy_column_formats[] = { "l", "i", "tsu:", "u" };
+static const char *htpy_column_dtypes[] = { "=i8", "=i4", "M8[us]", NULL };
+static const size_t htpy_column_widths[] = { 8, 4, 8, 0 };
+
+/* Where the value of a column comes from. */
+enum {
+	HTPY_FIELD_INDEX,
+	HTPY_FIELD_METHOD,
+	HTPY_FIELD_HOST,
+	HTPY_FIELD_PATH,
+	HTPY_FIELD_QUERY,
+	HTPY_FIELD_PROTOCOL,
+	HTPY_FIELD_STATUS,
+	HTPY_FIELD_REQUEST_MESSAGE_LENGTH,
+	HTPY_FIELD_REQUEST_ENTITY_LENGTH,
+	HTPY_FIELD_RESPONSE_MESSAGE_LENGTH,
+	HTPY_FIELD_RESPONSE_ENTITY_LENGTH,
+	HTPY_FIELD_REQUEST_START,
+	HTPY_FIELD_REQUEST_COMPLETE,
+	HTPY_FIELD_RESPONSE_START,
+	HTPY_FIELD_RESPONSE_COMPLETE,
+	HTPY_FIELD_REQUEST_HEADER,
+	HTPY_FIELD_RESPONSE_HEADER
+};
+
+/* The columns every exporter has, followed by the header columns. */
+static const struct {
+	const char *name;
+	int type;
+} htpy_export_fields[] = {
+	{ "index", HTPY_COLUMN_INT64 },
+	{ "method", HTPY_COLUMN_UTF8 },
+	{ "host", HTPY_COLUMN_UTF8 },
+	{ "path", HTPY_COLUMN_UTF8 },
+	{ "query", HTPY_COLUMN_UTF8 },
+	{ "protocol", HTPY_COLUMN_UTF8 },
+	{ "status", HTPY_COLUMN_INT32 },
+	{ "request_message_length", HTPY_COLUMN_INT64 },
+	{ "request_entity_length", HTPY_COLUMN_INT64 },
+	{ "response_message_length", HTPY_COLUMN_INT64 },
+	{ "response_entity_length", HTPY_COLUMN_INT64 },
+	{ "request_start", HTPY_COLUMN_TIMESTAMP },
+	{ "request_complete", HTPY_COLUMN_TIMESTAMP },
+	{ "response_start", HTPY_COLUMN_TIMESTAMP },
+	{ "response_complete", HTPY_COLUMN_TIMESTAMP }
+};
+
+#define HTPY_EXPORT_FIELDS (sizeof(htpy_export_fields) / sizeof(htpy_export_fields[0]))
+
+typedef struct {
+	/* The column name, UTF-8. */
+	char *name;
+	int type;
+	int field;
+	/* The header for header columns. */
+	char *header;
+	size_t header_len;
+} htpy_export_def;
+
+typedef struct {
+	char *name;
+	int type;
+	/* Set bits for the rows which are not null. */
+	unsigned char *validity;
+	int64_t nulls;
+	/* The values, or the characters of the strings. */
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	/* Where each string starts in data, one more than there are rows. */
+	int32_t *offsets;
+} htpy_export_column;
+
+typedef struct htpy_batch {
+	struct htpy_batch *next;
+	int refs;
+	size_t rows;
+	size_t capacity;
+	size_t ncols;
+	htpy_export_column *cols;
+} htpy_batch;
+
+typedef struct {
+	PyObject_HEAD
+	pthread_mutex_t lock;
+	Py_ssize_t batch_size;
+	size_t ncols;
+	htpy_export_def *defs;
+	/* The batch being filled, and the full ones in the order they filled. */
+	htpy_batch *current;
+	htpy_batch *done;
+	htpy_batch *done_tail;
+	unsigned long rows;
+	unsigned long dropped;
+} htpy_exporter;
+
+typedef struct {
+	PyObject_HEAD
+	htpy_batch *batch;
+} htpy_record_batch;
+
+/* Latin-1 to UTF-8, out must have room for twice len. Returns the length. */
+static size_t htpy_latin1_to_utf8(unsigned char *out, const unsigned char *in, size_t len) {
+	unsigned char *p = out;
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		/* Nearly everything is ASCII, which is copied a word at a time. */
+		while (len - i >= 8) {
+			memcpy(&w, in + i, 8);
+			if (w & 0x8080808080808080ULL)
+				break;
+			memcpy(p, &w, 8);
+			p += 8;
+			i += 8;
+		}
+		if (i == len)
+			break;
+		if (in[i] < 0x80) {
+			*p++ = in[i];
+		} else {
+			*p++ = 0xc0 | (in[i] >> 6);
+			*p++ = 0x80 | (in[i] & 0x3f);
+		}
+	}
+
+	return (size_t) (p - out);
+}
+
+static void htpy_batch_free(htpy_batch *b) {
+	size_t i;
+
+	for (i = 0; i < b->ncols; i++) {
+		free(b->cols[i].name);
+		free(b->cols[i].validity);
+		free(b->cols[i].data);
+		free(b->cols[i].offsets);
+	}
+	free(b->cols);
+	free(b);
+}
+
+static void htpy_batch_ref(htpy_batch *b) {
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void htpy_batch_unref(htpy_batch *b) {
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		htpy_batch_free(b);
+}
+
+static htpy_batch *htpy_batch_new(htpy_exporter *exp) {
+	htpy_batch *b;
+	htpy_export_column *c;
+	size_t i, cap = (size_t) exp->batch_size;
+
+	b = calloc(1, sizeof(htpy_batch));
+	if (!b)
+		return NULL;
+	b->refs = 1;
+	b->capacity = cap;
+	b->ncols = exp->ncols;
+	b->cols = calloc(exp->ncols, sizeof(htpy_export_column));
+	if (!b->cols) {
+		free(b);
+		return NULL;
+	}
+
+	for (i = 0; i < exp->ncols; i++) {
+		c = &b->cols[i];
+		c->type = exp->defs[i].type;
+		c->name = strdup(exp->defs[i].name);
+		c->validity = calloc((cap + 7) / 8, 1);
+		if (c->type == HTPY_COLUMN_UTF8) {
+			c->size = 4096;
+			c->offsets = calloc(cap + 1, sizeof(int32_t));
+			if (!c->offsets)
+				goto fail;
+		} else {
+			c->size = cap * htpy_column_widths[c->type];
+		}
+		c->data = malloc(c->size);
+		if (!c->name || !c->validity || !c->data)
+			goto fail;
+	}
+
+	return b;
+
+fail:
+	htpy_batch_free(b);
+	return NULL;
+}
+
+/* The value of a string column for a transaction, NULL if it has none. */
+static bstr *htpy_export_bstr(htpy_export_def *def, htp_tx_t *tx) {
+	htp_header_t *h;
+
+	switch (def->field) {
+	case HTPY_FIELD_METHOD:
+		return tx->request_method;
+	case HTPY_FIELD_HOST:
+		return tx->request_hostname;
+	case HTPY_FIELD_PATH:
+		return tx->parsed_uri ? tx->parsed_uri->path : NULL;
+	case HTPY_FIELD_QUERY:
+		return tx->parsed_uri ? tx->parsed_uri->query : NULL;
+	case HTPY_FIELD_PROTOCOL:
+		return tx->request_protocol;
+	case HTPY_FIELD_REQUEST_HEADER:
+		h = tx->request_headers ? htp_table_get_mem(tx->request_headers, def->header, def->header_len) : NULL;
+		return h ? h->value : NULL;
+	case HTPY_FIELD_RESPONSE_HEADER:
+		h = tx->response_headers ? htp_table_get_mem(tx->response_headers, def->header, def->header_len) : NULL;
+		return h ? h->value : NULL;
+	}
+
+	return NULL;
+}
+
+/* The value of a fixed width column, returns 0 if it is null. */
+static int htpy_export_value(htpy_export_def *def, htp_tx_t *tx, const htpy_tx_times *t, int64_t *v) {
+	const htp_time_t *ts = NULL;
+
+	switch (def->field) {
+	case HTPY_FIELD_INDEX:
+		*v = (int64_t) tx->index;
+		return 1;
+	case HTPY_FIELD_STATUS:
+		*v = tx->response_status_number;
+		return 1;
+	case HTPY_FIELD_REQUEST_MESSAGE_LENGTH:
+		*v = tx->request_message_len;
+		return 1;
+	case HTPY_FIELD_REQUEST_ENTITY_LENGTH:
+		*v = tx->request_entity_len;
+		return 1;
+	case HTPY_FIELD_RESPONSE_MESSAGE_LENGTH:
+		*v = tx->response_message_len;
+		return 1;
+	case HTPY_FIELD_RESPONSE_ENTITY_LENGTH:
+		*v = tx->response_entity_len;
+		return 1;
+	case HTPY_FIELD_REQUEST_START:
+		ts = t ? &t->request_start : NULL;
+		break;
+	case HTPY_FIELD_REQUEST_COMPLETE:
+		ts = t ? &t->request_complete : NULL;
+		break;
+	case HTPY_FIELD_RESPONSE_START:
+		ts = t ? &t->response_start : NULL;
+		break;
+	case HTPY_FIELD_RESPONSE_COMPLETE:
+		ts = t ? &t->response_complete : NULL;
+		break;
+	}
+
+	*v = 0;
+	if (!ts || (!ts->tv_sec && !ts->tv_usec))
+		return 0;
+	*v = (int64_t) ts->tv_sec * 1000000 + ts->tv_usec;
+	return 1;
+}
+
+/* Move the batch being filled to the full ones. */
+static void htpy_exporter_finish(htpy_exporter *exp) {
+	htpy_batch *b = exp->current;
+
+	if (!b || !b->rows)
+		return;
+
+	exp->current = NULL;
+	if (exp->done_tail)
+		exp->done_tail->next = b;
+	else
+		exp->done = b;
+	exp->done_tail = b;
+}
+
+/* Check every string of a row fits in a batch, growing it if need be. */
+static int htpy_export_reserve(htpy_batch *b, bstr **strs) {
+	htpy_export_column *c;
+	size_t i, need, size;
+	void *p;
+
+	for (i = 0; i < b->ncols; i++) {
+		c = &b->cols[i];
+		if (c->type != HTPY_COLUMN_UTF8 || !strs[i])
+			continue;
+		need = bstr_len(strs[i]) * 2;
+		if (need > (size_t) INT32_MAX - c->len)
+			return 0;
+		if (need <= c->size - c->len)
+			continue;
+		for (size = c->size ? c->size : 4096; size - c->len < need; size *= 2)
+			;
+		p = realloc(c->data, size);
+		if (!p)
+			return -1;
+		c->data = p;
+		c->size = size;
+	}
+
+	return 1;
+}
+
+/*
+ * Append a row for a transaction. Called from the transaction complete
+ * handler, without the GIL.
+ */
+static void htpy_export_tx(htpy_exporter *exp, htp_tx_t *tx) {
+	const htpy_tx_times *t = htpy_tx_times_get(tx, 0);
+	htpy_batch *b;
+	htpy_export_column *c;
+	bstr *strs[64];
+	bstr **vals = strs;
+	int64_t v;
+	size_t i, row;
+	int valid, x;
+
+	if (!exp->defs)
+		return;
+
+	if (exp->ncols > sizeof(strs) / sizeof(strs[0])) {
+		vals = malloc(exp->ncols * sizeof(bstr *));
+		if (!vals) {
+			pthread_mutex_lock(&exp->lock);
+			exp->dropped++;
+			pthread_mutex_unlock(&exp->lock);
+			return;
+		}
+	}
+	for (i = 0; i < exp->ncols; i++)
+		vals[i] = exp->defs[i].type == HTPY_COLUMN_UTF8 ? htpy_export_bstr(&exp->defs[i], tx) : NULL;
+
+	pthread_mutex_lock(&exp->lock);
+
+	if (!exp->current)
+		exp->current = htpy_batch_new(exp);
+	b = exp->current;
+	x = b ? htpy_export_reserve(b, vals) : -1;
+	if (x == 0 && b->rows) {
+		/* Strings are limited to 2GB a batch by their 32 bit offsets. */
+		htpy_exporter_finish(exp);
+		b = exp->current = htpy_batch_new(exp);
+		x = b ? htpy_export_reserve(b, vals) : -1;
+	}
+	if (x != 1) {
+		exp->dropped++;
+		goto out;
+	}
+
+	row = b->rows;
+	for (i = 0; i < b->ncols; i++) {
+		c = &b->cols[i];
+		if (c->type == HTPY_COLUMN_UTF8) {
+			valid = vals[i] != NULL;
+			if (valid)
+				c->len += htpy_latin1_to_utf8(c->data + c->len, bstr_ptr(vals[i]), bstr_len(vals[i]));
+			c->offsets[row + 1] = (int32_t) c->len;
+		} else {
+			valid = htpy_export_value(&exp->defs[i], tx, t, &v);
+			if (c->type == HTPY_COLUMN_INT32)
+				((int32_t *) c->data)[row] = (int32_t) v;
+			else
+				((int64_t *) c->data)[row] = v;
+		}
+		if (valid)
+			c->validity[row / 8] |= 1 << (row % 8);
+		else
+			c->nulls++;
+	}
+	b->rows++;
+	exp->rows++;
+
+	if (b->rows == b->capacity)
+		htpy_exporter_finish(exp);
+
+out:
+	pthread_mutex_unlock(&exp->lock);
+	if (vals != strs)
+		free(vals);
+}
+
+static int htpy_exporter_def(htpy_export_def *def, const char *prefix, int field, PyObject *header) {
+	const char *data;
+	Py_ssize_t len;
+	size_t plen = strlen(prefix);
+
+	if (htpy_str_data(header, &data, &len) == -1)
+		return -1;
+	if (!data) {
+		PyErr_SetString(htpy_get_state()->error, "Header names must be latin-1.");
+		return -1;
+	}
+
+	def->type = HTPY_COLUMN_UTF8;
+	def->field = field;
+	def->header = malloc(len ? (size_t) len : 1);
+	def->name = malloc(plen + (size_t) len * 2 + 1);
+	if (!def->header || !def->name) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	memcpy(def->header, data, (size_t) len);
+	def->header_len = (size_t) len;
+	memcpy(def->name, prefix, plen);
+	def->name[plen + htpy_latin1_to_utf8((unsigned char *) def->name + plen, (const unsigned char *) data, (size_t) len)] = '\0';
+
+	return 0;
+}
+
+static PyObject *htpy_exporter_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	htpy_exporter *self;
+
+	self = (htpy_exporter *) type->tp_alloc(type, 0);
+	if (self)
+		pthread_mutex_init(&self->lock, NULL);
+
+	return (PyObject *) self;
+}
+
+static int htpy_exporter_init(htpy_exporter *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "batch_size", "request_headers", "response_headers", NULL };
+	Py_ssize_t batch_size = 1024;
+	PyObject *req = NULL, *res = NULL;
+	PyObject *req_seq = NULL, *res_seq = NULL;
+	Py_ssize_t i, nreq = 0, nres = 0;
+	size_t n;
+	int ret = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nOO:htpy_exporter_init", kwlist, &batch_size, &req, &res))
+		return -1;
+
+	if (self->defs) {
+		PyErr_SetString(htpy_get_state()->error, "Exporter is already initialized.");
+		return -1;
+	}
+
+	if (batch_size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "batch_size must be positive");
+		return -1;
+	}
+
+	if (req) {
+		req_seq = PySequence_Fast(req, "request_headers must be a sequence");
+		if (!req_seq)
+			goto out;
+		nreq = PySequence_Fast_GET_SIZE(req_seq);
+	}
+	if (res) {
+		res_seq = PySequence_Fast(res, "response_headers must be a sequence");
+		if (!res_seq)
+			goto out;
+		nres = PySequence_Fast_GET_SIZE(res_seq);
+	}
+
+	self->defs = calloc(HTPY_EXPORT_FIELDS + nreq + nres, sizeof(htpy_export_def));
+	if (!self->defs) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (n = 0; n < HTPY_EXPORT_FIELDS; n++) {
+		self->defs[n].name = strdup(htpy_export_fields[n].name);
+		if (!self->defs[n].name) {
+			self->ncols = n;
+			PyErr_NoMemory();
+			goto out;
+		}
+		self->defs[n].type = htpy_export_fields[n].type;
+		self->defs[n].field = (int) n;
+	}
+	for (i = 0; i < nreq; i++, n++) {
+		self->ncols = n + 1;
+		if (htpy_exporter_def(&self->defs[n], "request.", HTPY_FIELD_REQUEST_HEADER, PySequence_Fast_GET_ITEM(req_seq, i)) == -1)
+			goto out;
+	}
+	for (i = 0; i < nres; i++, n++) {
+		self->ncols = n + 1;
+		if (htpy_exporter_def(&self->defs[n], "response.", HTPY_FIELD_RESPONSE_HEADER, PySequence_Fast_GET_ITEM(res_seq, i)) == -1)
+			goto out;
+	}
+
+	self->ncols = n;
+	self->batch_size = batch_size;
+	ret = 0;
+
+out:
+	if (ret == -1 && self->defs) {
+		for (n = 0; n < self->ncols; n++) {
+			free(self->defs[n].name);
+			free(self->defs[n].header);
+		}
+		free(self->defs);
+		self->defs = NULL;
+		self->ncols = 0;
+	}
+	Py_XDECREF(req_seq);
+	Py_XDECREF(res_seq);
+	return ret;
+}
+
+static void htpy_exporter_dealloc(htpy_exporter *self) {
+	htpy_batch *b, *next;
+	size_t i;
+
+	for (b = self->done; b; b = next) {
+		next = b->next;
+		htpy_batch_unref(b);
+	}
+	if (self->current)
+		htpy_batch_unref(self->current);
+	for (i = 0; self->defs && i < self->ncols; i++) {
+		free(self->defs[i].name);
+		free(self->defs[i].header);
+	}
+	free(self->defs);
+	pthread_mutex_destroy(&self->lock);
+	HTPY_FREE(self);
+}
+
+static PyObject *htpy_record_batch_wrap(htpy_batch *b) {
+	htpy_record_batch *rb;
+
+	rb = PyObject_New(htpy_record_batch, htpy_get_state()->record_batch_type);
+	if (!rb) {
+		htpy_batch_unref(b);
+		return NULL;
+	}
+	rb->batch = b;
+
+	return (PyObject *) rb;
+}
+
+static PyObject *htpy_exporter_get_batches(PyObject *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "flush", NULL };
+	htpy_exporter *exp = (htpy_exporter *) self;
+	htpy_batch *b, *next;
+	PyObject *list, *item;
+	int flush = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:htpy_exporter_get_batches", kwlist, &flush))
+		return NULL;
+
+	if (!exp->defs) {
+		PyErr_SetString(htpy_get_state()->error, "Exporter is not initialized.");
+		return NULL;
+	}
+
+	list = PyList_New(0);
+	if (!list)
+		return NULL;
+
+	pthread_mutex_lock(&exp->lock);
+	if (flush)
+		htpy_exporter_finish(exp);
+	b = exp->done;
+	exp->done = exp->done_tail = NULL;
+	pthread_mutex_unlock(&exp->lock);
+
+	for (; b; b = next) {
+		next = b->next;
+		b->next = NULL;
+		item = htpy_record_batch_wrap(b);
+		if (!item || PyList_Append(list, item) == -1) {
+			Py_XDECREF(item);
+			for (b = next; b; b = next) {
+				next = b->next;
+				htpy_batch_unref(b);
+			}
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+
+	return list;
+}
+
+static PyObject *htpy_exporter_get_pending(htpy_exporter *self, void *closure) {
+	size_t n;
+
+	pthread_mutex_lock(&self->lock);
+	n = self->current ? self->current->rows : 0;
+	pthread_mutex_unlock(&self->lock);
+
+	return PyLong_FromSize_t(n);
+}
+
+static PyMethodDef htpy_exporter_methods[] = {
+	{ "get_batches", (PyCFunction) htpy_exporter_get_batches, METH_VARARGS | METH_KEYWORDS,
+	  "Return the full record batches, and the one being filled if flush is true." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_exporter_members[] = {
+	{ "batch_size", T_PYSSIZET, offsetof(htpy_exporter, batch_size), READONLY, "Rows in each record batch" },
+	{ "rows", T_ULONG, offsetof(htpy_exporter, rows), READONLY, "Transactions exported" },
+	{ "dropped", T_ULONG, offsetof(htpy_exporter, dropped), READONLY, "Transactions which could not be exported" },
+	{ NULL }
+};
+
+static PyGetSetDef htpy_exporter_getseters[] = {
+	{ "pending", (getter) htpy_exporter_get_pending, NULL,
+	  "Rows in the record batch being filled", NULL },
+	{ NULL }
+};
+
+static PyTypeObject htpy_exporter_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.exporter",                 /* tp_name */
+	sizeof(htpy_exporter),           /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_exporter_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	0,                               /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"exporter object",               /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_exporter_methods,           /* tp_methods */
+	htpy_exporter_members,           /* tp_members */
+	htpy_exporter_getseters,         /* tp_getset */
+	0,                               /* tp_base */
+	0,                               /* tp_dict */
+	0,                               /* tp_descr_get */
+	0,                               /* tp_descr_set */
+	0,                               /* tp_dictoffset */
+	(initproc) htpy_exporter_init,   /* tp_init */
+	0,                               /* tp_alloc */
+	htpy_exporter_new,               /* tp_new */
+};
+
+/*
+ * Arrow C data interface. The schema and array structs handed out own
+ * everything they point to, apart from the column buffers, which they
+ * keep alive with a reference to the batch. The children are allocated
+ * with their parent and only freed along with it, as the spec allows a
+ * consumer to move a child out and release it on its own.
+ */
+static void htpy_arrow_child_schema_release(struct ArrowSchema *s) {
+	free((char *) s->name);
+	s->release = NULL;
+}
+
+static void htpy_arrow_schema_release(struct ArrowSchema *s) {
+	int64_t i;
+
+	for (i = 0; i < s->n_children; i++) {
+		if (s->children[i]->release)
+			s->children[i]->release(s->children[i]);
+	}
+	free(s->children);
+	free(s->private_data);
+	s->release = NULL;
+}
+
+static int htpy_arrow_schema_fill(struct ArrowSchema *s, htpy_batch *b) {
+	struct ArrowSchema *kids;
+	size_t i;
+
+	memset(s, 0, sizeof(*s));
+	kids = calloc(b->ncols ? b->ncols : 1, sizeof(struct ArrowSchema));
+	s->children = calloc(b->ncols ? b->ncols : 1, sizeof(struct ArrowSchema *));
+	if (!kids || !s->children) {
+		free(kids);
+		free(s->children);
+		return -1;
+	}
+
+	s->format = "+s";
+	s->name = "";
+	s->n_children = (int64_t) b->ncols;
+	s->private_data = kids;
+	s->release = htpy_arrow_schema_release;
+
+	for (i = 0; i < b->ncols; i++) {
+		kids[i].format = htpy_column_formats[b->cols[i].type];
+		kids[i].name = strdup(b->cols[i].name);
+		kids[i].flags = ARROW_FLAG_NULLABLE;
+		kids[i].release = htpy_arrow_child_schema_release;
+		s->children[i] = &kids[i];
+		if (!kids[i].name) {
+			s->n_children = (int64_t) i + 1;
+			s->release(s);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void htpy_arrow_child_array_release(struct ArrowArray *a) {
+	htpy_batch_unref((htpy_batch *) a->private_data);
+	free(a->buffers);
+	a->release = NULL;
+}
+
+static void htpy_arrow_array_release(struct ArrowArray *a) {
+	int64_t i;
+
+	for (i = 0; i < a->n_children; i++) {
+		if (a->children[i]->release)
+			a->children[i]->release(a->children[i]);
+	}
+	free(a->children);
+	free((void *) a->buffers);
+	htpy_batch_unref((htpy_batch *) ((void **) a->private_data)[0]);
+	free(a->private_data);
+	a->release = NULL;
+}
+
+static int htpy_arrow_array_fill(struct ArrowArray *a, htpy_batch *b) {
+	struct ArrowArray *kids;
+	htpy_export_column *c;
+	void **priv;
+	const void **bufs;
+	size_t i;
+
+	memset(a, 0, sizeof(*a));
+	/* The batch, then the children. */
+	priv = calloc(1, sizeof(void *) + (b->ncols ? b->ncols : 1) * sizeof(struct ArrowArray));
+	a->children = calloc(b->ncols ? b->ncols : 1, sizeof(struct ArrowArray *));
+	a->buffers = calloc(1, sizeof(void *));
+	if (!priv || !a->children || !a->buffers) {
+		free(priv);
+		free(a->children);
+		free((void *) a->buffers);
+		return -1;
+	}
+	kids = (struct ArrowArray *) (priv + 1);
+
+	htpy_batch_ref(b);
+	priv[0] = b;
+	a->length = (int64_t) b->rows;
+	a->n_buffers = 1;
+	a->n_children = 0;
+	a->private_data = priv;
+	a->release = htpy_arrow_array_release;
+
+	for (i = 0; i < b->ncols; i++) {
+		c = &b->cols[i];
+		bufs = calloc(3, sizeof(void *));
+		if (!bufs) {
+			a->release(a);
+			return -1;
+		}
+		bufs[0] = c->nulls ? c->validity : NULL;
+		if (c->type == HTPY_COLUMN_UTF8) {
+			bufs[1] = c->offsets;
+			bufs[2] = c->data;
+			kids[i].n_buffers = 3;
+		} else {
+			bufs[1] = c->data;
+			kids[i].n_buffers = 2;
+		}
+		htpy_batch_ref(b);
+		kids[i].length = (int64_t) b->rows;
+		kids[i].null_count = c->nulls;
+		kids[i].buffers = bufs;
+		kids[i].private_data = b;
+		kids[i].release = htpy_arrow_child_array_release;
+		a->children[i] = &kids[i];
+		a->n_children = (int64_t) i + 1;
+	}
+
+	return 0;
+}
+
+static void htpy_arrow_schema_capsule_free(PyObject *capsule) {
+	struct ArrowSchema *s = PyCapsule_GetPointer(capsule, "arrow_schema");
+
+	if (!s)
+		return;
+	if (s->release)
+		s->release(s);
+	free(s);
+}
+
+static void htpy_arrow_array_capsule_free(PyObject *capsule) {
+	struct ArrowArray *a = PyCapsule_GetPointer(capsule, "arrow_array");
+
+	if (!a)
+		return;
+	if (a->release)
+		a->release(a);
+	free(a);
+}
+
+static PyObject *htpy_record_batch_schema_capsule(htpy_batch *b) {
+	struct ArrowSchema *s;
+	PyObject *capsule;
+
+	s = malloc(sizeof(struct ArrowSchema));
+	if (!s || htpy_arrow_schema_fill(s, b) == -1) {
+		free(s);
+		return PyErr_NoMemory();
+	}
+
+	capsule = PyCapsule_New(s, "arrow_schema", htpy_arrow_schema_capsule_free);
+	if (!capsule) {
+		s->release(s);
+		free(s);
+	}
+
+	return capsule;
+}
+
+static PyObject *htpy_record_batch_arrow_c_schema(PyObject *self, PyObject *args) {
+	return htpy_record_batch_schema_capsule(((htpy_record_batch *) self)->batch);
+}
+
+/* The requested schema is ignored, the columns are only ever one type. */
+static PyObject *htpy_record_batch_arrow_c_array(PyObject *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "requested_schema", NULL };
+	htpy_batch *b = ((htpy_record_batch *) self)->batch;
+	PyObject *requested = NULL;
+	PyObject *schema, *array;
+	struct ArrowArray *a;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:__arrow_c_array__", kwlist, &requested))
+		return NULL;
+
+	schema = htpy_record_batch_schema_capsule(b);
+	if (!schema)
+		return NULL;
+
+	a = malloc(sizeof(struct ArrowArray));
+	if (!a || htpy_arrow_array_fill(a, b) == -1) {
+		free(a);
+		Py_DECREF(schema);
+		return PyErr_NoMemory();
+	}
+
+	array = PyCapsule_New(a, "arrow_array", htpy_arrow_array_capsule_free);
+	if (!array) {
+		a->release(a);
+		free(a);
+		Py_DECREF(schema);
+		return NULL;
+	}
+
+	return Py_BuildValue("(NN)", schema, array);
+}
+
+/* A string of a column as the same kind of string htpy gives elsewhere. */
+static PyObject *htpy_export_str(const unsigned char *data, size_t len) {
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_DecodeUTF8((const char *) data, (Py_ssize_t) len, NULL);
+#else
+	PyObject *u, *s;
+
+	u = PyUnicode_DecodeUTF8((const char *) data, (Py_ssize_t) len, NULL);
+	if (!u)
+		return NULL;
+	s = PyUnicode_AsLatin1String(u);
+	Py_DECREF(u);
+	return s;
+#endif
+}
+
+static PyObject *htpy_export_column_list(htpy_batch *b, htpy_export_column *c) {
+	PyObject *list, *item;
+	size_t row;
+
+	list = PyList_New((Py_ssize_t) b->rows);
+	if (!list)
+		return NULL;
+
+	for (row = 0; row < b->rows; row++) {
+		if (!(c->validity[row / 8] & (1 << (row % 8)))) {
+			Py_INCREF(Py_None);
+			item = Py_None;
+		} else if (c->type == HTPY_COLUMN_UTF8) {
+			item = htpy_export_str(c->data + c->offsets[row], (size_t) (c->offsets[row + 1] - c->offsets[row]));
+		} else if (c->type == HTPY_COLUMN_INT32) {
+			item = PyInt_FromLong(((int32_t *) c->data)[row]);
+		} else {
+			item = PyLong_FromLongLong(((int64_t *) c->data)[row]);
+		}
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, row, item);
+	}
+
+	return list;
+}
+
+static PyObject *htpy_record_batch_column(PyObject *self, PyObject *args) {
+	htpy_batch *b = ((htpy_record_batch *) self)->batch;
+	const char *name;
+	size_t i;
+
+	if (!PyArg_ParseTuple(args, "s:column", &name))
+		return NULL;
+
+	for (i = 0; i < b->ncols; i++) {
+		if (!strcmp(b->cols[i].name, name))
+			return htpy_export_column_list(b, &b->cols[i]);
+	}
+
+	PyErr_SetString(PyExc_KeyError, name);
+	return NULL;
+}
+
+static PyObject *htpy_record_batch_to_pydict(PyObject *self, PyObject *args) {
+	htpy_batch *b = ((htpy_record_batch *) self)->batch;
+	PyObject *dict, *list;
+	size_t i;
+
+	dict = PyDict_New();
+	if (!dict)
+		return NULL;
+
+	for (i = 0; i < b->ncols; i++) {
+		list = htpy_export_column_list(b, &b->cols[i]);
+		if (!list || PyDict_SetItemString(dict, b->cols[i].name, list) == -1) {
+			Py_XDECREF(list);
+			Py_DECREF(dict);
+			return NULL;
+		}
+		Py_DECREF(list);
+	}
+
+	return dict;
+}
+
+/*
+ * The fixed width columns as the records of a NumPy structured array: a
+ * list of (name, dtype) and a string of the records, in native byte
+ * order. Null times are NaT.
+ */
+static PyObject *htpy_record_batch_numpy_records(PyObject *self, PyObject *args) {
+	htpy_batch *b = ((htpy_record_batch *) self)->batch;
+	htpy_export_column *c;
+	PyObject *descr, *item, *records;
+	size_t i, row, width = 0, pos;
+	unsigned char *out;
+	int64_t nat = INT64_MIN;
+
+	descr = PyList_New(0);
+	if (!descr)
+		return NULL;
+
+	for (i = 0; i < b->ncols; i++) {
+		c = &b->cols[i];
+		if (c->type == HTPY_COLUMN_UTF8)
+			continue;
+		width += htpy_column_widths[c->type];
+		item = Py_BuildValue("(ss)", c->name, htpy_column_dtypes[c->type]);
+		if (!item || PyList_Append(descr, item) == -1) {
+			Py_XDECREF(item);
+			Py_DECREF(descr);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+
+	records = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) (width * b->rows));
+	if (!records) {
+		Py_DECREF(descr);
+		return NULL;
+	}
+	out = (unsigned char *) PyBytes_AS_STRING(records);
+
+	for (row = 0; row < b->rows; row++) {
+		for (i = 0, pos = 0; i < b->ncols; i++) {
+			c = &b->cols[i];
+			if (c->type == HTPY_COLUMN_UTF8)
+				continue;
+			if (c->type == HTPY_COLUMN_TIMESTAMP && !(c->validity[row / 8] & (1 << (row % 8))))
+				memcpy(out + pos, &nat, sizeof(nat));
+			else
+				memcpy(out + pos, c->data + row * htpy_column_widths[c->type], htpy_column_widths[c->type]);
+			pos += htpy_column_widths[c->type];
+		}
+		out += width;
+	}
+
+	return Py_BuildValue("(NN)", descr, records);
+}
+
+static void htpy_record_batch_dealloc(htpy_record_batch *self) {
+	if (self->batch)
+		htpy_batch_unref(self->batch);
+	HTPY_FREE(self);
+}
+
+static Py_ssize_t htpy_record_batch_length(htpy_record_batch *self) {
+	return (Py_ssize_t) self->batch->rows;
+}
+
+static PyObject *htpy_record_batch_get_num_rows(htpy_record_batch *self, void *closure) {
+	return PyLong_FromSize_t(self->batch->rows);
+}
+
+static PyObject *htpy_record_batch_get_schema(htpy_record_batch *self, void *closure) {
+	htpy_batch *b = self->batch;
+	PyObject *list, *item;
+	size_t i;
+
+	list = PyList_New((Py_ssize_t) b->ncols);
+	if (!list)
+		return NULL;
+
+	for (i = 0; i < b->ncols; i++) {
+		item = Py_BuildValue("(ss)", b->cols[i].name, htpy_column_formats[b->cols[i].type]);
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+
+	return list;
+}
+
+static PyMethodDef htpy_record_batch_methods[] = {
+	{ "__arrow_c_schema__", htpy_record_batch_arrow_c_schema, METH_NOARGS,
+	  "Return the schema as an Arrow PyCapsule." },
+	{ "__arrow_c_array__", (PyCFunction) htpy_record_batch_arrow_c_array, METH_VARARGS | METH_KEYWORDS,
+	  "Return the schema and the columns as Arrow PyCapsules." },
+	{ "column", htpy_record_batch_column, METH_VARARGS,
+	  "Return the values of a column as a list." },
+	{ "to_pydict", htpy_record_batch_to_pydict, METH_NOARGS,
+	  "Return a dictionary of each column name to its values." },
+	{ "numpy_records", htpy_record_batch_numpy_records, METH_NOARGS,
+	  "Return the dtype and records of the fixed width columns for a NumPy structured array." },
+	{ NULL }
+};
+
+static PyGetSetDef htpy_record_batch_getseters[] = {
+	{ "num_rows", (getter) htpy_record_batch_get_num_rows, NULL,
+	  "Rows in the record batch", NULL },
+	{ "schema", (getter) htpy_record_batch_get_schema, NULL,
+	  "List of the name and Arrow format of each column", NULL },
+	{ NULL }
+};
+
+static PySequenceMethods htpy_record_batch_as_sequence = {
+	(lenfunc) htpy_record_batch_length, /* sq_length */
+};
+
+static PyTypeObject htpy_record_batch_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.record_batch",             /* tp_name */
+	sizeof(htpy_record_batch),       /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_record_batch_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	&htpy_record_batch_as_sequence,  /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"record batch object",           /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_record_batch_methods,       /* tp_methods */
+	0,                               /* tp_members */
+	htpy_record_batch_getseters,     /* tp_getset */
+	0,                               /* tp_base */
+	0,                               /* tp_dict */
+	0,                               /* tp_descr_get */
+	0,                               /* tp_descr_set */
+	0,                               /* tp_dictoffset */
+	0,                               /* tp_init */
+	0,                               /* tp_alloc */
+	0,                               /* tp_new */
+};
+
+/*
+ * Callback handlers.
+ *
+ * Libhtp will call one of these callbacks. This callback will then get the
  * connp, convert it into a PyObject and pass that to the real callback.
  * It will then convert the returned PyObject to an int and pass that back to
  * libhtp.
  *
- * The callbacks that take a htp_tx_t are defined with CALLBACK_TX. The
- * log callback is not defined in a macro because there is only one of it's
- * type.
+ * The callbacks that take a htp_tx_t are defined with CALLBACK_TX. The
+ * log callback is not defined in a macro because there is only one of it's
+ * type.
+ *
+ * Parsing happens without the GIL held (and possibly on a pool worker
+ * thread) so every handler must acquire the GIL before touching any
+ * python objects and release it again before returning to libhtp. As the
+ * handlers are registered per config a connection parser may not have a
+ * python callback for a hook which fires, in which case the handler returns
+ * without ever taking the GIL.
+ *
+ * A callback can also be a capsule holding a C function, which is called
+ * straight from the handler without the GIL and without building any
+ * python objects. The capsule name says which kind of function it holds,
+ * and the capsule context is passed to it. Looking at the capsule does not
+ * touch its reference count, so the GIL is not needed for that either.
+ *
+ * XXX: Add support for removing callbacks?
+ */
+#define HTPY_TX_HANDLER "htpy.tx_handler"
+#define HTPY_DATA_HANDLER "htpy.data_handler"
+#define HTPY_FILE_HANDLER "htpy.file_handler"
+#define HTPY_LOG_HANDLER "htpy.log_handler"
+
+typedef int (*htpy_tx_handler)(htp_tx_t *tx, void *context);
+typedef int (*htpy_data_handler)(htp_tx_data_t *txd, void *context);
+typedef int (*htpy_file_handler)(htp_file_data_t *file_data, void *context);
+typedef int (*htpy_log_handler)(htp_log_t *log, void *context);
+
+#define HTPY_HANDLER(CB, NAME) \
+	PyCapsule_GetPointer((CB), (NAME))
+
+/*
+ * Call a python callback. With vectorcall the arguments are passed
+ * straight from the stack. Otherwise the argument tuple is kept in CACHE
+ * between calls and only its items are replaced, unless the callback held
+ * on to the tuple, in which case it is left to the callback and a new one
+ * is made next time. The cache is emptied while a call is in progress in
+ * case the callback manages to get back here. Items are cleared after the
+ * call so the cached tuple does not keep anything alive.
+ */
+static PyObject *htpy_call(PyObject **cache, PyObject *cb, PyObject **argv, Py_ssize_t n) {
+#if PY_VERSION_HEX >= 0x03090000
+	return PyObject_Vectorcall(cb, argv, n, NULL);
+#else
+	PyObject *args = *cache;
+	PyObject *res, *item;
+	Py_ssize_t i;
+
+	*cache = NULL;
+	if (!args || PyTuple_GET_SIZE(args) != n) {
+		Py_XDECREF(args);
+		args = PyTuple_New(n);
+		if (!args)
+			return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		Py_INCREF(argv[i]);
+		PyTuple_SET_ITEM(args, i, argv[i]);
+	}
+
+	res = PyObject_Call(cb, args, NULL);
+
+	if (Py_REFCNT(args) > 1 || *cache) {
+		Py_DECREF(args);
+		return res;
+	}
+
+	for (i = 0; i < n; i++) {
+		item = PyTuple_GET_ITEM(args, i);
+		PyTuple_SET_ITEM(args, i, NULL);
+		Py_DECREF(item);
+	}
+	*cache = args;
+
+	return res;
+#endif
+}
+
+#define CALLBACK(CB, STAGE) CALLBACK_FN(CB, htpy_##CB##_callback, STAGE)
+
+#define CALLBACK_FN(CB, FN, STAGE) \
+int FN(htp_tx_t *tx) { \
+	PyObject *obj = (PyObject *) htp_connp_get_user_data(tx->connp); \
+	PyObject *argv[3]; \
+	Py_ssize_t n = 0; \
+	PyObject *txobj = NULL; \
+	PyObject *cb; \
+	PyObject *res; \
+	PyThreadState *gstate; \
+	unsigned long long start; \
+	long i = HTP_ERROR; \
+	if (!obj) \
+		return HTP_OK; \
+	if (HTPY_EVENT_WANTED(obj, CB)) \
+		return htpy_filter_tx(obj, tx, HTPY_STAGE_##STAGE) ? htpy_event_push(obj, HTPY_HOOK_##CB, tx, NULL, 0) : HTP_OK; \
+	if (!(cb = HTPY_CALLBACK(obj, CB)) || !htpy_filter_tx(obj, tx, HTPY_STAGE_##STAGE)) \
+		return HTP_OK; \
+	start = htpy_hook_begin(obj); \
+	if (PyCapsule_CheckExact(cb)) { \
+		i = ((htpy_tx_handler) HTPY_HANDLER(cb, HTPY_TX_HANDLER))(tx, PyCapsule_GetContext(cb)); \
+		htpy_hook_end(obj, HTPY_HOOK_##CB, start); \
+		return((int) i); \
+	} \
+	gstate = htpy_gil_ensure(); \
+	cb = HTPY_CALLBACK(obj, CB); \
+	argv[n++] = obj; \
+	if (((htpy_config *) ((htpy_connp *) obj)->cfg)->pass_tx) { \
+		txobj = htpy_tx_get(obj, tx); \
+		if (!txobj) \
+			goto out; \
+		argv[n++] = txobj; \
+	} \
+	if (((htpy_connp *) obj)->obj_store) \
+		argv[n++] = ((htpy_connp *) obj)->obj_store; \
+	Py_INCREF(cb); \
+	res = htpy_call(&((htpy_connp *) obj)->args, cb, argv, n); \
+	Py_DECREF(cb); \
+	Py_XDECREF(txobj); \
+	if (PyErr_Occurred() != NULL) { \
+		PyErr_PrintEx(0); \
+		goto out; \
+	} \
+	i = PyInt_AsLong(res); \
+	Py_DECREF(res); \
+out: \
+	htpy_gil_release(gstate); \
+	htpy_hook_end(obj, HTPY_HOOK_##CB, start); \
+	return((int) i); \
+}
+
+CALLBACK(request_start, NONE)
+CALLBACK(request_line, REQUEST_LINE)
+CALLBACK(request_uri_normalize, REQUEST_LINE)
+CALLBACK(request_headers, REQUEST_HEADERS)
+CALLBACK(request_trailer, REQUEST_HEADERS)
+CALLBACK(request_complete, REQUEST_HEADERS)
+CALLBACK(response_start, REQUEST_HEADERS)
+CALLBACK(response_line, RESPONSE_LINE)
+CALLBACK(response_headers, RESPONSE_HEADERS)
+CALLBACK(response_trailer, RESPONSE_HEADERS)
+CALLBACK(response_complete, RESPONSE_HEADERS)
+CALLBACK_FN(transaction_complete, htpy_transaction_complete_python, RESPONSE_HEADERS)
+
+static void htpy_log_flush(PyObject *obj);
+
+int htpy_transaction_complete_callback(htp_tx_t *tx) {
+	PyObject *obj = (PyObject *) htp_connp_get_user_data(tx->connp);
+	int rc;
+
+	/* Batched log messages go before the transaction they belong to. */
+	if (obj)
+		htpy_log_flush(obj);
+
+	if (obj && ((htpy_connp *) obj)->stats)
+		((htpy_connp *) obj)->stats->transactions++;
+
+	if (obj && ((htpy_connp *) obj)->checkpoint)
+		htpy_checkpoint_tx_complete((htpy_connp *) obj, tx);
+
+	if (obj && ((htpy_config *) ((htpy_connp *) obj)->cfg)->exporter && htpy_filter_tx(obj, tx, HTPY_STAGE_RESPONSE_HEADERS))
+		htpy_export_tx((htpy_exporter *) ((htpy_config *) ((htpy_connp *) obj)->cfg)->exporter, tx);
+
+	rc = htpy_transaction_complete_python(tx);
+
+	/* libhtp destroys the transaction as soon as this returns HTP_OK. */
+	if (rc == HTP_OK && tx->connp->cfg->tx_auto_destroy) {
+		htpy_tx_detach(tx);
+	}
+
+	return rc;
+}
+
+/*
+ * Chunks.
+ *
+ * In zero copy mode data is passed to callbacks as a chunk object, which
+ * reads straight from the libhtp buffer while the callback runs. Indexing,
+ * slicing and tobytes() copy only what they return. A buffer exported
+ * through the buffer protocol may be kept after the callback returns, and
+ * there is no way to point it at other memory then, so the first export
+ * copies the data into memory the chunk owns and every export shares that
+ * copy. Once the callback returns a chunk with no exports left gives up
+ * the data and refuses any further access.
+ */
+typedef struct {
+	PyObject_HEAD
+	/* libhtp's buffer or the copy, NULL once released. */
+	const unsigned char *data;
+	unsigned char *copy;
+	Py_ssize_t len;
+	Py_ssize_t exports;
+} htpy_chunk;
+
+static PyTypeObject htpy_chunk_type;
+
+static void htpy_chunk_dealloc(htpy_chunk *self) {
+	PyMem_Free(self->copy);
+	HTPY_FREE(self);
+}
+
+static int htpy_chunk_valid(htpy_chunk *self) {
+	if (!self->data) {
+		PyErr_SetString(PyExc_ValueError, "Chunk is only valid during the callback.");
+		return 0;
+	}
+	return 1;
+}
+
+static Py_ssize_t htpy_chunk_length(htpy_chunk *self) {
+	return self->len;
+}
+
+static PyObject *htpy_chunk_subscript(htpy_chunk *self, PyObject *key) {
+	Py_ssize_t i, start, stop, step, n;
+	PyObject *ret;
+	char *p;
+
+	if (!htpy_chunk_valid(self))
+		return NULL;
+
+	if (PySlice_Check(key)) {
+#if PY_MAJOR_VERSION >= 3
+		if (PySlice_GetIndicesEx(key, self->len, &start, &stop, &step, &n) == -1)
+#else
+		if (PySlice_GetIndicesEx((PySliceObject *) key, self->len, &start, &stop, &step, &n) == -1)
+#endif
+			return NULL;
+		if (step == 1)
+			return PyBytes_FromStringAndSize((const char *) self->data + start, n);
+		ret = PyBytes_FromStringAndSize(NULL, n);
+		if (!ret)
+			return NULL;
+		p = PyBytes_AS_STRING(ret);
+		for (i = 0; i < n; i++, start += step)
+			p[i] = (char) self->data[start];
+		return ret;
+	}
+
+	i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+	if (i == -1 && PyErr_Occurred())
+		return NULL;
+	if (i < 0)
+		i += self->len;
+	if (i < 0 || i >= self->len) {
+		PyErr_SetString(PyExc_IndexError, "chunk index out of range");
+		return NULL;
+	}
+#if PY_MAJOR_VERSION >= 3
+	return PyInt_FromLong(self->data[i]);
+#else
+	return PyBytes_FromStringAndSize((const char *) self->data + i, 1);
+#endif
+}
+
+static PyObject *htpy_chunk_tobytes(htpy_chunk *self, PyObject *args) {
+	if (!htpy_chunk_valid(self))
+		return NULL;
+	return PyBytes_FromStringAndSize((const char *) self->data, self->len);
+}
+
+static int htpy_chunk_getbuffer(htpy_chunk *self, Py_buffer *view, int flags) {
+	if (!htpy_chunk_valid(self))
+		return -1;
+
+	if (!self->copy) {
+		self->copy = PyMem_Malloc(self->len ? self->len : 1);
+		if (!self->copy) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		memcpy(self->copy, self->data, self->len);
+		self->data = self->copy;
+	}
+
+	if (PyBuffer_FillInfo(view, (PyObject *) self, self->copy, self->len, 1, flags) == -1)
+		return -1;
+	self->exports++;
+	return 0;
+}
+
+static void htpy_chunk_releasebuffer(htpy_chunk *self, Py_buffer *view) {
+	self->exports--;
+}
+
+#if PY_MAJOR_VERSION < 3
+/*
+ * Callers of the old buffer interface only use the pointer until they
+ * return, so it can be libhtp's buffer.
+ */
+static Py_ssize_t htpy_chunk_getreadbuffer(htpy_chunk *self, Py_ssize_t segment, void **ptr) {
+	if (segment != 0) {
+		PyErr_SetString(PyExc_SystemError, "accessing non-existent chunk segment");
+		return -1;
+	}
+	if (!htpy_chunk_valid(self))
+		return -1;
+	*ptr = (void *) self->data;
+	return self->len;
+}
+
+static Py_ssize_t htpy_chunk_getsegcount(htpy_chunk *self, Py_ssize_t *lenp) {
+	if (lenp)
+		*lenp = self->len;
+	return 1;
+}
+#endif
+
+static PyObject *htpy_chunk_repr(htpy_chunk *self) {
+	return PyString_FromFormat("<htpy.chunk, %zd bytes%s>", self->len, self->data ? "" : ", released");
+}
+
+static PyMappingMethods htpy_chunk_as_mapping = {
+	(lenfunc) htpy_chunk_length,     /* mp_length */
+	(binaryfunc) htpy_chunk_subscript, /* mp_subscript */
+	0,                               /* mp_ass_subscript */
+};
+
+static PySequenceMethods htpy_chunk_as_sequence = {
+	(lenfunc) htpy_chunk_length,     /* sq_length */
+};
+
+static PyBufferProcs htpy_chunk_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	(readbufferproc) htpy_chunk_getreadbuffer, /* bf_getreadbuffer */
+	0,                               /* bf_getwritebuffer */
+	(segcountproc) htpy_chunk_getsegcount, /* bf_getsegcount */
+	(charbufferproc) htpy_chunk_getreadbuffer, /* bf_getcharbuffer */
+#endif
+	(getbufferproc) htpy_chunk_getbuffer, /* bf_getbuffer */
+	(releasebufferproc) htpy_chunk_releasebuffer, /* bf_releasebuffer */
+};
+
+static PyMethodDef htpy_chunk_methods[] = {
+	{ "tobytes", (PyCFunction) htpy_chunk_tobytes, METH_NOARGS,
+	  "Return a copy of the data." },
+#if PY_MAJOR_VERSION >= 3
+	{ "__bytes__", (PyCFunction) htpy_chunk_tobytes, METH_NOARGS,
+	  "Return a copy of the data." },
+#endif
+	{ NULL }
+};
+
+static PyTypeObject htpy_chunk_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.chunk",                    /* tp_name */
+	sizeof(htpy_chunk),              /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_chunk_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	(reprfunc) htpy_chunk_repr,      /* tp_repr */
+	0,                               /* tp_as_number */
+	&htpy_chunk_as_sequence,         /* tp_as_sequence */
+	&htpy_chunk_as_mapping,          /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	&htpy_chunk_as_buffer,           /* tp_as_buffer */
+#if PY_MAJOR_VERSION >= 3
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+#else
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+#endif
+	"chunk of data passed to a callback", /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_chunk_methods,              /* tp_methods */
+};
+
+/*
+ * Build the object used to pass a chunk of data to a callback. Normally
+ * this is a copy of the data in a string, in zero copy mode it is a chunk
+ * over the libhtp buffer. htpy_chunk_release() must be called on the
+ * result once the callback is done with it.
+ */
+static PyObject *htpy_chunk_new(const unsigned char *data, size_t len, int zero_copy) {
+	htpy_chunk *chunk;
+
+	if (!data)
+		Py_RETURN_NONE;
+
+	if (!zero_copy)
+		return PyBytes_FromStringAndSize((const char *) data, (Py_ssize_t) len);
+
+	chunk = PyObject_New(htpy_chunk, htpy_get_state()->chunk_type);
+	if (!chunk)
+		return NULL;
+	chunk->data = data;
+	chunk->copy = NULL;
+	chunk->len = (Py_ssize_t) len;
+	chunk->exports = 0;
+
+	return (PyObject *) chunk;
+}
+
+static void htpy_chunk_release(PyObject *chunk) {
+	PyObject *type, *value, *tb;
+	htpy_chunk *c;
+
+	/* Keep the exception of the callback, if any, while letting go. */
+	PyErr_Fetch(&type, &value, &tb);
+	if (Py_TYPE(chunk) == htpy_get_state()->chunk_type) {
+		c = (htpy_chunk *) chunk;
+		/* Exported buffers still use the copy. */
+		if (!c->exports) {
+			PyMem_Free(c->copy);
+			c->copy = NULL;
+			c->data = NULL;
+		}
+	}
+	Py_DECREF(chunk);
+	PyErr_Restore(type, value, tb);
+}
+
+/* These callbacks take a htp_tx_data_t pointer. */
+#define CALLBACK_TX(CB, STAGE) \
+int htpy_##CB##_callback(htp_tx_data_t *txd) { \
+	PyObject *obj = (PyObject *) htp_connp_get_user_data(txd->tx->connp); \
+	PyObject *argv[4]; \
+	Py_ssize_t n = 0; \
+	PyObject *chunk; \
+	PyObject *len; \
+	PyObject *txobj = NULL; \
+	PyObject *cb; \
+	PyObject *res; \
+	PyThreadState *gstate; \
+	unsigned long long start; \
+	long i = HTP_ERROR; \
+	if (!obj) \
+		return HTP_OK; \
+	if (HTPY_EVENT_WANTED(obj, CB)) \
+		return htpy_filter_tx(obj, txd->tx, HTPY_STAGE_##STAGE) ? htpy_event_push(obj, HTPY_HOOK_##CB, txd->tx, txd->data, txd->data ? txd->len : 0) : HTP_OK; \
+	if (!(cb = HTPY_CALLBACK(obj, CB)) || !htpy_filter_tx(obj, txd->tx, HTPY_STAGE_##STAGE)) \
+		return HTP_OK; \
+	start = htpy_hook_begin(obj); \
+	if (PyCapsule_CheckExact(cb)) { \
+		i = ((htpy_data_handler) HTPY_HANDLER(cb, HTPY_DATA_HANDLER))(txd, PyCapsule_GetContext(cb)); \
+		htpy_hook_end(obj, HTPY_HOOK_##CB, start); \
+		return((int) i); \
+	} \
+	gstate = htpy_gil_ensure(); \
+	cb = HTPY_CALLBACK(obj, CB); \
+	if (((htpy_config *) ((htpy_connp *) obj)->cfg)->pass_tx) { \
+		txobj = htpy_tx_get(obj, txd->tx); \
+		if (!txobj) \
+			goto out; \
+	} \
+	chunk = htpy_chunk_new(txd->data, txd->len, ((htpy_config *) ((htpy_connp *) obj)->cfg)->zero_copy); \
+	if (!chunk) { \
+		Py_XDECREF(txobj); \
+		goto out; \
+	} \
+	len = PyInt_FromSize_t(txd->len); \
+	if (!len) { \
+		htpy_chunk_release(chunk); \
+		Py_XDECREF(txobj); \
+		goto out; \
+	} \
+	argv[n++] = chunk; \
+	argv[n++] = len; \
+	if (txobj) \
+		argv[n++] = txobj; \
+	if (((htpy_connp *) obj)->obj_store) \
+		argv[n++] = ((htpy_connp *) obj)->obj_store; \
+	Py_INCREF(cb); \
+	res = htpy_call(&((htpy_connp *) obj)->data_args, cb, argv, n); \
+	Py_DECREF(cb); \
+	Py_DECREF(len); \
+	Py_XDECREF(txobj); \
+	htpy_chunk_release(chunk); \
+	if (!res) { \
+		PyErr_PrintEx(0); \
+		goto out; \
+	} \
+	i = PyInt_AsLong(res); \
+	Py_DECREF(res); \
+out: \
+	htpy_gil_release(gstate); \
+	htpy_hook_end(obj, HTPY_HOOK_##CB, start); \
+	return((int) i); \
+}
+
+CALLBACK_TX(request_header_data, REQUEST_LINE)
+CALLBACK_TX(request_body_data, REQUEST_HEADERS)
+CALLBACK_TX(request_trailer_data, REQUEST_HEADERS)
+CALLBACK_TX(response_header_data, RESPONSE_LINE)
+CALLBACK_TX(response_body_data, RESPONSE_HEADERS)
+CALLBACK_TX(response_trailer_data, RESPONSE_HEADERS)
+
+/* Another special case callback. This one takes a htp_file_data_t pointer. */
+/*
+ * File objects.
+ *
+ * Request file data callbacks are passed one object per file which is
+ * reused for every chunk of that file, rather than a new dictionary for
+ * each chunk. For compatibility it can still be used like the dictionary
+ * it replaced, with "data", "filename" and "tmpname" keys.
+ */
+typedef struct {
+	PyObject_HEAD
+	/* The libhtp file, only used to recognise the next chunk of it. */
+	htp_file_t *file;
+	PyObject *data;
+	PyObject *filename;
+	PyObject *tmpname;
+	PY_LONG_LONG size;
+	long limit;
+	int done;
+} htpy_file;
+
+static PyTypeObject htpy_file_type;
+
+static void htpy_file_dealloc(htpy_file *self) {
+	Py_XDECREF(self->data);
+	Py_XDECREF(self->filename);
+	Py_XDECREF(self->tmpname);
+	HTPY_FREE(self);
+}
+
+/* Update the file object of a connection parser for the next chunk. */
+static htpy_file *htpy_file_update(htpy_connp *obj, htp_file_data_t *file_data) {
+	htpy_file *f = (htpy_file *) obj->file;
+
+	if (!f || f->file != file_data->file) {
+		f = PyObject_New(htpy_file, htpy_get_state()->file_type);
+		if (!f)
+			return NULL;
+		f->file = file_data->file;
+		f->data = NULL;
+		f->filename = NULL;
+		f->tmpname = NULL;
+		f->size = 0;
+		f->limit = ((htpy_config *) obj->cfg)->extract_request_file_size_limit;
+		f->done = 0;
+		Py_XDECREF(obj->file);
+		obj->file = (PyObject *) f;
+	}
+
+	if (!f->filename && file_data->file->filename) {
+		f->filename = htpy_str(bstr_ptr(file_data->file->filename), bstr_len(file_data->file->filename));
+		if (!f->filename)
+			return NULL;
+	}
+
+	if (!f->tmpname && file_data->file->tmpname) {
+		f->tmpname = PyString_FromString(file_data->file->tmpname);
+		if (!f->tmpname)
+			return NULL;
+	}
+
+	f->data = htpy_chunk_new(file_data->data, file_data->len, ((htpy_config *) obj->cfg)->zero_copy);
+	if (!f->data)
+		return NULL;
+	f->size = file_data->file->len;
+	f->done = file_data->data == NULL;
+
+	return f;
+}
+
+static PyObject *htpy_file_key(htpy_file *self, const char *key) {
+	if (!strcmp(key, "data"))
+		return self->data;
+	if (!strcmp(key, "filename"))
+		return self->filename;
+	if (!strcmp(key, "tmpname"))
+		return self->tmpname;
+	return NULL;
+}
+
+static PyObject *htpy_file_subscript(htpy_file *self, PyObject *key) {
+	PyObject *val = NULL;
+
+	if (PyString_Check(key))
+		val = htpy_file_key(self, PyString_AS_STRING(key));
+	if (!val) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	Py_INCREF(val);
+	return val;
+}
+
+static int htpy_file_contains(htpy_file *self, PyObject *key) {
+	return PyString_Check(key) && htpy_file_key(self, PyString_AS_STRING(key)) != NULL;
+}
+
+static PyObject *htpy_file_get(htpy_file *self, PyObject *args) {
+	PyObject *key, *def = Py_None, *val = NULL;
+
+	if (!PyArg_ParseTuple(args, "O|O:get", &key, &def))
+		return NULL;
+
+	if (PyString_Check(key))
+		val = htpy_file_key(self, PyString_AS_STRING(key));
+	if (!val)
+		val = def;
+
+	Py_INCREF(val);
+	return val;
+}
+
+static PyObject *htpy_file_keys(htpy_file *self, PyObject *args) {
+	static const char *keys[] = { "data", "filename", "tmpname" };
+	PyObject *list, *key;
+	size_t i;
+
+	list = PyList_New(0);
+	if (!list)
+		return NULL;
+
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		if (!htpy_file_key(self, keys[i]))
+			continue;
+		key = PyString_FromString(keys[i]);
+		if (!key || PyList_Append(list, key) == -1) {
+			Py_XDECREF(key);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(key);
+	}
+
+	return list;
+}
+
+#define FILE_GET(ATTR) \
+static PyObject *htpy_file_get_##ATTR(htpy_file *self, void *closure) { \
+	if (!self->ATTR) \
+		Py_RETURN_NONE; \
+	Py_INCREF(self->ATTR); \
+	return self->ATTR; \
+}
+
+FILE_GET(data)
+FILE_GET(filename)
+FILE_GET(tmpname)
+
+static PyObject *htpy_file_get_size(htpy_file *self, void *closure) {
+	return PyLong_FromLongLong(self->size);
+}
+
+static PyObject *htpy_file_get_truncated(htpy_file *self, void *closure) {
+	return PyBool_FromLong(self->tmpname && self->limit && self->size > self->limit);
+}
+
+static PyObject *htpy_file_get_done(htpy_file *self, void *closure) {
+	return PyBool_FromLong(self->done);
+}
+
+static PyObject *htpy_file_repr(htpy_file *self) {
+	PyObject *name, *ret;
+
+	name = PyObject_Repr(self->filename ? self->filename : Py_None);
+	if (!name)
+		return NULL;
+
+	ret = PyString_FromFormat("<htpy.file %s, %lld bytes>", PyString_AS_STRING(name), self->size);
+	Py_DECREF(name);
+	return ret;
+}
+
+static PyMappingMethods htpy_file_as_mapping = {
+	0,                               /* mp_length */
+	(binaryfunc) htpy_file_subscript, /* mp_subscript */
+	0,                               /* mp_ass_subscript */
+};
+
+static PySequenceMethods htpy_file_as_sequence = {
+	0,                               /* sq_length */
+	0,                               /* sq_concat */
+	0,                               /* sq_repeat */
+	0,                               /* sq_item */
+	0,                               /* sq_slice */
+	0,                               /* sq_ass_item */
+	0,                               /* sq_ass_slice */
+	(objobjproc) htpy_file_contains, /* sq_contains */
+};
+
+static PyMethodDef htpy_file_methods[] = {
+	{ "get", (PyCFunction) htpy_file_get, METH_VARARGS,
+	  "Return the value of a key, or a default if it is not there." },
+	{ "keys", (PyCFunction) htpy_file_keys, METH_NOARGS,
+	  "Return the keys which are present." },
+	{ NULL }
+};
+
+static PyGetSetDef htpy_file_getseters[] = {
+    {"data", (getter) htpy_file_get_data, NULL,
+     "The current chunk of the file, None at the end", NULL},
+    {"filename", (getter) htpy_file_get_filename, NULL,
+     "File name given by the client", NULL},
+    {"tmpname", (getter) htpy_file_get_tmpname, NULL,
+     "Name of the file the data is extracted to", NULL},
+    {"size", (getter) htpy_file_get_size, NULL,
+     "Number of bytes of the file seen so far", NULL},
+    {"truncated", (getter) htpy_file_get_truncated, NULL,
+     "True if the extracted file was cut at the size limit", NULL},
+    {"done", (getter) htpy_file_get_done, NULL,
+     "True for the last call for the file", NULL},
+    {NULL}
+};
+
+static PyTypeObject htpy_file_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.file",                     /* tp_name */
+	sizeof(htpy_file),               /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_file_dealloc,  /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	(reprfunc) htpy_file_repr,       /* tp_repr */
+	0,                               /* tp_as_number */
+	&htpy_file_as_sequence,          /* tp_as_sequence */
+	&htpy_file_as_mapping,           /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"request file object",           /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_file_methods,               /* tp_methods */
+	0,                               /* tp_members */
+	htpy_file_getseters,             /* tp_getset */
+};
+
+/*
+ * Stop writing an extracted file once it reaches the size limit. This
+ * runs before libhtp writes the chunk, so the part of it which still fits
+ * is written here and the file closed so libhtp does not write the rest.
+ */
+static int htpy_extract_file_data(htp_file_data_t *file_data) {
+	htpy_connp *obj = (htpy_connp *) htpy_current_connp;
+	htp_file_t *file = file_data->file;
+	long limit;
+	int64_t before;
+	size_t len;
+	ssize_t n;
+
+	if (!obj || file->fd == -1 || !file_data->data)
+		return HTP_OK;
+
+	limit = ((htpy_config *) obj->cfg)->extract_request_file_size_limit;
+	if (!limit || file->len <= limit)
+		return HTP_OK;
+
+	before = file->len - file_data->len;
+	if (before < limit) {
+		len = limit - before;
+		while (len) {
+			n = write(file->fd, file_data->data + (limit - before - len), len);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			len -= n;
+		}
+	}
+
+	close(file->fd);
+	file->fd = -1;
+
+	return HTP_OK;
+}
+
+int htpy_request_file_data_callback(htp_file_data_t *file_data) {
+	PyObject *obj = htpy_current_connp;
+	long i = HTP_ERROR;
+	PyObject *res;
+	PyObject *cb;
+	PyObject *argv[1];
+	htpy_file *file;
+	htp_tx_t *tx;
+	PyThreadState *gstate;
+	unsigned long long start;
+
+	if (!obj || !(cb = HTPY_CALLBACK(obj, request_file_data)))
+		return HTP_OK;
+
+	/* File data always belongs to the request being parsed. */
+	tx = ((htpy_connp *) obj)->connp->in_tx;
+	if (tx && !htpy_filter_tx(obj, tx, HTPY_STAGE_REQUEST_HEADERS))
+		return HTP_OK;
+
+	start = htpy_hook_begin(obj);
+	if (PyCapsule_CheckExact(cb)) {
+		i = ((htpy_file_handler) HTPY_HANDLER(cb, HTPY_FILE_HANDLER))(file_data, PyCapsule_GetContext(cb));
+		htpy_hook_end(obj, HTPY_HOOK_request_file_data, start);
+		return((int) i);
+	}
+
+	gstate = htpy_gil_ensure();
+	cb = HTPY_CALLBACK(obj, request_file_data);
+
+	file = htpy_file_update((htpy_connp *) obj, file_data);
+	if (!file) {
+		PyErr_PrintEx(0);
+		goto out;
+	}
+	Py_INCREF(file);
+	argv[0] = (PyObject *) file;
+
+	Py_INCREF(cb);
+	res = htpy_call(&((htpy_connp *) obj)->file_args, cb, argv, 1);
+	Py_DECREF(cb);
+
+	/* The chunk is only valid during the call. */
+	htpy_chunk_release(file->data);
+	file->data = NULL;
+	if (file->done && ((htpy_connp *) obj)->file == (PyObject *) file)
+		Py_CLEAR(((htpy_connp *) obj)->file);
+	Py_DECREF(file);
+
+	if (!res) {
+		PyErr_PrintEx(0);
+		goto out;
+	}
+	i = PyInt_AsLong(res);
+	Py_DECREF(res);
+out:
+	htpy_gil_release(gstate);
+	htpy_hook_end(obj, HTPY_HOOK_request_file_data, start);
+	return((int) i);
+}
+
+int htpy_log_callback(htp_log_t *log) {
+	PyObject *obj = (PyObject *) htp_connp_get_user_data(log->connp);
+	PyObject *argv[4];
+	Py_ssize_t n = 0;
+	PyObject *msg, *level;
+	PyObject *res;
+	PyObject *cb;
+	htpy_config *cfg;
+	PyThreadState *gstate;
+	unsigned long long start;
+	long i = HTP_ERROR;
+
+	if (!obj || !(cb = HTPY_CALLBACK(obj, log)))
+		return HTP_OK;
+
+	cfg = (htpy_config *) ((htpy_connp *) obj)->cfg;
+	if (!cfg->log_batch)
+		((htpy_connp *) obj)->log_next = htp_list_size(log->connp->conn->messages);
+
+	if ((int) log->level > cfg->log_callback_level) {
+		((htpy_connp *) obj)->log_suppressed++;
+		return HTP_OK;
+	}
+
+	/* libhtp keeps the message, htpy_log_flush() picks it up from there. */
+	if (cfg->log_batch)
+		return HTP_OK;
+
+	((htpy_connp *) obj)->log_delivered++;
+
+	start = htpy_hook_begin(obj);
+	if (PyCapsule_CheckExact(cb)) {
+		i = ((htpy_log_handler) HTPY_HANDLER(cb, HTPY_LOG_HANDLER))(log, PyCapsule_GetContext(cb));
+		htpy_hook_end(obj, HTPY_HOOK_log, start);
+		return((int) i);
+	}
+
+	gstate = htpy_gil_ensure();
+	cb = HTPY_CALLBACK(obj, log);
+
+	msg = htpy_str(log->msg, strlen(log->msg));
+	level = PyInt_FromLong(log->level);
+	if (!msg || !level) {
+		Py_XDECREF(msg);
+		Py_XDECREF(level);
+		goto out;
+	}
+	argv[n++] = obj;
+	argv[n++] = msg;
+	argv[n++] = level;
+	if (((htpy_connp *) obj)->obj_store)
+		argv[n++] = ((htpy_connp *) obj)->obj_store;
+
+	Py_INCREF(cb);
+	res = htpy_call(&((htpy_connp *) obj)->log_args, cb, argv, n);
+	Py_DECREF(cb);
+	Py_DECREF(msg);
+	Py_DECREF(level);
+	if (PyErr_Occurred() != NULL) {
+		PyErr_PrintEx(0);
+		goto out;
+	}
+	i = PyInt_AsLong(res);
+	Py_DECREF(res);
+out:
+	htpy_gil_release(gstate);
+	htpy_hook_end(obj, HTPY_HOOK_log, start);
+	return((int) i);
+}
+
+/*
+ * In batch mode, pass the log messages kept since the last batch to the
+ * log callback as one list of (msg, level) tuples, along with the level of
+ * the most severe of them. C handlers are still called once per message.
+ * Called with the parser locked, with or without the GIL.
+ */
+static void htpy_log_flush(PyObject *obj) {
+	htpy_connp *cp = (htpy_connp *) obj;
+	htpy_config *cfg = (htpy_config *) cp->cfg;
+	htp_list_t *messages = cp->connp->conn->messages;
+	size_t i = cp->log_next;
+	size_t count = htp_list_size(messages);
+	PyObject *argv[4];
+	Py_ssize_t n = 0;
+	PyObject *list, *item, *level;
+	PyObject *res;
+	PyObject *cb;
+	PyObject *prev;
+	htp_log_t *log;
+	PyThreadState *gstate;
+	unsigned long long start;
+	int most = HTP_LOG_DEBUG2;
+
+	cp->log_next = count;
+	if (!cfg->log_batch || i >= count || !(cb = HTPY_CALLBACK(obj, log)))
+		return;
+
+	start = htpy_hook_begin(obj);
+	if (PyCapsule_CheckExact(cb)) {
+		for (; i < count; i++) {
+			log = htp_list_get(messages, i);
+			if ((int) log->level > cfg->log_callback_level)
+				continue;
+			cp->log_delivered++;
+			((htpy_log_handler) HTPY_HANDLER(cb, HTPY_LOG_HANDLER))(log, PyCapsule_GetContext(cb));
+		}
+		htpy_hook_end(obj, HTPY_HOOK_log, start);
+		return;
+	}
+
+	gstate = htpy_gil_ensure();
+	cb = HTPY_CALLBACK(obj, log);
+
+	list = PyList_New(0);
+	if (!list)
+		goto out;
+	for (; i < count; i++) {
+		log = htp_list_get(messages, i);
+		if ((int) log->level > cfg->log_callback_level)
+			continue;
+		item = Py_BuildValue("(Ni)", htpy_str(log->msg, strlen(log->msg)), log->level);
+		if (!item || PyList_Append(list, item) == -1) {
+			Py_XDECREF(item);
+			Py_DECREF(list);
+			goto out;
+		}
+		Py_DECREF(item);
+		if ((int) log->level < most)
+			most = log->level;
+	}
+
+	if (PyList_GET_SIZE(list) == 0 || !(level = PyInt_FromLong(most))) {
+		Py_DECREF(list);
+		goto out;
+	}
+	argv[n++] = obj;
+	argv[n++] = list;
+	argv[n++] = level;
+	if (cp->obj_store)
+		argv[n++] = cp->obj_store;
+
+	cp->log_delivered += PyList_GET_SIZE(list);
+	cp->log_batches++;
+
+	/* The lock is held, so let the callback use the getters. */
+	prev = htpy_current_connp;
+	htpy_current_connp = obj;
+	Py_INCREF(cb);
+	res = htpy_call(&cp->log_args, cb, argv, n);
+	Py_DECREF(cb);
+	htpy_current_connp = prev;
+	Py_DECREF(list);
+	Py_DECREF(level);
+	Py_XDECREF(res);
+out:
+	if (PyErr_Occurred() != NULL)
+		PyErr_PrintEx(0);
+	htpy_gil_release(gstate);
+	htpy_hook_end(obj, HTPY_HOOK_log, start);
+}
+
+/*
+ * Registering callbacks...
+ *
+ * HOOK_ONCE registers the C handler for a hook with libhtp the first time
+ * it is needed for a config. Registering it again would make libhtp call
+ * it once per registration.
+ */
+#define HOOK_ONCE(CFG, CB) \
+	if (!((CFG)->hooks & (1U << HTPY_HOOK_##CB))) { \
+		htp_config_register_##CB((CFG)->cfg, htpy_##CB##_callback); \
+		(CFG)->hooks |= 1U << HTPY_HOOK_##CB; \
+	}
+
+/*
+ * A callback is either a python callable or a capsule holding the C
+ * handler for the kind of hook it is registered on.
+ */
+static int htpy_check_callback(PyObject *cb, const char *handler) {
+	if (PyCapsule_CheckExact(cb)) {
+		if (!PyCapsule_IsValid(cb, handler)) {
+			PyErr_Format(PyExc_TypeError, "capsule must be a %s", handler);
+			return 0;
+		}
+		return 1;
+	}
+
+	if (!PyCallable_Check(cb)) {
+		PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+		return 0;
+	}
+
+	return 1;
+}
+
+#define REGISTER_CALLBACK(CB, KIND) \
+static PyObject *htpy_connp_register_##CB(PyObject *self, PyObject *args) { \
+	PyObject *res = NULL; \
+	PyObject *temp; \
+	if (PyArg_ParseTuple(args, "O:htpy_connp_register_##CB", &temp)) { \
+		if (!htpy_check_callback(temp, HTPY_##KIND##_HANDLER)) \
+			return NULL; \
+		Py_XINCREF(temp); \
+		Py_XDECREF(((htpy_connp *) self)->CB##_callback); \
+		((htpy_connp *) self)->CB##_callback = temp; \
+		HOOK_ONCE((htpy_config *) ((htpy_connp *) self)->cfg, CB); \
+		Py_INCREF(Py_None); \
+		res = Py_None; \
+	} \
+	return res; \
+} \
+static PyObject *htpy_config_register_##CB(PyObject *self, PyObject *args) { \
+	PyObject *res = NULL; \
+	PyObject *temp; \
+	if (PyArg_ParseTuple(args, "O:htpy_config_register_##CB", &temp)) { \
+		if (!htpy_check_callback(temp, HTPY_##KIND##_HANDLER)) \
+			return NULL; \
+		Py_XINCREF(temp); \
+		Py_XDECREF(((htpy_config *) self)->CB##_callback); \
+		((htpy_config *) self)->CB##_callback = temp; \
+		HOOK_ONCE((htpy_config *) self, CB); \
+		Py_INCREF(Py_None); \
+		res = Py_None; \
+	} \
+	return res; \
+}
+
+REGISTER_CALLBACK(request_start, TX)
+REGISTER_CALLBACK(request_line, TX)
+REGISTER_CALLBACK(request_uri_normalize, TX)
+REGISTER_CALLBACK(request_headers, TX)
+REGISTER_CALLBACK(request_header_data, DATA)
+REGISTER_CALLBACK(request_body_data, DATA)
+REGISTER_CALLBACK(request_trailer, TX)
+REGISTER_CALLBACK(request_trailer_data, DATA)
+REGISTER_CALLBACK(request_complete, TX)
+REGISTER_CALLBACK(response_start, TX)
+REGISTER_CALLBACK(response_line, TX)
+REGISTER_CALLBACK(response_headers, TX)
+REGISTER_CALLBACK(response_header_data, DATA)
+REGISTER_CALLBACK(response_body_data, DATA)
+REGISTER_CALLBACK(response_trailer, TX)
+REGISTER_CALLBACK(response_trailer_data, DATA)
+REGISTER_CALLBACK(response_complete, TX)
+REGISTER_CALLBACK(transaction_complete, TX)
+REGISTER_CALLBACK(log, LOG)
+
+/* Make sure libhtp calls the handler of every hook queued as an event. */
+#define HOOK_EVENT(CFG, CB) \
+	if ((CFG)->events & (1U << HTPY_HOOK_##CB)) \
+		HOOK_ONCE(CFG, CB)
+
+static void htpy_config_hook_events(htpy_config *self) {
+	HOOK_EVENT(self, request_start);
+	HOOK_EVENT(self, request_line);
+	HOOK_EVENT(self, request_uri_normalize);
+	HOOK_EVENT(self, request_headers);
+	HOOK_EVENT(self, request_header_data);
+	HOOK_EVENT(self, request_body_data);
+	HOOK_EVENT(self, request_trailer);
+	HOOK_EVENT(self, request_trailer_data);
+	HOOK_EVENT(self, request_complete);
+	HOOK_EVENT(self, response_start);
+	HOOK_EVENT(self, response_line);
+	HOOK_EVENT(self, response_headers);
+	HOOK_EVENT(self, response_header_data);
+	HOOK_EVENT(self, response_body_data);
+	HOOK_EVENT(self, response_trailer);
+	HOOK_EVENT(self, response_trailer_data);
+	HOOK_EVENT(self, response_complete);
+	HOOK_EVENT(self, transaction_complete);
+}
+
+/*
+ * The file data hook also needs the multipart parser, which is itself a
+ * hook and so is only registered once as well.
+ */
+static void htpy_config_hook_multipart(htpy_config *cfg) {
+	if (!(cfg->hooks & (1U << HTPY_HOOK_multipart_parser))) {
+		htp_config_register_multipart_parser(cfg->cfg);
+		cfg->hooks |= 1U << HTPY_HOOK_multipart_parser;
+	}
+}
+
+static void htpy_config_hook_request_file_data(htpy_config *cfg, int extract) {
+	if (extract)
+		cfg->cfg->extract_request_files = 1;
+
+	htpy_config_hook_multipart(cfg);
+	HOOK_ONCE(cfg, request_file_data);
+}
+
+static PyObject *htpy_connp_register_request_file_data(PyObject *self, PyObject *args) {
+	PyObject *res = NULL;
+	PyObject *temp;
+	int extract = 0;
+	if (PyArg_ParseTuple(args, "O|i:htpy_connp_register_request_file_data", &temp, &extract)) {
+		if (!htpy_check_callback(temp, HTPY_FILE_HANDLER))
+			return NULL;
+
+		Py_XINCREF(temp);
+		Py_XDECREF(((htpy_connp *) self)->request_file_data_callback);
+
+		((htpy_connp *) self)->request_file_data_callback = temp;
+
+		htpy_config_hook_request_file_data((htpy_config *) ((htpy_connp *) self)->cfg, extract);
+
+		Py_INCREF(Py_None);
+		res = Py_None;
+	}
+	return res;
+}
+
+static PyObject *htpy_config_register_request_file_data(PyObject *self, PyObject *args) {
+	PyObject *res = NULL;
+	PyObject *temp;
+	int extract = 0;
+	if (PyArg_ParseTuple(args, "O|i:htpy_config_register_request_file_data", &temp, &extract)) {
+		if (!htpy_check_callback(temp, HTPY_FILE_HANDLER))
+			return NULL;
+
+		Py_XINCREF(temp);
+		Py_XDECREF(((htpy_config *) self)->request_file_data_callback);
+
+		((htpy_config *) self)->request_file_data_callback = temp;
+
+		htpy_config_hook_request_file_data((htpy_config *) self, extract);
+
+		Py_INCREF(Py_None);
+		res = Py_None;
+	}
+	return res;
+}
+
+/* The stats of parsers made with this config which have been reset or destroyed. */
+static PyObject *htpy_config_get_parser_stats(PyObject *self, PyObject *args) {
+	return htpy_stats_dict(((htpy_config *) self)->stats_total);
+}
+
+static PyObject *htpy_config_clear_stats(PyObject *self, PyObject *args) {
+	htpy_config *cfg = (htpy_config *) self;
+
+	if (cfg->stats_total)
+		memset(cfg->stats_total, 0, sizeof(htpy_stats));
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef htpy_config_methods[] = {
+	{ "register_request_start", htpy_config_register_request_start,
+	  METH_VARARGS, "Register a hook for start of a request." },
+	{ "register_request_line", htpy_config_register_request_line, METH_VARARGS,
+	  "Register a hook for right after request line has been parsed." },
+	{ "register_request_uri_normalize",
+	  htpy_config_register_request_uri_normalize, METH_VARARGS,
+	  "Register a hook for right before the URI is normalized." },
+	{ "register_request_headers", htpy_config_register_request_headers,
+	  METH_VARARGS,
+	  "Register a hook for right after headers have been parsed and sanity checked." },
+	{ "register_request_header_data", htpy_config_register_request_header_data,
+	  METH_VARARGS,
+	  "Register a hook for right as headers are being parsed and sanity checked." },
+	{ "register_request_body_data", htpy_config_register_request_body_data,
+	  METH_VARARGS,
+	  "Register a hook for when a piece of request body data is processed." },
+	{ "register_request_file_data", htpy_config_register_request_file_data,
+	  METH_VARARGS,
+	  "Register a hook for when a full request body data is processed." },
+	{ "register_request_trailer", htpy_config_register_request_trailer,
+	  METH_VARARGS,
+	  "Register a hook for request trailer completion." },
+	{ "register_request_trailer_data", htpy_config_register_request_trailer_data,
+	  METH_VARARGS,
+	  "Register a hook request trialer data." },
+	{ "register_request_complete", htpy_config_register_request_complete, METH_VARARGS,
+	  "Register a callback for when the entire request is parsed." },
+	{ "register_response_start", htpy_config_register_response_start,
+	  METH_VARARGS,
+	  "Register a hook for as soon as a response is about to start." },
+	{ "register_response_line", htpy_config_register_response_line,
+	  METH_VARARGS,
+	  "Register a hook for right after response line has been parsed." },
+	{ "register_response_headers", htpy_config_register_response_headers,
+	  METH_VARARGS, "Register a hook for right after headers have been parsed and sanity checked." },
+	{ "register_response_header_data", htpy_config_register_response_header_data,
+	  METH_VARARGS, "Register a hook for right as headers have been parsed and sanity checked." },
+	{ "register_response_body_data", htpy_config_register_response_body_data,
+	  METH_VARARGS,
+	  "Register a hook for when a piece of response body data is processed. Chunked and gzip'ed data are handled." },
+	{ "register_response_trailer", htpy_config_register_response_trailer,
+	  METH_VARARGS,
+	  "Register a hook for response trailer completion." },
+	{ "register_response_trailer_data", htpy_config_register_response_trailer_data,
+	  METH_VARARGS,
+	  "Register a hook for response trailer data." },
+	{ "register_response_complete", htpy_config_register_response_complete, METH_VARARGS,
+	  "Register a hook for right after an entire response has been parsed." },
+	{ "register_transaction_complete", htpy_config_register_transaction_complete, METH_VARARGS,
+	  "Register a hook for right after a transaction has completed." },
+	{ "register_log", htpy_config_register_log, METH_VARARGS,
+	  "Register a callback for when a log message is generated." },
+	{ "get_stats", htpy_config_get_parser_stats, METH_NOARGS,
+	  "Return the stats of connection parsers made with this config which have been reset or destroyed." },
+	{ "clear_stats", htpy_config_clear_stats, METH_NOARGS,
+	  "Reset the stats of the config." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_config_members[] = {
+	{ NULL }
+};
+
+static PyTypeObject htpy_config_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.config",                    /* tp_name */
+	sizeof(htpy_config),              /* tp_basicsize */
+	0,                                /* tp_itemsize */
+	(destructor) htpy_config_dealloc, /* tp_dealloc */
+	0,                                /* tp_print */
+	0,                                /* tp_getattr */
+	0,                                /* tp_setattr */
+	0,                                /* tp_compare */
+	0,                                /* tp_repr */
+	0,                                /* tp_as_number */
+	0,                                /* tp_as_sequence */
+	0,                                /* tp_as_mapping */
+	0,                                /* tp_hash */
+	0,                                /* tp_call */
+	0,                                /* tp_str */
+	0,                                /* tp_getattro */
+	0,                                /* tp_setattro */
+	0,                                /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,               /* tp_flags */
+	"config object",                  /* tp_doc */
+	0,                                /* tp_traverse */
+	0,                                /* tp_clear */
+	0,                                /* tp_richcompare */
+	0,                                /* tp_weaklistoffset */
+	0,                                /* tp_iter */
+	0,                                /* tp_iternext */
+	htpy_config_methods,              /* tp_methods */
+	htpy_config_members,              /* tp_members */
+	htpy_config_getseters,            /* tp_getset */
+	0,                                /* tp_base */
+	0,                                /* tp_dict */
+	0,                                /* tp_descr_get */
+	0,                                /* tp_descr_set */
+	0,                                /* tp_dictoffset */
+	(initproc) htpy_config_init,      /* tp_init */
+	0,                                /* tp_alloc */
+	htpy_config_new,                  /* tp_new */
+};
+
+/* Return a header who'se key is the given string. */
+#define GET_HEADER(TYPE) \
+static PyObject *htpy_connp_get_##TYPE##_header_unlocked(PyObject *self, PyObject *args) { \
+	PyObject *ret; \
+	htp_header_t *hdr; \
+	PyObject *py_str = NULL; \
+	const char *name; \
+	Py_ssize_t len; \
+	htp_tx_t *tx = NULL; \
+	if (!PyArg_ParseTuple(args, "O:htpy_connp_get_##TYPE##_header", &py_str)) \
+		return NULL; \
+	if (htpy_str_data(py_str, &name, &len) == -1) \
+		return NULL; \
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1); \
+	if (!tx || !tx->TYPE##_headers) { \
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction or headers."); \
+		return NULL; \
+	} \
+	hdr = name ? htp_table_get_mem(tx->TYPE##_headers, name, len) : NULL; \
+	if (!hdr) \
+		Py_RETURN_NONE; \
+	ret = htpy_str(bstr_ptr(hdr->value), bstr_len(hdr->value)); \
+	if (!ret) \
+		return NULL; \
+	return ret; \
+} \
+CONNP_LOCKED(get_##TYPE##_header)
+
+GET_HEADER(request)
+GET_HEADER(response)
+
+/* Return a dictionary of all request or response headers. */
+#define GET_ALL_HEADERS(TYPE) \
+static PyObject *htpy_connp_get_all_##TYPE##_headers_unlocked(PyObject *self, PyObject *args) { \
+	htp_tx_t *tx = NULL; \
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1); \
+	if (!tx || !tx->TYPE##_headers) { \
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction or headers."); \
+		return NULL; \
+	} \
+	return htpy_headers_to_dict(tx->TYPE##_headers); \
+} \
+CONNP_LOCKED(get_all_##TYPE##_headers)
+
+GET_ALL_HEADERS(request)
+GET_ALL_HEADERS(response)
+
+/* Return a header view of the request or response headers. */
+#define GET_HEADERS_VIEW(TYPE, DIRECTION) \
+static PyObject *htpy_connp_get_##TYPE##_headers_view_unlocked(PyObject *self, PyObject *args) { \
+	PyObject *tx_obj, *ret; \
+	htp_tx_t *tx = NULL; \
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1); \
+	if (!tx) { \
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction or headers."); \
+		return NULL; \
+	} \
+	tx_obj = htpy_tx_get(self, tx); \
+	if (!tx_obj) \
+		return NULL; \
+	ret = htpy_headers_new((htpy_tx *) tx_obj, DIRECTION); \
+	Py_DECREF(tx_obj); \
+	return ret; \
+} \
+CONNP_LOCKED(get_##TYPE##_headers_view)
+
+GET_HEADERS_VIEW(request, HTPY_REQUEST)
+GET_HEADERS_VIEW(response, HTPY_RESPONSE)
+
+/*
+ * XXX: Not sure I like mucking around in the transaction to get the method,
+ * but I'm not sure of a better way.
+ */
+static PyObject *htpy_connp_get_method_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+	htp_tx_t *tx = NULL;
+
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
+	if (!tx || !tx->request_method) {
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction or request method.");
+		return NULL;
+	}
+
+	ret = htpy_method_name(tx);
+
+	return ret;
+}
+
+CONNP_LOCKED(get_method)
+
+static PyObject *htpy_connp_set_obj(PyObject *self, PyObject *args) {
+	PyObject *obj;
+
+	if (!PyArg_ParseTuple(args, "O:htpy_connp_set_obj", &obj))
+		return NULL;
+
+	/*
+	 * Remove a reference to any existing object. This ensures we
+	 * do not leak objects in the case of someone calling this
+	 * multiple times.
+	 */
+	Py_XDECREF(((htpy_connp *) self)->obj_store);
+
+	Py_XINCREF(obj);
+	((htpy_connp *) self)->obj_store = obj;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *htpy_connp_del_obj(PyObject *self, PyObject *args) {
+	Py_XDECREF(((htpy_connp *) self)->obj_store);
+	((htpy_connp *) self)->obj_store = NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *htpy_connp_reset(PyObject *self, PyObject *args) {
+	if (htpy_connp_reset_obj((htpy_connp *) self) == -1)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * XXX: Not sure I like mucking around in the transaction to get the status,
+ * but I'm not sure of a better way.
+ */
+static PyObject *htpy_connp_get_response_status_string_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+	htp_tx_t *tx = NULL;
+
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
+	if (!tx) {
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction.");
+		return NULL;
+	}
+
+	ret = htpy_str(bstr_ptr(tx->response_status), bstr_len(tx->response_status));
+
+	return ret;
+}
+
+CONNP_LOCKED(get_response_status_string)
+
+static PyObject *htpy_connp_get_response_status_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+	htp_tx_t *tx = NULL;
+
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
+	if (!tx) {
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction.");
+		return NULL;
+	}
+
+	ret = Py_BuildValue("i", tx->response_status_number);
+
+	return ret;
+}
+
+CONNP_LOCKED(get_response_status)
+
+static PyObject *htpy_time_to_float(const htp_time_t *t) {
+	if (t->tv_sec == 0 && t->tv_usec == 0)
+		Py_RETURN_NONE;
+
+	return PyFloat_FromDouble((double) t->tv_sec + (double) t->tv_usec / 1000000.0);
+}
+
+/*
+ * Return a dictionary with the times the last transaction started and
+ * completed in each direction, along with the latency of the server (the
+ * time between the end of the request and the start of the response).
+ * Times which were not recorded, because no timestamps were passed in or
+ * the transaction has not reached that point, are None.
+ */
+static PyObject *htpy_connp_get_transaction_times_unlocked(PyObject *self, PyObject *args) {
+	htp_tx_t *tx = NULL;
+	htpy_tx_times *t;
+	PyObject *latency;
+	PyObject *ret;
+
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
+	if (!tx) {
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction.");
+		return NULL;
+	}
+
+	t = htpy_tx_times_get(tx, 0);
+	if (!t)
+		Py_RETURN_NONE;
+
+	if ((t->request_complete.tv_sec || t->request_complete.tv_usec) && (t->response_start.tv_sec || t->response_start.tv_usec))
+		latency = PyFloat_FromDouble((double) (t->response_start.tv_sec - t->request_complete.tv_sec) + (double) (t->response_start.tv_usec - t->request_complete.tv_usec) / 1000000.0);
+	else
+		latency = (Py_INCREF(Py_None), Py_None);
+	if (!latency)
+		return NULL;
+
+	ret = Py_BuildValue("{sNsNsNsNsN}",
+	                    "request_start", htpy_time_to_float(&t->request_start),
+	                    "request_complete", htpy_time_to_float(&t->request_complete),
+	                    "response_start", htpy_time_to_float(&t->response_start),
+	                    "response_complete", htpy_time_to_float(&t->response_complete),
+	                    "latency", latency);
+
+	return ret;
+}
+
+CONNP_LOCKED(get_transaction_times)
+
+static PyObject *htpy_connp_get_body_digests_unlocked(PyObject *self, PyObject *args) {
+	htp_tx_t *tx = NULL;
+
+	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
+	if (!tx) {
+		PyErr_SetString(htpy_get_state()->error, "Missing transaction.");
+		return NULL;
+	}
+
+	return htpy_tx_digests_dict(tx);
+}
+
+CONNP_LOCKED(get_body_digests)
+
+static PyObject *htpy_connp_get_memory_usage(PyObject *self, PyObject *args) {
+	return PyLong_FromSize_t(htpy_connp_memory((htpy_connp *) self));
+}
+
+static PyObject *htpy_connp_get_stats(PyObject *self, PyObject *args) {
+	htpy_connp *cp = (htpy_connp *) self;
+	PyObject *ret;
+
+	/* A worker may be updating them. */
+	if (pthread_mutex_trylock(&cp->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return NULL;
+	}
+	ret = htpy_stats_dict(cp->stats);
+	pthread_mutex_unlock(&cp->lock);
+
+	return ret;
+}
+
+/*
+ * Hand the queued events to python and empty the queue. Returns a tuple of
+ * a list of (type, index, offset, length) tuples, a string of the data
+ * the offsets and lengths are into, and the number of events dropped.
+ */
+static PyObject *htpy_connp_drain_events(PyObject *self, PyObject *args) {
+	htpy_connp *cp = (htpy_connp *) self;
+	htpy_events *ev;
+	htpy_event *e;
+	PyObject *list = NULL;
+	PyObject *item;
+	PyObject *ret = NULL;
+	size_t i;
+
+	if (pthread_mutex_trylock(&cp->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return NULL;
+	}
+
+	ev = cp->events;
+	list = PyList_New(ev ? (Py_ssize_t) ev->n : 0);
+	if (!list)
+		goto out;
+
+	for (i = 0; ev && i < ev->n; i++) {
+		e = &ev->records[i];
+		item = Py_BuildValue("(Innn)", e->type, (Py_ssize_t) e->index, (Py_ssize_t) e->offset, (Py_ssize_t) e->len);
+		if (!item) {
+			Py_CLEAR(list);
+			goto out;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+
+	ret = Py_BuildValue("(NNk)", list, PyBytes_FromStringAndSize(ev ? (char *) ev->data : NULL, ev ? (Py_ssize_t) ev->len : 0), ev ? ev->dropped : 0UL);
+	htpy_events_clear(ev);
+
+out:
+	pthread_mutex_unlock(&cp->lock);
+	return ret;
+}
+
+static PyObject *htpy_connp_get_log_stats(PyObject *self, PyObject *args) {
+	htpy_connp *cp = (htpy_connp *) self;
+
+	return Py_BuildValue("{sksksk}", "delivered", cp->log_delivered, "suppressed", cp->log_suppressed, "batches", cp->log_batches);
+}
+
+/* Pass on batched log messages without waiting for a transaction to complete. */
+static PyObject *htpy_connp_flush_logs(PyObject *self, PyObject *args) {
+	if (pthread_mutex_trylock(&((htpy_connp *) self)->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return NULL;
+	}
+
+	htpy_log_flush(self);
+	pthread_mutex_unlock(&((htpy_connp *) self)->lock);
+
+	Py_RETURN_NONE;
+}
+
+#define GET_TX(TYPE) \
+static PyObject *htpy_connp_get_##TYPE##_tx_unlocked(PyObject *self, PyObject *args) { \
+	if (!((htpy_connp *) self)->connp->TYPE##_tx) \
+		Py_RETURN_NONE; \
+	return htpy_tx_get(self, ((htpy_connp *) self)->connp->TYPE##_tx); \
+} \
+CONNP_LOCKED(get_##TYPE##_tx)
+
+GET_TX(in)
+GET_TX(out)
+
+static PyObject *htpy_connp_get_response_line_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->out_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->out_tx->response_line)
+		Py_RETURN_NONE;
+
+	ret = htpy_str(bstr_ptr(((htpy_connp *) self)->connp->out_tx->response_line), bstr_len(((htpy_connp *) self)->connp->out_tx->response_line));
+	return ret;
+}
+
+CONNP_LOCKED(get_response_line)
+
+static PyObject *htpy_connp_get_request_line_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->in_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->in_tx->request_line)
+		Py_RETURN_NONE;
+
+	ret = htpy_str(bstr_ptr(((htpy_connp *) self)->connp->in_tx->request_line), bstr_len(((htpy_connp *) self)->connp->in_tx->request_line));
+	return ret;
+}
+
+CONNP_LOCKED(get_request_line)
+
+/* See HTTP 1.1 RFC 4.3 Message Body */
+
+/*
+ * The length of the response message-body. In most cases, this value
+ * will be the same as response_entity_len. The values will be different
+ * if response compression or chunking were applied. In that case,
+ * response_message_len contains the length of the response body as it
+ * has been seen over TCP; response_entity_len contains the length after
+ * de-chunking and decompression.
+ */
+static PyObject *htpy_connp_get_response_message_length_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->out_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->out_tx->response_message_len)
+		Py_RETURN_NONE;
+
+	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->out_tx->response_message_len);
+	return ret;
+}
+
+CONNP_LOCKED(get_response_message_length)
+
+/*
+ * The length of the request message-body. In most cases, this value
+ * will be the same as request_entity_len. The values will be different
+ * if request compression or chunking were applied. In that case,
+ * request_message_len contains the length of the request body as it
+ * has been seen over TCP; request_entity_len contains length after
+ * de-chunking and decompression.
+ */
+static PyObject *htpy_connp_get_request_message_length_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->in_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->in_tx->request_message_len)
+		Py_RETURN_NONE;
+
+	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->in_tx->request_message_len);
+	return ret;
+}
+
+CONNP_LOCKED(get_request_message_length)
+
+/*
+ * The length of the response entity-body. In most cases, this value
+ * will be the same as response_message_len. The values will be different
+ * if request compression or chunking were applied. In that case,
+ * response_message_len contains the length of the response body as it
+ * has been seen over TCP; response_entity_len contains length after
+ * de-chunking and decompression.
+ */
+static PyObject *htpy_connp_get_response_entity_length_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->out_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->out_tx->response_entity_len)
+		Py_RETURN_NONE;
+
+	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->out_tx->response_entity_len);
+	return ret;
+}
+
+CONNP_LOCKED(get_response_entity_length)
+
+/*
+ * The length of the request entity-body. In most cases, this value
+ * will be the same as request_message_len. The values will be different
+ * if request compression or chunking were applied. In that case,
+ * request_message_len contains the length of the request body as it
+ * has been seen over TCP; request_entity_len contains length after
+ * de-chunking and decompression.
+ */
+static PyObject *htpy_connp_get_request_entity_length_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->in_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->in_tx->request_entity_len)
+		Py_RETURN_NONE;
+
+	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->in_tx->request_entity_len);
+	return ret;
+}
+
+CONNP_LOCKED(get_request_entity_length)
+
+/*
+ * Convert a python timestamp into a htp_time_t. The timestamp may be None,
+ * a number of seconds since the epoch or a (seconds, microseconds) tuple.
+ * Returns 1 if a timestamp was given, 0 for None and -1 on error.
+ */
+static int htpy_parse_timestamp(PyObject *obj, htp_time_t *ts) {
+	double d;
+	long sec, usec;
+
+	if (!obj || obj == Py_None)
+		return 0;
+
+	if (PyTuple_Check(obj)) {
+		if (!PyArg_ParseTuple(obj, "ll:timestamp", &sec, &usec))
+			return -1;
+		ts->tv_sec = sec;
+		ts->tv_usec = usec;
+		return 1;
+	}
+
+	d = PyFloat_AsDouble(obj);
+	if (d == -1.0 && PyErr_Occurred()) {
+		PyErr_SetString(PyExc_TypeError, "timestamp must be a number or a (sec, usec) tuple");
+		return -1;
+	}
+	ts->tv_sec = (long) d;
+	ts->tv_usec = (long) ((d - (double) ts->tv_sec) * 1000000.0);
+
+	return 1;
+}
+
+/*
+ * Narrow a buffer down to the optional offset and length given along with
+ * it. A negative length means everything from offset to the end of the
+ * buffer.
+ */
+static int htpy_buffer_slice(Py_buffer *buf, Py_ssize_t offset, Py_ssize_t length, const unsigned char **data, size_t *len) {
+	if (offset < 0 || offset > buf->len) {
+		PyErr_SetString(PyExc_ValueError, "offset out of range");
+		return -1;
+	}
+
+	if (length < 0)
+		length = buf->len - offset;
+
+	if (length > buf->len - offset) {
+		PyErr_SetString(PyExc_ValueError, "length out of range");
+		return -1;
+	}
+
+	*data = (const unsigned char *) buf->buf + offset;
+	*len = (size_t) length;
+
+	return 0;
+}
+
+/*
+ * Feed data to a connection parser with the GIL released. Returns the
+ * stream status from libhtp, or -1 with an exception set if the parser is
+ * already being fed.
+ */
+static int htpy_connp_feed(PyObject *self, int direction, const htp_time_t *ts, const unsigned char *data, size_t len) {
+	int x;
+	PyObject *prev;
+
+	if (pthread_mutex_trylock(&((htpy_connp *) self)->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return -1;
+	}
+
+	HTPY_BEGIN_ALLOW_THREADS
+	prev = htpy_current_connp;
+	htpy_current_connp = self;
+	x = htpy_parse((htpy_connp *) self, direction, ts, data, len);
+	htpy_current_connp = prev;
+	HTPY_END_ALLOW_THREADS
+	if (x == HTP_STREAM_ERROR)
+		htpy_log_flush(self);
+	pthread_mutex_unlock(&((htpy_connp *) self)->lock);
+
+	return x;
+}
+
+/*
+ * Tell libhtp the connection is closed, which completes what can still be
+ * completed and runs the callbacks for it.
+ */
+static int htpy_connp_close_obj(PyObject *self, const htp_time_t *ts) {
+	PyObject *prev;
+
+	if (pthread_mutex_trylock(&((htpy_connp *) self)->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return -1;
+	}
+
+	HTPY_BEGIN_ALLOW_THREADS
+	prev = htpy_current_connp;
+	htpy_current_connp = self;
+	htp_connp_close(((htpy_connp *) self)->connp, ts);
+	htpy_current_connp = prev;
+	HTPY_END_ALLOW_THREADS
+	htpy_log_flush(self);
+	pthread_mutex_unlock(&((htpy_connp *) self)->lock);
+
+	return 0;
+}
+
+/* Tell a connection parser some data in a direction was lost. */
+static int htpy_connp_gap_obj(PyObject *self, int direction, size_t len) {
+	int x;
+	PyObject *prev;
+
+	if (pthread_mutex_trylock(&((htpy_connp *) self)->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return -1;
+	}
+
+	HTPY_BEGIN_ALLOW_THREADS
+	prev = htpy_current_connp;
+	htpy_current_connp = self;
+	x = htpy_gap((htpy_connp *) self, direction, len);
+	htpy_current_connp = prev;
+	HTPY_END_ALLOW_THREADS
+	if (x == HTP_STREAM_ERROR)
+		htpy_log_flush(self);
+	pthread_mutex_unlock(&((htpy_connp *) self)->lock);
+
+	return x;
+}
+
+/* Turn a stream status into the return value of the data methods. */
+static PyObject *htpy_stream_status(int x) {
+	if (x == HTP_STREAM_ERROR) {
+		PyErr_SetString(htpy_get_state()->error, "Stream error.");
+		return NULL;
+	}
+	if (x == HTP_STREAM_STOP) {
+		PyErr_SetString(htpy_get_state()->stop, "Stream stop.");
+		return NULL;
+	}
+
+	return PyInt_FromLong((long) x);
+}
+
+/*
+ * These do the actual parsing. The data can be any object which supports
+ * the buffer protocol. The GIL is released while libhtp is working on it.
+ */
+#define DATA(TYPE, DIRECTION) \
+static PyObject *htpy_connp_##TYPE##_data(PyObject *self, PyObject *args, PyObject *kwds) { \
+	static char *kwlist[] = { "data", "offset", "length", "timestamp", NULL }; \
+	Py_buffer buf; \
+	Py_ssize_t offset = 0; \
+	Py_ssize_t length = -1; \
+	PyObject *ts_obj = NULL; \
+	htp_time_t ts; \
+	int has_ts; \
+	const unsigned char *data; \
+	size_t len; \
+	int x; \
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*|nnO:htpy_connp_##TYPE##_data", kwlist, &buf, &offset, &length, &ts_obj)) \
+		return NULL; \
+	if (htpy_buffer_slice(&buf, offset, length, &data, &len) == -1) { \
+		PyBuffer_Release(&buf); \
+		return NULL; \
+	} \
+	has_ts = htpy_parse_timestamp(ts_obj, &ts); \
+	if (has_ts == -1) { \
+		PyBuffer_Release(&buf); \
+		return NULL; \
+	} \
+	x = htpy_connp_feed(self, DIRECTION, has_ts ? &ts : NULL, data, len); \
+	PyBuffer_Release(&buf); \
+	if (x == -1) \
+		return NULL; \
+	return htpy_stream_status(x); \
+}
+
+DATA(req, HTPY_REQUEST)
+DATA(res, HTPY_RESPONSE)
+
+#define GAP(TYPE, DIRECTION) \
+static PyObject *htpy_connp_##TYPE##_gap(PyObject *self, PyObject *args) { \
+	Py_ssize_t length; \
+	int x; \
+	if (!PyArg_ParseTuple(args, "n:" #TYPE "_gap", &length)) \
+		return NULL; \
+	if (length < 0) { \
+		PyErr_SetString(PyExc_ValueError, "length may not be negative"); \
+		return NULL; \
+	} \
+	x = htpy_connp_gap_obj(self, DIRECTION, (size_t) length); \
+	if (x == -1) \
+		return NULL; \
+	return htpy_stream_status(x); \
+}
+
+GAP(req, HTPY_REQUEST)
+GAP(res, HTPY_RESPONSE)
+
+/*
+ * A checkpoint is the magic and version, followed by the request and then
+ * the response stream, each as the last timestamp (64 bit seconds and 32
+ * bit microseconds), a 32 bit length and that much data. Everything is
+ * big endian.
+ */
+#define HTPY_CHECKPOINT_HEADER 5
+#define HTPY_CHECKPOINT_STREAM 16
+
+static unsigned char *htpy_put_be(unsigned char *p, unsigned long long v, int n) {
+	int i;
+
+	for (i = n - 1; i >= 0; i--) {
+		p[i] = (unsigned char) (v & 0xff);
+		v >>= 8;
+	}
+	return p + n;
+}
+
+static unsigned long long htpy_get_be(const unsigned char *p, int n) {
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static PyObject *htpy_connp_serialize(PyObject *self, PyObject *args) {
+	htpy_connp *cp = (htpy_connp *) self;
+	htpy_checkpoint *ck = cp->checkpoint;
+	htpy_checkpoint_stream *s;
+	PyObject *ret = NULL;
+	unsigned char *p;
+	size_t size;
+	int i;
+
+	if (!((htpy_config *) cp->cfg)->checkpoint_limit) {
+		PyErr_SetString(htpy_get_state()->error, "Checkpoints are not enabled, set checkpoint_limit in the config.");
+		return NULL;
+	}
+
+	if (pthread_mutex_trylock(&cp->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		return NULL;
+	}
+
+	if (cp->connp->in_status == HTP_STREAM_ERROR || cp->connp->out_status == HTP_STREAM_ERROR) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser has failed.");
+		goto out;
+	}
+
+	size = HTPY_CHECKPOINT_HEADER + 2 * HTPY_CHECKPOINT_STREAM;
+	for (i = 0; ck && i < 2; i++) {
+		if (ck->stream[i].lost || ck->stream[i].len > 0xffffffffUL) {
+			PyErr_SetString(htpy_get_state()->error, "Connection parser state is over the checkpoint limit.");
+			goto out;
+		}
+		size += ck->stream[i].len;
+	}
+
+	ret = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) size);
+	if (!ret)
+		goto out;
+
+	p = (unsigned char *) PyBytes_AS_STRING(ret);
+	memcpy(p, HTPY_CHECKPOINT_MAGIC, 4);
+	p[4] = HTPY_CHECKPOINT_VERSION;
+	p += HTPY_CHECKPOINT_HEADER;
+	for (i = 0; i < 2; i++) {
+		if (!ck) {
+			memset(p, 0, HTPY_CHECKPOINT_STREAM);
+			p += HTPY_CHECKPOINT_STREAM;
+			continue;
+		}
+		s = &ck->stream[i];
+		p = htpy_put_be(p, (unsigned long long) s->ts.tv_sec, 8);
+		p = htpy_put_be(p, (unsigned long long) s->ts.tv_usec, 4);
+		p = htpy_put_be(p, s->len, 4);
+		if (s->len)
+			memcpy(p, s->data, s->len);
+		p += s->len;
+	}
+
+out:
+	pthread_mutex_unlock(&cp->lock);
+	return ret;
+}
+
+/*
+ * Create a connection parser from a checkpoint by feeding it the data in
+ * the checkpoint. If the request side stops for the response side to catch
+ * up, as it does for CONNECT, the rest of it is fed after the response.
+ */
+static PyObject *htpy_connp_restore(PyObject *cls, PyObject *args) {
+	PyObject *cfg_obj = NULL;
+	PyObject *cp;
+	Py_buffer buf;
+	const unsigned char *p, *end;
+	const unsigned char *data[2];
+	size_t len[2], consumed;
+	htp_time_t ts[2];
+	int i, x, progress;
+
+	if (!PyArg_ParseTuple(args, "s*|O:restore", &buf, &cfg_obj))
+		return NULL;
+
+	p = (const unsigned char *) buf.buf;
+	end = p + buf.len;
+	if (buf.len < HTPY_CHECKPOINT_HEADER || memcmp(p, HTPY_CHECKPOINT_MAGIC, 4) || p[4] != HTPY_CHECKPOINT_VERSION)
+		goto invalid;
+	p += HTPY_CHECKPOINT_HEADER;
+	for (i = 0; i < 2; i++) {
+		if (end - p < HTPY_CHECKPOINT_STREAM)
+			goto invalid;
+		ts[i].tv_sec = (long) htpy_get_be(p, 8);
+		ts[i].tv_usec = (long) htpy_get_be(p + 8, 4);
+		len[i] = (size_t) htpy_get_be(p + 12, 4);
+		p += HTPY_CHECKPOINT_STREAM;
+		if ((size_t) (end - p) < len[i])
+			goto invalid;
+		data[i] = p;
+		p += len[i];
+	}
+	if (p != end)
+		goto invalid;
+
+	cp = PyObject_CallFunctionObjArgs(cls, cfg_obj, NULL);
+	if (!cp) {
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	do {
+		progress = 0;
+		for (i = HTPY_REQUEST; i <= HTPY_RESPONSE; i++) {
+			if (!len[i])
+				continue;
+			x = htpy_connp_feed(cp, i, &ts[i], data[i], len[i]);
+			if (x == -1 || x == HTP_STREAM_ERROR || x == HTP_STREAM_STOP) {
+				PyBuffer_Release(&buf);
+				Py_DECREF(cp);
+				return x == -1 ? NULL : htpy_stream_status(x);
+			}
+			consumed = len[i];
+			if (x == HTP_STREAM_DATA_OTHER)
+				consumed = i == HTPY_REQUEST ? htp_connp_req_data_consumed(((htpy_connp *) cp)->connp) : htp_connp_res_data_consumed(((htpy_connp *) cp)->connp);
+			if (consumed)
+				progress = 1;
+			data[i] += consumed;
+			len[i] -= consumed;
+		}
+	} while (progress && (len[HTPY_REQUEST] || len[HTPY_RESPONSE]));
+
+	PyBuffer_Release(&buf);
+	if (len[HTPY_REQUEST] || len[HTPY_RESPONSE]) {
+		Py_DECREF(cp);
+		PyErr_SetString(htpy_get_state()->error, "Checkpoint data could not be parsed.");
+		return NULL;
+	}
+
+	return cp;
+
+invalid:
+	PyBuffer_Release(&buf);
+	PyErr_SetString(htpy_get_state()->error, "Invalid checkpoint.");
+	return NULL;
+}
+
+typedef struct {
+	int direction;
+	int has_ts;
+	htp_time_t ts;
+	Py_buffer buf;
+} htpy_segment;
+
+/*
+ * Parse a sequence of (direction, timestamp, data) tuples in one call. All
+ * of the buffers are acquired up front so the entire batch is parsed
+ * without the GIL. Parsing stops at the first segment which results in an
+ * error or stop, and the index of that segment is the second argument of
+ * the exception raised.
+ */
+static PyObject *htpy_connp_feed_many(PyObject *self, PyObject *args) {
+	PyObject *segments;
+	PyObject *seq;
+	PyObject *item;
+	PyObject *ts_obj;
+	PyObject *err;
+	htpy_segment *segs;
+	Py_ssize_t i, n, acquired;
+	int x = HTP_STREAM_OPEN;
+	PyObject *prev;
+
+	if (!PyArg_ParseTuple(args, "O:htpy_connp_feed_many", &segments))
+		return NULL;
+
+	seq = PySequence_Fast(segments, "segments must be a sequence");
+	if (!seq)
+		return NULL;
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	segs = PyMem_Malloc(sizeof(htpy_segment) * (n ? n : 1));
+	if (!segs) {
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+
+	for (acquired = 0; acquired < n; acquired++) {
+		item = PySequence_Fast_GET_ITEM(seq, acquired);
+		if (!PyTuple_Check(item)) {
+			PyErr_SetString(PyExc_TypeError, "segments must be (direction, timestamp, data) tuples");
+			goto fail;
+		}
+		if (!PyArg_ParseTuple(item, "iOs*:feed_many", &segs[acquired].direction, &ts_obj, &segs[acquired].buf))
+			goto fail;
+		if (segs[acquired].direction != HTPY_REQUEST && segs[acquired].direction != HTPY_RESPONSE) {
+			PyBuffer_Release(&segs[acquired].buf);
+			PyErr_SetString(PyExc_ValueError, "direction must be htpy.HTPY_REQUEST or htpy.HTPY_RESPONSE");
+			goto fail;
+		}
+		segs[acquired].has_ts = htpy_parse_timestamp(ts_obj, &segs[acquired].ts);
+		if (segs[acquired].has_ts == -1) {
+			PyBuffer_Release(&segs[acquired].buf);
+			goto fail;
+		}
+	}
+
+	if (pthread_mutex_trylock(&((htpy_connp *) self)->lock) != 0) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is busy.");
+		goto fail;
+	}
+
+	HTPY_BEGIN_ALLOW_THREADS
+	prev = htpy_current_connp;
+	htpy_current_connp = self;
+	for (i = 0; i < n; i++) {
+		x = htpy_parse((htpy_connp *) self, segs[i].direction, segs[i].has_ts ? &segs[i].ts : NULL, segs[i].buf.buf, segs[i].buf.len);
+		if (x == HTP_STREAM_ERROR || x == HTP_STREAM_STOP)
+			break;
+	}
+	htpy_current_connp = prev;
+	HTPY_END_ALLOW_THREADS
+	if (x == HTP_STREAM_ERROR)
+		htpy_log_flush(self);
+	pthread_mutex_unlock(&((htpy_connp *) self)->lock);
+
+	while (acquired > 0)
+		PyBuffer_Release(&segs[--acquired].buf);
+	PyMem_Free(segs);
+	Py_DECREF(seq);
+
+	if (x == HTP_STREAM_ERROR || x == HTP_STREAM_STOP) {
+		/* The exception is given the index of the segment which failed. */
+		err = Py_BuildValue("(sn)", x == HTP_STREAM_ERROR ? "Stream error." : "Stream stop.", i);
+		if (!err)
+			return NULL;
+		PyErr_SetObject(x == HTP_STREAM_ERROR ? htpy_get_state()->error : htpy_get_state()->stop, err);
+		Py_DECREF(err);
+		return NULL;
+	}
+
+	return PyInt_FromLong((long) x);
+
+fail:
+	while (acquired > 0)
+		PyBuffer_Release(&segs[--acquired].buf);
+	PyMem_Free(segs);
+	Py_DECREF(seq);
+	return NULL;
+}
+
+#define DATA_CONSUMED(TYPE) \
+static PyObject *htpy_connp_##TYPE##_data_consumed_unlocked(PyObject *self, PyObject *args) { \
+	PyObject *ret; \
+	ret = Py_BuildValue("I", htp_connp_##TYPE##_data_consumed(((htpy_connp *) self)->connp)); \
+	return(ret); \
+} \
+CONNP_LOCKED(TYPE##_data_consumed)
+
+DATA_CONSUMED(req)
+DATA_CONSUMED(res)
+
+static PyObject *htpy_connp_get_last_error_unlocked(PyObject *self, PyObject *args) {
+	htp_log_t *err = NULL;
+	PyObject *ret;
+
+	err = htp_connp_get_last_error(((htpy_connp *) self)->connp);
+	if (!err)
+		Py_RETURN_NONE;
+
+	ret = Py_BuildValue("{sisNsssi}", "level", err->level, "msg", htpy_str(err->msg, strlen(err->msg)), "file", err->file, "line", err->line);
+
+	return(ret);
+}
+
+CONNP_LOCKED(get_last_error)
+
+static PyObject *htpy_connp_clear_error_unlocked(PyObject *self, PyObject *args) {
+	htp_connp_clear_error(((htpy_connp *) self)->connp);
+	Py_RETURN_NONE;
+}
+
+CONNP_LOCKED(clear_error)
+
+static PyObject *htpy_connp_get_request_protocol_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->in_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->in_tx->request_protocol)
+		Py_RETURN_NONE;
+
+	ret = htpy_str(bstr_ptr(((htpy_connp *) self)->connp->in_tx->request_protocol), bstr_len(((htpy_connp *) self)->connp->in_tx->request_protocol));
+	return ret;
+}
+
+CONNP_LOCKED(get_request_protocol)
+
+static PyObject *htpy_connp_get_request_protocol_number_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->in_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->in_tx->request_protocol_number)
+		Py_RETURN_NONE;
+
+	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->in_tx->request_protocol_number);
+	return ret;
+}
+
+CONNP_LOCKED(get_request_protocol_number)
+
+static PyObject *htpy_connp_get_response_protocol_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->out_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->out_tx->response_protocol)
+		Py_RETURN_NONE;
+
+	ret = htpy_str(bstr_ptr(((htpy_connp *) self)->connp->out_tx->response_protocol), bstr_len(((htpy_connp *) self)->connp->out_tx->response_protocol));
+	return ret;
+}
+
+CONNP_LOCKED(get_response_protocol)
+
+static PyObject *htpy_connp_get_response_protocol_number_unlocked(PyObject *self, PyObject *args) {
+	PyObject *ret;
+
+	if (!((htpy_connp *) self)->connp->out_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->out_tx->response_protocol_number)
+		Py_RETURN_NONE;
+
+	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->out_tx->response_protocol_number);
+	return ret;
+}
+
+CONNP_LOCKED(get_response_protocol_number)
+
+/*
+ * The dictionary is built once per transaction and kept on the transaction
+ * object, which lives as long as the transaction, so calling this from
+ * several callbacks is cheap and returns the same dictionary.
+ */
+static PyObject *htpy_connp_get_uri_unlocked(PyObject *self, PyObject *args) {
+	PyObject *tx, *ret;
+
+	/* Empty tx? That's odd. */
+	if (!((htpy_connp *) self)->connp->in_tx)
+		Py_RETURN_NONE;
+
+	if (!((htpy_connp *) self)->connp->in_tx->parsed_uri)
+		Py_RETURN_NONE;
+
+	tx = htpy_tx_get(self, ((htpy_connp *) self)->connp->in_tx);
+	if (!tx)
+		return NULL;
+
+	ret = htpy_tx_get_parsed_uri_unlocked((htpy_tx *) tx, NULL);
+	Py_DECREF(tx);
+	return ret;
+}
+
+CONNP_LOCKED(get_uri)
+
+static PyObject *htpy_connp_get_uri_component_unlocked(PyObject *self, PyObject *args) {
+	PyObject *tx, *ret;
+
+	if (!((htpy_connp *) self)->connp->in_tx)
+		Py_RETURN_NONE;
+
+	tx = htpy_tx_get(self, ((htpy_connp *) self)->connp->in_tx);
+	if (!tx)
+		return NULL;
+
+	ret = htpy_tx_get_uri_component_unlocked(tx, args);
+	Py_DECREF(tx);
+	return ret;
+}
+
+CONNP_LOCKED(get_uri_component)
+
+static PyMethodDef htpy_connp_methods[] = {
+	{ "get_request_header", htpy_connp_get_request_header, METH_VARARGS,
+	  "Return a string for the requested header." },
+	{ "get_response_header", htpy_connp_get_response_header, METH_VARARGS,
+	  "Return a string for the requested header." },
+	{ "get_all_request_headers", htpy_connp_get_all_request_headers,
+	  METH_NOARGS, "Return a dictionary of all request headers." },
+	{ "get_all_response_headers", htpy_connp_get_all_response_headers,
+	  METH_NOARGS, "Return a dictionary of all response headers." },
+	{ "get_request_headers_view", htpy_connp_get_request_headers_view,
+	  METH_NOARGS, "Return a read only view of the request headers." },
+	{ "get_response_headers_view", htpy_connp_get_response_headers_view,
+	  METH_NOARGS, "Return a read only view of the response headers." },
+	{ "get_response_status", htpy_connp_get_response_status, METH_VARARGS,
+	  "Return the response status number as an integer." },
+	{ "get_response_status_string", htpy_connp_get_response_status_string, METH_VARARGS,
+	  "Return the response status as string." },
+	{ "get_response_line", htpy_connp_get_response_line, METH_VARARGS,
+	  "Return the response status line as string." },
+	{ "get_request_line", htpy_connp_get_request_line, METH_VARARGS,
+	  "Return the request line as string." },
+	{ "register_request_start", htpy_connp_register_request_start,
+	  METH_VARARGS, "Register a hook for start of a request." },
+	{ "register_request_line", htpy_connp_register_request_line, METH_VARARGS,
+	  "Register a hook for right after request line has been parsed." },
+	{ "register_request_uri_normalize",
+	  htpy_connp_register_request_uri_normalize, METH_VARARGS,
+	  "Register a hook for right before the URI is normalized." },
+	{ "get_response_message_length", htpy_connp_get_response_message_length, METH_VARARGS,
+	  "Return the response message length before decompressed and dechunked." },
+	{ "get_request_message_length", htpy_connp_get_request_message_length, METH_VARARGS,
+	  "Return the request message length before decompressed and dechunked." },
+	{ "get_response_entity_length", htpy_connp_get_response_entity_length, METH_VARARGS,
+	  "Return the response message length after decomressed and dechunked." },
+	{ "get_request_entity_length", htpy_connp_get_request_entity_length, METH_VARARGS,
+	  "Return the request message length after decompressed and dechunked." },
+	{ "register_request_headers", htpy_connp_register_request_headers,
+	  METH_VARARGS,
+	  "Register a hook for right after headers have been parsed and sanity checked." },
+	{ "register_request_header_data", htpy_connp_register_request_header_data,
+	  METH_VARARGS,
+	  "Register a hook for right as headers are being parsed and sanity checked." },
+	{ "register_request_body_data", htpy_connp_register_request_body_data,
+	  METH_VARARGS,
+	  "Register a hook for when a piece of request body data is processed." },
+	{ "register_request_file_data", htpy_connp_register_request_file_data,
+	  METH_VARARGS,
+	  "Register a hook for when a full request body data is processed." },
+	{ "register_request_trailer", htpy_connp_register_request_trailer,
+	  METH_VARARGS,
+	  "Register a hook for request trailer completion." },
+	{ "register_request_trailer_data", htpy_connp_register_request_trailer_data,
+	  METH_VARARGS,
+	  "Register a hook request trialer data." },
+	{ "register_request_complete", htpy_connp_register_request_complete, METH_VARARGS,
+	  "Register a callback for when the entire request is parsed." },
+	{ "register_response_start", htpy_connp_register_response_start,
+	  METH_VARARGS,
+	  "Register a hook for as soon as a response is about to start." },
+	{ "register_response_line", htpy_connp_register_response_line,
+	  METH_VARARGS,
+	  "Register a hook for right after response line has been parsed." },
+	{ "register_response_headers", htpy_connp_register_response_headers,
+	  METH_VARARGS, "Register a hook for right after headers have been parsed and sanity checked." },
+	{ "register_response_header_data", htpy_connp_register_response_header_data,
+	  METH_VARARGS, "Register a hook for right as headers have been parsed and sanity checked." },
+	{ "register_response_body_data", htpy_connp_register_response_body_data,
+	  METH_VARARGS,
+	  "Register a hook for when a piece of response body data is processed. Chunked and gzip'ed data are handled." },
+	{ "register_response_trailer", htpy_connp_register_response_trailer,
+	  METH_VARARGS,
+	  "Register a hook for response trailer completion." },
+	{ "register_response_trailer_data", htpy_connp_register_response_trailer_data,
+	  METH_VARARGS,
+	  "Register a hook for response trailer data." },
+	{ "register_response_complete", htpy_connp_register_response_complete, METH_VARARGS,
+	  "Register a hook for right after an entire response has been parsed." },
+	{ "register_transaction_complete", htpy_connp_register_transaction_complete, METH_VARARGS,
+	  "Register a hook for right after a transaction has completed." },
+	{ "register_log", htpy_connp_register_log, METH_VARARGS,
+	  "Register a callback for when a log message is generated." },
+	{ "set_obj", htpy_connp_set_obj, METH_VARARGS,
+	  "Set arbitrary python object to be passed to callbacks." },
+	{ "del_obj", htpy_connp_del_obj, METH_VARARGS,
+	  "Remove arbitrary python object being passed to callbacks." },
+	{ "reset", htpy_connp_reset, METH_NOARGS,
+	  "Reset the parser for a new connection, keeping its callbacks." },
+	{ "req_data", (PyCFunction) htpy_connp_req_data, METH_VARARGS | METH_KEYWORDS,
+	  "Parse a request." },
+	{ "feed_many", htpy_connp_feed_many, METH_VARARGS,
+	  "Parse a sequence of (direction, timestamp, data) tuples." },
+	{ "req_data_consumed", htpy_connp_req_data_consumed, METH_NOARGS,
+	  "Return amount of data consumed." },
+	{ "res_data", (PyCFunction) htpy_connp_res_data, METH_VARARGS | METH_KEYWORDS,
+	  "Parse a response." },
+	{ "res_data_consumed", htpy_connp_res_data_consumed, METH_NOARGS,
+	  "Return amount of data consumed." },
+	{ "req_gap", htpy_connp_req_gap, METH_VARARGS,
+	  "Tell the parser length bytes of request data were lost." },
+	{ "res_gap", htpy_connp_res_gap, METH_VARARGS,
+	  "Tell the parser length bytes of response data were lost." },
+	{ "get_last_error", htpy_connp_get_last_error, METH_NOARGS,
+	  "Return a dictionary of the last error for the parser." },
+	{ "clear_error", htpy_connp_clear_error, METH_NOARGS,
+	  "Clear last error for the parser." },
+	{ "get_request_protocol", htpy_connp_get_request_protocol, METH_NOARGS,
+	  "Return request protocol as a string." },
+	{ "get_request_protocol_number", htpy_connp_get_request_protocol_number, METH_NOARGS,
+	  "Return request protocol number." },
+	{ "get_response_protocol", htpy_connp_get_response_protocol, METH_NOARGS,
+	  "Return response protocol as a string." },
+	{ "get_response_protocol_number", htpy_connp_get_response_protocol_number, METH_NOARGS,
+	  "Return response protocol number." },
+	{ "get_uri", htpy_connp_get_uri, METH_NOARGS,
+	  "Return a dictionary of the URI." },
+	{ "get_uri_component", htpy_connp_get_uri_component, METH_VARARGS,
+	  "Return one part of the parsed URI, or None." },
+	{ "get_method", htpy_connp_get_method, METH_NOARGS,
+	  "Return the request method as a string." },
+	{ "get_in_tx", htpy_connp_get_in_tx, METH_NOARGS,
+	  "Return the transaction object for the current request." },
+	{ "get_out_tx", htpy_connp_get_out_tx, METH_NOARGS,
+	  "Return the transaction object for the current response." },
+	{ "get_transaction_times", htpy_connp_get_transaction_times, METH_NOARGS,
+	  "Return a dictionary of the start and complete times of the transaction." },
+	{ "get_body_digests", htpy_connp_get_body_digests, METH_NOARGS,
+	  "Return the body digests of the last transaction." },
+	{ "get_memory_usage", htpy_connp_get_memory_usage, METH_NOARGS,
+	  "Return an estimate of the memory held by the connection parser." },
+	{ "get_log_stats", htpy_connp_get_log_stats, METH_NOARGS,
+	  "Return a dictionary of how many log messages were passed to the log callback and left out." },
+	{ "get_stats", htpy_connp_get_stats, METH_NOARGS,
+	  "Return a dictionary of the counts and times of the connection parser." },
+	{ "drain_events", htpy_connp_drain_events, METH_NOARGS,
+	  "Return the queued events and their data, and empty the queue." },
+	{ "flush_logs", htpy_connp_flush_logs, METH_NOARGS,
+	  "Pass batched log messages to the log callback now." },
+	{ "serialize", htpy_connp_serialize, METH_NOARGS,
+	  "Return a checkpoint of the connection parser as a string." },
+	{ "restore", htpy_connp_restore, METH_VARARGS | METH_CLASS,
+	  "Return a new connection parser with the state of a checkpoint." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_connp_members[] = {
+	{ "cfg", T_OBJECT_EX, offsetof(htpy_connp, cfg), 0, "Configuration object"},
+	{ NULL }
+};
+
+static PyTypeObject htpy_connp_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.connp",                    /* tp_name */
+	sizeof(htpy_connp),              /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_connp_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	0,                               /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"connp object",                  /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_connp_methods,              /* tp_methods */
+	htpy_connp_members,              /* tp_members */
+	0,                               /* tp_getset */
+	0,                               /* tp_base */
+	0,                               /* tp_dict */
+	0,                               /* tp_descr_get */
+	0,                               /* tp_descr_set */
+	0,                               /* tp_dictoffset */
+	(initproc) htpy_connp_init,      /* tp_init */
+	0,                               /* tp_alloc */
+	htpy_connp_new,                  /* tp_new */
+};
+
+/*
+ * A pool of native worker threads which parse data for many connection
+ * parsers at once. Each connection parser is always handed to the same
+ * worker so the data for a given connection is parsed in the order it was
+ * submitted. Workers only take the GIL when a python callback fires.
+ *
+ * Work items which have been parsed are not released by the workers as
+ * doing so would require the GIL. Instead they are put on a done list
+ * which is reaped the next time python calls into the pool.
+ */
+typedef struct htpy_work {
+	struct htpy_work *next;
+	htpy_connp *connp;
+	Py_buffer buf;
+	const unsigned char *data;
+	size_t len;
+	int has_ts;
+	htp_time_t ts;
+	int direction;
+	int status;
+} htpy_work;
+
+struct htpy_pool;
+
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	htpy_work *head;
+	htpy_work *tail;
+	int shutdown;
+	struct htpy_pool *pool;
+} htpy_worker;
+
+typedef struct htpy_pool {
+	PyObject_HEAD
+	htpy_worker *workers;
+	int nworkers;
+	int running;
+	/* Protects done and pending. */
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	htpy_work *done;
+	size_t pending;
+	/* List of (connp, status) tuples for feeds which did not return OK. */
+	PyObject *failures;
+	/* Where the workers run callbacks. */
+	PyInterpreterState *interp;
+} htpy_pool;
+
+static void *htpy_pool_worker(void *arg) {
+	htpy_worker *w = (htpy_worker *) arg;
+	htpy_pool *pool = w->pool;
+	htpy_work *work;
+	PyThreadState *tstate;
+	PyObject *prev;
+
+	/* For callbacks to take the GIL with, see htpy_gil_ensure(). */
+	tstate = PyThreadState_New(pool->interp);
+	if (!tstate)
+		Py_FatalError("Unable to create a thread state for a pool worker");
+	htpy_saved_tstate = tstate;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->head && !w->shutdown)
+			pthread_cond_wait(&w->cond, &w->lock);
+		work = w->head;
+		if (!work) {
+			/* Shutting down and nothing is left to parse. */
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		w->head = work->next;
+		if (!w->head)
+			w->tail = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		pthread_mutex_lock(&work->connp->lock);
+		prev = htpy_current_connp;
+		htpy_current_connp = (PyObject *) work->connp;
+		work->status = htpy_parse(work->connp, work->direction, work->has_ts ? &work->ts : NULL, work->data, work->len);
+		htpy_current_connp = prev;
+		pthread_mutex_unlock(&work->connp->lock);
+
+		pthread_mutex_lock(&pool->lock);
+		work->next = pool->done;
+		pool->done = work;
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idle);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	PyEval_RestoreThread(tstate);
+	PyThreadState_Clear(tstate);
+	PyThreadState_DeleteCurrent();
+	htpy_saved_tstate = NULL;
+
+	return NULL;
+}
+
+/*
+ * Release finished work items. Must be called with the GIL held. Returns
+ * -1 if recording a failure failed, in which case an exception is set.
+ */
+static int htpy_pool_reap(htpy_pool *self) {
+	htpy_work *work, *next;
+	PyObject *failure;
+	int ret = 0;
+
+	pthread_mutex_lock(&self->lock);
+	work = self->done;
+	self->done = NULL;
+	pthread_mutex_unlock(&self->lock);
+
+	for (; work; work = next) {
+		next = work->next;
+		if (ret == 0 && (work->status == HTP_STREAM_ERROR || work->status == HTP_STREAM_STOP)) {
+			failure = Py_BuildValue("(Oi)", (PyObject *) work->connp, work->status);
+			if (!failure || PyList_Append(self->failures, failure) == -1)
+				ret = -1;
+			Py_XDECREF(failure);
+		}
+		Py_DECREF(work->connp);
+		PyBuffer_Release(&work->buf);
+		PyMem_Free(work);
+	}
+
+	return ret;
+}
+
+/* Stop and join all worker threads. Must be called with the GIL held. */
+static void htpy_pool_stop(htpy_pool *self) {
+	int i;
+
+	if (!self->running)
+		return;
+	self->running = 0;
+
+	for (i = 0; i < self->nworkers; i++) {
+		pthread_mutex_lock(&self->workers[i].lock);
+		self->workers[i].shutdown = 1;
+		pthread_cond_signal(&self->workers[i].cond);
+		pthread_mutex_unlock(&self->workers[i].lock);
+	}
+
+	/* Workers may need the GIL to finish running callbacks. */
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < self->nworkers; i++)
+		pthread_join(self->workers[i].thread, NULL);
+	Py_END_ALLOW_THREADS
+
+	for (i = 0; i < self->nworkers; i++) {
+		pthread_cond_destroy(&self->workers[i].cond);
+		pthread_mutex_destroy(&self->workers[i].lock);
+	}
+}
+
+static PyObject *htpy_pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	htpy_pool *self;
+
+	self = (htpy_pool *) type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	if (pthread_mutex_init(&self->lock, NULL) != 0) {
+		HTPY_FREE(self);
+		PyErr_SetString(htpy_get_state()->error, "Unable to create pool lock.");
+		return NULL;
+	}
+	pthread_cond_init(&self->idle, NULL);
+
+	return (PyObject *) self;
+}
+
+static int htpy_pool_init(htpy_pool *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "workers", NULL };
+	int nworkers = 0;
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:htpy_pool_init", kwlist, &nworkers))
+		return -1;
+
+	if (self->running) {
+		PyErr_SetString(htpy_get_state()->error, "Pool is already running.");
+		return -1;
+	}
+
+	/* Default to one worker per online CPU. */
+	if (nworkers <= 0)
+		nworkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0)
+		nworkers = 1;
+
+	if (!self->failures) {
+		self->failures = PyList_New(0);
+		if (!self->failures)
+			return -1;
+	}
+
+	PyMem_Free(self->workers);
+	self->workers = PyMem_Malloc(sizeof(htpy_worker) * nworkers);
+	if (!self->workers) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	memset(self->workers, 0, sizeof(htpy_worker) * nworkers);
+	self->interp = PyThreadState_Get()->interp;
+
+	for (i = 0; i < nworkers; i++) {
+		self->workers[i].pool = self;
+		pthread_mutex_init(&self->workers[i].lock, NULL);
+		pthread_cond_init(&self->workers[i].cond, NULL);
+		if (pthread_create(&self->workers[i].thread, NULL, htpy_pool_worker, &self->workers[i]) != 0) {
+			pthread_cond_destroy(&self->workers[i].cond);
+			pthread_mutex_destroy(&self->workers[i].lock);
+			self->nworkers = i;
+			self->running = 1;
+			htpy_pool_stop(self);
+			PyErr_SetString(htpy_get_state()->error, "Unable to start worker thread.");
+			return -1;
+		}
+	}
+
+	self->nworkers = nworkers;
+	self->running = 1;
+
+	return 0;
+}
+
+static void htpy_pool_dealloc(htpy_pool *self) {
+	htpy_pool_stop(self);
+	if (htpy_pool_reap(self) == -1)
+		PyErr_Clear();
+	Py_XDECREF(self->failures);
+	PyMem_Free(self->workers);
+	pthread_cond_destroy(&self->idle);
+	pthread_mutex_destroy(&self->lock);
+	HTPY_FREE(self);
+}
+
+static PyObject *htpy_pool_submit(htpy_pool *self, PyObject *args, PyObject *kwds, int direction) {
+	static char *kwlist[] = { "cp", "data", "offset", "length", "timestamp", NULL };
+	PyObject *cp;
+	Py_ssize_t offset = 0;
+	Py_ssize_t length = -1;
+	PyObject *ts_obj = NULL;
+	htpy_work *work;
+	htpy_worker *w;
+	size_t h;
+
+	if (!self->running) {
+		PyErr_SetString(htpy_get_state()->error, "Pool is not running.");
+		return NULL;
+	}
+
+	if (htpy_pool_reap(self) == -1)
+		return NULL;
+
+	work = PyMem_Malloc(sizeof(htpy_work));
+	if (!work)
+		return PyErr_NoMemory();
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!s*|nnO:htpy_pool_submit", kwlist, htpy_get_state()->connp_type, &cp, &work->buf, &offset, &length, &ts_obj)) {
+		PyMem_Free(work);
+		return NULL;
+	}
+
+	work->has_ts = htpy_parse_timestamp(ts_obj, &work->ts);
+	if (work->has_ts == -1 || htpy_buffer_slice(&work->buf, offset, length, &work->data, &work->len) == -1) {
+		PyBuffer_Release(&work->buf);
+		PyMem_Free(work);
+		return NULL;
+	}
+
+	if (!((htpy_connp *) cp)->connp) {
+		PyBuffer_Release(&work->buf);
+		PyMem_Free(work);
+		PyErr_SetString(htpy_get_state()->error, "Connection parser is not initialized.");
+		return NULL;
+	}
+
+	Py_INCREF(cp);
+	work->next = NULL;
+	work->connp = (htpy_connp *) cp;
+	work->direction = direction;
+	work->status = HTP_STREAM_OPEN;
+
+	/* Fibonacci hash of the parser address picks the worker. */
+	h = (size_t) ((uintptr_t) cp * (uintptr_t) 0x9E3779B97F4A7C15ULL);
+	w = &self->workers[(h >> (sizeof(size_t) * 4)) % self->nworkers];
+
+	pthread_mutex_lock(&self->lock);
+	self->pending++;
+	pthread_mutex_unlock(&self->lock);
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail)
+		w->tail->next = work;
+	else
+		w->head = work;
+	w->tail = work;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *htpy_pool_req_data(PyObject *self, PyObject *args, PyObject *kwds) {
+	return htpy_pool_submit((htpy_pool *) self, args, kwds, HTPY_REQUEST);
+}
+
+static PyObject *htpy_pool_res_data(PyObject *self, PyObject *args, PyObject *kwds) {
+	return htpy_pool_submit((htpy_pool *) self, args, kwds, HTPY_RESPONSE);
+}
+
+/*
+ * Block until every submitted piece of data has been parsed. Returns a
+ * list of (connp, status) tuples for every feed which resulted in
+ * HTP_STREAM_ERROR or HTP_STREAM_STOP since the last call.
+ */
+static PyObject *htpy_pool_wait(PyObject *self, PyObject *args) {
+	htpy_pool *pool = (htpy_pool *) self;
+	PyObject *ret;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	Py_END_ALLOW_THREADS
+
+	if (htpy_pool_reap(pool) == -1)
+		return NULL;
+
+	ret = pool->failures;
+	pool->failures = PyList_New(0);
+	if (!pool->failures) {
+		pool->failures = ret;
+		return NULL;
+	}
+
+	return ret;
+}
+
+static PyObject *htpy_pool_close(PyObject *self, PyObject *args) {
+	htpy_pool_stop((htpy_pool *) self);
+	if (htpy_pool_reap((htpy_pool *) self) == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef htpy_pool_methods[] = {
+	{ "req_data", (PyCFunction) htpy_pool_req_data, METH_VARARGS | METH_KEYWORDS,
+	  "Queue request data to be parsed by the given connection parser." },
+	{ "res_data", (PyCFunction) htpy_pool_res_data, METH_VARARGS | METH_KEYWORDS,
+	  "Queue response data to be parsed by the given connection parser." },
+	{ "wait", htpy_pool_wait, METH_NOARGS,
+	  "Wait for all queued data to be parsed and return a list of failures." },
+	{ "close", htpy_pool_close, METH_NOARGS,
+	  "Finish parsing queued data and stop all worker threads." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_pool_members[] = {
+	{ "workers", T_INT, offsetof(htpy_pool, nworkers), READONLY, "Number of worker threads"},
+	{ NULL }
+};
+
+static PyTypeObject htpy_pool_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.pool",                     /* tp_name */
+	sizeof(htpy_pool),               /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_pool_dealloc,  /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	0,                               /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"pool object",                   /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_pool_methods,               /* tp_methods */
+	htpy_pool_members,               /* tp_members */
+	0,                               /* tp_getset */
+	0,                               /* tp_base */
+	0,                               /* tp_dict */
+	0,                               /* tp_descr_get */
+	0,                               /* tp_descr_set */
+	0,                               /* tp_dictoffset */
+	(initproc) htpy_pool_init,       /* tp_init */
+	0,                               /* tp_alloc */
+	htpy_pool_new,                   /* tp_new */
+};
+
+/*
+ * Connection parser pools hand out connection parsers made from one config
+ * and take them back when the connection is done, resetting them instead of
+ * destroying them. Up to size parsers are kept for reuse.
+ */
+typedef struct {
+	PyObject_HEAD
+	PyObject *cfg;
+	PyObject **free;
+	Py_ssize_t nfree;
+	Py_ssize_t size;
+} htpy_connp_pool;
+
+static PyObject *htpy_connp_pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	htpy_connp_pool *self;
+
+	self = (htpy_connp_pool *) type->tp_alloc(type, 0);
+
+	return (PyObject *) self;
+}
+
+static int htpy_connp_pool_init(htpy_connp_pool *self, PyObject *args, PyObject *kwds) {
+	PyObject *cfg, *cp;
+	Py_ssize_t size, i;
+
+	if (!PyArg_ParseTuple(args, "O!n:htpy_connp_pool_init", htpy_get_state()->config_type, &cfg, &size))
+		return -1;
+
+	if (self->cfg) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser pool is already initialized.");
+		return -1;
+	}
+
+	if (size < 0) {
+		PyErr_SetString(PyExc_ValueError, "size must not be negative");
+		return -1;
+	}
+
+	self->free = PyMem_New(PyObject *, size ? size : 1);
+	if (!self->free) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	Py_INCREF(cfg);
+	self->cfg = cfg;
+	self->size = size;
+
+	for (i = 0; i < size; i++) {
+		cp = PyObject_CallFunctionObjArgs((PyObject *) htpy_get_state()->connp_type, cfg, NULL);
+		if (!cp)
+			return -1;
+		self->free[self->nfree++] = cp;
+	}
+
+	return 0;
+}
+
+static void htpy_connp_pool_dealloc(htpy_connp_pool *self) {
+	Py_ssize_t i;
+
+	for (i = 0; i < self->nfree; i++)
+		Py_DECREF(self->free[i]);
+	PyMem_Free(self->free);
+	Py_XDECREF(self->cfg);
+	HTPY_FREE(self);
+}
+
+static PyObject *htpy_connp_pool_get(PyObject *self, PyObject *args) {
+	htpy_connp_pool *pool = (htpy_connp_pool *) self;
+
+	if (!pool->cfg) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser pool is not initialized.");
+		return NULL;
+	}
+
+	if (pool->nfree > 0)
+		return pool->free[--pool->nfree];
+
+	return PyObject_CallFunctionObjArgs((PyObject *) htpy_get_state()->connp_type, pool->cfg, NULL);
+}
+
+static PyObject *htpy_connp_pool_put(PyObject *self, PyObject *args) {
+	htpy_connp_pool *pool = (htpy_connp_pool *) self;
+	PyObject *cp;
+
+	if (!PyArg_ParseTuple(args, "O!:htpy_connp_pool_put", htpy_get_state()->connp_type, &cp))
+		return NULL;
+
+	if (((htpy_connp *) cp)->cfg != pool->cfg) {
+		PyErr_SetString(htpy_get_state()->error, "Connection parser was not made with the config of this pool.");
+		return NULL;
+	}
+
+	/* Not worth resetting if it is not going to be kept. */
+	if (pool->nfree >= pool->size)
+		Py_RETURN_NONE;
+
+	if (htpy_connp_reset_obj((htpy_connp *) cp) == -1)
+		return NULL;
+
+	Py_INCREF(cp);
+	pool->free[pool->nfree++] = cp;
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef htpy_connp_pool_methods[] = {
+	{ "get", htpy_connp_pool_get, METH_NOARGS,
+	  "Return a connection parser, reusing one if there is one available." },
+	{ "put", htpy_connp_pool_put, METH_VARARGS,
+	  "Reset a connection parser and keep it for reuse." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_connp_pool_members[] = {
+	{ "size", T_PYSSIZET, offsetof(htpy_connp_pool, size), READONLY, "Number of parsers kept for reuse" },
+	{ "available", T_PYSSIZET, offsetof(htpy_connp_pool, nfree), READONLY, "Number of parsers ready to be handed out" },
+	{ "config", T_OBJECT, offsetof(htpy_connp_pool, cfg), READONLY, "Config the parsers are made with" },
+	{ NULL }
+};
+
+static PyTypeObject htpy_connp_pool_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.connp_pool",               /* tp_name */
+	sizeof(htpy_connp_pool),         /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_connp_pool_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	0,                               /* tp_as_sequence */
+	0,                               /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"connection parser pool object", /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_connp_pool_methods,         /* tp_methods */
+	htpy_connp_pool_members,         /* tp_members */
+	0,                               /* tp_getset */
+	0,                               /* tp_base */
+	0,                               /* tp_dict */
+	0,                               /* tp_descr_get */
+	0,                               /* tp_descr_set */
+	0,                               /* tp_dictoffset */
+	(initproc) htpy_connp_pool_init, /* tp_init */
+	0,                               /* tp_alloc */
+	htpy_connp_pool_new,             /* tp_new */
+};
+
+/*
+ * Flow tables own a connection parser for each flow, keyed by any hashable
+ * object. They keep the flows in the order they were last fed, which is
+ * the order they are evicted in: when they have been idle for longer than
+ * idle_timeout, when there are more than max_flows of them, or when all of
+ * them together hold more than max_memory. A single flow holding more than
+ * max_flow_memory is evicted on its own. Evicted parsers are closed first,
+ * so the callbacks for whatever they were in the middle of still run.
  *
- * XXX: Add support for removing callbacks?
+ * Memory is what htpy_connp_memory() estimates, measured each time a flow
+ * is fed.
  */
-#define CALLBACK(CB) \
-int htpy_##CB##_callback(htp_tx_t *tx) { \
-	PyObject *obj = (PyObject *) htp_connp_get_user_data(tx->connp); \
-	PyObject *arglist; \
-	PyObject *res; \
-	long i; \
-	if (((htpy_connp *) obj)->obj_store) \
-		arglist = Py_BuildValue("(OO)", obj, ((htpy_connp *) obj)->obj_store); \
-	else \
-		arglist = Py_BuildValue("(O)", obj); \
-	if (!arglist) \
-		return HTP_ERROR; \
-	res = PyObject_CallObject(((htpy_connp *) obj)->CB##_callback, arglist); \
-	Py_DECREF(arglist); \
-	if (PyErr_Occurred() != NULL) { \
-		PyErr_PrintEx(0); \
-		return HTP_ERROR; \
-	} \
-	i = PyInt_AsLong(res); \
-	Py_DECREF(res); \
-	return((int) i); \
+#define HTPY_EVICT_IDLE 1
+#define HTPY_EVICT_FLOWS 2
+#define HTPY_EVICT_MEMORY 3
+#define HTPY_EVICT_SIZE 4
+
+typedef struct htpy_table_flow {
+	/* Next in the hash bucket. */
+	struct htpy_table_flow *next;
+	/* Neighbours in order of activity. */
+	struct htpy_table_flow *older;
+	struct htpy_table_flow *newer;
+	PyObject *key;
+	long hash;
+	PyObject *connp;
+	double last;
+	size_t memory;
+} htpy_table_flow;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *cfg;
+	PyObject *evict_callback;
+	htpy_table_flow **buckets;
+	size_t nbuckets;
+	Py_ssize_t nflows;
+	htpy_table_flow *oldest;
+	htpy_table_flow *newest;
+	/* Limits, zero for none. */
+	double idle_timeout;
+	Py_ssize_t max_flows;
+	Py_ssize_t max_memory;
+	Py_ssize_t max_flow_memory;
+	Py_ssize_t memory;
+	/* Latest time any flow was fed at. */
+	double now;
+	/* Set while flows are being fed or removed, which may run callbacks. */
+	int busy;
+	unsigned long long evicted[HTPY_EVICT_SIZE + 1];
+} htpy_flow_table;
+
+static PyTypeObject htpy_flow_table_type;
+
+static PyObject *htpy_flow_table_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	htpy_flow_table *self;
+
+	self = (htpy_flow_table *) type->tp_alloc(type, 0);
+
+	return (PyObject *) self;
+}
+
+static int htpy_flow_table_init(htpy_flow_table *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "config", "idle_timeout", "max_flows", "max_memory", "max_flow_memory", "evict_callback", NULL };
+	PyObject *cfg, *evict_callback = NULL;
+	double idle_timeout = 0;
+	Py_ssize_t max_flows = 0, max_memory = 0, max_flow_memory = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|dnnnO:htpy_flow_table_init", kwlist, htpy_get_state()->config_type, &cfg, &idle_timeout, &max_flows, &max_memory, &max_flow_memory, &evict_callback))
+		return -1;
+
+	if (self->cfg) {
+		PyErr_SetString(htpy_get_state()->error, "Flow table is already initialized.");
+		return -1;
+	}
+
+	if (evict_callback == Py_None)
+		evict_callback = NULL;
+	if (evict_callback && !PyCallable_Check(evict_callback)) {
+		PyErr_SetString(PyExc_TypeError, "evict_callback must be callable");
+		return -1;
+	}
+
+	if (idle_timeout < 0 || max_flows < 0 || max_memory < 0 || max_flow_memory < 0) {
+		PyErr_SetString(PyExc_ValueError, "limits must not be negative");
+		return -1;
+	}
+
+	self->nbuckets = 256;
+	self->buckets = calloc(self->nbuckets, sizeof(htpy_table_flow *));
+	if (!self->buckets) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	Py_INCREF(cfg);
+	self->cfg = cfg;
+	Py_XINCREF(evict_callback);
+	self->evict_callback = evict_callback;
+	self->idle_timeout = idle_timeout;
+	self->max_flows = max_flows;
+	self->max_memory = max_memory;
+	self->max_flow_memory = max_flow_memory;
+
+	return 0;
+}
+
+static void htpy_flow_table_dealloc(htpy_flow_table *self) {
+	htpy_table_flow *flow, *next;
+
+	for (flow = self->oldest; flow; flow = next) {
+		next = flow->newer;
+		Py_DECREF(flow->key);
+		Py_DECREF(flow->connp);
+		free(flow);
+	}
+	free(self->buckets);
+	Py_XDECREF(self->evict_callback);
+	Py_XDECREF(self->cfg);
+	HTPY_FREE(self);
+}
+
+static int htpy_flow_table_check(htpy_flow_table *self) {
+	if (!self->cfg) {
+		PyErr_SetString(htpy_get_state()->error, "Flow table is not initialized.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Flows can not be added or removed from callbacks run while doing that. */
+static int htpy_flow_table_enter(htpy_flow_table *self) {
+	if (htpy_flow_table_check(self) == -1)
+		return -1;
+
+	if (self->busy) {
+		PyErr_SetString(htpy_get_state()->error, "Flow table is busy.");
+		return -1;
+	}
+
+	self->busy = 1;
+	return 0;
 }
 
-CALLBACK(request_start)
-CALLBACK(request_line)
-CALLBACK(request_uri_normalize)
-CALLBACK(request_headers)
-CALLBACK(request_trailer)
-CALLBACK(request_complete)
-CALLBACK(response_start)
-CALLBACK(response_line)
-CALLBACK(response_headers)
-CALLBACK(response_trailer)
-CALLBACK(response_complete)
-CALLBACK(transaction_complete)
+/* Returns NULL without an exception set if there is no such flow. */
+static htpy_table_flow *htpy_flow_table_find(htpy_flow_table *self, PyObject *key, long hash) {
+	htpy_table_flow *flow;
+	int eq;
+
+	for (flow = self->buckets[hash & (self->nbuckets - 1)]; flow; flow = flow->next) {
+		if (flow->hash != hash)
+			continue;
+		if (flow->key == key)
+			return flow;
+		eq = PyObject_RichCompareBool(flow->key, key, Py_EQ);
+		if (eq == -1)
+			return NULL;
+		if (eq)
+			return flow;
+	}
 
-/* These callbacks take a htp_tx_data_t pointer. */
-#define CALLBACK_TX(CB) \
-int htpy_##CB##_callback(htp_tx_data_t *txd) { \
-	PyObject *obj = (PyObject *) htp_connp_get_user_data(txd->tx->connp); \
-	PyObject *arglist; \
-	PyObject *res; \
-	long i; \
-	if (((htpy_connp *) obj)->obj_store) \
-		arglist = Py_BuildValue("(s#IO)", txd->data, txd->len, txd->len, ((htpy_connp *) obj)->obj_store); \
-	else \
-		arglist = Py_BuildValue("(s#I)", txd->data, txd->len, txd->len); \
-	if (!arglist) \
-		return HTP_ERROR; \
-	res = PyObject_CallObject(((htpy_connp *) obj)->CB##_callback, arglist); \
-	Py_DECREF(arglist); \
-	if (PyErr_Occurred() != NULL) { \
-		PyErr_PrintEx(0); \
-		return HTP_ERROR; \
-	} \
-	i = PyInt_AsLong(res); \
-	Py_DECREF(res); \
-	return((int) i); \
+	return NULL;
 }
 
-CALLBACK_TX(request_header_data)
-CALLBACK_TX(request_body_data)
-CALLBACK_TX(request_trailer_data)
-CALLBACK_TX(response_header_data)
-CALLBACK_TX(response_body_data)
-CALLBACK_TX(response_trailer_data)
+static void htpy_flow_table_grow(htpy_flow_table *self) {
+	size_t nbuckets = self->nbuckets * 2, i;
+	htpy_table_flow **buckets = calloc(nbuckets, sizeof(htpy_table_flow *));
+	htpy_table_flow *flow, *next;
 
-/* Another special case callback. This one takes a htp_file_data_t pointer. */
-int htpy_request_file_data_callback(htp_file_data_t *file_data) {
-	long i;
+	/* Longer chains are not the end of the world. */
+	if (!buckets)
+		return;
+
+	for (i = 0; i < self->nbuckets; i++) {
+		for (flow = self->buckets[i]; flow; flow = next) {
+			next = flow->next;
+			flow->next = buckets[flow->hash & (nbuckets - 1)];
+			buckets[flow->hash & (nbuckets - 1)] = flow;
+		}
+	}
+
+	free(self->buckets);
+	self->buckets = buckets;
+	self->nbuckets = nbuckets;
+}
+
+static void htpy_flow_table_unlink(htpy_flow_table *self, htpy_table_flow *flow) {
+	if (flow->older)
+		flow->older->newer = flow->newer;
+	else
+		self->oldest = flow->newer;
+	if (flow->newer)
+		flow->newer->older = flow->older;
+	else
+		self->newest = flow->older;
+	flow->older = flow->newer = NULL;
+}
+
+static void htpy_flow_table_append(htpy_flow_table *self, htpy_table_flow *flow) {
+	flow->older = self->newest;
+	if (self->newest)
+		self->newest->newer = flow;
+	else
+		self->oldest = flow;
+	self->newest = flow;
+}
+
+static void htpy_flow_table_touch(htpy_flow_table *self, htpy_table_flow *flow) {
+	if (self->newest == flow)
+		return;
+
+	htpy_flow_table_unlink(self, flow);
+	htpy_flow_table_append(self, flow);
+}
+
+/*
+ * Remove a flow, closing its parser first if asked to, and pass it to the
+ * evict callback if it is being evicted. Returns -1 with an exception set
+ * if closing the parser or the callback failed, the flow is gone anyway.
+ */
+static int htpy_flow_table_remove(htpy_flow_table *self, htpy_table_flow *flow, int reason, int close, const htp_time_t *ts) {
+	htpy_table_flow **p;
 	PyObject *res;
-	PyObject *arglist;
-	PyObject *data_key, *data_val;
-	PyObject *filename_key, *filename_val;
-	PyObject *tmpname_key, *tmpname_val;
-	PyObject *dict = PyDict_New();
-
-	if (!dict) {
-		PyErr_SetString(htpy_error, "Unable to create dictionary.");
-		return HTP_ERROR;
+	int ret = 0;
+
+	for (p = &self->buckets[flow->hash & (self->nbuckets - 1)]; *p; p = &(*p)->next) {
+		if (*p == flow) {
+			*p = flow->next;
+			break;
+		}
+	}
+	htpy_flow_table_unlink(self, flow);
+	self->nflows--;
+	self->memory -= flow->memory;
+
+	if (close && htpy_connp_close_obj(flow->connp, ts) == -1)
+		ret = -1;
+
+	if (reason) {
+		self->evicted[reason]++;
+		if (ret == 0 && self->evict_callback) {
+			res = PyObject_CallFunction(self->evict_callback, "OOi", flow->key, flow->connp, reason);
+			if (!res)
+				ret = -1;
+			Py_XDECREF(res);
+		}
 	}
 
-	data_key = Py_BuildValue("s", "data");
-	data_val = Py_BuildValue("s#", file_data->data, file_data->len);
-	if (!data_key || !data_val) {
-		Py_DECREF(dict);
-		return HTP_ERROR;
+	Py_DECREF(flow->key);
+	Py_DECREF(flow->connp);
+	free(flow);
+
+	return ret;
+}
+
+static void htpy_time_from_double(double d, htp_time_t *ts) {
+	ts->tv_sec = (long) d;
+	ts->tv_usec = (long) ((d - (double) ts->tv_sec) * 1000000.0);
+}
+
+/* Evict flows which have been idle for too long, oldest first. */
+static Py_ssize_t htpy_flow_table_expire_idle(htpy_flow_table *self, double now) {
+	htp_time_t ts;
+	Py_ssize_t n = 0;
+
+	if (self->idle_timeout <= 0)
+		return 0;
+
+	htpy_time_from_double(now, &ts);
+	while (self->oldest && self->oldest->last + self->idle_timeout < now) {
+		if (htpy_flow_table_remove(self, self->oldest, HTPY_EVICT_IDLE, 1, &ts) == -1)
+			return -1;
+		n++;
 	}
-	if (PyDict_SetItem(dict, data_key, data_val) == -1) {
-		Py_DECREF(dict);
-		return HTP_ERROR;
+
+	return n;
+}
+
+/* Enforce the limits after a flow has been fed. */
+static int htpy_flow_table_enforce(htpy_flow_table *self, htpy_table_flow *flow) {
+	htp_time_t ts;
+	size_t memory;
+
+	memory = htpy_connp_memory((htpy_connp *) flow->connp);
+	self->memory += (Py_ssize_t) memory - (Py_ssize_t) flow->memory;
+	flow->memory = memory;
+
+	htpy_time_from_double(self->now, &ts);
+	if (self->max_flow_memory && flow->memory > (size_t) self->max_flow_memory) {
+		if (htpy_flow_table_remove(self, flow, HTPY_EVICT_SIZE, 1, &ts) == -1)
+			return -1;
 	}
 
-	if (file_data->file->filename) {
-		filename_key = Py_BuildValue("s", "filename");
-		filename_val = Py_BuildValue("s#", bstr_ptr(file_data->file->filename), bstr_len(file_data->file->filename));
-		if (PyDict_SetItem(dict, filename_key, filename_val) == -1) {
-			Py_DECREF(dict);
-			return HTP_ERROR;
-		}
+	if (htpy_flow_table_expire_idle(self, self->now) == -1)
+		return -1;
+
+	while (self->max_memory && self->memory > self->max_memory && self->oldest) {
+		if (htpy_flow_table_remove(self, self->oldest, HTPY_EVICT_MEMORY, 1, &ts) == -1)
+			return -1;
 	}
 
-	if (file_data->file->tmpname) {
-		tmpname_key = Py_BuildValue("s", "tmpname");
-		tmpname_val = Py_BuildValue("s", file_data->file->tmpname);
-		if (PyDict_SetItem(dict, tmpname_key, tmpname_val) == -1) {
-			Py_DECREF(dict);
-			return HTP_ERROR;
+	return 0;
+}
+
+/* Find the flow for a key, adding one with a new parser if there is none. */
+static htpy_table_flow *htpy_flow_table_get_flow(htpy_flow_table *self, PyObject *key) {
+	htpy_table_flow *flow;
+	htp_time_t ts;
+	long hash;
+
+	hash = PyObject_Hash(key);
+	if (hash == -1)
+		return NULL;
+
+	flow = htpy_flow_table_find(self, key, hash);
+	if (flow || PyErr_Occurred())
+		return flow;
+
+	if (self->max_flows && self->nflows >= self->max_flows && self->oldest) {
+		htpy_time_from_double(self->now, &ts);
+		if (htpy_flow_table_remove(self, self->oldest, HTPY_EVICT_FLOWS, 1, &ts) == -1)
+			return NULL;
+	}
+
+	flow = calloc(1, sizeof(htpy_table_flow));
+	if (!flow) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	flow->connp = PyObject_CallFunctionObjArgs((PyObject *) htpy_get_state()->connp_type, self->cfg, NULL);
+	if (!flow->connp) {
+		free(flow);
+		return NULL;
+	}
+	Py_INCREF(key);
+	flow->key = key;
+	flow->hash = hash;
+	flow->last = self->now;
+
+	if ((size_t) self->nflows >= self->nbuckets)
+		htpy_flow_table_grow(self);
+	flow->next = self->buckets[hash & (self->nbuckets - 1)];
+	self->buckets[hash & (self->nbuckets - 1)] = flow;
+	self->nflows++;
+	htpy_flow_table_append(self, flow);
+
+	return flow;
+}
+
+/*
+ * Feed data to the parser of a flow. When no timestamp is given the
+ * current time is used for the activity of the flow, libhtp is not given
+ * one. A flow whose parser fails is removed.
+ */
+static PyObject *htpy_flow_table_data(PyObject *self, PyObject *args, PyObject *kwds, int direction) {
+	static char *kwlist[] = { "key", "data", "timestamp", NULL };
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	htpy_table_flow *flow;
+	PyObject *key, *ts_obj = NULL;
+	PyObject *ret = NULL;
+	Py_buffer buf;
+	htp_time_t ts;
+	int has_ts, x;
+	double now;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os*|O:htpy_flow_table_data", kwlist, &key, &buf, &ts_obj))
+		return NULL;
+
+	has_ts = htpy_parse_timestamp(ts_obj, &ts);
+	if (has_ts == -1 || htpy_flow_table_enter(table) == -1) {
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	if (has_ts) {
+		now = (double) ts.tv_sec + (double) ts.tv_usec / 1000000.0;
+	} else {
+		htp_time_t tv;
+		gettimeofday(&tv, NULL);
+		now = (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+	}
+	if (now > table->now)
+		table->now = now;
+
+	flow = htpy_flow_table_get_flow(table, key);
+	if (!flow)
+		goto out;
+	if (now > flow->last)
+		flow->last = now;
+	htpy_flow_table_touch(table, flow);
+
+	x = htpy_connp_feed(flow->connp, direction, has_ts ? &ts : NULL, buf.buf, buf.len);
+	if (x == -1)
+		goto out;
+
+	if (x == HTP_STREAM_ERROR || x == HTP_STREAM_STOP) {
+		htpy_flow_table_remove(table, flow, 0, 0, NULL);
+		ret = htpy_stream_status(x);
+		goto out;
+	}
+
+	if (htpy_flow_table_enforce(table, flow) == 0)
+		ret = htpy_stream_status(x);
+
+out:
+	table->busy = 0;
+	PyBuffer_Release(&buf);
+	return ret;
+}
+
+static PyObject *htpy_flow_table_req_data(PyObject *self, PyObject *args, PyObject *kwds) {
+	return htpy_flow_table_data(self, args, kwds, HTPY_REQUEST);
+}
+
+static PyObject *htpy_flow_table_res_data(PyObject *self, PyObject *args, PyObject *kwds) {
+	return htpy_flow_table_data(self, args, kwds, HTPY_RESPONSE);
+}
+
+static PyObject *htpy_flow_table_get(PyObject *self, PyObject *args) {
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	htpy_table_flow *flow;
+	PyObject *key;
+	long hash;
+
+	if (htpy_flow_table_check(table) == -1)
+		return NULL;
+
+	if (!PyArg_ParseTuple(args, "O:htpy_flow_table_get", &key))
+		return NULL;
+
+	hash = PyObject_Hash(key);
+	if (hash == -1)
+		return NULL;
+
+	flow = htpy_flow_table_find(table, key, hash);
+	if (!flow) {
+		if (PyErr_Occurred())
+			return NULL;
+		Py_RETURN_NONE;
+	}
+
+	Py_INCREF(flow->connp);
+	return flow->connp;
+}
+
+/* Close the parser of a flow and remove it. Returns whether there was one. */
+static PyObject *htpy_flow_table_close(PyObject *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "key", "timestamp", NULL };
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	htpy_table_flow *flow;
+	PyObject *key, *ts_obj = NULL;
+	htp_time_t ts;
+	int has_ts, x;
+	long hash;
+
+	if (htpy_flow_table_check(table) == -1)
+		return NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:htpy_flow_table_close", kwlist, &key, &ts_obj))
+		return NULL;
+
+	has_ts = htpy_parse_timestamp(ts_obj, &ts);
+	if (has_ts == -1)
+		return NULL;
+
+	hash = PyObject_Hash(key);
+	if (hash == -1)
+		return NULL;
+
+	flow = htpy_flow_table_find(table, key, hash);
+	if (!flow) {
+		if (PyErr_Occurred())
+			return NULL;
+		Py_RETURN_FALSE;
+	}
+
+	if (htpy_flow_table_enter(table) == -1)
+		return NULL;
+	x = htpy_flow_table_remove(table, flow, 0, 1, has_ts ? &ts : NULL);
+	table->busy = 0;
+	if (x == -1)
+		return NULL;
+
+	Py_RETURN_TRUE;
+}
+
+/*
+ * Evict the flows which have been idle for longer than idle_timeout at
+ * the given time, or the latest time any flow was fed at.
+ */
+static PyObject *htpy_flow_table_expire(PyObject *self, PyObject *args) {
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	PyObject *now_obj = NULL;
+	double now;
+	Py_ssize_t n;
+
+	if (!PyArg_ParseTuple(args, "|O:htpy_flow_table_expire", &now_obj))
+		return NULL;
+
+	now = table->now;
+	if (now_obj && now_obj != Py_None) {
+		now = PyFloat_AsDouble(now_obj);
+		if (now == -1.0 && PyErr_Occurred())
+			return NULL;
+		if (now > table->now)
+			table->now = now;
+	}
+
+	if (htpy_flow_table_enter(table) == -1)
+		return NULL;
+	n = htpy_flow_table_expire_idle(table, now);
+	table->busy = 0;
+	if (n == -1)
+		return NULL;
+
+	return PyInt_FromSsize_t(n);
+}
+
+/* Close and remove every flow, as at the end of a capture. */
+static PyObject *htpy_flow_table_close_all(PyObject *self, PyObject *args) {
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	htp_time_t ts;
+
+	if (htpy_flow_table_enter(table) == -1)
+		return NULL;
+
+	htpy_time_from_double(table->now, &ts);
+	while (table->oldest) {
+		if (htpy_flow_table_remove(table, table->oldest, 0, 1, &ts) == -1) {
+			table->busy = 0;
+			return NULL;
 		}
 	}
+	table->busy = 0;
 
-	arglist = Py_BuildValue("(O)", dict);
-	if (!arglist)
-		return HTP_ERROR;
+	Py_RETURN_NONE;
+}
 
-	res = PyObject_CallObject(request_file_data_callback, arglist);
-	Py_DECREF(arglist);
-	if (PyErr_Occurred() != NULL) {
-		PyErr_PrintEx(0);
-		return HTP_ERROR;
+static PyObject *htpy_flow_table_keys(PyObject *self, PyObject *args) {
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	htpy_table_flow *flow;
+	PyObject *ret;
+	Py_ssize_t i = 0;
+
+	ret = PyList_New(table->nflows);
+	if (!ret)
+		return NULL;
+
+	for (flow = table->oldest; flow; flow = flow->newer) {
+		Py_INCREF(flow->key);
+		PyList_SET_ITEM(ret, i++, flow->key);
 	}
-	i = PyInt_AsLong(res);
-	Py_DECREF(res);
-	return((int) i);
+
+	return ret;
 }
 
-int htpy_log_callback(htp_log_t *log) {
-	PyObject *obj = (PyObject *) htp_connp_get_user_data(log->connp);
-	PyObject *arglist = NULL;
-	PyObject *res;
-	long i;
+static PyObject *htpy_flow_table_get_stats(PyObject *self, PyObject *args) {
+	htpy_flow_table *table = (htpy_flow_table *) self;
 
-	if (((htpy_connp *) obj)->obj_store)
-		arglist = Py_BuildValue("(OsiO)", (htpy_connp *) obj, log->msg, log->level, ((htpy_connp *) obj)->obj_store);
-	else
-		arglist = Py_BuildValue("(Osi)", (htpy_connp *) obj, log->msg, log->level);
-	if (!arglist)
-		return HTP_ERROR;
+	return Py_BuildValue("{snsnsKsKsKsK}",
+	                     "flows", table->nflows,
+	                     "memory", table->memory,
+	                     "evicted_idle", table->evicted[HTPY_EVICT_IDLE],
+	                     "evicted_flows", table->evicted[HTPY_EVICT_FLOWS],
+	                     "evicted_memory", table->evicted[HTPY_EVICT_MEMORY],
+	                     "evicted_size", table->evicted[HTPY_EVICT_SIZE]);
+}
 
-	res = PyObject_CallObject(((htpy_connp *) obj)->log_callback, arglist);
-	Py_DECREF(arglist);
-	if (PyErr_Occurred() != NULL) {
-		PyErr_PrintEx(0);
-		return HTP_ERROR;
+static Py_ssize_t htpy_flow_table_length(PyObject *self) {
+	return ((htpy_flow_table *) self)->nflows;
+}
+
+static PyObject *htpy_flow_table_subscript(PyObject *self, PyObject *key) {
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	htpy_table_flow *flow;
+	long hash;
+
+	if (htpy_flow_table_check(table) == -1)
+		return NULL;
+
+	hash = PyObject_Hash(key);
+	if (hash == -1)
+		return NULL;
+
+	flow = htpy_flow_table_find(table, key, hash);
+	if (!flow) {
+		if (!PyErr_Occurred())
+			PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
 	}
-	i = PyInt_AsLong(res);
-	Py_DECREF(res);
-	return((int) i);
+
+	Py_INCREF(flow->connp);
+	return flow->connp;
 }
 
-/* Registering callbacks... */
-#define REGISTER_CALLBACK(CB) \
-static PyObject *htpy_connp_register_##CB(PyObject *self, PyObject *args) { \
-	PyObject *res = NULL; \
-	PyObject *temp; \
-	if (PyArg_ParseTuple(args, "O:htpy_connp_register_##CB", &temp)) { \
-		if (!PyCallable_Check(temp)) { \
-			PyErr_SetString(PyExc_TypeError, "parameter must be callable"); \
-			return NULL; \
-		} \
-		Py_XINCREF(temp); \
-		Py_XDECREF(((htpy_connp *) self)->CB##_callback); \
-		((htpy_connp *) self)->CB##_callback = temp; \
-		htp_config_register_##CB(((htpy_connp *) self)->connp->cfg, htpy_##CB##_callback); \
-		Py_INCREF(Py_None); \
-		res = Py_None; \
+static int htpy_flow_table_contains(PyObject *self, PyObject *key) {
+	htpy_flow_table *table = (htpy_flow_table *) self;
+	long hash;
+
+	if (htpy_flow_table_check(table) == -1)
+		return -1;
+
+	hash = PyObject_Hash(key);
+	if (hash == -1)
+		return -1;
+
+	if (htpy_flow_table_find(table, key, hash))
+		return 1;
+
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyMappingMethods htpy_flow_table_as_mapping = {
+	htpy_flow_table_length,          /* mp_length */
+	htpy_flow_table_subscript,       /* mp_subscript */
+	0,                               /* mp_ass_subscript */
+};
+
+static PySequenceMethods htpy_flow_table_as_sequence = {
+	htpy_flow_table_length,          /* sq_length */
+	0,                               /* sq_concat */
+	0,                               /* sq_repeat */
+	0,                               /* sq_item */
+	0,                               /* sq_slice */
+	0,                               /* sq_ass_item */
+	0,                               /* sq_ass_slice */
+	htpy_flow_table_contains,        /* sq_contains */
+};
+
+static PyMethodDef htpy_flow_table_methods[] = {
+	{ "req_data", (PyCFunction) htpy_flow_table_req_data, METH_VARARGS | METH_KEYWORDS,
+	  "Send request data for a flow to its connection parser." },
+	{ "res_data", (PyCFunction) htpy_flow_table_res_data, METH_VARARGS | METH_KEYWORDS,
+	  "Send response data for a flow to its connection parser." },
+	{ "get", htpy_flow_table_get, METH_VARARGS,
+	  "Return the connection parser of a flow, or None." },
+	{ "close", (PyCFunction) htpy_flow_table_close, METH_VARARGS | METH_KEYWORDS,
+	  "Close the connection parser of a flow and remove it." },
+	{ "close_all", htpy_flow_table_close_all, METH_NOARGS,
+	  "Close and remove every flow." },
+	{ "expire", htpy_flow_table_expire, METH_VARARGS,
+	  "Evict flows which have been idle for too long." },
+	{ "keys", htpy_flow_table_keys, METH_NOARGS,
+	  "Return a list of the keys of the flows, least recently fed first." },
+	{ "get_stats", htpy_flow_table_get_stats, METH_NOARGS,
+	  "Return a dictionary of the flows, memory and evictions." },
+	{ NULL }
+};
+
+static PyMemberDef htpy_flow_table_members[] = {
+	{ "config", T_OBJECT, offsetof(htpy_flow_table, cfg), READONLY, "Config the parsers are made with" },
+	{ "memory", T_PYSSIZET, offsetof(htpy_flow_table, memory), READONLY, "Estimated memory held by all flows" },
+	{ NULL }
+};
+
+/* The limits are checked the same way as by __init__(). */
+static PyObject *htpy_flow_table_get_idle_timeout(htpy_flow_table *self, void *closure) {
+	return PyFloat_FromDouble(self->idle_timeout);
+}
+
+static int htpy_flow_table_set_idle_timeout(htpy_flow_table *self, PyObject *value, void *closure) {
+	double v;
+
+	if (!value) {
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None.");
+		return -1;
+	}
+	v = PyFloat_AsDouble(value);
+	if (v == -1 && PyErr_Occurred())
+		return -1;
+	if (v < 0) {
+		PyErr_SetString(PyExc_ValueError, "limits must not be negative");
+		return -1;
+	}
+	self->idle_timeout = v;
+	return 0;
+}
+
+#define FLOW_TABLE_LIMIT(ATTR) \
+static PyObject *htpy_flow_table_get_##ATTR(htpy_flow_table *self, void *closure) { \
+	return PyInt_FromSsize_t(self->ATTR); \
+} \
+static int htpy_flow_table_set_##ATTR(htpy_flow_table *self, PyObject *value, void *closure) { \
+	Py_ssize_t v; \
+	if (!value) { \
+		PyErr_SetString(htpy_get_state()->error, "Value may not be None."); \
+		return -1; \
 	} \
-	return res; \
+	v = PyNumber_AsSsize_t(value, PyExc_OverflowError); \
+	if (v == -1 && PyErr_Occurred()) \
+		return -1; \
+	if (v < 0) { \
+		PyErr_SetString(PyExc_ValueError, "limits must not be negative"); \
+		return -1; \
+	} \
+	self->ATTR = v; \
+	return 0; \
 }
 
-REGISTER_CALLBACK(request_start)
-REGISTER_CALLBACK(request_line)
-REGISTER_CALLBACK(request_uri_normalize)
-REGISTER_CALLBACK(request_headers)
-REGISTER_CALLBACK(request_header_data)
-REGISTER_CALLBACK(request_body_data)
-REGISTER_CALLBACK(request_trailer)
-REGISTER_CALLBACK(request_trailer_data)
-REGISTER_CALLBACK(request_complete)
-REGISTER_CALLBACK(response_start)
-REGISTER_CALLBACK(response_line)
-REGISTER_CALLBACK(response_headers)
-REGISTER_CALLBACK(response_header_data)
-REGISTER_CALLBACK(response_body_data)
-REGISTER_CALLBACK(response_trailer)
-REGISTER_CALLBACK(response_trailer_data)
-REGISTER_CALLBACK(response_complete)
-REGISTER_CALLBACK(transaction_complete)
-REGISTER_CALLBACK(log)
+FLOW_TABLE_LIMIT(max_flows)
+FLOW_TABLE_LIMIT(max_memory)
+FLOW_TABLE_LIMIT(max_flow_memory)
+
+static PyGetSetDef htpy_flow_table_getseters[] = {
+    {"idle_timeout", (getter) htpy_flow_table_get_idle_timeout,
+     (setter) htpy_flow_table_set_idle_timeout,
+     "Seconds a flow may be idle, 0 for no limit", NULL},
+    {"max_flows", (getter) htpy_flow_table_get_max_flows,
+     (setter) htpy_flow_table_set_max_flows,
+     "Maximum number of flows, 0 for no limit", NULL},
+    {"max_memory", (getter) htpy_flow_table_get_max_memory,
+     (setter) htpy_flow_table_set_max_memory,
+     "Maximum memory of all flows, 0 for no limit", NULL},
+    {"max_flow_memory", (getter) htpy_flow_table_get_max_flow_memory,
+     (setter) htpy_flow_table_set_max_flow_memory,
+     "Maximum memory of one flow, 0 for no limit", NULL},
+    {NULL}
+};
+
+static PyTypeObject htpy_flow_table_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.flow_table",               /* tp_name */
+	sizeof(htpy_flow_table),         /* tp_basicsize */
+	0,                               /* tp_itemsize */
+	(destructor) htpy_flow_table_dealloc, /* tp_dealloc */
+	0,                               /* tp_print */
+	0,                               /* tp_getattr */
+	0,                               /* tp_setattr */
+	0,                               /* tp_compare */
+	0,                               /* tp_repr */
+	0,                               /* tp_as_number */
+	&htpy_flow_table_as_sequence,    /* tp_as_sequence */
+	&htpy_flow_table_as_mapping,     /* tp_as_mapping */
+	0,                               /* tp_hash */
+	0,                               /* tp_call */
+	0,                               /* tp_str */
+	0,                               /* tp_getattro */
+	0,                               /* tp_setattro */
+	0,                               /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,              /* tp_flags */
+	"Connection parsers for many flows, with idle and memory limits", /* tp_doc */
+	0,                               /* tp_traverse */
+	0,                               /* tp_clear */
+	0,                               /* tp_richcompare */
+	0,                               /* tp_weaklistoffset */
+	0,                               /* tp_iter */
+	0,                               /* tp_iternext */
+	htpy_flow_table_methods,         /* tp_methods */
+	htpy_flow_table_members,         /* tp_members */
+	htpy_flow_table_getseters,       /* tp_getset */
+	0,                               /* tp_base */
+	0,                               /* tp_dict */
+	0,                               /* tp_descr_get */
+	0,                               /* tp_descr_set */
+	0,                               /* tp_dictoffset */
+	(initproc) htpy_flow_table_init, /* tp_init */
+	0,                               /* tp_alloc */
+	htpy_flow_table_new,             /* tp_new */
+};
+
+/*
+ * Pcap reader.
+ *
+ * Reads pcap and pcapng files, mmap'd when the source is a regular file,
+ * reassembles TCP streams and feeds each connection into its own
+ * connection parser. Connection parsers are created with the config the
+ * reader was given, so only the callbacks registered there (or by the flow
+ * callback) ever get to python. The loop runs without the GIL, which is
+ * only taken to create and destroy connection parser objects and by the
+ * callback trampolines.
+ *
+ * Reassembly is deliberately simple: the first sequence number seen for
+ * each direction (or SYN + 1) starts the stream, retransmitted data is
+ * trimmed, and data which arrives early is kept until the hole before it is
+ * filled. If more than HTPY_PCAP_MAX_OOO bytes are waiting the hole is
+ * skipped over and counted as a gap.
+ */
+#define HTPY_PCAP_BUCKETS 1024
+#define HTPY_PCAP_MAX_OOO (1024 * 1024)
 
-static PyObject *htpy_connp_register_request_file_data(PyObject *self, PyObject *args) {
-	PyObject *res = NULL;
-	PyObject *temp;
-	int extract = 0;
-	if (PyArg_ParseTuple(args, "O|i:htpy_connp_register_request_file_data", &temp, &extract)) {
-		if (!PyCallable_Check(temp)) {
-			PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-			return NULL;
-		}
+typedef struct htpy_tcp_seg {
+	struct htpy_tcp_seg *next;
+	uint32_t seq;
+	size_t len;
+	unsigned char data[];
+} htpy_tcp_seg;
 
-		Py_XINCREF(temp);
-		Py_XDECREF(request_file_data_callback);
+typedef struct {
+	int started;
+	int fin;
+	uint32_t next_seq;
+	htpy_tcp_seg *ooo;
+	size_t ooo_bytes;
+} htpy_tcp_half;
+
+/* Endpoints are kept in a fixed order so both directions hash the same. */
+typedef struct {
+	int family;
+	unsigned char addr[2][16];
+	uint16_t port[2];
+} htpy_flow_key;
+
+typedef struct htpy_flow {
+	struct htpy_flow *next;
+	htpy_flow_key key;
+	size_t hash;
+	/* Which endpoint of the key is the client. */
+	int client;
+	/* Set once the parser returned an error or stop, data is dropped. */
+	int dead;
+	/* Indexed by HTPY_REQUEST and HTPY_RESPONSE. */
+	htpy_tcp_half half[2];
+	PyObject *connp;
+} htpy_flow;
 
-		request_file_data_callback = temp;
+/* Interfaces of a pcapng section. */
+typedef struct {
+	uint32_t linktype;
+	uint64_t units;
+	int64_t offset;
+} htpy_pcap_iface;
 
-		if (extract)
-			((htpy_connp *) self)->connp->cfg->extract_request_files = 1;
+typedef struct {
+	PyObject_HEAD
+	PyObject *cfg;
+	PyObject *flow_callback;
+	const unsigned char *data;
+	size_t size;
+	void *map;
+	size_t map_size;
+	unsigned char *buf;
+	htpy_flow **buckets;
+	size_t nbuckets;
+	size_t nflows;
+	htp_time_t last_ts;
+	/* Exception raised by python code called from the loop. */
+	PyObject *exc_type, *exc_value, *exc_tb;
+	int running;
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long flows;
+	unsigned long long gaps;
+	unsigned long long errors;
+	unsigned long long skipped;
+} htpy_pcap;
+
+static PyObject *htpy_pcap_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	htpy_pcap *self;
+
+	self = (htpy_pcap *) type->tp_alloc(type, 0);
 
-		htp_config_register_multipart_parser(((htpy_connp *) self)->connp->cfg);
+	return (PyObject *) self;
+}
 
-		htp_config_register_request_file_data(((htpy_connp *) self)->connp->cfg, htpy_request_file_data_callback);
+/* Read the whole of a file descriptor which can not be mmap'd. */
+static int htpy_pcap_slurp(htpy_pcap *self, int fd) {
+	size_t alloc = 65536, len = 0;
+	unsigned char *buf = malloc(alloc), *tmp;
+	ssize_t n;
 
-		Py_INCREF(Py_None);
-		res = Py_None;
+	if (!buf)
+		return -1;
+
+	for (;;) {
+		if (len == alloc) {
+			alloc *= 2;
+			tmp = realloc(buf, alloc);
+			if (!tmp) {
+				free(buf);
+				return -1;
+			}
+			buf = tmp;
+		}
+		n = read(fd, buf + len, alloc - len);
+		if (n == 0)
+			break;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return -1;
+		}
+		len += n;
 	}
-	return res;
-}
 
-/* Return a header who'se key is the given string. */
-#define GET_HEADER(TYPE) \
-static PyObject *htpy_connp_get_##TYPE##_header(PyObject *self, PyObject *args) { \
-	PyObject *ret; \
-	htp_header_t *hdr; \
-	PyObject *py_str = NULL; \
-	htp_tx_t *tx = NULL; \
-	char *p = NULL; \
-	if (!PyArg_ParseTuple(args, "S:htpy_connp_get_##TYPE##_header", &py_str)) \
-		return NULL; \
-	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1); \
-	if (!tx || !tx->TYPE##_headers) { \
-		PyErr_SetString(htpy_error, "Missing transaction or headers."); \
-		return NULL; \
-	} \
-	p = PyString_AsString(py_str); \
-	if (!p) \
-		return NULL; \
-	hdr = htp_table_get_c(tx->TYPE##_headers, p); \
-	if (!hdr) \
-		Py_RETURN_NONE; \
-	ret = Py_BuildValue("s#", bstr_ptr(hdr->value), bstr_len(hdr->value)); \
-	if (!ret) \
-		return NULL; \
-	return ret; \
+	self->buf = buf;
+	self->data = buf;
+	self->size = len;
+	return 0;
 }
 
-GET_HEADER(request)
-GET_HEADER(response)
+static int htpy_pcap_load(htpy_pcap *self, int fd) {
+	struct stat sb;
+	off_t pos;
+	int ret = 0;
+
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		pos = lseek(fd, 0, SEEK_CUR);
+		if (pos < 0 || pos > sb.st_size)
+			pos = 0;
+		self->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (self->map != MAP_FAILED) {
+			madvise(self->map, sb.st_size, MADV_SEQUENTIAL);
+			self->map_size = sb.st_size;
+			self->data = (unsigned char *) self->map + pos;
+			self->size = sb.st_size - pos;
+			return 0;
+		}
+		self->map = NULL;
+	}
 
-/* Return a dictionary of all request or response headers. */
-#define GET_ALL_HEADERS(TYPE) \
-static PyObject *htpy_connp_get_all_##TYPE##_headers(PyObject *self, PyObject *args) { \
-	int i; \
-	size_t n; \
-	htp_header_t *hdr = NULL; \
-	PyObject *key, *val; \
-	htp_tx_t *tx = NULL; \
-	PyObject *ret = PyDict_New(); \
-	if (!ret) { \
-		PyErr_SetString(htpy_error, "Unable to create return dictionary."); \
-		return NULL; \
-	} \
-	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1); \
-	if (!tx || !tx->TYPE##_headers) { \
-		PyErr_SetString(htpy_error, "Missing transaction or headers."); \
-		Py_DECREF(ret); \
-		return NULL; \
-	} \
-	for (i = 0, n = htp_table_size(tx->TYPE##_headers); i < n; i++) { \
-		hdr = htp_table_get_index(tx->TYPE##_headers, i, NULL); \
-		key = Py_BuildValue("s#", bstr_ptr(hdr->name), bstr_len(hdr->name)); \
-		val = Py_BuildValue("s#", bstr_ptr(hdr->value), bstr_len(hdr->value)); \
-		if (!key || !val) { \
-			Py_DECREF(ret); \
-			Py_XDECREF(key); \
-			Py_XDECREF(val); \
-			return NULL; \
-		} \
-		if (PyDict_SetItem(ret, key, val) == -1) { \
-			Py_DECREF(ret); \
-			return NULL; \
-		} \
-		Py_XDECREF(key); \
-		Py_XDECREF(val); \
-	} \
-	return ret; \
+	Py_BEGIN_ALLOW_THREADS
+	ret = htpy_pcap_slurp(self, fd);
+	Py_END_ALLOW_THREADS
+
+	return ret;
 }
 
-GET_ALL_HEADERS(request)
-GET_ALL_HEADERS(response)
+static int htpy_pcap_init(htpy_pcap *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "source", "config", "flow_callback", NULL };
+	PyObject *source, *cfg, *flow_callback = NULL;
+	int fd, own = 0, rc;
 
-/*
- * XXX: Not sure I like mucking around in the transaction to get the method,
- * but I'm not sure of a better way.
- */
-static PyObject *htpy_connp_get_method(PyObject *self, PyObject *args) {
-	PyObject *ret;
-	htp_tx_t *tx = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!|O:htpy_pcap_init", kwlist, &source, htpy_get_state()->config_type, &cfg, &flow_callback))
+		return -1;
 
-	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
-	if (!tx || !tx->request_method) {
-		PyErr_SetString(htpy_error, "Missing transaction or request method.");
-		return NULL;
+	if (flow_callback == Py_None)
+		flow_callback = NULL;
+	if (flow_callback && !PyCallable_Check(flow_callback)) {
+		PyErr_SetString(PyExc_TypeError, "flow_callback must be callable");
+		return -1;
 	}
 
-	ret = Py_BuildValue("s#", bstr_ptr(tx->request_method), bstr_len(tx->request_method));
-
-	return ret;
-}
+	if (self->data) {
+		PyErr_SetString(htpy_get_state()->error, "Pcap reader is already initialized.");
+		return -1;
+	}
 
-static PyObject *htpy_connp_set_obj(PyObject *self, PyObject *args) {
-	PyObject *obj;
+	if (PyString_Check(source)) {
+		fd = open(PyString_AS_STRING(source), O_RDONLY);
+		if (fd == -1) {
+			PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyString_AS_STRING(source));
+			return -1;
+		}
+		own = 1;
+	} else {
+		fd = PyObject_AsFileDescriptor(source);
+		if (fd == -1)
+			return -1;
+	}
 
-	if (!PyArg_ParseTuple(args, "O:htpy_connp_set_obj", &obj))
-		return NULL;
+	rc = htpy_pcap_load(self, fd);
+	if (own)
+		close(fd);
+	if (rc == -1) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
 
-	/*
-	 * Remove a reference to any existing object. This ensures we
-	 * do not leak objects in the case of someone calling this
-	 * multiple times.
-	 */
-	Py_XDECREF(((htpy_connp *) self)->obj_store);
+	self->buckets = calloc(HTPY_PCAP_BUCKETS, sizeof(htpy_flow *));
+	if (!self->buckets) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	self->nbuckets = HTPY_PCAP_BUCKETS;
 
-	Py_XINCREF(obj);
-	((htpy_connp *) self)->obj_store = obj;
+	Py_INCREF(cfg);
+	self->cfg = cfg;
+	Py_XINCREF(flow_callback);
+	self->flow_callback = flow_callback;
 
-	Py_RETURN_NONE;
+	return 0;
 }
 
-static PyObject *htpy_connp_del_obj(PyObject *self, PyObject *args) {
-	Py_XDECREF(((htpy_connp *) self)->obj_store);
-	((htpy_connp *) self)->obj_store = NULL;
+static void htpy_tcp_half_free(htpy_tcp_half *h) {
+	htpy_tcp_seg *seg;
 
-	Py_RETURN_NONE;
+	while ((seg = h->ooo)) {
+		h->ooo = seg->next;
+		free(seg);
+	}
+	h->ooo_bytes = 0;
 }
 
-/*
- * XXX: Not sure I like mucking around in the transaction to get the status,
- * but I'm not sure of a better way.
- */
-static PyObject *htpy_connp_get_response_status_string(PyObject *self, PyObject *args) {
-	PyObject *ret;
-	htp_tx_t *tx = NULL;
+/* Destroy a flow without closing its parser. Called with the GIL held. */
+static void htpy_flow_free(htpy_flow *flow) {
+	htpy_tcp_half_free(&flow->half[HTPY_REQUEST]);
+	htpy_tcp_half_free(&flow->half[HTPY_RESPONSE]);
+	Py_XDECREF(flow->connp);
+	free(flow);
+}
 
-	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
-	if (!tx) {
-		PyErr_SetString(htpy_error, "Missing transaction.");
-		return NULL;
+/* Destroy every flow without closing the parsers. */
+static void htpy_pcap_free_all(htpy_pcap *self) {
+	htpy_flow *flow;
+	size_t i;
+
+	for (i = 0; i < self->nbuckets; i++) {
+		while ((flow = self->buckets[i])) {
+			self->buckets[i] = flow->next;
+			htpy_flow_free(flow);
+		}
 	}
+	self->nflows = 0;
+}
 
-	ret = Py_BuildValue("s#", bstr_ptr(tx->response_status), bstr_len(tx->response_status));
+static void htpy_pcap_dealloc(htpy_pcap *self) {
+	htpy_pcap_free_all(self);
+	free(self->buckets);
+	if (self->map)
+		munmap(self->map, self->map_size);
+	free(self->buf);
+	Py_XDECREF(self->exc_type);
+	Py_XDECREF(self->exc_value);
+	Py_XDECREF(self->exc_tb);
+	Py_XDECREF(self->flow_callback);
+	Py_XDECREF(self->cfg);
+	HTPY_FREE(self);
+}
 
-	return ret;
+/* Keep the current python exception to be raised when the loop ends. */
+static void htpy_pcap_fail(htpy_pcap *self) {
+	if (!self->exc_type)
+		PyErr_Fetch(&self->exc_type, &self->exc_value, &self->exc_tb);
+	else
+		PyErr_Clear();
 }
 
-static PyObject *htpy_connp_get_response_status(PyObject *self, PyObject *args) {
-	PyObject *ret;
-	htp_tx_t *tx = NULL;
+static size_t htpy_flow_hash(const htpy_flow_key *key) {
+	const unsigned char *p = (const unsigned char *) key;
+	size_t i, h = 2166136261u;
 
-	tx = htp_list_get(((htpy_connp *) self)->connp->conn->transactions, htp_list_size(((htpy_connp *) self)->connp->conn->transactions) - 1);
-	if (!tx) {
-		PyErr_SetString(htpy_error, "Missing transaction.");
-		return NULL;
+	for (i = 0; i < sizeof(*key); i++) {
+		h ^= p[i];
+		h *= 16777619u;
 	}
 
-	ret = Py_BuildValue("i", tx->response_status_number);
-
-	return ret;
+	return h;
 }
 
-static PyObject *htpy_connp_get_response_line(PyObject *self, PyObject *args) {
-	PyObject *ret;
+static int htpy_pcap_grow(htpy_pcap *self) {
+	size_t i, n = self->nbuckets * 2;
+	htpy_flow **buckets = calloc(n, sizeof(htpy_flow *));
+	htpy_flow *flow;
 
-	if (!((htpy_connp *) self)->connp->out_tx)
-		Py_RETURN_NONE;
+	if (!buckets)
+		return -1;
 
-	if (!((htpy_connp *) self)->connp->out_tx->response_line)
-		Py_RETURN_NONE;
+	for (i = 0; i < self->nbuckets; i++) {
+		while ((flow = self->buckets[i])) {
+			self->buckets[i] = flow->next;
+			flow->next = buckets[flow->hash & (n - 1)];
+			buckets[flow->hash & (n - 1)] = flow;
+		}
+	}
 
-	ret = Py_BuildValue("s#", bstr_ptr(((htpy_connp *) self)->connp->out_tx->response_line), bstr_len(((htpy_connp *) self)->connp->out_tx->response_line));
-	return ret;
+	free(self->buckets);
+	self->buckets = buckets;
+	self->nbuckets = n;
+	return 0;
 }
 
-static PyObject *htpy_connp_get_request_line(PyObject *self, PyObject *args) {
-	PyObject *ret;
+/* Create a flow and its connection parser. Takes the GIL. */
+static htpy_flow *htpy_pcap_flow_new(htpy_pcap *self, const htpy_flow_key *key, size_t hash, int client, const htp_time_t *ts) {
+	PyThreadState *gstate;
+	char addr[2][INET6_ADDRSTRLEN];
+	int af = key->family == 4 ? AF_INET : AF_INET6;
+	int server = !client;
+	htpy_flow *flow;
+	PyObject *res;
 
-	if (!((htpy_connp *) self)->connp->in_tx)
-		Py_RETURN_NONE;
+	if (self->nflows >= self->nbuckets && htpy_pcap_grow(self) == -1)
+		return NULL;
 
-	if (!((htpy_connp *) self)->connp->in_tx->request_line)
-		Py_RETURN_NONE;
+	flow = calloc(1, sizeof(htpy_flow));
+	if (!flow)
+		return NULL;
 
-	ret = Py_BuildValue("s#", bstr_ptr(((htpy_connp *) self)->connp->in_tx->request_line), bstr_len(((htpy_connp *) self)->connp->in_tx->request_line));
-	return ret;
+	flow->key = *key;
+	flow->hash = hash;
+	flow->client = client;
+
+	inet_ntop(af, key->addr[client], addr[0], sizeof(addr[0]));
+	inet_ntop(af, key->addr[server], addr[1], sizeof(addr[1]));
+
+	gstate = htpy_gil_ensure();
+	flow->connp = PyObject_CallFunctionObjArgs((PyObject *) htpy_get_state()->connp_type, self->cfg, NULL);
+	if (!flow->connp) {
+		htpy_pcap_fail(self);
+		free(flow);
+		htpy_gil_release(gstate);
+		return NULL;
+	}
+	htp_connp_open(((htpy_connp *) flow->connp)->connp, addr[0], key->port[client], addr[1], key->port[server], (htp_time_t *) ts);
+	if (self->flow_callback) {
+		res = PyObject_CallFunction(self->flow_callback, "O(sisi)", flow->connp, addr[0], key->port[client], addr[1], key->port[server]);
+		if (!res) {
+			htpy_pcap_fail(self);
+			Py_DECREF(flow->connp);
+			free(flow);
+			htpy_gil_release(gstate);
+			return NULL;
+		}
+		Py_DECREF(res);
+	}
+	htpy_gil_release(gstate);
+
+	flow->next = self->buckets[hash & (self->nbuckets - 1)];
+	self->buckets[hash & (self->nbuckets - 1)] = flow;
+	self->nflows++;
+	self->flows++;
+
+	return flow;
 }
 
-/* See HTTP 1.1 RFC 4.3 Message Body */
+/* Close the parser of a flow, remove the flow and destroy it. */
+static void htpy_pcap_flow_close(htpy_pcap *self, htpy_flow *flow, const htp_time_t *ts) {
+	PyThreadState *gstate;
+	htpy_connp *cp = (htpy_connp *) flow->connp;
+	htpy_flow **p;
+	PyObject *prev;
+
+	if (!flow->dead) {
+		pthread_mutex_lock(&cp->lock);
+		prev = htpy_current_connp;
+		htpy_current_connp = flow->connp;
+		htp_connp_close(cp->connp, ts);
+		htpy_current_connp = prev;
+		htpy_log_flush(flow->connp);
+		pthread_mutex_unlock(&cp->lock);
+	}
 
-/*
- * The length of the response message-body. In most cases, this value
- * will be the same as response_entity_len. The values will be different
- * if response compression or chunking were applied. In that case,
- * response_message_len contains the length of the response body as it
- * has been seen over TCP; response_entity_len contains the length after
- * de-chunking and decompression.
- */
-static PyObject *htpy_connp_get_response_message_length(PyObject *self, PyObject *args) {
-	PyObject *ret;
+	for (p = &self->buckets[flow->hash & (self->nbuckets - 1)]; *p; p = &(*p)->next) {
+		if (*p == flow) {
+			*p = flow->next;
+			break;
+		}
+	}
+	self->nflows--;
 
-	if (!((htpy_connp *) self)->connp->out_tx)
-		Py_RETURN_NONE;
+	gstate = htpy_gil_ensure();
+	htpy_flow_free(flow);
+	htpy_gil_release(gstate);
+}
 
-	if (!((htpy_connp *) self)->connp->out_tx->response_message_len)
-		Py_RETURN_NONE;
+static void htpy_pcap_deliver(htpy_pcap *self, htpy_flow *flow, int direction, const htp_time_t *ts, const unsigned char *data, size_t len) {
+	htpy_connp *cp = (htpy_connp *) flow->connp;
+	int rc;
+	PyObject *prev;
 
-	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->out_tx->response_message_len);
-	return ret;
+	self->bytes += len;
+	if (flow->dead)
+		return;
+
+	pthread_mutex_lock(&cp->lock);
+	prev = htpy_current_connp;
+	htpy_current_connp = flow->connp;
+	rc = htpy_parse(cp, direction, ts, data, len);
+	htpy_current_connp = prev;
+	if (rc == HTP_STREAM_ERROR)
+		htpy_log_flush(flow->connp);
+	pthread_mutex_unlock(&cp->lock);
+
+	if (rc == HTP_STREAM_ERROR || rc == HTP_STREAM_STOP) {
+		flow->dead = 1;
+		self->errors++;
+	}
 }
 
-/*
- * The length of the request message-body. In most cases, this value
- * will be the same as request_entity_len. The values will be different
- * if request compression or chunking were applied. In that case,
- * request_message_len contains the length of the request body as it
- * has been seen over TCP; request_entity_len contains length after
- * de-chunking and decompression.
- */
-static PyObject *htpy_connp_get_request_message_length(PyObject *self, PyObject *args) {
-	PyObject *ret;
+/* Tell the parser of a flow about data which never turned up. */
+static void htpy_pcap_gap(htpy_pcap *self, htpy_flow *flow, int direction, size_t len) {
+	htpy_connp *cp = (htpy_connp *) flow->connp;
+	int rc;
+	PyObject *prev;
 
-	if (!((htpy_connp *) self)->connp->in_tx)
-		Py_RETURN_NONE;
+	if (flow->dead)
+		return;
 
-	if (!((htpy_connp *) self)->connp->in_tx->request_message_len)
-		Py_RETURN_NONE;
+	pthread_mutex_lock(&cp->lock);
+	prev = htpy_current_connp;
+	htpy_current_connp = flow->connp;
+	rc = htpy_gap(cp, direction, len);
+	htpy_current_connp = prev;
+	if (rc == HTP_STREAM_ERROR)
+		htpy_log_flush(flow->connp);
+	pthread_mutex_unlock(&cp->lock);
+
+	if (rc == HTP_STREAM_ERROR || rc == HTP_STREAM_STOP) {
+		flow->dead = 1;
+		self->errors++;
+	}
+}
 
-	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->in_tx->request_message_len);
-	return ret;
+/* Deliver queued segments which are now in order. */
+static void htpy_pcap_drain(htpy_pcap *self, htpy_flow *flow, int direction, const htp_time_t *ts) {
+	htpy_tcp_half *h = &flow->half[direction];
+	htpy_tcp_seg *seg;
+	int32_t diff;
+
+	while ((seg = h->ooo) && (diff = (int32_t) (seg->seq - h->next_seq)) <= 0) {
+		h->ooo = seg->next;
+		h->ooo_bytes -= seg->len;
+		if ((size_t) -diff < seg->len) {
+			htpy_pcap_deliver(self, flow, direction, ts, seg->data - diff, seg->len + diff);
+			h->next_seq += seg->len + diff;
+		}
+		free(seg);
+	}
 }
 
-/*
- * The length of the response entity-body. In most cases, this value
- * will be the same as response_message_len. The values will be different
- * if request compression or chunking were applied. In that case,
- * response_message_len contains the length of the response body as it
- * has been seen over TCP; response_entity_len contains length after
- * de-chunking and decompression.
- */
-static PyObject *htpy_connp_get_response_entity_length(PyObject *self, PyObject *args) {
-	PyObject *ret;
+static void htpy_pcap_segment(htpy_pcap *self, htpy_flow *flow, int direction, const htp_time_t *ts, uint32_t seq, int syn, const unsigned char *data, size_t len) {
+	htpy_tcp_half *h = &flow->half[direction];
+	htpy_tcp_seg *seg, **p;
+	int32_t diff;
 
-	if (!((htpy_connp *) self)->connp->out_tx)
-		Py_RETURN_NONE;
+	if (!h->started) {
+		h->started = 1;
+		h->next_seq = syn ? seq + 1 : seq;
+	}
 
-	if (!((htpy_connp *) self)->connp->out_tx->response_entity_len)
-		Py_RETURN_NONE;
+	/* Data on a SYN starts after the SYN's sequence number. */
+	if (syn)
+		seq++;
 
-	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->out_tx->response_entity_len);
-	return ret;
-}
+	if (!len)
+		return;
 
-/*
- * The length of the request entity-body. In most cases, this value
- * will be the same as request_message_len. The values will be different
- * if request compression or chunking were applied. In that case,
- * request_message_len contains the length of the request body as it
- * has been seen over TCP; request_entity_len contains length after
- * de-chunking and decompression.
- */
-static PyObject *htpy_connp_get_request_entity_length(PyObject *self, PyObject *args) {
-	PyObject *ret;
+	diff = (int32_t) (seq - h->next_seq);
+	if (diff <= 0) {
+		/* Retransmitted, maybe with some new data at the end. */
+		if ((size_t) -diff >= len)
+			return;
+		htpy_pcap_deliver(self, flow, direction, ts, data - diff, len + diff);
+		h->next_seq += len + diff;
+		htpy_pcap_drain(self, flow, direction, ts);
+		return;
+	}
 
-	if (!((htpy_connp *) self)->connp->in_tx)
-		Py_RETURN_NONE;
+	seg = malloc(sizeof(htpy_tcp_seg) + len);
+	if (!seg)
+		return;
+	seg->seq = seq;
+	seg->len = len;
+	memcpy(seg->data, data, len);
+	for (p = &h->ooo; *p && (int32_t) ((*p)->seq - seq) <= 0; p = &(*p)->next);
+	seg->next = *p;
+	*p = seg;
+	h->ooo_bytes += len;
+
+	if (h->ooo_bytes > HTPY_PCAP_MAX_OOO) {
+		self->gaps++;
+		htpy_pcap_gap(self, flow, direction, (uint32_t) (h->ooo->seq - h->next_seq));
+		h->next_seq = h->ooo->seq;
+		htpy_pcap_drain(self, flow, direction, ts);
+	}
+}
 
-	if (!((htpy_connp *) self)->connp->in_tx->request_entity_len)
-		Py_RETURN_NONE;
+static void htpy_pcap_tcp(htpy_pcap *self, const htp_time_t *ts, int family, const unsigned char *src, const unsigned char *dst, const unsigned char *p, size_t len) {
+	htpy_flow_key key;
+	htpy_flow *flow;
+	size_t hash, alen = family == 4 ? 4 : 16;
+	uint16_t sport, dport;
+	uint32_t seq;
+	size_t doff;
+	int flags, sender, cmp, direction;
+
+	if (len < 20) {
+		self->skipped++;
+		return;
+	}
 
-	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->in_tx->request_entity_len);
-	return ret;
-}
+	sport = (p[0] << 8) | p[1];
+	dport = (p[2] << 8) | p[3];
+	seq = ((uint32_t) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+	doff = (p[12] >> 4) * 4;
+	flags = p[13];
+	if (doff < 20 || doff > len) {
+		self->skipped++;
+		return;
+	}
 
-/* These do the actual parsing. */
-#define DATA(TYPE) \
-static PyObject *htpy_connp_##TYPE##_data(PyObject *self, PyObject *args) { \
-	const char *data; \
-	PyObject *ret; \
-	int x; \
-	int len; \
-	if (!PyArg_ParseTuple(args, "s#:htpy_connp_##TYPE##_data", &data, &len)) \
-		return NULL; \
-	x = htp_connp_##TYPE##_data(((htpy_connp *) self)->connp, NULL, (unsigned char *) data, len); \
-	if (x == HTP_STREAM_ERROR) { \
-		PyErr_SetString(htpy_error, "Stream error."); \
-		return NULL; \
-	} \
-	if (x == HTP_STREAM_STOP) { \
-		PyErr_SetString(htpy_stop, "Stream stop."); \
-		return NULL; \
-	} \
-	ret = PyInt_FromLong((long) x); \
-	return(ret); \
-}
+	memset(&key, 0, sizeof(key));
+	key.family = family;
+	cmp = memcmp(src, dst, alen);
+	if (cmp == 0)
+		cmp = sport - dport;
+	sender = cmp > 0;
+	memcpy(key.addr[sender], src, alen);
+	memcpy(key.addr[!sender], dst, alen);
+	key.port[sender] = sport;
+	key.port[!sender] = dport;
+	hash = htpy_flow_hash(&key);
+
+	for (flow = self->buckets[hash & (self->nbuckets - 1)]; flow; flow = flow->next)
+		if (flow->hash == hash && !memcmp(&flow->key, &key, sizeof(key)))
+			break;
+
+	if (!flow) {
+		int client;
+
+		/* Stray ACKs and resets do not start a connection. */
+		if ((flags & 0x04) || (!(flags & 0x02) && len == doff))
+			return;
+
+		/*
+		 * A SYN comes from the client and a SYN-ACK from the server.
+		 * Without either, assume the server has the lower port.
+		 */
+		if (flags & 0x02)
+			client = (flags & 0x10) ? !sender : sender;
+		else
+			client = sport < dport ? !sender : sender;
+
+		flow = htpy_pcap_flow_new(self, &key, hash, client, ts);
+		if (!flow)
+			return;
+	}
 
-DATA(req)
-DATA(res)
+	direction = sender == flow->client ? HTPY_REQUEST : HTPY_RESPONSE;
+	htpy_pcap_segment(self, flow, direction, ts, seq, flags & 0x02, p + doff, len - doff);
 
-#define DATA_CONSUMED(TYPE) \
-static PyObject *htpy_connp_##TYPE##_data_consumed(PyObject *self, PyObject *args) { \
-	PyObject *ret; \
-	ret = Py_BuildValue("I", htp_connp_##TYPE##_data_consumed(((htpy_connp *) self)->connp)); \
-	return(ret); \
-}
+	if (flags & 0x01)
+		flow->half[direction].fin = 1;
 
-DATA_CONSUMED(req)
-DATA_CONSUMED(res)
+	if ((flags & 0x04) || (flow->half[HTPY_REQUEST].fin && flow->half[HTPY_RESPONSE].fin))
+		htpy_pcap_flow_close(self, flow, ts);
+}
 
-static PyObject *htpy_connp_get_last_error(PyObject *self, PyObject *args) {
-	htp_log_t *err = NULL;
-	PyObject *ret;
+static void htpy_pcap_ip(htpy_pcap *self, const htp_time_t *ts, const unsigned char *p, size_t len) {
+	size_t hlen, tot;
+	int proto;
 
-	err = htp_connp_get_last_error(((htpy_connp *) self)->connp);
-	if (!err)
-		Py_RETURN_NONE;
+	if (len < 1) {
+		self->skipped++;
+		return;
+	}
 
-	ret = Py_BuildValue("{sisssssi}", "level", err->level, "msg", err->msg, "file", err->file, "line", err->line);
+	switch (p[0] >> 4) {
+		case 4:
+			hlen = (p[0] & 0x0f) * 4;
+			if (len < 20 || hlen < 20 || len < hlen)
+				break;
+			tot = (p[2] << 8) | p[3];
+			if (tot < hlen)
+				break;
+			if (tot < len)
+				len = tot;
+			/* Fragments are not reassembled. */
+			if (((p[6] << 8) | p[7]) & 0x3fff)
+				break;
+			if (p[9] != 6)
+				break;
+			htpy_pcap_tcp(self, ts, 4, p + 12, p + 16, p + hlen, len - hlen);
+			return;
+		case 6:
+			if (len < 40)
+				break;
+			tot = 40 + ((p[4] << 8) | p[5]);
+			if (tot < len)
+				len = tot;
+			proto = p[6];
+			hlen = 40;
+			/* Hop-by-hop, routing and destination options. */
+			while ((proto == 0 || proto == 43 || proto == 60) && len >= hlen + 8) {
+				proto = p[hlen];
+				hlen += (p[hlen + 1] + 1) * 8;
+			}
+			if (proto != 6 || hlen > len)
+				break;
+			htpy_pcap_tcp(self, ts, 6, p + 8, p + 24, p + hlen, len - hlen);
+			return;
+	}
 
-	return(ret);
+	self->skipped++;
 }
 
-static PyObject *htpy_connp_clear_error(PyObject *self, PyObject *args) {
-	htp_connp_clear_error(((htpy_connp *) self)->connp);
-	Py_RETURN_NONE;
+static int htpy_pcap_is_ip_ethertype(int type) {
+	return type == 0x0800 || type == 0x86dd;
 }
 
-static PyObject *htpy_connp_get_request_protocol(PyObject *self, PyObject *args) {
-	PyObject *ret;
+static void htpy_pcap_packet(htpy_pcap *self, uint32_t linktype, const htp_time_t *ts, const unsigned char *p, size_t len) {
+	size_t off = 0;
+	int type;
+
+	self->packets++;
+	self->last_ts = *ts;
+
+	switch (linktype) {
+		case 1: /* Ethernet */
+			if (len < 14)
+				goto skip;
+			type = (p[12] << 8) | p[13];
+			off = 14;
+			while ((type == 0x8100 || type == 0x88a8 || type == 0x9100) && len >= off + 4) {
+				type = (p[off + 2] << 8) | p[off + 3];
+				off += 4;
+			}
+			if (!htpy_pcap_is_ip_ethertype(type))
+				goto skip;
+			break;
+		case 0: /* BSD loopback */
+		case 108: /* OpenBSD loopback */
+			off = 4;
+			break;
+		case 12: /* Raw IP */
+		case 14:
+		case 101:
+		case 228: /* IPv4 */
+		case 229: /* IPv6 */
+			break;
+		case 113: /* Linux cooked */
+			if (len < 16 || !htpy_pcap_is_ip_ethertype((p[14] << 8) | p[15]))
+				goto skip;
+			off = 16;
+			break;
+		case 276: /* Linux cooked v2 */
+			if (len < 20 || !htpy_pcap_is_ip_ethertype((p[0] << 8) | p[1]))
+				goto skip;
+			off = 20;
+			break;
+		default:
+			goto skip;
+	}
 
-	if (!((htpy_connp *) self)->connp->in_tx)
-		Py_RETURN_NONE;
+	if (off > len)
+		goto skip;
 
-	if (!((htpy_connp *) self)->connp->in_tx->request_protocol)
-		Py_RETURN_NONE;
+	htpy_pcap_ip(self, ts, p + off, len - off);
+	return;
 
-	ret = Py_BuildValue("s#", bstr_ptr(((htpy_connp *) self)->connp->in_tx->request_protocol), bstr_len(((htpy_connp *) self)->connp->in_tx->request_protocol));
-	return ret;
+skip:
+	self->skipped++;
 }
 
-static PyObject *htpy_connp_get_request_protocol_number(PyObject *self, PyObject *args) {
-	PyObject *ret;
+static uint16_t htpy_rd16(const unsigned char *p, int big) {
+	return big ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
 
-	if (!((htpy_connp *) self)->connp->in_tx)
-		Py_RETURN_NONE;
+static uint32_t htpy_rd32(const unsigned char *p, int big) {
+	if (big)
+		return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	return ((uint32_t) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
 
-	if (!((htpy_connp *) self)->connp->in_tx->request_protocol_number)
-		Py_RETURN_NONE;
+static uint64_t htpy_rd64(const unsigned char *p, int big) {
+	if (big)
+		return ((uint64_t) htpy_rd32(p, big) << 32) | htpy_rd32(p + 4, big);
+	return ((uint64_t) htpy_rd32(p + 4, big) << 32) | htpy_rd32(p, big);
+}
 
-	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->in_tx->request_protocol_number);
-	return ret;
+static void htpy_pcap_time(uint64_t t, uint64_t units, int64_t offset, htp_time_t *ts) {
+	ts->tv_sec = t / units + offset;
+	ts->tv_usec = (double) (t % units) * 1000000.0 / units;
 }
 
-static PyObject *htpy_connp_get_response_protocol(PyObject *self, PyObject *args) {
-	PyObject *ret;
+static const char *htpy_pcap_classic(htpy_pcap *self) {
+	const unsigned char *p = self->data, *end = self->data + self->size;
+	uint32_t linktype, caplen;
+	uint64_t units;
+	htp_time_t ts;
+	int big;
+
+	if (p[0] == 0xd4 && p[1] == 0xc3 && p[2] == 0xb2 && p[3] == 0xa1) {
+		big = 0;
+		units = 1000000;
+	} else if (p[0] == 0xa1 && p[1] == 0xb2 && p[2] == 0xc3 && p[3] == 0xd4) {
+		big = 1;
+		units = 1000000;
+	} else if (p[0] == 0x4d && p[1] == 0x3c && p[2] == 0xb2 && p[3] == 0xa1) {
+		big = 0;
+		units = 1000000000;
+	} else if (p[0] == 0xa1 && p[1] == 0xb2 && p[2] == 0x3c && p[3] == 0x4d) {
+		big = 1;
+		units = 1000000000;
+	} else {
+		return "Not a pcap or pcapng file.";
+	}
 
-	if (!((htpy_connp *) self)->connp->out_tx)
-		Py_RETURN_NONE;
+	if (self->size < 24)
+		return "Truncated pcap header.";
 
-	if (!((htpy_connp *) self)->connp->out_tx->response_protocol)
-		Py_RETURN_NONE;
+	/* The upper bits may hold the FCS length. */
+	linktype = htpy_rd32(p + 20, big) & 0x0fffffff;
 
-	ret = Py_BuildValue("s#", bstr_ptr(((htpy_connp *) self)->connp->out_tx->response_protocol), bstr_len(((htpy_connp *) self)->connp->out_tx->response_protocol));
-	return ret;
+	for (p += 24; p + 16 <= end && !self->exc_type; p += 16 + caplen) {
+		caplen = htpy_rd32(p + 8, big);
+		if (caplen > (size_t) (end - p - 16))
+			break;
+		htpy_pcap_time(htpy_rd32(p, big) * units + htpy_rd32(p + 4, big), units, 0, &ts);
+		htpy_pcap_packet(self, linktype, &ts, p + 16, caplen);
+	}
+
+	return NULL;
 }
 
-static PyObject *htpy_connp_get_response_protocol_number(PyObject *self, PyObject *args) {
-	PyObject *ret;
+static const char *htpy_pcap_ng(htpy_pcap *self) {
+	const unsigned char *p = self->data, *end = self->data + self->size;
+	const unsigned char *body, *opt;
+	htpy_pcap_iface *ifaces = NULL, *tmp;
+	size_t nifaces = 0;
+	uint32_t type, len, caplen, id;
+	uint16_t code, olen;
+	uint64_t t;
+	htp_time_t ts;
+	int big = 0, v;
+
+	for (; p + 12 <= end && !self->exc_type; p += len) {
+		type = htpy_rd32(p, big);
+		if (type == 0x0a0d0d0a) {
+			/* Section header, sets the byte order of the section. */
+			if (p[8] == 0x4d && p[9] == 0x3c && p[10] == 0x2b && p[11] == 0x1a)
+				big = 0;
+			else if (p[8] == 0x1a && p[9] == 0x2b && p[10] == 0x3c && p[11] == 0x4d)
+				big = 1;
+			else
+				break;
+			nifaces = 0;
+		}
+		len = htpy_rd32(p + 4, big);
+		if (len < 12 || len > (size_t) (end - p) || len & 3)
+			break;
+		body = p + 8;
+
+		switch (type) {
+			case 1: /* Interface description */
+				if (len < 20)
+					break;
+				tmp = realloc(ifaces, (nifaces + 1) * sizeof(htpy_pcap_iface));
+				if (!tmp) {
+					free(ifaces);
+					return "Unable to allocate interface list.";
+				}
+				ifaces = tmp;
+				ifaces[nifaces].linktype = htpy_rd16(body, big);
+				ifaces[nifaces].units = 1000000;
+				ifaces[nifaces].offset = 0;
+				for (opt = body + 8; opt + 4 <= p + len - 4; opt += 4 + ((olen + 3) & ~3)) {
+					code = htpy_rd16(opt, big);
+					olen = htpy_rd16(opt + 2, big);
+					if (code == 0 || opt + 4 + olen > p + len - 4)
+						break;
+					if (code == 9 && olen >= 1) {
+						v = opt[4];
+						if (v & 0x80)
+							ifaces[nifaces].units = 1ULL << ((v & 0x7f) > 63 ? 63 : (v & 0x7f));
+						else
+							for (ifaces[nifaces].units = 1; v > 0 && ifaces[nifaces].units <= 1000000000000000000ULL; v--)
+								ifaces[nifaces].units *= 10;
+					} else if (code == 14 && olen >= 8) {
+						ifaces[nifaces].offset = (int64_t) htpy_rd64(opt + 4, big);
+					}
+				}
+				nifaces++;
+				break;
+			case 6: /* Enhanced packet */
+				if (len < 32)
+					break;
+				id = htpy_rd32(body, big);
+				caplen = htpy_rd32(body + 12, big);
+				if (id >= nifaces || caplen > len - 32)
+					break;
+				t = ((uint64_t) htpy_rd32(body + 4, big) << 32) | htpy_rd32(body + 8, big);
+				htpy_pcap_time(t, ifaces[id].units, ifaces[id].offset, &ts);
+				htpy_pcap_packet(self, ifaces[id].linktype, &ts, body + 20, caplen);
+				break;
+			case 3: /* Simple packet, no timestamp */
+				if (len < 16 || !nifaces)
+					break;
+				caplen = htpy_rd32(body, big);
+				if (caplen > len - 16)
+					caplen = len - 16;
+				ts = self->last_ts;
+				htpy_pcap_packet(self, ifaces[0].linktype, &ts, body + 4, caplen);
+				break;
+			case 2: /* Obsolete packet */
+				if (len < 32)
+					break;
+				id = htpy_rd16(body, big);
+				caplen = htpy_rd32(body + 12, big);
+				if (id >= nifaces || caplen > len - 32)
+					break;
+				t = ((uint64_t) htpy_rd32(body + 4, big) << 32) | htpy_rd32(body + 8, big);
+				htpy_pcap_time(t, ifaces[id].units, ifaces[id].offset, &ts);
+				htpy_pcap_packet(self, ifaces[id].linktype, &ts, body + 20, caplen);
+				break;
+		}
+	}
 
-	if (!((htpy_connp *) self)->connp->out_tx)
-		Py_RETURN_NONE;
+	free(ifaces);
+	return NULL;
+}
 
-	if (!((htpy_connp *) self)->connp->out_tx->response_protocol_number)
-		Py_RETURN_NONE;
+/* Close every flow still open at the end of the capture. */
+static void htpy_pcap_close_all(htpy_pcap *self) {
+	htpy_flow *flow;
+	size_t i;
 
-	ret = Py_BuildValue("i", ((htpy_connp *) self)->connp->out_tx->response_protocol_number);
-	return ret;
+	for (i = 0; i < self->nbuckets; i++)
+		while ((flow = self->buckets[i]))
+			htpy_pcap_flow_close(self, flow, &self->last_ts);
 }
 
-static PyObject *htpy_connp_get_uri(PyObject *self, PyObject *args) {
-	htp_uri_t *uri;
-	int fail = 0;
-	PyObject *key, *val;
-	PyObject *ret = PyDict_New();
+static PyObject *htpy_pcap_run(PyObject *self, PyObject *args) {
+	htpy_pcap *pcap = (htpy_pcap *) self;
+	const char *err = NULL;
 
-	if (!ret) {
-		PyErr_SetString(htpy_error, "Unable to create new dictionary.");
+	if (!pcap->data) {
+		PyErr_SetString(htpy_get_state()->error, "Pcap reader is not initialized.");
 		return NULL;
 	}
 
-	/* Empty tx? That's odd. */
-	if (!((htpy_connp *) self)->connp->in_tx)
-		Py_RETURN_NONE;
+	if (pcap->running) {
+		PyErr_SetString(htpy_get_state()->error, "Pcap reader is already running.");
+		return NULL;
+	}
 
-	if (!((htpy_connp *) self)->connp->in_tx->parsed_uri)
-		Py_RETURN_NONE;
+	if (pcap->size < 4) {
+		PyErr_SetString(htpy_get_state()->error, "Not a pcap or pcapng file.");
+		return NULL;
+	}
 
-	uri = ((htpy_connp *) self)->connp->in_tx->parsed_uri;
-
-	if (uri->scheme) {
-		key = Py_BuildValue("s", "scheme");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->scheme));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->username) {
-		key = Py_BuildValue("s", "username");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->username));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->password) {
-		key = Py_BuildValue("s", "password");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->password));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->hostname) {
-		key = Py_BuildValue("s", "hostname");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->hostname));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->port) {
-		key = Py_BuildValue("s", "port");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->port));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->port_number) {
-		key = Py_BuildValue("s", "port_number");
-		val = Py_BuildValue("i", uri->port_number);
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->path) {
-		key = Py_BuildValue("s", "path");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->path));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->query) {
-		key = Py_BuildValue("s", "query");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->query));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
-	}
-
-	if (uri->fragment) {
-		key = Py_BuildValue("s", "fragment");
-		val = Py_BuildValue("s", bstr_util_strdup_to_c(uri->fragment));
-		if (!key || !val)
-			fail = 1;
-		if (PyDict_SetItem(ret, key, val) == -1)
-			fail = 1;
-		Py_XDECREF(key);
-		Py_XDECREF(val);
+	pcap->running = 1;
+	HTPY_BEGIN_ALLOW_THREADS
+	if (pcap->data[0] == 0x0a && pcap->data[1] == 0x0d && pcap->data[2] == 0x0d && pcap->data[3] == 0x0a)
+		err = htpy_pcap_ng(pcap);
+	else
+		err = htpy_pcap_classic(pcap);
+	if (!pcap->exc_type)
+		htpy_pcap_close_all(pcap);
+	HTPY_END_ALLOW_THREADS
+	pcap->running = 0;
+
+	if (pcap->exc_type) {
+		htpy_pcap_free_all(pcap);
+		PyErr_Restore(pcap->exc_type, pcap->exc_value, pcap->exc_tb);
+		pcap->exc_type = pcap->exc_value = pcap->exc_tb = NULL;
+		return NULL;
 	}
 
-	// Exception should be set by Py_BuildValue or PyDict_SetItem failing.
-	if (fail) {
-		Py_DECREF(ret);
+	if (err) {
+		PyErr_SetString(htpy_get_state()->error, err);
 		return NULL;
 	}
 
-	return ret;
+	return PyLong_FromUnsignedLongLong(pcap->packets);
 }
 
-static PyMethodDef htpy_connp_methods[] = {
-	{ "get_request_header", htpy_connp_get_request_header, METH_VARARGS,
-	  "Return a string for the requested header." },
-	{ "get_response_header", htpy_connp_get_response_header, METH_VARARGS,
-	  "Return a string for the requested header." },
-	{ "get_all_request_headers", htpy_connp_get_all_request_headers,
-	  METH_NOARGS, "Return a dictionary of all request headers." },
-	{ "get_all_response_headers", htpy_connp_get_all_response_headers,
-	  METH_NOARGS, "Return a dictionary of all response headers." },
-	{ "get_response_status", htpy_connp_get_response_status, METH_VARARGS,
-	  "Return the response status number as an integer." },
-	{ "get_response_status_string", htpy_connp_get_response_status_string, METH_VARARGS,
-	  "Return the response status as string." },
-	{ "get_response_line", htpy_connp_get_response_line, METH_VARARGS,
-	  "Return the response status line as string." },
-	{ "get_request_line", htpy_connp_get_request_line, METH_VARARGS,
-	  "Return the request line as string." },
-	{ "register_request_start", htpy_connp_register_request_start,
-	  METH_VARARGS, "Register a hook for start of a request." },
-	{ "register_request_line", htpy_connp_register_request_line, METH_VARARGS,
-	  "Register a hook for right after request line has been parsed." },
-	{ "register_request_uri_normalize",
-	  htpy_connp_register_request_uri_normalize, METH_VARARGS,
-	  "Register a hook for right before the URI is normalized." },
-	{ "get_response_message_length", htpy_connp_get_response_message_length, METH_VARARGS,
-	  "Return the response message length before decompressed and dechunked." },
-	{ "get_request_message_length", htpy_connp_get_request_message_length, METH_VARARGS,
-	  "Return the request message length before decompressed and dechunked." },
-	{ "get_response_entity_length", htpy_connp_get_response_entity_length, METH_VARARGS,
-	  "Return the response message length after decomressed and dechunked." },
-	{ "get_request_entity_length", htpy_connp_get_request_entity_length, METH_VARARGS,
-	  "Return the request message length after decompressed and dechunked." },
-	{ "register_request_headers", htpy_connp_register_request_headers,
-	  METH_VARARGS,
-	  "Register a hook for right after headers have been parsed and sanity checked." },
-	{ "register_request_header_data", htpy_connp_register_request_header_data,
-	  METH_VARARGS,
-	  "Register a hook for right as headers are being parsed and sanity checked." },
-	{ "register_request_body_data", htpy_connp_register_request_body_data,
-	  METH_VARARGS,
-	  "Register a hook for when a piece of request body data is processed." },
-	{ "register_request_file_data", htpy_connp_register_request_file_data,
-	  METH_VARARGS,
-	  "Register a hook for when a full request body data is processed." },
-	{ "register_request_trailer", htpy_connp_register_request_trailer,
-	  METH_VARARGS,
-	  "Register a hook for request trailer completion." },
-	{ "register_request_trailer_data", htpy_connp_register_request_trailer_data,
-	  METH_VARARGS,
-	  "Register a hook request trialer data." },
-	{ "register_request_complete", htpy_connp_register_request_complete, METH_VARARGS,
-	  "Register a callback for when the entire request is parsed." },
-	{ "register_response_start", htpy_connp_register_response_start,
-	  METH_VARARGS,
-	  "Register a hook for as soon as a response is about to start." },
-	{ "register_response_line", htpy_connp_register_response_line,
-	  METH_VARARGS,
-	  "Register a hook for right after response line has been parsed." },
-	{ "register_response_headers", htpy_connp_register_response_headers,
-	  METH_VARARGS, "Register a hook for right after headers have been parsed and sanity checked." },
-	{ "register_response_header_data", htpy_connp_register_response_header_data,
-	  METH_VARARGS, "Register a hook for right as headers have been parsed and sanity checked." },
-	{ "register_response_body_data", htpy_connp_register_response_body_data,
-	  METH_VARARGS,
-	  "Register a hook for when a piece of response body data is processed. Chunked and gzip'ed data are handled." },
-	{ "register_response_trailer", htpy_connp_register_response_trailer,
-	  METH_VARARGS,
-	  "Register a hook for response trailer completion." },
-	{ "register_response_trailer_data", htpy_connp_register_response_trailer_data,
-	  METH_VARARGS,
-	  "Register a hook for response trailer data." },
-	{ "register_response_complete", htpy_connp_register_response_complete, METH_VARARGS,
-	  "Register a hook for right after an entire response has been parsed." },
-	{ "register_transaction_complete", htpy_connp_register_transaction_complete, METH_VARARGS,
-	  "Register a hook for right after a transaction has completed." },
-	{ "register_log", htpy_connp_register_log, METH_VARARGS,
-	  "Register a callback for when a log message is generated." },
-	{ "set_obj", htpy_connp_set_obj, METH_VARARGS,
-	  "Set arbitrary python object to be passed to callbacks." },
-	{ "del_obj", htpy_connp_del_obj, METH_VARARGS,
-	  "Remove arbitrary python object being passed to callbacks." },
-	{ "req_data", htpy_connp_req_data, METH_VARARGS, "Parse a request." },
-	{ "req_data_consumed", htpy_connp_req_data_consumed, METH_NOARGS,
-	  "Return amount of data consumed." },
-	{ "res_data", htpy_connp_res_data, METH_VARARGS, "Parse a response." },
-	{ "res_data_consumed", htpy_connp_res_data_consumed, METH_NOARGS,
-	  "Return amount of data consumed." },
-	{ "get_last_error", htpy_connp_get_last_error, METH_NOARGS,
-	  "Return a dictionary of the last error for the parser." },
-	{ "clear_error", htpy_connp_clear_error, METH_NOARGS,
-	  "Clear last error for the parser." },
-	{ "get_request_protocol", htpy_connp_get_request_protocol, METH_NOARGS,
-	  "Return request protocol as a string." },
-	{ "get_request_protocol_number", htpy_connp_get_request_protocol_number, METH_NOARGS,
-	  "Return request protocol number." },
-	{ "get_response_protocol", htpy_connp_get_response_protocol, METH_NOARGS,
-	  "Return response protocol as a string." },
-	{ "get_response_protocol_number", htpy_connp_get_response_protocol_number, METH_NOARGS,
-	  "Return response protocol number." },
-	{ "get_uri", htpy_connp_get_uri, METH_NOARGS,
-	  "Return a dictionary of the URI." },
-	{ "get_method", htpy_connp_get_method, METH_NOARGS,
-	  "Return the request method as a string." },
+static PyMethodDef htpy_pcap_methods[] = {
+	{ "run", htpy_pcap_run, METH_NOARGS,
+	  "Read the entire capture, return the number of packets read." },
 	{ NULL }
 };
 
-static PyMemberDef htpy_connp_members[] = {
-	{ "cfg", T_OBJECT_EX, offsetof(htpy_connp, cfg), 0, "Configuration object"},
+static PyMemberDef htpy_pcap_members[] = {
+	{ "packets", T_ULONGLONG, offsetof(htpy_pcap, packets), READONLY, "Packets read" },
+	{ "bytes", T_ULONGLONG, offsetof(htpy_pcap, bytes), READONLY, "TCP payload bytes reassembled" },
+	{ "flows", T_ULONGLONG, offsetof(htpy_pcap, flows), READONLY, "Connections seen" },
+	{ "gaps", T_ULONGLONG, offsetof(htpy_pcap, gaps), READONLY, "Holes skipped in TCP streams" },
+	{ "errors", T_ULONGLONG, offsetof(htpy_pcap, errors), READONLY, "Connections the parser gave up on" },
+	{ "skipped", T_ULONGLONG, offsetof(htpy_pcap, skipped), READONLY, "Packets which were not TCP over IP" },
 	{ NULL }
 };
 
-static PyTypeObject htpy_connp_type = {
-	PyObject_HEAD_INIT(NULL)
-	0,                               /* ob_size */
-	"htpy.connp",                    /* tp_name */
-	sizeof(htpy_connp),              /* tp_basicsize */
+static PyTypeObject htpy_pcap_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"htpy.pcap_reader",              /* tp_name */
+	sizeof(htpy_pcap),               /* tp_basicsize */
 	0,                               /* tp_itemsize */
-	(destructor) htpy_connp_dealloc, /* tp_dealloc */
+	(destructor) htpy_pcap_dealloc,  /* tp_dealloc */
 	0,                               /* tp_print */
 	0,                               /* tp_getattr */
 	0,                               /* tp_setattr */
@@ -1180,30 +11051,30 @@ static PyTypeObject htpy_connp_type = {
 	0,                               /* tp_setattro */
 	0,                               /* tp_as_buffer */
 	Py_TPFLAGS_DEFAULT,              /* tp_flags */
-	"connp object",                  /* tp_doc */
+	"pcap reader object",            /* tp_doc */
 	0,                               /* tp_traverse */
 	0,                               /* tp_clear */
 	0,                               /* tp_richcompare */
 	0,                               /* tp_weaklistoffset */
 	0,                               /* tp_iter */
 	0,                               /* tp_iternext */
-	htpy_connp_methods,              /* tp_methods */
-	htpy_connp_members,              /* tp_members */
+	htpy_pcap_methods,               /* tp_methods */
+	htpy_pcap_members,               /* tp_members */
 	0,                               /* tp_getset */
 	0,                               /* tp_base */
 	0,                               /* tp_dict */
 	0,                               /* tp_descr_get */
 	0,                               /* tp_descr_set */
 	0,                               /* tp_dictoffset */
-	(initproc) htpy_connp_init,      /* tp_init */
+	(initproc) htpy_pcap_init,       /* tp_init */
 	0,                               /* tp_alloc */
-	htpy_connp_new,                  /* tp_new */
+	htpy_pcap_new,                   /* tp_new */
 };
 
 static PyObject *htpy_init(PyObject *self, PyObject *args) {
 	PyObject *connp;
 
-	connp = PyObject_CallObject((PyObject *) &htpy_connp_type, NULL);
+	connp = PyObject_CallObject((PyObject *) htpy_get_state()->connp_type, NULL);
 
 	return(connp);
 }
@@ -1214,31 +11085,205 @@ static PyMethodDef htpy_methods[] = {
 	{ NULL }
 };
 
-PyMODINIT_FUNC inithtpy(void) {
-	PyObject *m;
+#if PY_MAJOR_VERSION >= 3
+#define HTPY_TYPES(X) \
+	X(config) X(connp) X(pool) X(connp_pool) X(flow_table) X(tx) \
+	X(headers) X(headers_iter) X(filter) X(file) X(pcap) X(exporter) \
+	X(record_batch) X(chunk)
 
-	if (PyType_Ready(&htpy_config_type) < 0 || PyType_Ready(&htpy_connp_type) < 0)
-		return;
+/*
+ * Make a heap type for this interpreter out of one of the static type
+ * definitions, which are only used as templates under python 3.
+ */
+static PyTypeObject *htpy_type_new(PyObject *m, PyTypeObject *t) {
+	PyType_Slot slots[20];
+	PyType_Spec spec;
+	PyObject *type;
+	int n = 0;
+
+#define HTPY_SLOT(ID, FN) \
+	if (FN) { \
+		slots[n].slot = ID; \
+		slots[n].pfunc = (void *) (FN); \
+		n++; \
+	}
+	HTPY_SLOT(Py_tp_dealloc, t->tp_dealloc)
+	HTPY_SLOT(Py_tp_repr, t->tp_repr)
+	HTPY_SLOT(Py_tp_doc, t->tp_doc)
+	HTPY_SLOT(Py_tp_iter, t->tp_iter)
+	HTPY_SLOT(Py_tp_iternext, t->tp_iternext)
+	HTPY_SLOT(Py_tp_methods, t->tp_methods)
+	HTPY_SLOT(Py_tp_members, t->tp_members)
+	HTPY_SLOT(Py_tp_getset, t->tp_getset)
+	HTPY_SLOT(Py_tp_init, t->tp_init)
+	HTPY_SLOT(Py_tp_new, t->tp_new)
+	if (t->tp_as_sequence) {
+		HTPY_SLOT(Py_sq_length, t->tp_as_sequence->sq_length)
+		HTPY_SLOT(Py_sq_item, t->tp_as_sequence->sq_item)
+		HTPY_SLOT(Py_sq_contains, t->tp_as_sequence->sq_contains)
+	}
+	if (t->tp_as_mapping) {
+		HTPY_SLOT(Py_mp_length, t->tp_as_mapping->mp_length)
+		HTPY_SLOT(Py_mp_subscript, t->tp_as_mapping->mp_subscript)
+		HTPY_SLOT(Py_mp_ass_subscript, t->tp_as_mapping->mp_ass_subscript)
+	}
+	if (t->tp_as_buffer) {
+		HTPY_SLOT(Py_bf_getbuffer, t->tp_as_buffer->bf_getbuffer)
+		HTPY_SLOT(Py_bf_releasebuffer, t->tp_as_buffer->bf_releasebuffer)
+	}
+#undef HTPY_SLOT
+	slots[n].slot = 0;
+	slots[n].pfunc = NULL;
+
+	spec.name = t->tp_name;
+	spec.basicsize = (int) t->tp_basicsize;
+	spec.itemsize = (int) t->tp_itemsize;
+	spec.flags = (unsigned int) t->tp_flags;
+	spec.slots = slots;
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+	if (!t->tp_new)
+		spec.flags |= Py_TPFLAGS_DISALLOW_INSTANTIATION;
+#endif
+
+	type = PyType_FromModuleAndSpec(m, &spec, NULL);
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+	/* Heap types inherit tp_new from object otherwise. */
+	if (type && !t->tp_new)
+		((PyTypeObject *) type)->tp_new = NULL;
+#endif
+
+	return (PyTypeObject *) type;
+}
+#endif
 
-	m = Py_InitModule3("htpy", htpy_methods, "Python interface to libhtp.");
-	if (!m)
-		return;
+static int htpy_exec(PyObject *m) {
+#if PY_MAJOR_VERSION >= 3
+	htpy_state *state = PyModule_GetState(m);
+
+#define HTPY_TYPE_NEW(NAME) \
+	state->NAME##_type = htpy_type_new(m, &htpy_##NAME##_type); \
+	if (!state->NAME##_type) \
+		return -1;
+	HTPY_TYPES(HTPY_TYPE_NEW)
+#undef HTPY_TYPE_NEW
+#else
+	htpy_state *state = &htpy_static_state;
+
+	if (PyType_Ready(&htpy_config_type) < 0 || PyType_Ready(&htpy_connp_type) < 0 || PyType_Ready(&htpy_pool_type) < 0 || PyType_Ready(&htpy_tx_type) < 0 || PyType_Ready(&htpy_headers_type) < 0 || PyType_Ready(&htpy_headers_iter_type) < 0 || PyType_Ready(&htpy_pcap_type) < 0 || PyType_Ready(&htpy_connp_pool_type) < 0 || PyType_Ready(&htpy_flow_table_type) < 0 || PyType_Ready(&htpy_filter_type) < 0 || PyType_Ready(&htpy_file_type) < 0 || PyType_Ready(&htpy_exporter_type) < 0 || PyType_Ready(&htpy_record_batch_type) < 0 || PyType_Ready(&htpy_chunk_type) < 0)
+		return -1;
 
-	htpy_error = PyErr_NewException("htpy.error", NULL, NULL);
-	Py_INCREF(htpy_error);
-	PyModule_AddObject(m, "error", htpy_error);
+	state->config_type = &htpy_config_type;
+	state->connp_type = &htpy_connp_type;
+	state->pool_type = &htpy_pool_type;
+	state->connp_pool_type = &htpy_connp_pool_type;
+	state->flow_table_type = &htpy_flow_table_type;
+	state->tx_type = &htpy_tx_type;
+	state->headers_type = &htpy_headers_type;
+	state->headers_iter_type = &htpy_headers_iter_type;
+	state->filter_type = &htpy_filter_type;
+	state->file_type = &htpy_file_type;
+	state->pcap_type = &htpy_pcap_type;
+	state->exporter_type = &htpy_exporter_type;
+	state->record_batch_type = &htpy_record_batch_type;
+	state->chunk_type = &htpy_chunk_type;
+
+	/* Callbacks may be run from pool worker threads. */
+	PyEval_InitThreads();
+#endif
+
+	if (htpy_intern_init(state) == -1)
+		return -1;
 
-	htpy_stop = PyErr_NewException("htpy.stop", NULL, NULL);
-	Py_INCREF(htpy_stop);
-	PyModule_AddObject(m, "stop", htpy_stop);
+	state->error = PyErr_NewException("htpy.error", NULL, NULL);
+	if (!state->error)
+		return -1;
+	Py_INCREF(state->error);
+	PyModule_AddObject(m, "error", state->error);
 
-	Py_INCREF(&htpy_config_type);
-	PyModule_AddObject(m, "config", (PyObject *) &htpy_config_type);
-	Py_INCREF(&htpy_connp_type);
-	PyModule_AddObject(m, "connp", (PyObject *) &htpy_connp_type);
+	state->stop = PyErr_NewException("htpy.stop", NULL, NULL);
+	if (!state->stop)
+		return -1;
+	Py_INCREF(state->stop);
+	PyModule_AddObject(m, "stop", state->stop);
+
+	Py_INCREF(state->config_type);
+	PyModule_AddObject(m, "config", (PyObject *) state->config_type);
+	Py_INCREF(state->connp_type);
+	PyModule_AddObject(m, "connp", (PyObject *) state->connp_type);
+	Py_INCREF(state->pool_type);
+	PyModule_AddObject(m, "pool", (PyObject *) state->pool_type);
+	Py_INCREF(state->tx_type);
+	PyModule_AddObject(m, "tx", (PyObject *) state->tx_type);
+	Py_INCREF(state->headers_type);
+	PyModule_AddObject(m, "headers", (PyObject *) state->headers_type);
+	Py_INCREF(state->pcap_type);
+	PyModule_AddObject(m, "pcap_reader", (PyObject *) state->pcap_type);
+	Py_INCREF(state->connp_pool_type);
+	PyModule_AddObject(m, "connp_pool", (PyObject *) state->connp_pool_type);
+	Py_INCREF(state->flow_table_type);
+	PyModule_AddObject(m, "flow_table", (PyObject *) state->flow_table_type);
+
+	Py_INCREF(state->filter_type);
+	PyModule_AddObject(m, "filter", (PyObject *) state->filter_type);
+
+	Py_INCREF(state->file_type);
+	PyModule_AddObject(m, "file", (PyObject *) state->file_type);
+
+	Py_INCREF(state->exporter_type);
+	PyModule_AddObject(m, "exporter", (PyObject *) state->exporter_type);
+	Py_INCREF(state->record_batch_type);
+	PyModule_AddObject(m, "record_batch", (PyObject *) state->record_batch_type);
+	Py_INCREF(state->chunk_type);
+	PyModule_AddObject(m, "chunk", (PyObject *) state->chunk_type);
 
 	PyModule_AddStringMacro(m, HTPY_VERSION);
 
+	PyModule_AddIntMacro(m, HTPY_REQUEST);
+	PyModule_AddIntMacro(m, HTPY_RESPONSE);
+	PyModule_AddObject(m, "HTPY_TX_GAP", PyLong_FromUnsignedLongLong(HTPY_TX_GAP));
+	PyModule_AddIntConstant(m, "CAPTURE_REQUEST", HTPY_CAPTURE_REQUEST);
+	PyModule_AddIntConstant(m, "CAPTURE_RESPONSE", HTPY_CAPTURE_RESPONSE);
+	PyModule_AddIntConstant(m, "DIGEST_MD5", HTPY_DIGEST_MD5);
+	PyModule_AddIntConstant(m, "DIGEST_SHA1", HTPY_DIGEST_SHA1);
+	PyModule_AddIntConstant(m, "DIGEST_SHA256", HTPY_DIGEST_SHA256);
+	PyModule_AddIntConstant(m, "FILTER_EXACT", HTPY_FILTER_EXACT);
+	PyModule_AddIntConstant(m, "FILTER_PREFIX", HTPY_FILTER_PREFIX);
+	PyModule_AddIntConstant(m, "FILTER_SUFFIX", HTPY_FILTER_SUFFIX);
+	PyModule_AddIntConstant(m, "FILTER_SUBSTRING", HTPY_FILTER_SUBSTRING);
+	PyModule_AddIntConstant(m, "FILTER_NOCASE", HTPY_FILTER_NOCASE);
+	PyModule_AddIntConstant(m, "EVICT_IDLE", HTPY_EVICT_IDLE);
+	PyModule_AddIntConstant(m, "EVICT_FLOWS", HTPY_EVICT_FLOWS);
+	PyModule_AddIntConstant(m, "EVICT_MEMORY", HTPY_EVICT_MEMORY);
+	PyModule_AddIntConstant(m, "EVICT_SIZE", HTPY_EVICT_SIZE);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_START", 1L << HTPY_HOOK_request_start);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_LINE", 1L << HTPY_HOOK_request_line);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_URI_NORMALIZE", 1L << HTPY_HOOK_request_uri_normalize);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_HEADERS", 1L << HTPY_HOOK_request_headers);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_HEADER_DATA", 1L << HTPY_HOOK_request_header_data);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_BODY_DATA", 1L << HTPY_HOOK_request_body_data);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_TRAILER", 1L << HTPY_HOOK_request_trailer);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_TRAILER_DATA", 1L << HTPY_HOOK_request_trailer_data);
+	PyModule_AddIntConstant(m, "EVENT_REQUEST_COMPLETE", 1L << HTPY_HOOK_request_complete);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_START", 1L << HTPY_HOOK_response_start);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_LINE", 1L << HTPY_HOOK_response_line);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_HEADERS", 1L << HTPY_HOOK_response_headers);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_HEADER_DATA", 1L << HTPY_HOOK_response_header_data);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_BODY_DATA", 1L << HTPY_HOOK_response_body_data);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_TRAILER", 1L << HTPY_HOOK_response_trailer);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_TRAILER_DATA", 1L << HTPY_HOOK_response_trailer_data);
+	PyModule_AddIntConstant(m, "EVENT_RESPONSE_COMPLETE", 1L << HTPY_HOOK_response_complete);
+	PyModule_AddIntConstant(m, "EVENT_TRANSACTION_COMPLETE", 1L << HTPY_HOOK_transaction_complete);
+#ifdef HTPY_ARENA
+	PyModule_AddIntConstant(m, "HTPY_ARENA", 1);
+#else
+	PyModule_AddIntConstant(m, "HTPY_ARENA", 0);
+#endif
+
+	PyModule_AddStringMacro(m, HTPY_TX_HANDLER);
+	PyModule_AddStringMacro(m, HTPY_DATA_HANDLER);
+	PyModule_AddStringMacro(m, HTPY_FILE_HANDLER);
+	PyModule_AddStringMacro(m, HTPY_LOG_HANDLER);
+
 	PyModule_AddIntMacro(m, HTP_ERROR);
 	PyModule_AddIntMacro(m, HTP_OK);
 	PyModule_AddIntMacro(m, HTP_STOP);
@@ -1270,4 +11315,113 @@ PyMODINIT_FUNC inithtpy(void) {
 	PyModule_AddIntMacro(m, HTP_STREAM_DATA_OTHER);
 	PyModule_AddIntMacro(m, HTP_STREAM_DATA);
 	PyModule_AddIntMacro(m, HTP_STREAM_STOP);
+
+	PyModule_AddIntMacro(m, HTP_SERVER_MINIMAL);
+	PyModule_AddIntMacro(m, HTP_SERVER_GENERIC);
+	PyModule_AddIntMacro(m, HTP_SERVER_IDS);
+	PyModule_AddIntMacro(m, HTP_SERVER_IIS_4_0);
+	PyModule_AddIntMacro(m, HTP_SERVER_IIS_5_0);
+	PyModule_AddIntMacro(m, HTP_SERVER_IIS_5_1);
+	PyModule_AddIntMacro(m, HTP_SERVER_IIS_6_0);
+	PyModule_AddIntMacro(m, HTP_SERVER_IIS_7_0);
+	PyModule_AddIntMacro(m, HTP_SERVER_IIS_7_5);
+	PyModule_AddIntMacro(m, HTP_SERVER_APACHE_2);
+
+	PyModule_AddIntMacro(m, HTP_URL_DECODE_PRESERVE_PERCENT);
+	PyModule_AddIntMacro(m, HTP_URL_DECODE_REMOVE_PERCENT);
+	PyModule_AddIntMacro(m, HTP_URL_DECODE_PROCESS_INVALID);
+
+	PyModule_AddIntMacro(m, HTP_COMPRESSION_BOMB_RATIO);
+
+#if PY_MAJOR_VERSION >= 3
+	/* Only now that everything is there can htpy_get_state() find it. */
+	{
+		PyObject *dict = PyInterpreterState_GetDict(PyInterpreterState_Get());
+		PyObject *capsule = PyCapsule_New(state, "htpy.state", NULL);
+
+		if (!dict || !capsule || PyDict_SetItemString(dict, "htpy.state", capsule) == -1) {
+			Py_XDECREF(capsule);
+			return -1;
+		}
+		Py_DECREF(capsule);
+		__atomic_add_fetch(&htpy_state_generation, 1, __ATOMIC_RELEASE);
+	}
+#endif
+
+	return 0;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static int htpy_traverse(PyObject *m, visitproc visit, void *arg) {
+	htpy_state *state = PyModule_GetState(m);
+
+	Py_VISIT(state->error);
+	Py_VISIT(state->stop);
+#define HTPY_TYPE_VISIT(NAME) Py_VISIT(state->NAME##_type);
+	HTPY_TYPES(HTPY_TYPE_VISIT)
+#undef HTPY_TYPE_VISIT
+
+	return 0;
+}
+
+static int htpy_clear(PyObject *m) {
+	htpy_state *state = PyModule_GetState(m);
+
+	Py_CLEAR(state->error);
+	Py_CLEAR(state->stop);
+#define HTPY_TYPE_CLEAR(NAME) Py_CLEAR(state->NAME##_type);
+	HTPY_TYPES(HTPY_TYPE_CLEAR)
+#undef HTPY_TYPE_CLEAR
+
+	return 0;
+}
+
+static void htpy_free(void *m) {
+	htpy_state *state = PyModule_GetState((PyObject *) m);
+	PyObject *dict = PyInterpreterState_GetDict(PyInterpreterState_Get());
+	PyObject *capsule;
+
+	htpy_clear((PyObject *) m);
+	htpy_intern_free(state);
+
+	/* Another import may have replaced it. */
+	capsule = dict ? PyDict_GetItemString(dict, "htpy.state") : NULL;
+	if (capsule && PyCapsule_GetPointer(capsule, "htpy.state") == state)
+		PyDict_DelItemString(dict, "htpy.state");
+	__atomic_add_fetch(&htpy_state_generation, 1, __ATOMIC_RELEASE);
+}
+
+static PyModuleDef_Slot htpy_slots[] = {
+	{ Py_mod_exec, htpy_exec },
+#ifdef Py_mod_multiple_interpreters
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+	{ 0, NULL }
+};
+
+static struct PyModuleDef htpy_module = {
+	PyModuleDef_HEAD_INIT,
+	"htpy",                          /* m_name */
+	"Python interface to libhtp.",   /* m_doc */
+	sizeof(htpy_state),              /* m_size */
+	htpy_methods,                    /* m_methods */
+	htpy_slots,                      /* m_slots */
+	htpy_traverse,                   /* m_traverse */
+	htpy_clear,                      /* m_clear */
+	htpy_free,                       /* m_free */
+};
+
+PyMODINIT_FUNC PyInit_htpy(void) {
+	return PyModuleDef_Init(&htpy_module);
+}
+#else
+PyMODINIT_FUNC inithtpy(void) {
+	PyObject *m;
+
+	m = Py_InitModule3("htpy", htpy_methods, "Python interface to libhtp.");
+	if (!m)
+		return;
+
+	htpy_exec(m);
 }
+#endif
@@ -0,0 +1,224 @@
+#
+# asyncio driver for htpy connection parsers.
+#
+# An AsyncConnp wraps an htpy.connp. Data is read from StreamReader like
+# sources and parsed in an executor, so the event loop is never blocked by
+# the parser, and the native parser releases the GIL while it runs. The
+# callbacks registered by the driver only record what happened, and the
+# events are handed out through a bounded queue. When the queue is full
+# the driver stops reading until the consumer catches up.
+#
+#   driver = htpy_async.AsyncConnp(cfg)
+#   task = asyncio.ensure_future(driver.run(client_reader, server_reader))
+#   async for event in driver:
+#       print(event.kind, event.index, event.tx)
+#   await task
+#
+# Python 3 only.
+
+import asyncio
+import collections
+import time
+
+import htpy
+
+# kind: the name of the hook, such as 'request_headers'.
+# index: the index of the transaction on the connection.
+# tx: a dictionary of the transaction fields when the hook was called, see
+#     snapshot(). None for body data events.
+# data: the body data as bytes for body data events, otherwise None.
+Event = collections.namedtuple('Event', 'kind index tx data')
+
+# Hooks which are recorded unless the events argument says otherwise.
+DEFAULT_EVENTS = ('request_headers', 'response_headers', 'transaction_complete')
+
+# Hooks of the request parser, the rest are called for the response.
+REQUEST_EVENTS = ('request_start', 'request_line', 'request_uri_normalize',
+                  'request_headers', 'request_body_data', 'request_trailer',
+                  'request_complete')
+RESPONSE_EVENTS = ('response_start', 'response_line', 'response_headers',
+                   'response_body_data', 'response_trailer',
+                   'response_complete', 'transaction_complete')
+DATA_EVENTS = ('request_body_data', 'response_body_data')
+
+# Transaction attributes copied into each event. Transaction objects only
+# keep the attributes which were used before libhtp destroyed them, and the
+# consumer normally runs after that, so everything is copied while the
+# transaction is still there.
+SNAPSHOT_ATTRS = ('method', 'uri', 'protocol', 'parsed_uri',
+                  'request_headers', 'status', 'status_message',
+                  'response_headers', 'request_message_length',
+                  'request_entity_length', 'response_message_length',
+                  'response_entity_length')
+
+READ_SIZE = 65536
+
+_EOF = object()
+
+
+def snapshot(tx):
+    """Return a dictionary of the fields of the transaction object tx."""
+    return dict((attr, getattr(tx, attr)) for attr in SNAPSHOT_ATTRS)
+
+
+class AsyncConnp(object):
+    """Drive an htpy.connp from asyncio and iterate over its events.
+
+    cfg is the htpy.config to create the connection parser from. events is
+    the names of the hooks to record, any of REQUEST_EVENTS and
+    RESPONSE_EVENTS. The driver registers its callbacks on the connection
+    parser, so for those hooks they are called instead of the ones
+    registered on the config. maxsize is the number of events which may be
+    waiting for the consumer before parsing stops. executor is the
+    concurrent.futures executor to parse in, the loop's default executor if
+    None.
+    """
+
+    def __init__(self, cfg, events=DEFAULT_EVENTS, maxsize=256,
+                 read_size=READ_SIZE, executor=None):
+        self.connp = htpy.connp(cfg)
+        self.read_size = read_size
+        self.executor = executor
+        self._queue = asyncio.Queue(maxsize)
+        self._lock = asyncio.Lock()
+        # Events recorded by the callbacks during the current parse.
+        self._pending = []
+        # Data which libhtp did not consume because it needs data in the
+        # other direction first, as (data, offset).
+        self._held = {htpy.HTPY_REQUEST: None, htpy.HTPY_RESPONSE: None}
+        self._closed = False
+        for kind in events:
+            if kind in REQUEST_EVENTS:
+                get_tx = self.connp.get_in_tx
+            elif kind in RESPONSE_EVENTS:
+                get_tx = self.connp.get_out_tx
+            else:
+                raise ValueError('unknown event: %r' % (kind,))
+            if kind in DATA_EVENTS:
+                callback = self._data_callback(kind, get_tx)
+            else:
+                callback = self._callback(kind, get_tx)
+            getattr(self.connp, 'register_' + kind)(callback)
+
+    # The callbacks run in the executor, with the GIL held by the parser.
+    def _callback(self, kind, get_tx):
+        def callback(*args):
+            tx = get_tx()
+            if tx is not None:
+                self._pending.append(Event(kind, tx.index, snapshot(tx), None))
+            return htpy.HTP_OK
+        return callback
+
+    def _data_callback(self, kind, get_tx):
+        def callback(data, length, *args):
+            tx = get_tx()
+            if tx is not None and data is not None:
+                self._pending.append(Event(kind, tx.index, None, bytes(data)))
+            return htpy.HTP_OK
+        return callback
+
+    def _parse(self, direction, data, offset, timestamp):
+        if direction == htpy.HTPY_REQUEST:
+            status = self.connp.req_data(data, offset, -1, timestamp)
+            consumed = self.connp.req_data_consumed()
+        else:
+            status = self.connp.res_data(data, offset, -1, timestamp)
+            consumed = self.connp.res_data_consumed()
+        if status == htpy.HTP_STREAM_DATA_OTHER:
+            self._held[direction] = (data, offset + consumed)
+        return status
+
+    async def _run_parse(self, direction, data, offset, timestamp):
+        loop = asyncio.get_running_loop()
+        try:
+            return await loop.run_in_executor(self.executor, self._parse,
+                                              direction, data, offset, timestamp)
+        finally:
+            pending = self._pending
+            self._pending = []
+            for event in pending:
+                await self._queue.put(event)
+
+    async def data(self, direction, data, timestamp=None):
+        """Parse data in the given direction and queue the events.
+
+        Returns the stream status, the same as req_data() and res_data() of
+        the connection parser, once the events have been queued. This waits
+        while the queue is full. Data which libhtp can not parse until it
+        has seen data in the other direction is kept and parsed after the
+        next data in that direction.
+        """
+        if timestamp is None:
+            timestamp = time.time()
+        other = htpy.HTPY_RESPONSE if direction == htpy.HTPY_REQUEST else htpy.HTPY_REQUEST
+        async with self._lock:
+            held = self._held[direction]
+            if held is not None:
+                self._held[direction] = None
+                data = held[0][held[1]:] + data
+            status = await self._run_parse(direction, data, 0, timestamp)
+            held = self._held[other]
+            if status != htpy.HTP_STREAM_DATA_OTHER and held is not None:
+                self._held[other] = None
+                await self._run_parse(other, held[0], held[1], timestamp)
+            return status
+
+    async def req_data(self, data, timestamp=None):
+        return await self.data(htpy.HTPY_REQUEST, data, timestamp)
+
+    async def res_data(self, data, timestamp=None):
+        return await self.data(htpy.HTPY_RESPONSE, data, timestamp)
+
+    async def feed(self, reader, direction):
+        """Parse everything read from reader until it is at EOF.
+
+        reader is anything with a coroutine read(n) method which returns
+        b'' at EOF, such as an asyncio.StreamReader.
+        """
+        while True:
+            data = await reader.read(self.read_size)
+            if not data:
+                break
+            await self.data(direction, data)
+
+    async def run(self, req_reader=None, res_reader=None):
+        """Feed both directions until EOF, then close the driver.
+
+        Any exception raised while parsing, such as htpy.error or htpy.stop
+        from a parser which gave up, ends iteration over the events with the
+        same exception.
+        """
+        feeds = []
+        if req_reader is not None:
+            feeds.append(self.feed(req_reader, htpy.HTPY_REQUEST))
+        if res_reader is not None:
+            feeds.append(self.feed(res_reader, htpy.HTPY_RESPONSE))
+        try:
+            await asyncio.gather(*feeds)
+        except Exception as e:
+            await self.close(e)
+            raise
+        await self.close()
+
+    async def close(self, exc=None):
+        """End iteration over the events once those queued are consumed.
+
+        If exc is given it is raised by the iteration instead.
+        """
+        if self._closed:
+            return
+        self._closed = True
+        await self._queue.put((_EOF, exc))
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        event = await self._queue.get()
+        if isinstance(event, tuple) and event and event[0] is _EOF:
+            # Leave it there for anyone else iterating.
+            self._queue.put_nowait(event)
+            if event[1] is not None:
+                raise event[1]
+            raise StopAsyncIteration
+        return event
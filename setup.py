@@ -1,9 +1,15 @@
 #! /usr/bin/env python
 
-from distutils.core import setup, Extension
+# Python 3.12 and later no longer ship distutils, setuptools provides it.
+try:
+    import setuptools
+except ImportError:
+    pass
+
+from distutils.core import setup, Extension, Command
 from distutils.command.build import build
 from distutils.spawn import spawn
-import os, os.path
+import os, os.path, shutil, subprocess, sys
 
 pathjoin = os.path.join
 
@@ -14,7 +20,34 @@ BUILDDIR = 'libhtp-' + GITVER
 
 INCLUDE_DIRS  = ['/usr/local/include', '/opt/local/include', '/usr/include']
 LIBRARY_DIRS  = ['/usr/lib', '/usr/local/lib']
-EXTRA_OBJECTS = ['-lz']
+EXTRA_OBJECTS = ['-lz', '-lpthread', '-lcrypto']
+DEFINE_MACROS = []
+EXTRA_LINK_ARGS = []
+
+# Set HTPY_ARENA=1 in the environment to build with per connection parser
+# allocation arenas. This wraps the allocator functions used by htpy and
+# libhtp, which needs GNU ld.
+if os.environ.get('HTPY_ARENA'):
+    DEFINE_MACROS.append(('HTPY_ARENA', '1'))
+    EXTRA_LINK_ARGS.append('-Wl,' + ','.join('--wrap=' + f for f in
+                           ['malloc', 'calloc', 'realloc', 'free', 'strdup']))
+
+# Set HTPY_FAST=1 to build libhtp and htpy with -O3 and link time
+# optimization, so libhtp can be inlined into htpy and the other way around.
+# HTPY_PGO=1 does the same and adds profile guided optimization, trained by
+# running bench/bench.py on a first build. HTPY_NATIVE=1 compiles for the
+# machine doing the build, which lets the compiler use SSE4.2 and AVX2 in the
+# loops it can vectorize; the result may not run on other machines.
+HTPY_PGO = bool(os.environ.get('HTPY_PGO'))
+HTPY_FAST = HTPY_PGO or bool(os.environ.get('HTPY_FAST'))
+PGO_DIR = os.path.abspath(pathjoin('build', 'pgo'))
+OPT_FLAGS = []
+if HTPY_FAST:
+    OPT_FLAGS += ['-O3', '-flto=auto']
+if os.environ.get('HTPY_NATIVE'):
+    OPT_FLAGS += ['-march=native']
+EXTRA_COMPILE_ARGS = list(OPT_FLAGS)
+EXTRA_LINK_ARGS += OPT_FLAGS
 
 class htpyMaker(build):
     HTPTAR = PKGTAR
@@ -27,25 +60,96 @@ class htpyMaker(build):
     if uname != 'Linux':
         EXTRA_OBJECTS.append('-liconv')
 
-    def buildHtp(self):
+    # The flags libhtp was last built with, so it is rebuilt when they change.
+    stamp = pathjoin(HTPDIR, '.htpy-cflags')
+
+    def buildHtp(self, flags=[]):
         # extremely crude package builder
+        cflags = 'CFLAGS=' + ' '.join(['-fPIC'] + flags)
         try:
             os.stat(self.libhtp)
-            return None           # assume already built
+            try:
+                built = open(self.stamp).read()
+            except IOError:
+                built = 'CFLAGS=-fPIC'
+            if built == cflags:
+                return None       # assume already built
         except OSError:
-            pass
+            spawn(['tar', '-zxf', self.HTPTAR], search_path = 1)
 
-        spawn(['tar', '-zxf', self.HTPTAR], search_path = 1)
         os.chdir(self.HTPDIR)
         spawn([pathjoin('.','autogen.sh')], '-i')
-        spawn([pathjoin('.','configure'), 'CFLAGS=-fPIC'])
-        spawn(['make'], search_path = 1)
+        # The profile flags are only given to make, the test programs of
+        # configure would otherwise leave their own profiles in PGO_DIR.
+        args = [pathjoin('.','configure'), 'CFLAGS=' + ' '.join(['-fPIC'] + OPT_FLAGS)]
+        # A static library of LTO objects needs the archiver plugin of gcc.
+        if HTPY_FAST:
+            args += ['AR=gcc-ar', 'RANLIB=gcc-ranlib', 'NM=gcc-nm']
+        spawn(args)
+        spawn(['make', 'clean'], search_path = 1)
+        spawn(['make', cflags], search_path = 1)
         os.chdir('..')
+        open(self.stamp, 'w').write(cflags)
 
-    def run(self):
-        self.buildHtp()
+    def buildAll(self, flags):
+        ext = self.distribution.ext_modules[0]
+        self.buildHtp(OPT_FLAGS + flags)
+        ext.extra_compile_args = EXTRA_COMPILE_ARGS + flags
+        ext.extra_link_args = EXTRA_LINK_ARGS + flags
         build.run(self)
 
+    def train(self):
+        env = dict(os.environ)
+        env['PYTHONPATH'] = self.build_platlib
+        subprocess.check_call([sys.executable, pathjoin('bench', 'bench.py'),
+                               '-t', '0.2', '-r', '1'], env = env)
+
+    def run(self):
+        if not HTPY_PGO:
+            self.buildHtp(OPT_FLAGS)
+            build.run(self)
+            return
+
+        # Build once to collect a profile, then again using it.
+        if os.path.isdir(PGO_DIR):
+            shutil.rmtree(PGO_DIR)
+        self.reinitialize_command('build_ext', force = 1)
+        self.buildAll(['-fprofile-generate=' + PGO_DIR])
+        self.train()
+        self.reinitialize_command('build_ext', force = 1)
+        self.buildAll(['-fprofile-use=' + PGO_DIR, '-fprofile-correction'])
+
+class htpyBench(Command):
+    description = 'build htpy and run the benchmarks in bench/'
+    user_options = [('corpus=', 'c', 'corpus to run (default all)'),
+                    ('callbacks=', 'k', 'callbacks to register: none, one or all (default all three)'),
+                    ('time=', 't', 'minimum seconds for each run'),
+                    ('pcap=', 'p', 'also run this pcap through htpy.pcap_reader')]
+
+    def initialize_options(self):
+        self.corpus = None
+        self.callbacks = None
+        self.time = None
+        self.pcap = None
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        self.run_command('build')
+        sys.path.insert(0, self.get_finalized_command('build').build_platlib)
+        sys.path.insert(0, 'bench')
+        import bench
+        argv = []
+        for (opt, value) in [('-c', self.corpus), ('-k', self.callbacks),
+                             ('-t', self.time), ('-p', self.pcap)]:
+            if value:
+                argv += [opt, value]
+        bench.main(argv)
+
+# The asyncio driver needs python 3.
+PY_MODULES = ['htpy_async'] if sys.version_info[0] >= 3 else []
+
 INCLUDE_DIRS = htpyMaker.include_dirs + INCLUDE_DIRS
 EXTRA_OBJECTS = htpyMaker.extra_objects + EXTRA_OBJECTS
 
@@ -57,10 +161,14 @@ setup (# Distribution meta-data
         author_email = "wxs@atarininja.org",
         license = "BSD",
         long_description = "Python bindings for libhtp",
-        cmdclass = {'build': htpyMaker},
+        cmdclass = {'build': htpyMaker, 'bench': htpyBench},
+        py_modules = PY_MODULES,
         ext_modules = [Extension("htpy",
                                  sources=["htpy.c"],
                                  include_dirs = INCLUDE_DIRS,
                                  library_dirs = LIBRARY_DIRS,
-                                 extra_objects = EXTRA_OBJECTS)],
+                                 extra_objects = EXTRA_OBJECTS,
+                                 define_macros = DEFINE_MACROS,
+                                 extra_compile_args = EXTRA_COMPILE_ARGS,
+                                 extra_link_args = EXTRA_LINK_ARGS)],
         url = "http://github.com/MITRECND/htpy")
@@ -0,0 +1,53 @@
+#! /usr/bin/env python
+#
+# Regression tests for callbacks which feed another connection parser.
+#
+#   python -m unittest discover tests
+
+import unittest
+
+import htpy
+
+REQUEST = b'GET /outer HTTP/1.1\r\nHost: example.com\r\n\r\n'
+
+
+class NestedFeedTest(unittest.TestCase):
+
+    def test_getters_after_nested_feed(self):
+        inner = htpy.connp()
+        outer = htpy.connp()
+        uris = []
+
+        def request_headers(cp):
+            inner.req_data(b'GET /inner HTTP/1.1\r\nHost: example.com\r\n\r\n')
+            uris.append(cp.get_uri()['path'])
+            return htpy.HTP_OK
+
+        outer.register_request_headers(request_headers)
+        outer.req_data(REQUEST)
+
+        self.assertEqual(uris, ['/outer'])
+
+    def test_nested_feed_in_inner_callback(self):
+        inner = htpy.connp()
+        outer = htpy.connp()
+        uris = []
+
+        def inner_request_headers(cp):
+            uris.append(cp.get_uri()['path'])
+            return htpy.HTP_OK
+
+        def outer_request_headers(cp):
+            inner.req_data(b'GET /inner HTTP/1.1\r\nHost: example.com\r\n\r\n')
+            uris.append(cp.get_uri()['path'])
+            return htpy.HTP_OK
+
+        inner.register_request_headers(inner_request_headers)
+        outer.register_request_headers(outer_request_headers)
+        outer.req_data(REQUEST)
+
+        self.assertEqual(uris, ['/inner', '/outer'])
+
+
+if __name__ == '__main__':
+    unittest.main()
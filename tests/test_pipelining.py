@@ -0,0 +1,169 @@
+#! /usr/bin/env python
+#
+# Regression tests for connections with many transactions in flight.
+#
+# The requests are all sent before any of the responses, so every
+# transaction has started before the first one completes.
+#
+#   python -m unittest discover tests
+
+from __future__ import print_function
+
+import hashlib
+import unittest
+
+import htpy
+
+# Well past the 16 transactions htpy once kept records for.
+IN_FLIGHT = 40
+
+
+class PipeliningTest(unittest.TestCase):
+
+    def test_times(self):
+        exp = htpy.exporter()
+        cfg = htpy.config()
+        cfg.exporter = exp
+        cp = htpy.connp(cfg)
+        for i in range(IN_FLIGHT):
+            cp.req_data(b'GET /%d HTTP/1.1\r\nHost: example.com\r\n\r\n' % i,
+                        timestamp=1 + i)
+
+        times = cp.get_transaction_times()
+        self.assertEqual(times['request_start'], IN_FLIGHT)
+        self.assertEqual(times['request_complete'], IN_FLIGHT)
+        self.assertEqual(times['response_start'], None)
+
+        for i in range(IN_FLIGHT):
+            cp.res_data(b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok',
+                        timestamp=1001 + i)
+
+        (batch,) = exp.get_batches(flush=True)
+        self.assertEqual(batch.num_rows, IN_FLIGHT)
+        expected = [(1 + i) * 1000000 for i in range(IN_FLIGHT)]
+        self.assertEqual(batch.column('request_start'), expected)
+        self.assertEqual(batch.column('request_complete'), expected)
+        expected = [(1001 + i) * 1000000 for i in range(IN_FLIGHT)]
+        self.assertEqual(batch.column('response_start'), expected)
+        self.assertEqual(batch.column('response_complete'), expected)
+
+    def test_filter_rule(self):
+        f = htpy.filter()
+        f.match_path('/even', htpy.FILTER_PREFIX)
+        f.match_path('/odd', htpy.FILTER_PREFIX)
+        cfg = htpy.config()
+        cfg.pass_tx = True
+        cfg.filter = f
+        txs = []
+
+        def request_complete(cp, tx):
+            txs.append(tx)
+            return htpy.HTP_OK
+
+        cfg.register_request_complete(request_complete)
+        cp = htpy.connp(cfg)
+        for i in range(IN_FLIGHT):
+            cp.req_data(b'GET /%s/%d HTTP/1.1\r\nHost: example.com\r\n\r\n'
+                        % (b'odd' if i % 2 else b'even', i))
+
+        self.assertEqual([tx.filter_rule for tx in txs],
+                         [i % 2 for i in range(IN_FLIGHT)])
+
+    def test_body_digests(self):
+        cfg = htpy.config()
+        cfg.pass_tx = True
+        cfg.body_digests = htpy.DIGEST_SHA256
+        txs = []
+
+        def request_complete(cp, tx):
+            txs.append(tx)
+            return htpy.HTP_OK
+
+        cfg.register_request_complete(request_complete)
+        cp = htpy.connp(cfg)
+        bodies = [b'body %d' % i for i in range(IN_FLIGHT)]
+        for body in bodies:
+            cp.req_data(b'POST / HTTP/1.1\r\nHost: example.com\r\n'
+                        b'Content-Length: %d\r\n\r\n%s' % (len(body), body))
+
+        for tx, body in zip(txs, bodies):
+            digests = tx.body_digests
+            self.assertEqual(digests['request_bytes'], len(body))
+            self.assertEqual(digests['request_sha256'],
+                             hashlib.sha256(body).hexdigest())
+
+    def test_captures(self):
+        cfg = htpy.config()
+        cfg.pass_tx = True
+        cfg.capture_bodies = htpy.CAPTURE_REQUEST | htpy.CAPTURE_RESPONSE
+        txs = []
+        captured = []
+
+        def request_complete(cp, tx):
+            txs.append(tx)
+            return htpy.HTP_OK
+
+        def response_complete(cp, tx):
+            captured.append((tx.request_body, tx.response_body))
+            return htpy.HTP_OK
+
+        cfg.register_request_complete(request_complete)
+        cfg.register_response_complete(response_complete)
+        cp = htpy.connp(cfg)
+        bodies = [b'body %d' % i for i in range(IN_FLIGHT)]
+        for body in bodies:
+            cp.req_data(b'POST / HTTP/1.1\r\nHost: example.com\r\n'
+                        b'Content-Length: %d\r\n\r\n%s' % (len(body), body))
+
+        self.assertEqual([tx.request_body for tx in txs],
+                         [(body, False) for body in bodies])
+
+        for body in bodies:
+            cp.res_data(b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s'
+                        % (len(body), body.upper()))
+
+        self.assertEqual(captured,
+                         [((body, False), (body.upper(), False)) for body in bodies])
+
+    def test_one_object_per_transaction(self):
+        cfg = htpy.config()
+        cfg.pass_tx = True
+        seen = []
+
+        def request_headers(cp, tx):
+            seen.append((tx, cp.get_in_tx(), cp.get_uri()))
+            return htpy.HTP_OK
+
+        def request_complete(cp, tx):
+            seen.append((tx, cp.get_in_tx(), cp.get_uri()))
+            return htpy.HTP_OK
+
+        cfg.register_request_headers(request_headers)
+        cfg.register_request_complete(request_complete)
+        cp = htpy.connp(cfg)
+        for i in range(IN_FLIGHT):
+            cp.req_data(b'GET /%d HTTP/1.1\r\nHost: example.com\r\n\r\n' % i)
+
+        self.assertEqual(len(seen), 2 * IN_FLIGHT)
+        for i in range(IN_FLIGHT):
+            (tx, in_tx, uri), (tx2, in_tx2, uri2) = seen[2 * i:2 * i + 2]
+            self.assertTrue(tx is in_tx and tx is tx2 and tx is in_tx2)
+            self.assertTrue(uri is uri2 and uri is tx.parsed_uri)
+            self.assertEqual(uri['path'], '/%d' % i)
+
+        del cp
+        self.assertFalse(seen[0][0].valid)
+
+    def test_get_uri_shared(self):
+        cp = htpy.connp()
+        cp.req_data(b'POST /upload HTTP/1.1\r\nHost: example.com\r\n'
+                    b'Content-Length: 10\r\n\r\n')
+
+        uri = cp.get_uri()
+        self.assertTrue(cp.get_uri() is uri)
+        self.assertTrue(cp.get_in_tx() is cp.get_in_tx())
+        self.assertTrue(cp.get_in_tx().parsed_uri is uri)
+
+
+if __name__ == '__main__':
+    unittest.main()